@@ -0,0 +1,474 @@
+#include "apriltag_cpu.h"
+
+#include <algorithm>
+#include <cmath>
+#include <string_view>
+#include <tuple>
+
+#include "labeling_allegretti_2019_BKE_cpu.h"
+#include "line_fit_filter_cpu.h"
+#include "parallel_for.h"
+#include "threshold_cpu.h"
+
+namespace frc971::apriltag {
+namespace {
+
+typedef std::chrono::duration<float, std::milli> float_milli;
+using std::chrono::steady_clock;
+
+// Rows of the decimated image to hand to a worker at a time.
+constexpr size_t kMinRowsPerTask = 8;
+
+// Number of blobs to hand to a worker at a time.
+constexpr size_t kMinBlobsPerTask = 16;
+
+// Returns the number of boundary points BlobDiffRow can produce for a
+// decimated image.  Everything downstream is a subset of these.
+size_t MaxBoundaryPoints(size_t decimated_width, size_t decimated_height) {
+  return (decimated_width - 2) * (decimated_height - 2) * 4;
+}
+
+// Computes the 4 QuadBoundaryPoints for each pixel in row y of the decimated
+// image, matching the BlobDiff kernel.  result holds 4 planes of
+// (width - 2) * (height - 2) points.
+template <typename Point>
+void BlobDiffRow(const uint8_t *thresholded_image, const uint32_t *blobs,
+                 const uint32_t *union_markers_size, Point *result,
+                 size_t width, size_t height, uint32_t rep_bits, size_t y) {
+  const size_t plane_size = (width - 2) * (height - 2);
+  for (size_t x = 1; x + 1 < width; ++x) {
+    const size_t global_input_index = x + y * width;
+    const size_t global_output_index = (x - 1) + (y - 1) * (width - 2);
+
+    const uint32_t rep0 = blobs[global_input_index];
+    const uint8_t v0 = thresholded_image[global_input_index];
+
+    // Short circuit 127's and write an empty point out.
+    if (v0 == 127 || union_markers_size[rep0] < 25) {
+      for (size_t point_offset = 0; point_offset < 4; ++point_offset) {
+        result[plane_size * point_offset + global_output_index] = Point();
+      }
+      continue;
+    }
+
+    // Returns the boundary point between x, y and the neighbor, or an empty
+    // point if they aren't in adjacent blobs.
+    auto conn = [&](int dx, int dy, size_t point_offset) {
+      Point cluster_id;
+      const size_t index1 = (x + dx) + (y + dy) * width;
+      const uint8_t v1 = thresholded_image[index1];
+      const uint32_t rep1 = blobs[index1];
+      if (v0 + v1 == 255) {
+        if (union_markers_size[rep1] >= 25) {
+          if (rep0 < rep1) {
+            cluster_id.set_rep01(rep0, rep1, rep_bits);
+          } else {
+            cluster_id.set_rep01(rep1, rep0, rep_bits);
+          }
+          cluster_id.set_base_xy(x, y);
+          cluster_id.set_dxy(point_offset);
+          cluster_id.set_black_to_white(v1 > v0);
+        }
+      }
+      result[plane_size * point_offset + global_output_index] = cluster_id;
+    };
+
+    // See BlobDiff for the neighbor layout and the dedup logic.
+    conn(1, 0, 0);
+    conn(1, 1, 1);
+    conn(0, 1, 2);
+
+    const size_t index_2 = x + (y + 1) * width;
+    const size_t index_left = x - 1 + y * width;
+    const uint8_t v1_block_2 = thresholded_image[index_2];
+    const uint8_t v1_block_left = thresholded_image[index_left];
+    if (v1_block_left != 127 && v1_block_2 != 127 &&
+        v1_block_2 != v1_block_left) {
+      if (x != 1 && union_markers_size[blobs[index_left]] >= 25 &&
+          union_markers_size[blobs[index_2]] >= 25) {
+        result[plane_size * 3 + global_output_index] = Point();
+        continue;
+      }
+    }
+
+    conn(-1, 1, 3);
+  }
+}
+
+// Returns true if the blob passes the size and dot product checks and is worth
+// further consideration.  Matches SelectBlobs.
+struct BlobFilter {
+  bool operator()(const MinMaxExtents &extents) const {
+    if (extents.count < min_cluster_pixels) {
+      return false;
+    }
+    if (extents.count > max_cluster_pixels) {
+      return false;
+    }
+
+    // Area must also be reasonable.
+    if (static_cast<size_t>((extents.max_x - extents.min_x) *
+                            (extents.max_y - extents.min_y)) < tag_width) {
+      return false;
+    }
+
+    // And the right side must be inside.
+    const bool quad_reversed_border = extents.dot() < 0.0;
+    if (!reversed_border && quad_reversed_border) {
+      return false;
+    }
+    if (!normal_border && !quad_reversed_border) {
+      return false;
+    }
+
+    return true;
+  }
+
+  size_t tag_width;
+  bool reversed_border;
+  bool normal_border;
+  size_t min_cluster_pixels;
+  size_t max_cluster_pixels;
+};
+
+// Adds the angle around the blob center to the point.  Matches
+// AddThetaToIndexPoint.
+template <typename Point>
+Point AddTheta(Point a, const MinMaxExtents &extents) {
+  float theta =
+      (atan2f(a.y() - extents.cy(), a.x() - extents.cx()) + M_PI) * 8e6;
+  long long int theta_int = llrintf(theta);
+
+  a.set_theta(std::max<long long int>(0, theta_int));
+  return a;
+}
+
+// Computes the weighted moments of a single point.  Matches
+// TransformLineFitPoint.
+template <typename Point>
+LineFitPoint ToLineFitPoint(Point p, const uint8_t *decimated_image,
+                            int decimated_width, int decimated_height) {
+  // we now undo our fixed-point arithmetic.
+  // adjust for pixel center bias
+  constexpr int delta = 1;
+  int32_t ix2 = p.x() + delta;
+  int32_t iy2 = p.y() + delta;
+  int32_t ix = ix2 / 2;
+  int32_t iy = iy2 / 2;
+
+  int32_t W = 1;
+
+  if (ix > 0 && ix + 1 < decimated_width && iy > 0 &&
+      iy + 1 < decimated_height) {
+    int32_t grad_x = decimated_image[iy * decimated_width + ix + 1] -
+                     decimated_image[iy * decimated_width + ix - 1];
+
+    int32_t grad_y = decimated_image[(iy + 1) * decimated_width + ix] -
+                     decimated_image[(iy - 1) * decimated_width + ix];
+
+    // XXX Tunable. How to shape the gradient magnitude?
+    W = hypotf(grad_x, grad_y) + 1;
+  }
+
+  return LineFitPoint::FromPoint(W, ix2, iy2, p.blob_index());
+}
+
+// Returns a key which sorts floats the same way as a radix sort does.
+uint32_t FloatSortKey(float value) {
+  uint32_t bits;
+  memcpy(&bits, &value, sizeof(bits));
+  return (bits & 0x80000000u) ? ~bits : (bits | 0x80000000u);
+}
+
+}  // namespace
+
+CpuDetector::CpuDetector(size_t width, size_t height,
+                         apriltag_detector_t *tag_detector,
+                         CameraMatrix camera_matrix,
+                         DistCoeffs distortion_coefficients)
+    : DetectorBackend(width, height, tag_detector, camera_matrix,
+                      distortion_coefficients),
+      decimated_image_(decimated_width_ * decimated_height_),
+      unfiltered_minmax_image_(
+          (decimated_width_ / 4 * decimated_height_ / 4) * 2),
+      minmax_image_((decimated_width_ / 4 * decimated_height_ / 4) * 2),
+      thresholded_image_(decimated_width_ * decimated_height_),
+      threshold_scratch_(CpuThresholdScratchSize(width, height, decimation_,
+                                                 tag_detector->wp)),
+      union_markers_(decimated_width_ * decimated_height_),
+      union_markers_size_(decimated_width_ * decimated_height_),
+      line_fit_points_(MaxBoundaryPoints(decimated_width_, decimated_height_)),
+      errs_(line_fit_points_.size()),
+      filtered_errs_(line_fit_points_.size()),
+      peaks_(line_fit_points_.size()),
+      compressed_peaks_(line_fit_points_.size()) {
+  CHECK(!tag_detector_->qtp.deglitch);
+  if (compact_points_) {
+    compact_boundary_points_.Resize(line_fit_points_.size());
+  } else {
+    wide_boundary_points_.Resize(line_fit_points_.size());
+  }
+  extents_.reserve(kMaxBlobs);
+  selected_extents_.reserve(kMaxBlobs);
+  peak_extents_.reserve(kMaxBlobs);
+  for (std::vector<uint8_t> &gray_image : gray_images_) {
+    gray_image.resize(width * height);
+  }
+}
+
+CpuDetector::~CpuDetector() { StopDecodeThread(); }
+
+uint8_t *CpuDetector::FindQuads(const uint8_t *image, ImageFormat format,
+                                size_t slot, std::vector<FitQuad> *fit_quads) {
+  workerpool_t *wp = tag_detector_->wp;
+  last_slot_ = slot;
+  uint8_t *gray_image = gray_images_[slot].data();
+
+  // Timestamps after each of the steps for timing.
+  events_.clear();
+  const steady_clock::time_point start = steady_clock::now();
+
+  // Threshold the image.
+  CpuToGreyscaleAndDecimate(
+      image, gray_image, decimated_image_.data(),
+      unfiltered_minmax_image_.data(), minmax_image_.data(),
+      thresholded_image_.data(), threshold_scratch_.data(), width_, height_,
+      decimation_, format, tag_detector_->qtp.min_white_black_diff, wp);
+  Record("Threshold");
+
+  std::fill(union_markers_size_.begin(), union_markers_size_.end(), 0u);
+  Record("Memset");
+
+  // Unionfind the image.
+  CpuLabelImage(ToDecimatedImage(thresholded_image_),
+                ToDecimatedImage(union_markers_),
+                ToDecimatedImage(union_markers_size_), wp);
+  Record("Unionfinding");
+
+  if (compact_points_) {
+    FitBoundaryPoints(&compact_boundary_points_);
+  } else {
+    FitBoundaryPoints(&wide_boundary_points_);
+  }
+
+  CpuFitLines(line_fit_points_.data(), num_selected_blobs_,
+              selected_extents_.data(), errs_.data(), filtered_errs_.data(),
+              peaks_.data(), wp);
+  Record("Error Filter");
+
+  const size_t num_compressed_peaks =
+      ParallelCopyIf(wp, peaks_.data(), num_selected_blobs_,
+                     compressed_peaks_.data(), [](const Peak &a) {
+                       return a.blob_index != Peak::kNoPeak();
+                     });
+  Record("Compress Peaks");
+
+  ParallelStableSort(wp, compressed_peaks_.data(), num_compressed_peaks,
+                     &peaks_scratch_, [](const Peak &a, const Peak &b) {
+                       if (a.blob_index != b.blob_index) {
+                         return a.blob_index < b.blob_index;
+                       }
+                       return FloatSortKey(a.error) < FloatSortKey(b.error);
+                     });
+  Record("Sort Peaks");
+
+  // Now that we have the peaks sorted, recompute the extents so we can easily
+  // pick out the number and top 10 peaks for line fitting.
+  peak_extents_.clear();
+  for (size_t i = 0; i < num_compressed_peaks; ++i) {
+    if (i == 0 || compressed_peaks_[i].blob_index !=
+                      compressed_peaks_[i - 1].blob_index) {
+      peak_extents_.push_back(PeakExtents{
+          .blob_index = compressed_peaks_[i].blob_index,
+          .starting_offset = static_cast<uint32_t>(i),
+          .count = 1,
+      });
+    } else {
+      ++peak_extents_.back().count;
+    }
+  }
+  Record("Peak Extents");
+
+  fit_quads->resize(peak_extents_.size());
+  CpuFitQuads(compressed_peaks_.data(), peak_extents_.data(),
+              peak_extents_.size(), line_fit_points_.data(),
+              tag_detector_->qtp.max_nmaxima, selected_extents_.data(),
+              tag_detector_->qtp.max_line_fit_mse,
+              tag_detector_->qtp.cos_critical_rad, fit_quads->data(), wp);
+  Record("FitQuads");
+
+  VLOG(1) << "Found " << num_compressed_union_marker_pair_ << " items";
+  VLOG(1) << "Selected " << num_selected_blobs_ << " right side out points";
+  VLOG(1) << "Found compressed runs: " << extents_.size();
+  VLOG(1) << "Peaks " << num_compressed_peaks << " peaks";
+  VLOG(1) << "Peak Selected blobs " << peak_extents_.size() << " quads";
+  steady_clock::time_point previous = start;
+  for (const auto &[name, time] : events_) {
+    VLOG(1) << "    " << name << " " << float_milli(time - previous).count()
+            << "ms";
+    previous = time;
+  }
+
+  ++execution_count_;
+  execution_duration_ += previous - start;
+  VLOG(1) << "Average overall "
+          << float_milli(execution_duration_ / execution_count_).count()
+          << "ms";
+  return gray_image;
+}
+
+template <typename Storage>
+void CpuDetector::FitBoundaryPoints(BoundaryPoints<Storage> *points) {
+  using Point = BasicQuadBoundaryPoint<Storage>;
+  using SelectedPoint = BasicIndexPoint<Storage>;
+  workerpool_t *wp = tag_detector_->wp;
+
+  const size_t decimated_width = decimated_width_;
+  const size_t decimated_height = decimated_height_;
+  const uint32_t rep_bits = Point::RepBits(decimated_width * decimated_height);
+
+  // Compute the unfiltered list of blob pairs and points.
+  {
+    ParallelFor(wp, 1, decimated_height - 1, kMinRowsPerTask,
+                [&](size_t begin, size_t end) {
+                  for (size_t y = begin; y < end; ++y) {
+                    BlobDiffRow(thresholded_image_.data(),
+                                union_markers_.data(),
+                                union_markers_size_.data(),
+                                points->union_marker_pair.data(),
+                                decimated_width, decimated_height, rep_bits,
+                                y);
+                  }
+                });
+  }
+  Record("Diff");
+
+  // Remove empty points which aren't to be considered before sorting to speed
+  // things up.
+  num_compressed_union_marker_pair_ = ParallelCopyIf(
+      wp, points->union_marker_pair.data(), points->union_marker_pair.size(),
+      points->sorted_union_marker_pair.data(),
+      [](const Point &a) { return a.nonzero(); });
+  Record("Compact");
+
+  // Now, sort just the blob ID pairs to group like points.  This is stable so
+  // points within a blob stay in the same order as the GPU radix sort.
+  ParallelStableSort(
+      wp, points->sorted_union_marker_pair.data(),
+      num_compressed_union_marker_pair_, &points->union_marker_pair_scratch,
+      [](const Point &a, const Point &b) { return a.rep01() < b.rep01(); });
+  Record("Sort");
+
+  // Compute the extents and dot product of each blob so we can filter blobs.
+  extents_.clear();
+  for (int i = 0; i < num_compressed_union_marker_pair_; ++i) {
+    const Point pt = points->sorted_union_marker_pair[i];
+    const int64_t pxgx_plus_pygy = static_cast<int64_t>(pt.x()) * pt.gx() +
+                                   static_cast<int64_t>(pt.y()) * pt.gy();
+    if (i == 0 ||
+        pt.rep01() != points->sorted_union_marker_pair[i - 1].rep01()) {
+      MinMaxExtents extents;
+      extents.min_y = extents.max_y = pt.y();
+      extents.min_x = extents.max_x = pt.x();
+      extents.starting_offset = i;
+      extents.count = 1;
+      extents.pxgx_plus_pygy_sum = pxgx_plus_pygy;
+      extents.gx_sum = pt.gx();
+      extents.gy_sum = pt.gy();
+      extents_.push_back(extents);
+      continue;
+    }
+
+    MinMaxExtents &extents = extents_.back();
+    extents.min_x = std::min<uint16_t>(extents.min_x, pt.x());
+    extents.max_x = std::max<uint16_t>(extents.max_x, pt.x());
+    extents.min_y = std::min<uint16_t>(extents.min_y, pt.y());
+    extents.max_y = std::max<uint16_t>(extents.max_y, pt.y());
+    ++extents.count;
+    extents.pxgx_plus_pygy_sum += pxgx_plus_pygy;
+    extents.gx_sum += pt.gx();
+    extents.gy_sum += pt.gy();
+  }
+  Record("Bounds");
+
+  // Longest april tag will be the full perimeter of the image.  See
+  // GpuDetector::FindQuads for the derivation.
+  const size_t max_april_tag_perimeter = 2 * (width_ + height_);
+
+  // Rewrite the extents to have the starting offset and count match the
+  // post-selected values.  Blob indices only have room for kMaxBlobs, so
+  // anything past that is dropped.
+  {
+    const BlobFilter filter{
+        .tag_width = static_cast<size_t>(min_tag_width_),
+        .reversed_border = reversed_border_,
+        .normal_border = normal_border_,
+        .min_cluster_pixels = std::max<size_t>(
+            24u, tag_detector_->qtp.min_cluster_pixels),
+        .max_cluster_pixels = max_april_tag_perimeter,
+    };
+    LOG_IF(WARNING, extents_.size() > kMaxBlobs)
+        << "Found " << extents_.size() << " blobs, only considering the first "
+        << kMaxBlobs;
+
+    selected_extents_ = extents_;
+    uint32_t starting_offset = 0;
+    for (size_t i = 0; i < selected_extents_.size(); ++i) {
+      MinMaxExtents &extents = selected_extents_[i];
+      if (i >= kMaxBlobs || !filter(extents)) {
+        extents.count = 0;
+      }
+      extents.starting_offset = starting_offset;
+      starting_offset += extents.count;
+    }
+    num_selected_blobs_ = starting_offset;
+  }
+  Record("Transform Extents");
+
+  // Now, copy over all points which pass our thresholds, adding the angle.
+  ParallelFor(
+      wp, 0, selected_extents_.size(), kMinBlobsPerTask,
+      [&](size_t begin, size_t end) {
+        for (size_t i = begin; i < end; ++i) {
+          const MinMaxExtents &selected = selected_extents_[i];
+          const MinMaxExtents &extents = extents_[i];
+          for (size_t j = 0; j < selected.count; ++j) {
+            const Point &pt =
+                points->sorted_union_marker_pair[extents.starting_offset + j];
+            points->sorted_selected_blobs[selected.starting_offset + j] =
+                AddTheta(SelectedPoint(i, pt.point_bits()), extents);
+          }
+        }
+      });
+  Record("Filter by dot product");
+
+  // Sort based on the angle.
+  ParallelStableSort(wp, points->sorted_selected_blobs.data(),
+                     num_selected_blobs_, &points->selected_blobs_scratch,
+                     [](const SelectedPoint &a, const SelectedPoint &b) {
+                       return a.sort_key() < b.sort_key();
+                     });
+  Record("Filtered sort");
+
+  // Compute the cumulative moments of each blob for line fitting.
+  ParallelFor(
+      wp, 0, selected_extents_.size(), kMinBlobsPerTask,
+      [&](size_t begin, size_t end) {
+        for (size_t i = begin; i < end; ++i) {
+          const MinMaxExtents &selected = selected_extents_[i];
+          for (size_t j = 0; j < selected.count; ++j) {
+            const size_t index = selected.starting_offset + j;
+            LineFitPoint point = ToLineFitPoint(
+                points->sorted_selected_blobs[index], decimated_image_.data(),
+                decimated_width, decimated_height);
+            if (j > 0) {
+              point = line_fit_points_[index - 1] + point;
+            }
+            line_fit_points_[index] = point;
+          }
+        }
+      });
+  Record("Line Fit");
+}
+
+}  // namespace frc971::apriltag
@@ -0,0 +1,214 @@
+#ifndef FRC971_ORIN_APRILTAG_CPU_H_
+#define FRC971_ORIN_APRILTAG_CPU_H_
+
+#include <stdint.h>
+
+#include <array>
+#include <chrono>
+#include <cstring>
+#include <string_view>
+#include <tuple>
+#include <type_traits>
+#include <vector>
+
+#include "detector_backend.h"
+#include "glog/logging.h"
+#include "gpu_image.h"
+#include "line_fit_filter.h"
+#include "points.h"
+
+namespace frc971::apriltag {
+
+// CPU based april tag detector.  Runs the same pipeline as GpuDetector, one
+// stage at a time, spreading each stage across tag_detector->wp.
+class CpuDetector : public DetectorBackend {
+ public:
+  // Constructs a detector, reserving space for detecting tags of the provided
+  // with and height, using the provided detector options.
+  CpuDetector(size_t width, size_t height, apriltag_detector_t *tag_detector,
+              CameraMatrix camera_matrix, DistCoeffs distortion_coefficients);
+  virtual ~CpuDetector();
+
+  // Debug methods to expose internal state for testing.
+  void CopyGrayTo(uint8_t *output) const override {
+    const std::vector<uint8_t> &gray_image = gray_images_[last_slot_];
+    memcpy(output, gray_image.data(), gray_image.size());
+  }
+  void CopyDecimatedTo(uint8_t *output) const override {
+    memcpy(output, decimated_image_.data(), decimated_image_.size());
+  }
+  void CopyThresholdedTo(uint8_t *output) const override {
+    memcpy(output, thresholded_image_.data(), thresholded_image_.size());
+  }
+  void CopyUnionMarkersTo(uint32_t *output) const override {
+    memcpy(output, union_markers_.data(),
+           union_markers_.size() * sizeof(uint32_t));
+  }
+  void CopyUnionMarkersSizeTo(uint32_t *output) const override {
+    memcpy(output, union_markers_size_.data(),
+           union_markers_size_.size() * sizeof(uint32_t));
+  }
+
+  // The point debug methods hand out wide points whichever layout is in use.
+  void CopyUnionMarkerPairTo(QuadBoundaryPoint *output) const {
+    VisitBoundaryPoints([&](const auto &points) {
+      const std::vector<QuadBoundaryPoint> wide =
+          ConvertPoints<QuadBoundaryPoint>(points.union_marker_pair.data(),
+                                           points.union_marker_pair.size());
+      memcpy(output, wide.data(), wide.size() * sizeof(QuadBoundaryPoint));
+    });
+  }
+
+  int NumCompressedUnionMarkerPairs() const {
+    return num_compressed_union_marker_pair_;
+  }
+
+  std::vector<QuadBoundaryPoint> CopySortedUnionMarkerPair() const {
+    return VisitBoundaryPoints([&](const auto &points) {
+      return ConvertPoints<QuadBoundaryPoint>(
+          points.sorted_union_marker_pair.data(),
+          num_compressed_union_marker_pair_);
+    });
+  }
+
+  int NumQuads() const { return extents_.size(); }
+
+  std::vector<MinMaxExtents> CopyExtents() const { return extents_; }
+
+  std::vector<MinMaxExtents> CopySelectedExtents() const {
+    return selected_extents_;
+  }
+
+  int NumSelectedPairs() const { return num_selected_blobs_; }
+
+  std::vector<IndexPoint> CopySortedSelectedBlobs() const {
+    return VisitBoundaryPoints([&](const auto &points) {
+      return ConvertPoints<IndexPoint>(points.sorted_selected_blobs.data(),
+                                       num_selected_blobs_);
+    });
+  }
+
+  std::vector<LineFitPoint> CopyLineFitPoints() const {
+    return std::vector<LineFitPoint>(
+        line_fit_points_.begin(),
+        line_fit_points_.begin() + num_selected_blobs_);
+  }
+
+  std::vector<Peak> CopyPeaks() const {
+    return std::vector<Peak>(peaks_.begin(),
+                             peaks_.begin() + num_selected_blobs_);
+  }
+
+  std::vector<FitQuad> CopyFitQuads() const { return fit_quads_host_; }
+
+ private:
+  // The boundary points of a frame in one of the point layouts, and the
+  // scratch to sort them.
+  template <typename Storage>
+  struct BoundaryPoints {
+    void Resize(size_t max_points) {
+      union_marker_pair.resize(max_points);
+      sorted_union_marker_pair.resize(max_points);
+      sorted_selected_blobs.resize(max_points);
+    }
+
+    // Full list of boundary points, densly stored but mostly zero.
+    std::vector<BasicQuadBoundaryPoint<Storage>> union_marker_pair;
+    // Blob representation sorted list of points with 0's removed.
+    std::vector<BasicQuadBoundaryPoint<Storage>> sorted_union_marker_pair;
+    // Points which pass our threshold, sorted by blob and angle.
+    std::vector<BasicIndexPoint<Storage>> sorted_selected_blobs;
+
+    // Scratch for the stable sorts, grown to the largest sort seen.
+    std::vector<BasicQuadBoundaryPoint<Storage>> union_marker_pair_scratch;
+    std::vector<BasicIndexPoint<Storage>> selected_blobs_scratch;
+  };
+
+  uint8_t *FindQuads(const uint8_t *image, ImageFormat format, size_t slot,
+                     std::vector<FitQuad> *fit_quads) override;
+
+  // Runs the stages of FindQuads which work on boundary points, from finding
+  // them in the labeled image through the line fit.
+  template <typename Storage>
+  void FitBoundaryPoints(BoundaryPoints<Storage> *points);
+
+  // Calls f with the boundary points of the layout in use.
+  template <typename F>
+  std::invoke_result_t<F, const BoundaryPoints<WidePointStorage> &>
+  VisitBoundaryPoints(F f) const {
+    return compact_points_ ? f(compact_boundary_points_)
+                           : f(wide_boundary_points_);
+  }
+
+  // Notes the time a step of FindQuads finished.
+  void Record(std::string_view name) {
+    events_.emplace_back(name, std::chrono::steady_clock::now());
+  }
+
+  // Creates a GpuImage wrapped around the provided decimated image.
+  template <typename T>
+  GpuImage<T> ToDecimatedImage(std::vector<T> &memory) {
+    CHECK_EQ(memory.size(), decimated_width_ * decimated_height_);
+    return GpuImage<T>{
+        .data = memory.data(),
+        .rows = decimated_height_,
+        .cols = decimated_width_,
+        .step = decimated_width_,
+    };
+  }
+
+  // Full size gray scale image of each slot, and the slot last written.
+  std::array<std::vector<uint8_t>, kSlots> gray_images_;
+  size_t last_slot_ = 0;
+  // Gray, decimated image.
+  std::vector<uint8_t> decimated_image_;
+  // Intermediates for thresholding.
+  std::vector<uint8_t> unfiltered_minmax_image_;
+  std::vector<uint8_t> minmax_image_;
+  std::vector<uint8_t> thresholded_image_;
+  std::vector<uint8_t> threshold_scratch_;
+
+  // The union markers for each pixel.
+  std::vector<uint32_t> union_markers_;
+  // The size of each blob, stored at the index of the union marker id.
+  std::vector<uint32_t> union_markers_size_;
+
+  // Only the layout compact_points_ picks is allocated.
+  BoundaryPoints<WidePointStorage> wide_boundary_points_;
+  BoundaryPoints<CompactPointStorage> compact_boundary_points_;
+  int num_compressed_union_marker_pair_ = 0;
+
+  // Bounds per blob, one blob per ID.
+  std::vector<MinMaxExtents> extents_;
+  // Extents of the blobs under consideration, indexed like extents_, with the
+  // count zeroed for rejected blobs and the starting offset pointing into
+  // sorted_selected_blobs_.
+  std::vector<MinMaxExtents> selected_extents_;
+
+  int num_selected_blobs_ = 0;
+
+  std::vector<LineFitPoint> line_fit_points_;
+
+  std::vector<double> errs_;
+  std::vector<double> filtered_errs_;
+  std::vector<Peak> peaks_;
+  std::vector<Peak> compressed_peaks_;
+  std::vector<PeakExtents> peak_extents_;
+
+  // Scratch for the peak sort, grown to the largest sort seen.
+  std::vector<Peak> peaks_scratch_;
+
+  // Time after each step of the last FindQuads, for logging.
+  std::vector<
+      std::tuple<std::string_view, std::chrono::steady_clock::time_point>>
+      events_;
+
+  // Cumulative duration of april tag detection.
+  std::chrono::nanoseconds execution_duration_{0};
+  // Number of detections.
+  size_t execution_count_ = 0;
+};
+
+}  // namespace frc971::apriltag
+
+#endif  // FRC971_ORIN_APRILTAG_CPU_H_
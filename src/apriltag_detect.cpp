@@ -0,0 +1,523 @@
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <iomanip>
+#include <string>
+#include <vector>
+
+#include "decode_cache.h"
+#include "detector_backend.h"
+#include "edge_refiner.h"
+#include "g2d.h"
+#include "gflags/gflags.h"
+#include "glog/logging.h"
+#include "line_fit_filter_cpu.h"
+#include "parallel_for.h"
+#include "undistort_map.h"
+#include "work_stealing_pool.h"
+
+DEFINE_int32(debug_blob_index, 4096, "Blob to print out for");
+
+constexpr int kUndistortIterationThreshold = 100;
+constexpr double kUndistortConvergenceEpsilon = 1e-6;
+
+// Number of edge refinement samples searched per task.
+constexpr size_t kEdgeSamplesPerTask = 256;
+
+extern "C" {
+
+void quad_decode_index(apriltag_detector_t *td, struct quad *quad_original,
+                       image_u8_t *im, image_u8_t *im_samples,
+                       zarray_t *detections);
+};
+
+namespace frc971::apriltag {
+const std::vector<QuadCorners> &DetectorBackend::FitQuads() const {
+  return quad_corners_host_;
+}
+
+void DetectorBackend::UpdateFitQuads() {
+  quad_corners_host_.resize(0);
+  VLOG(1) << "Considering " << fit_quads_host_.size();
+  for (const FitQuad &quad : fit_quads_host_) {
+    bool print = quad.blob_index == FLAGS_debug_blob_index;
+    if (!quad.valid) {
+      continue;
+    }
+    QuadCorners corners;
+    corners.blob_index = quad.blob_index;
+    CHECK(normal_border_ != reversed_border_);
+    corners.reversed_border = reversed_border_;
+
+    double lines[4][4];
+    for (int i = 0; i < 4; i++) {
+      double err;
+      double mse;
+      HostFitLine(quad.moments[i], lines[i], lines[i] + 2, &err, &mse);
+      if (print) {
+        LOG(INFO) << "Blob " << corners.blob_index << " mse -> " << mse
+                  << " err " << err << " index " << quad.indices[i] << ", "
+                  << quad.indices[(i + 1) % 4];
+        LOG(INFO) << "   " << quad.moments[i];
+      }
+    }
+
+    bool bad_determinant = false;
+    for (int i = 0; i < 4; i++) {
+      // solve for the intersection of lines (i) and (i+1)&3.
+      // p0 + lambda0*u0 = p1 + lambda1*u1, where u0 and u1
+      // are the line directions.
+      //
+      // lambda0*u0 - lambda1*u1 = (p1 - p0)
+      //
+      // rearrange (solve for lambdas)
+      //
+      // [u0_x   -u1_x ] [lambda0] = [ p1_x - p0_x ]
+      // [u0_y   -u1_y ] [lambda1]   [ p1_y - p0_y ]
+      //
+      // remember that lines[i][0,1] = p, lines[i][2,3] = NORMAL vector.
+      // We want the unit vector, so we need the perpendiculars. Thus, below
+      // we have swapped the x and y components and flipped the y components.
+
+      double A00 = lines[i][3], A01 = -lines[(i + 1) & 3][3];
+      double A10 = -lines[i][2], A11 = lines[(i + 1) & 3][2];
+      double B0 = -lines[i][0] + lines[(i + 1) & 3][0];
+      double B1 = -lines[i][1] + lines[(i + 1) & 3][1];
+
+      double det = A00 * A11 - A10 * A01;
+
+      // inverse.
+      double W00 = A11 / det, W01 = -A01 / det;
+      if (fabs(det) < 0.001) {
+        bad_determinant = true;
+        break;
+      }
+
+      // solve
+      double L0 = W00 * B0 + W01 * B1;
+
+      // compute intersection
+      corners.corners[i][0] = lines[i][0] + L0 * A00;
+      corners.corners[i][1] = lines[i][1] + L0 * A10;
+      if (print) {
+        LOG(INFO) << "Calculated corner[" << i << "] -> ("
+                  << std::setprecision(20) << corners.corners[i][0] << ", "
+                  << std::setprecision(20) << corners.corners[i][1] << ")";
+      }
+    }
+    if (bad_determinant) {
+      continue;
+    }
+
+    {
+      float area = 0;
+
+      // get area of triangle formed by points 0, 1, 2, 0
+      float length[3], p;
+      for (int i = 0; i < 3; i++) {
+        int idxa = i;            // 0, 1, 2,
+        int idxb = (i + 1) % 3;  // 1, 2, 0
+        length[i] =
+            hypotf((corners.corners[idxb][0] - corners.corners[idxa][0]),
+                   (corners.corners[idxb][1] - corners.corners[idxa][1]));
+      }
+      p = (length[0] + length[1] + length[2]) / 2;
+
+      area += sqrtf(p * (p - length[0]) * (p - length[1]) * (p - length[2]));
+
+      // get area of triangle formed by points 2, 3, 0, 2
+      for (int i = 0; i < 3; i++) {
+        int idxs[] = {2, 3, 0, 2};
+        int idxa = idxs[i];
+        int idxb = idxs[i + 1];
+        length[i] =
+            hypotf((corners.corners[idxb][0] - corners.corners[idxa][0]),
+                   (corners.corners[idxb][1] - corners.corners[idxa][1]));
+      }
+      p = (length[0] + length[1] + length[2]) / 2;
+
+      area += sqrtf(p * (p - length[0]) * (p - length[1]) * (p - length[2]));
+
+      if (area < 0.95 * min_tag_width_ * min_tag_width_) {
+        if (print) {
+          LOG(INFO) << "Area of " << area << " smaller than "
+                    << 0.95 * min_tag_width_ * min_tag_width_;
+        }
+        continue;
+      }
+    }
+
+    // reject quads whose cumulative angle change isn't equal to 2PI
+    {
+      bool reject_corner = false;
+      for (int i = 0; i < 4; i++) {
+        int i0 = i, i1 = (i + 1) & 3, i2 = (i + 2) & 3;
+
+        float dx1 = corners.corners[i1][0] - corners.corners[i0][0];
+        float dy1 = corners.corners[i1][1] - corners.corners[i0][1];
+        float dx2 = corners.corners[i2][0] - corners.corners[i1][0];
+        float dy2 = corners.corners[i2][1] - corners.corners[i1][1];
+        float cos_dtheta =
+            (dx1 * dx2 + dy1 * dy2) /
+            sqrtf((dx1 * dx1 + dy1 * dy1) * (dx2 * dx2 + dy2 * dy2));
+
+        if (print) {
+          LOG(INFO) << "Cosdtheta -> for " << i0 << " " << i1 << " " << i2
+                    << " -> " << cos_dtheta << " threshold "
+                    << tag_detector_->qtp.cos_critical_rad;
+        }
+
+        if (std::abs(cos_dtheta) > tag_detector_->qtp.cos_critical_rad ||
+            dx1 * dy2 < dy1 * dx2) {
+          reject_corner = true;
+          break;
+        }
+      }
+      if (reject_corner) {
+        continue;
+      }
+    }
+    quad_corners_host_.push_back(corners);
+  }
+}
+
+void DetectorBackend::AdjustCenter(float corners[4][2]) const {
+  const float quad_decimate = tag_detector_->quad_decimate;
+  if (tag_detector_->quad_decimate > 1) {
+    if (tag_detector_->quad_decimate == 1.5) {
+      for (int j = 0; j < 4; j++) {
+        corners[j][0] *= quad_decimate;
+        corners[j][1] *= quad_decimate;
+      }
+    } else {
+      for (int j = 0; j < 4; j++) {
+        corners[j][0] = (corners[j][0] - 0.5f) * quad_decimate + 0.5f;
+        corners[j][1] = (corners[j][1] - 0.5f) * quad_decimate + 0.5f;
+      }
+    }
+  }
+}
+
+void DetectorBackend::AdjustPixelCenters() {
+  const float quad_decimate = tag_detector_->quad_decimate;
+
+  if (quad_decimate > 1) {
+    if (tag_detector_->quad_decimate == 1.5) {
+      for (QuadCorners &quad : quad_corners_host_) {
+        for (int j = 0; j < 4; j++) {
+          quad.corners[j][0] *= quad_decimate;
+          quad.corners[j][1] *= quad_decimate;
+        }
+      }
+    } else {
+      for (QuadCorners &quad : quad_corners_host_) {
+        for (int j = 0; j < 4; j++) {
+          quad.corners[j][0] =
+              (quad.corners[j][0] - 0.5f) * quad_decimate + 0.5f;
+          quad.corners[j][1] =
+              (quad.corners[j][1] - 0.5f) * quad_decimate + 0.5f;
+        }
+      }
+    }
+  }
+}
+
+static inline int detection_compare_function(const void *_a, const void *_b) {
+  apriltag_detection_t *a = *(apriltag_detection_t **)_a;
+  apriltag_detection_t *b = *(apriltag_detection_t **)_b;
+  return a->id - b->id;
+}
+
+// We're undistorting using math found from this github page
+// https://yangyushi.github.io/code/2020/03/04/opencv-undistort.html
+bool DetectorBackend::UnDistort(double *u, double *v,
+                                const CameraMatrix *camera_matrix,
+                                const DistCoeffs *distortion_coefficients) {
+  bool converged = true;
+  const double k1 = distortion_coefficients->k1;
+  const double k2 = distortion_coefficients->k2;
+  const double p1 = distortion_coefficients->p1;
+  const double p2 = distortion_coefficients->p2;
+  const double k3 = distortion_coefficients->k3;
+
+  const double fx = camera_matrix->fx;
+  const double cx = camera_matrix->cx;
+  const double fy = camera_matrix->fy;
+  const double cy = camera_matrix->cy;
+
+  const double xPP = (*u - cx) / fx;
+  const double yPP = (*v - cy) / fy;
+
+  double xP = xPP;
+  double yP = yPP;
+
+  double x0 = xP;
+  double y0 = yP;
+
+  double prev_x = 0, prev_y = 0;
+
+  int iterations = 0;
+  do {
+    prev_x = xP;
+    prev_y = yP;
+    double rSq = xP * xP + yP * yP;
+
+    double radial_distortion =
+        1 + (k1 * rSq) + (k2 * rSq * rSq) + (k3 * rSq * rSq * rSq);
+
+    double radial_distortion_inv = 1 / radial_distortion;
+
+    double tangential_dx = 2 * p1 * xP * yP + p2 * (rSq + k3 * rSq * rSq * rSq);
+    double tangential_dy = p1 * (rSq + 2 * yP * yP) + 2 * p2 * xP * yP;
+
+    xP = (x0 - tangential_dx) * radial_distortion_inv;
+    yP = (y0 - tangential_dy) * radial_distortion_inv;
+
+    if (iterations > kUndistortIterationThreshold) {
+      converged = false;
+      break;
+    }
+
+    iterations++;
+  } while (std::abs(xP - prev_x) > kUndistortConvergenceEpsilon ||
+           std::abs(yP - prev_y) > kUndistortConvergenceEpsilon);
+
+  if (iterations < kUndistortIterationThreshold) {
+    VLOG(1) << "Took " << iterations << " iterations to reach convergence.";
+  } else {
+    VLOG(1) << "Took " << iterations
+            << " iterations and didn't reach convergence with "
+            << " (xP, yP): "
+            << " (" << xP << ", " << yP << ")"
+            << " vs. (prev_x, prev_y): "
+            << " (" << prev_x << ", " << prev_y << ")";
+  }
+
+  *u = xP * fx + cx;
+  *v = yP * fy + cy;
+
+  return converged;
+}
+
+namespace {
+
+// Converts corners into the quad libapriltag decodes.
+struct quad MakeQuad(const QuadCorners &corners) {
+  struct quad quad;
+  std::memcpy(quad.p, corners.corners, sizeof(corners.corners));
+
+  quad.reversed_border = corners.reversed_border;
+  quad.H = nullptr;
+  quad.Hinv = nullptr;
+  return quad;
+}
+
+}  // namespace
+
+void DetectorBackend::DecodeQuad(size_t quad_index, image_u8_t *im,
+                                 zarray_t *detections) {
+  apriltag_detector_t *td = tag_detector_;
+  const QuadCorners &corners = quad_corners_host_[quad_index];
+
+  struct quad quad_original = MakeQuad(corners);
+
+  if (td->refine_edges) {
+    edge_refiner_->FitQuad(quad_index, &quad_original, &camera_matrix_,
+                           &distortion_coefficients_, undistort_map_.get());
+  }
+
+  if (decode_cache_ != nullptr &&
+      decode_cache_->Lookup(quad_index, corners, quad_original, im,
+                            &detection_pool_, detections)) {
+    return;
+  }
+
+  if (td->debug) {
+    image_u8_t *im_quads = image_u8_copy(im);
+    image_u8_darken(im_quads);
+    image_u8_darken(im_quads);
+
+    srandom(0);
+
+    const int bias = 100;
+    int color = bias + (random() % (255 - bias));
+
+    image_u8_draw_line(im_quads, quad_original.p[0][0], quad_original.p[0][1],
+                       quad_original.p[1][0], quad_original.p[1][1], color,
+                       1);
+    image_u8_draw_line(im_quads, quad_original.p[1][0], quad_original.p[1][1],
+                       quad_original.p[2][0], quad_original.p[2][1], color,
+                       1);
+    image_u8_draw_line(im_quads, quad_original.p[2][0], quad_original.p[2][1],
+                       quad_original.p[3][0], quad_original.p[3][1], color,
+                       1);
+    image_u8_draw_line(im_quads, quad_original.p[3][0], quad_original.p[3][1],
+                       quad_original.p[0][0], quad_original.p[0][1], color,
+                       1);
+
+    image_u8_write_pnm(
+        im_quads,
+        std::string("/tmp/quad" + std::to_string(quad_index) + ".pnm").c_str());
+  }
+
+  const int first_detection = zarray_size(detections);
+  quad_decode_index(td, &quad_original, im, nullptr, detections);
+  if (decode_cache_ != nullptr) {
+    decode_cache_->Record(quad_index, corners, quad_original, im, detections,
+                          first_detection);
+  }
+}
+
+namespace {
+
+// Returns which of two detections to keep based on q, if it hasn't been
+// decided yet.  Negative keeps the first, positive the second.
+int PreferSmaller(int pref, double q0, double q1) {
+  if (pref != 0) {
+    return pref;
+  }
+  if (q0 < q1) {
+    return -1;
+  }
+  if (q1 < q0) {
+    return 1;
+  }
+  return 0;
+}
+
+}  // namespace
+
+void DetectorBackend::ReconcileDetections() {
+  for (int i0 = 0; i0 < zarray_size(detections_); i0++) {
+    apriltag_detection_t *det0;
+    zarray_get(detections_, i0, &det0);
+    for (int k = 0; k < 4; k++) {
+      zarray_set(poly0_, k, det0->p[k], nullptr);
+    }
+
+    bool dropped_det0 = false;
+    for (int i1 = i0 + 1; i1 < zarray_size(detections_); i1++) {
+      apriltag_detection_t *det1;
+      zarray_get(detections_, i1, &det1);
+      if (det0->id != det1->id || det0->family != det1->family) {
+        continue;
+      }
+      for (int k = 0; k < 4; k++) {
+        zarray_set(poly1_, k, det1->p[k], nullptr);
+      }
+      if (!g2d_polygon_overlaps_polygon(poly0_, poly1_)) {
+        continue;
+      }
+
+      // Small hamming, then big margins, then anything deterministic.
+      int pref = 0;
+      pref = PreferSmaller(pref, det0->hamming, det1->hamming);
+      pref = PreferSmaller(pref, -det0->decision_margin,
+                           -det1->decision_margin);
+      for (int i = 0; i < 4; i++) {
+        pref = PreferSmaller(pref, det0->p[i][0], det1->p[i][0]);
+        pref = PreferSmaller(pref, det0->p[i][1], det1->p[i][1]);
+      }
+
+      if (pref < 0) {
+        detection_pool_.Recycle(det1);
+        zarray_remove_index(detections_, i1, 0);
+        i1--;
+      } else {
+        detection_pool_.Recycle(det0);
+        zarray_remove_index(detections_, i0, 0);
+        dropped_det0 = true;
+        break;
+      }
+    }
+    if (dropped_det0) {
+      i0--;
+    }
+  }
+}
+
+void DetectorBackend::DecodeTags(uint8_t *gray_image) {
+  RecycleDetections();
+
+  image_u8_t im_orig{
+      .width = static_cast<int32_t>(width_),
+      .height = static_cast<int32_t>(height_),
+      .stride = static_cast<int32_t>(width_),
+      .buf = gray_image,
+  };
+
+  if (tag_detector_->refine_edges) {
+    // XXX tunable: how far to search?  We want to search far enough that we
+    // find the best edge, but not so far that we hit other edges that aren't
+    // part of the tag. We shouldn't ever have to search more than
+    // quad_decimate, since otherwise we would (ideally) have started our
+    // search on another pixel in the first place. Likewise, for very small
+    // tags, we don't want the range to be too big.
+    edge_refiner_->Start(tag_detector_->quad_decimate + 1);
+    for (const QuadCorners &corners : quad_corners_host_) {
+      edge_refiner_->AddQuad(MakeQuad(corners));
+    }
+
+    // Every sample costs the same to search, so the whole frame's samples
+    // are split into even chunks.
+    const size_t samples = edge_refiner_->sample_count();
+    decode_pool_->ForEach(
+        (samples + kEdgeSamplesPerTask - 1) / kEdgeSamplesPerTask,
+        [&](size_t chunk, size_t) {
+          edge_refiner_->FindEdges(
+              &im_orig, chunk * kEdgeSamplesPerTask,
+              std::min(samples, (chunk + 1) * kEdgeSamplesPerTask));
+        });
+  }
+
+  if (decode_cache_ != nullptr) {
+    decode_cache_->StartFrame(quad_corners_host_.size());
+  }
+
+  // Quads cost wildly different amounts to decode (most bad quads bail out
+  // early), so each one is its own task and idle workers steal.
+  decode_pool_->ForEach(
+      quad_corners_host_.size(), [&](size_t quad_index, size_t worker) {
+        DecodeOutput &output = decode_outputs_[worker];
+        DecodeQuad(quad_index, &im_orig, output.scratch);
+        for (int i = 0; i < zarray_size(output.scratch); ++i) {
+          apriltag_detection_t *det;
+          zarray_get(output.scratch, i, &det);
+          output.detections.emplace_back(quad_index, det);
+        }
+        zarray_truncate(output.scratch, 0);
+      });
+  detection_pool_.Settle();
+
+  if (decode_cache_ != nullptr) {
+    decode_cache_->FinishFrame();
+    VLOG(1) << "Decode cache: " << decode_cache_->stats().ToString();
+  }
+
+  // Put everything back in quad order so the result doesn't depend on who
+  // decoded what.
+  merged_detections_.clear();
+  for (DecodeOutput &output : decode_outputs_) {
+    merged_detections_.insert(merged_detections_.end(),
+                              output.detections.begin(),
+                              output.detections.end());
+    output.detections.clear();
+  }
+  merged_scratch_.resize(merged_detections_.size());
+  StableSort(merged_detections_.data(), merged_detections_.size(),
+             merged_scratch_.data(),
+             [](const std::pair<size_t, apriltag_detection_t *> &a,
+                const std::pair<size_t, apriltag_detection_t *> &b) {
+               return a.first < b.first;
+             });
+  for (const std::pair<size_t, apriltag_detection_t *> &detection :
+       merged_detections_) {
+    zarray_add(detections_, &detection.second);
+  }
+
+  ReconcileDetections();
+
+  zarray_sort(detections_, detection_compare_function);
+}
+
+}  // namespace frc971::apriltag
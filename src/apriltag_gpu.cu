@@ -13,7 +13,6 @@
 #include <vector>
 
 #include "apriltag_gpu.h"
-#include "g2d.h"
 #include "glog/logging.h"
 
 //#include "aos/time/time.h"
@@ -28,8 +27,9 @@ typedef std::chrono::duration<float, std::milli> float_milli;
 
 // Returns true if the QuadBoundaryPoint is nonzero.
 struct NonZero {
+  template <typename Storage>
   __host__ __device__ __forceinline__ bool operator()(
-      const QuadBoundaryPoint &a) const {
+      const BasicQuadBoundaryPoint<Storage> &a) const {
     return a.nonzero();
   }
 };
@@ -43,11 +43,11 @@ struct True {
 };
 
 // Computes and returns the scratch space needed for DeviceRadixSort::SortKeys
-// of the provided key with the provided number of elements.
-template <typename T>
+// of the provided key and decomposer with the provided number of elements.
+template <typename T, typename Decomposer>
 static size_t RadixSortScratchSpace(size_t elements) {
   size_t temp_storage_bytes = 0;
-  QuadBoundaryPointDecomposer decomposer;
+  Decomposer decomposer;
   cub::DeviceRadixSort::SortKeys(nullptr, temp_storage_bytes, (T *)(nullptr),
                                  (T *)(nullptr), elements, decomposer);
   return temp_storage_bytes;
@@ -111,131 +111,211 @@ static size_t DeviceScanInclusiveScanByKeyScratchSpace(size_t elements) {
 
 }  // namespace
 
+template <typename T>
+ScratchLayout::Buffer GpuDetector::AddScratch(std::string_view name,
+                                              size_t size, Stage first,
+                                              Stage last) {
+  // The debug methods read the scratch buffers after Detect returns, so don't
+  // let anything share memory when debugging.
+  if (tag_detector_->debug) {
+    first = kBlobDiff;
+    last = static_cast<Stage>(kNumStages - 1);
+  }
+  return scratch_.Add<T>(name, size, first, last);
+}
+
+template <typename Storage>
+GpuDetector::BoundaryPointsScratch GpuDetector::AddBoundaryPointsScratch(
+    size_t max_points) {
+  using Point = BasicQuadBoundaryPoint<Storage>;
+  using SelectedPoint = BasicIndexPoint<Storage>;
+  BoundaryPointsScratch scratch;
+  scratch.union_marker_pair = AddScratch<Point>(
+      "union_marker_pair", max_points, kBlobDiff, kCompact);
+  scratch.compressed_union_marker_pair = AddScratch<Point>(
+      "compressed_union_marker_pair", max_points, kCompact, kSort);
+  scratch.sorted_union_marker_pair = AddScratch<Point>(
+      "sorted_union_marker_pair", max_points, kSort, kFilter);
+  scratch.selected_blobs = AddScratch<SelectedPoint>(
+      "selected_blobs", max_points, kFilter, kFilteredSort);
+  scratch.sorted_selected_blobs = AddScratch<SelectedPoint>(
+      "sorted_selected_blobs", max_points, kFilteredSort, kLineFit);
+
+  scratch.temp_storage_compact = AddScratch<uint8_t>(
+      "temp_storage_compact",
+      DeviceSelectIfScratchSpace<Point, Point>(
+          max_points, num_compressed_union_marker_pair_device_.get()),
+      kCompact, kCompact);
+  scratch.temp_storage_sort = AddScratch<uint8_t>(
+      "temp_storage_sort",
+      RadixSortScratchSpace<Point, SortWordDecomposer<Point>>(max_points),
+      kSort, kSort);
+  scratch.temp_storage_filter = AddScratch<uint8_t>(
+      "temp_storage_filter",
+      DeviceSelectIfScratchSpace<SelectedPoint, SelectedPoint>(
+          max_points, num_selected_blobs_device_.get()),
+      kFilter, kFilter);
+  scratch.temp_storage_filtered_sort = AddScratch<uint8_t>(
+      "temp_storage_filtered_sort",
+      RadixSortScratchSpace<SelectedPoint, SortWordDecomposer<SelectedPoint>>(
+          max_points),
+      kFilteredSort, kFilteredSort);
+  return scratch;
+}
+
+template <typename Storage>
+void GpuDetector::GetBoundaryPointsScratch(
+    const BoundaryPointsScratch &scratch,
+    BoundaryPointsDevice<Storage> *points) {
+  using Point = BasicQuadBoundaryPoint<Storage>;
+  using SelectedPoint = BasicIndexPoint<Storage>;
+  points->union_marker_pair = scratch_.Get<Point>(scratch.union_marker_pair);
+  points->compressed_union_marker_pair =
+      scratch_.Get<Point>(scratch.compressed_union_marker_pair);
+  points->sorted_union_marker_pair =
+      scratch_.Get<Point>(scratch.sorted_union_marker_pair);
+  points->selected_blobs =
+      scratch_.Get<SelectedPoint>(scratch.selected_blobs);
+  points->sorted_selected_blobs =
+      scratch_.Get<SelectedPoint>(scratch.sorted_selected_blobs);
+}
+
 GpuDetector::GpuDetector(size_t width, size_t height,
                          apriltag_detector_t *tag_detector,
                          CameraMatrix camera_matrix,
                          DistCoeffs distortion_coefficients)
-    : width_(width),
-      height_(height),
-      tag_detector_(tag_detector),
+    : DetectorBackend(width, height, tag_detector, camera_matrix,
+                      distortion_coefficients),
       color_image_host_(width * height * 2),
-      gray_image_host_(width * height),
-      color_image_device_(width * height * 2),
+      // Sized for the widest pixel format we accept.
+      color_image_device_(width * height * 3),
       gray_image_device_(width * height),
-      decimated_image_device_(width / 2 * height / 2),
-      unfiltered_minmax_image_device_((width / 2 / 4 * height / 2 / 4) * 2),
-      minmax_image_device_((width / 2 / 4 * height / 2 / 4) * 2),
-      thresholded_image_device_(width / 2 * height / 2),
-      union_markers_device_(width / 2 * height / 2),
-      union_markers_size_device_(width / 2 * height / 2),
-      union_marker_pair_device_((width / 2 - 2) * (height / 2 - 2) * 4),
-      compressed_union_marker_pair_device_(union_marker_pair_device_.size()),
-      sorted_union_marker_pair_device_(union_marker_pair_device_.size()),
-      extents_device_(union_marker_pair_device_.size()),
+      decimated_image_device_(decimated_width_ * decimated_height_),
+      unfiltered_minmax_image_device_(
+          (decimated_width_ / 4 * decimated_height_ / 4) * 2),
+      minmax_image_device_((decimated_width_ / 4 * decimated_height_ / 4) * 2),
+      thresholded_image_device_(decimated_width_ * decimated_height_),
+      union_markers_device_(decimated_width_ * decimated_height_),
+      union_markers_size_device_(decimated_width_ * decimated_height_),
       selected_extents_device_(kMaxBlobs),
-      selected_blobs_device_(union_marker_pair_device_.size()),
-      sorted_selected_blobs_device_(selected_blobs_device_.size()),
-      line_fit_points_device_(selected_blobs_device_.size()),
-      errs_device_(line_fit_points_device_.size()),
-      filtered_errs_device_(line_fit_points_device_.size()),
-      filtered_is_local_peak_device_(line_fit_points_device_.size()),
-      compressed_peaks_device_(line_fit_points_device_.size()),
-      sorted_compressed_peaks_device_(line_fit_points_device_.size()),
       peak_extents_device_(kMaxBlobs),
-      camera_matrix_(camera_matrix),
-      distortion_coefficients_(distortion_coefficients),
-      fit_quads_device_(kMaxBlobs),
-      radix_sort_tmpstorage_device_(RadixSortScratchSpace<QuadBoundaryPoint>(
-          sorted_union_marker_pair_device_.size())),
-      temp_storage_compressed_union_marker_pair_device_(
-          DeviceSelectIfScratchSpace<QuadBoundaryPoint, QuadBoundaryPoint>(
-              union_marker_pair_device_.size(),
-              num_compressed_union_marker_pair_device_.get())),
-      temp_storage_bounds_reduce_by_key_device_(
-          DeviceReduceByKeyScratchSpace<uint64_t, MinMaxExtents>(
-              union_marker_pair_device_.size())),
-      temp_storage_dot_product_device_(
-          DeviceReduceByKeyScratchSpace<uint64_t, float>(
-              union_marker_pair_device_.size())),
-      temp_storage_compressed_filtered_blobs_device_(
-          DeviceSelectIfScratchSpace<IndexPoint, IndexPoint>(
-              union_marker_pair_device_.size(),
-              num_selected_blobs_device_.get())),
-      temp_storage_selected_extents_scan_device_(
-          DeviceScanInclusiveScanScratchSpace<
-              cub::KeyValuePair<long, MinMaxExtents>>(kMaxBlobs)),
-      temp_storage_line_fit_scan_device_(
-          DeviceScanInclusiveScanByKeyScratchSpace<uint32_t, LineFitPoint>(
-              sorted_selected_blobs_device_.size())) {
-  fit_quads_host_.reserve(kMaxBlobs);
-  quad_corners_host_.reserve(kMaxBlobs);
-
-  CHECK_EQ(tag_detector_->quad_decimate, 2);
+      fit_quads_device_(kMaxBlobs) {
   CHECK(!tag_detector_->qtp.deglitch);
 
-  for (int i = 0; i < zarray_size(tag_detector_->tag_families); i++) {
-    apriltag_family_t *family;
-    zarray_get(tag_detector_->tag_families, i, &family);
-    if (family->width_at_border < min_tag_width_) {
-      min_tag_width_ = family->width_at_border;
-    }
-    normal_border_ |= !family->reversed_border;
-    reversed_border_ |= family->reversed_border;
-  }
-  min_tag_width_ /= tag_detector_->quad_decimate;
-  if (min_tag_width_ < 3) {
-    min_tag_width_ = 3;
+  // Every boundary point BlobDiff can produce.  Everything downstream is a
+  // subset of these.
+  const size_t max_points =
+      (decimated_width_ - 2) * (decimated_height_ - 2) * 4;
+
+  // Small frames use compact points, which halves the memory the point
+  // buffers take and the bandwidth the stages on them use.
+  const BoundaryPointsScratch points =
+      compact_points_
+          ? AddBoundaryPointsScratch<CompactPointStorage>(max_points)
+          : AddBoundaryPointsScratch<WidePointStorage>(max_points);
+  const ScratchLayout::Buffer extents =
+      AddScratch<MinMaxExtents>("extents", max_points, kBounds, kFilter);
+  const ScratchLayout::Buffer line_fit_points = AddScratch<LineFitPoint>(
+      "line_fit_points", max_points, kLineFit, kFitQuads);
+  const ScratchLayout::Buffer errs =
+      AddScratch<double>("errs", max_points, kFitLines, kFitLines);
+  const ScratchLayout::Buffer filtered_errs =
+      AddScratch<double>("filtered_errs", max_points, kFitLines, kFitLines);
+  const ScratchLayout::Buffer filtered_is_local_peak = AddScratch<Peak>(
+      "filtered_is_local_peak", max_points, kFitLines, kCompressPeaks);
+  const ScratchLayout::Buffer compressed_peaks = AddScratch<Peak>(
+      "compressed_peaks", max_points, kCompressPeaks, kSortPeaks);
+  const ScratchLayout::Buffer sorted_compressed_peaks = AddScratch<Peak>(
+      "sorted_compressed_peaks", max_points, kSortPeaks, kFitQuads);
+
+  const ScratchLayout::Buffer temp_storage_bounds = AddScratch<uint8_t>(
+      "temp_storage_bounds",
+      DeviceReduceByKeyScratchSpace<uint64_t, MinMaxExtents>(max_points),
+      kBounds, kBounds);
+  const ScratchLayout::Buffer temp_storage_selected_extents_scan =
+      AddScratch<uint8_t>(
+          "temp_storage_selected_extents_scan",
+          DeviceScanInclusiveScanScratchSpace<
+              cub::KeyValuePair<long, MinMaxExtents>>(kMaxBlobs),
+          kSelectExtents, kSelectExtents);
+  const ScratchLayout::Buffer temp_storage_line_fit_scan = AddScratch<uint8_t>(
+      "temp_storage_line_fit_scan",
+      DeviceScanInclusiveScanByKeyScratchSpace<uint32_t, LineFitPoint>(
+          max_points),
+      kLineFit, kLineFit);
+  const ScratchLayout::Buffer temp_storage_compress_peaks = AddScratch<uint8_t>(
+      "temp_storage_compress_peaks",
+      DeviceSelectIfScratchSpace<Peak, Peak>(
+          max_points, num_compressed_peaks_device_.get()),
+      kCompressPeaks, kCompressPeaks);
+  const ScratchLayout::Buffer temp_storage_sort_peaks = AddScratch<uint8_t>(
+      "temp_storage_sort_peaks",
+      RadixSortScratchSpace<Peak, PeakDecomposer>(max_points), kSortPeaks,
+      kSortPeaks);
+  const ScratchLayout::Buffer temp_storage_peak_extents = AddScratch<uint8_t>(
+      "temp_storage_peak_extents",
+      DeviceReduceByKeyScratchSpace<uint32_t, PeakExtents>(max_points),
+      kPeakExtents, kPeakExtents);
+
+  scratch_.Allocate();
+  VLOG(1) << "Scratch arena for " << width_ << "x" << height_ << ":\n"
+          << scratch_.layout().ToString();
+
+  if (compact_points_) {
+    GetBoundaryPointsScratch(points, &compact_points_device_);
+  } else {
+    GetBoundaryPointsScratch(points, &wide_points_device_);
   }
-
-  poly0_ = g2d_polygon_create_zeros(4);
-  poly1_ = g2d_polygon_create_zeros(4);
-
-  detections_ = zarray_create(sizeof(apriltag_detection_t *));
-  zarray_ensure_capacity(detections_, kMaxBlobs);
-}
-
-GpuDetector::~GpuDetector() {
-  for (int i = 0; i < zarray_size(detections_); ++i) {
-    apriltag_detection_t *det;
-    zarray_get(detections_, i, &det);
-    apriltag_detection_destroy(det);
+  extents_device_ = scratch_.Get<MinMaxExtents>(extents);
+  line_fit_points_device_ = scratch_.Get<LineFitPoint>(line_fit_points);
+  errs_device_ = scratch_.Get<double>(errs);
+  filtered_errs_device_ = scratch_.Get<double>(filtered_errs);
+  filtered_is_local_peak_device_ = scratch_.Get<Peak>(filtered_is_local_peak);
+  compressed_peaks_device_ = scratch_.Get<Peak>(compressed_peaks);
+  sorted_compressed_peaks_device_ = scratch_.Get<Peak>(sorted_compressed_peaks);
+
+  temp_storage_compact_device_ =
+      scratch_.Get<uint8_t>(points.temp_storage_compact);
+  temp_storage_sort_device_ = scratch_.Get<uint8_t>(points.temp_storage_sort);
+  temp_storage_bounds_device_ = scratch_.Get<uint8_t>(temp_storage_bounds);
+  temp_storage_selected_extents_scan_device_ =
+      scratch_.Get<uint8_t>(temp_storage_selected_extents_scan);
+  temp_storage_filter_device_ =
+      scratch_.Get<uint8_t>(points.temp_storage_filter);
+  temp_storage_filtered_sort_device_ =
+      scratch_.Get<uint8_t>(points.temp_storage_filtered_sort);
+  temp_storage_line_fit_scan_device_ =
+      scratch_.Get<uint8_t>(temp_storage_line_fit_scan);
+  temp_storage_compress_peaks_device_ =
+      scratch_.Get<uint8_t>(temp_storage_compress_peaks);
+  temp_storage_sort_peaks_device_ =
+      scratch_.Get<uint8_t>(temp_storage_sort_peaks);
+  temp_storage_peak_extents_device_ =
+      scratch_.Get<uint8_t>(temp_storage_peak_extents);
+
+  for (std::unique_ptr<HostMemory<uint8_t>> &gray_image : gray_image_host_) {
+    gray_image = std::make_unique<HostMemory<uint8_t>>(width * height);
   }
-
-  zarray_destroy(detections_);
-  zarray_destroy(poly1_);
-  zarray_destroy(poly0_);
 }
 
-void GpuDetector::ReinitializeDetections() {
-  // Convenience method to reinitialize the detections_ array
-  // so we don't have to call the destructor to free the memory.
-  for (int i = 0; i < zarray_size(detections_); ++i) {
-    apriltag_detection_t *det;
-    zarray_get(detections_, i, &det);
-    apriltag_detection_destroy(det);
-  }
-
-  zarray_destroy(detections_);
-  zarray_destroy(poly1_);
-  zarray_destroy(poly0_);
-
-  poly0_ = g2d_polygon_create_zeros(4);
-  poly1_ = g2d_polygon_create_zeros(4);
+GpuDetector::~GpuDetector() { StopDecodeThread(); }
 
-  detections_ = zarray_create(sizeof(apriltag_detection_t *));
-  zarray_ensure_capacity(detections_, kMaxBlobs);
+std::unique_ptr<DetectorBackend> MakeGpuDetector(
+    size_t width, size_t height, apriltag_detector_t *tag_detector,
+    CameraMatrix camera_matrix, DistCoeffs distortion_coefficients) {
+  return std::make_unique<GpuDetector>(width, height, tag_detector,
+                                       camera_matrix, distortion_coefficients);
 }
 
 namespace {
 
 // Computes a massive image of 4x QuadBoundaryPoint per pixel with a
 // QuadBoundaryPoint for each pixel pair which crosses a blob boundary.
-template <size_t kBlockWidth, size_t kBlockHeight>
+template <size_t kBlockWidth, size_t kBlockHeight, typename Point>
 __global__ void BlobDiff(const uint8_t *thresholded_image,
                          const uint32_t *blobs,
-                         const uint32_t *union_markers_size,
-                         QuadBoundaryPoint *result, size_t width,
-                         size_t height) {
+                         const uint32_t *union_markers_size, Point *result,
+                         size_t width, size_t height, uint32_t rep_bits) {
   __shared__ uint32_t temp_blob_storage[kBlockWidth * kBlockHeight];
   __shared__ uint8_t temp_image_storage[kBlockWidth * kBlockHeight];
 
@@ -294,7 +374,7 @@ __global__ void BlobDiff(const uint8_t *thresholded_image,
     for (size_t point_offset = 0; point_offset < 4; ++point_offset) {
       const size_t write_address =
           (width - 2) * (height - 2) * point_offset + global_output_index;
-      result[write_address] = QuadBoundaryPoint();
+      result[write_address] = Point();
     }
     return;
   }
@@ -304,7 +384,7 @@ __global__ void BlobDiff(const uint8_t *thresholded_image,
 
 #define DO_CONN(dx, dy, point_offset)                                    \
   {                                                                      \
-    QuadBoundaryPoint cluster_id;                                        \
+    Point cluster_id;                                                    \
     const uint x1 = dx + threadIdx.x;                                    \
     const uint y1 = dy + threadIdx.y;                                    \
     const uint thread_linear_index1 = x1 + blockDim.x * y1;              \
@@ -313,11 +393,9 @@ __global__ void BlobDiff(const uint8_t *thresholded_image,
     if (v0 + v1 == 255) {                                                \
       if (union_markers_size[rep1] >= 25) {                              \
         if (rep0 < rep1) {                                               \
-          cluster_id.set_rep1(rep1);                                     \
-          cluster_id.set_rep0(rep0);                                     \
+          cluster_id.set_rep01(rep0, rep1, rep_bits);                    \
         } else {                                                         \
-          cluster_id.set_rep1(rep0);                                     \
-          cluster_id.set_rep0(rep1);                                     \
+          cluster_id.set_rep01(rep1, rep0, rep_bits);                    \
         }                                                                \
         cluster_id.set_base_xy(x, y);                                    \
         cluster_id.set_dxy(point_offset);                                \
@@ -359,7 +437,7 @@ __global__ void BlobDiff(const uint8_t *thresholded_image,
         union_markers_size[rep_block_2] >= 25) {
       const size_t write_address =
           (width - 2) * (height - 2) * 3 + global_output_index;
-      result[write_address] = QuadBoundaryPoint();
+      result[write_address] = Point();
       return;
     }
   }
@@ -369,31 +447,34 @@ __global__ void BlobDiff(const uint8_t *thresholded_image,
 
 // Masks out just the blob ID pair, rep01.
 struct MaskRep01 {
+  template <typename Storage>
   __host__ __device__ __forceinline__ uint64_t
-  operator()(const QuadBoundaryPoint &a) const {
+  operator()(const BasicQuadBoundaryPoint<Storage> &a) const {
     return a.rep01();
   }
 };
 
 // Masks out just the blob ID pair, rep01.
 struct MaskBlobIndex {
+  template <typename Storage>
   __host__ __device__ __forceinline__ uint32_t
-  operator()(const IndexPoint &a) const {
+  operator()(const BasicIndexPoint<Storage> &a) const {
     return a.blob_index();
   }
 };
 
-// Rewrites a QuadBoundaryPoint to an IndexPoint, adding the angle to the
-// center.
+// Rewrites a QuadBoundaryPoint to an IndexPoint of the same layout, adding the
+// angle to the center.
+template <typename Storage>
 class RewriteToIndexPoint {
  public:
   RewriteToIndexPoint(MinMaxExtents *extents_device, size_t num_extents)
       : blob_finder_(extents_device, num_extents) {}
 
-  __host__ __device__ __forceinline__ IndexPoint
-  operator()(cub::KeyValuePair<long, QuadBoundaryPoint> pt) const {
+  __host__ __device__ __forceinline__ BasicIndexPoint<Storage> operator()(
+      cub::KeyValuePair<long, BasicQuadBoundaryPoint<Storage>> pt) const {
     size_t index = blob_finder_.FindBlobIndex(pt.key);
-    IndexPoint result(index, pt.value.point_bits());
+    BasicIndexPoint<Storage> result(index, pt.value.point_bits());
     return result;
   }
 
@@ -401,11 +482,12 @@ class RewriteToIndexPoint {
 };
 
 // Calculates Theta for a given IndexPoint
+template <typename Point>
 class AddThetaToIndexPoint {
  public:
   AddThetaToIndexPoint(MinMaxExtents *extents_device, size_t num_extents)
       : blob_finder_(extents_device, num_extents) {}
-  __host__ __device__ __forceinline__ IndexPoint operator()(IndexPoint a) {
+  __host__ __device__ __forceinline__ Point operator()(Point a) {
     MinMaxExtents extents = blob_finder_.Get(a.blob_index());
     float theta =
         (atan2f(a.y() - extents.cy(), a.x() - extents.cx()) + M_PI) * 8e6;
@@ -424,8 +506,9 @@ class AddThetaToIndexPoint {
 
 // Transforms aQuadBoundaryPoint into a single point extent for Reduce.
 struct TransformQuadBoundaryPointToMinMaxExtents {
-  __host__ __device__ __forceinline__ MinMaxExtents
-  operator()(cub::KeyValuePair<long, QuadBoundaryPoint> pt) const {
+  template <typename Storage>
+  __host__ __device__ __forceinline__ MinMaxExtents operator()(
+      cub::KeyValuePair<long, BasicQuadBoundaryPoint<Storage>> pt) const {
     MinMaxExtents result;
     result.min_y = result.max_y = pt.value.y();
     result.min_x = result.max_x = pt.value.x();
@@ -472,8 +555,9 @@ struct ComputeDotProductTransform {
         min_cluster_pixels_(std::max<size_t>(24u, min_cluster_pixels)),
         max_cluster_pixels_(max_cluster_pixels) {}
 
+  template <typename Storage>
   __host__ __device__ __forceinline__ float operator()(
-      cub::KeyValuePair<long, QuadBoundaryPoint> a) const {
+      cub::KeyValuePair<long, BasicQuadBoundaryPoint<Storage>> a) const {
     const size_t y = a.value.y();
     const size_t x = a.value.x();
 
@@ -517,8 +601,9 @@ class NonzeroBlobs {
   NonzeroBlobs(const cub::KeyValuePair<long, MinMaxExtents> *extents_device)
       : extents_device_(extents_device) {}
 
+  template <typename Storage>
   __host__ __device__ __forceinline__ bool operator()(
-      const IndexPoint &a) const {
+      const BasicIndexPoint<Storage> &a) const {
     return extents_device_[a.blob_index()].value.count > 0;
   }
 
@@ -569,8 +654,9 @@ class SelectBlobs {
     return true;
   }
 
+  template <typename Storage>
   __host__ __device__ __forceinline__ bool operator()(
-      const IndexPoint &a) const {
+      const BasicIndexPoint<Storage> &a) const {
     bool result = (*this)(extents_device_[a.blob_index()]);
 
     return result;
@@ -640,10 +726,9 @@ struct SumPoints {
 };
 
 struct TransformLineFitPoint {
+  template <typename Storage>
   __host__ __device__ __forceinline__ LineFitPoint
-  operator()(IndexPoint p) const {
-    LineFitPoint result;
-
+  operator()(BasicIndexPoint<Storage> p) const {
     // we now undo our fixed-point arithmetic.
     // adjust for pixel center bias
     constexpr int delta = 1;
@@ -667,14 +752,7 @@ struct TransformLineFitPoint {
       W = hypotf(grad_x, grad_y) + 1;
     }
 
-    result.Mx = W * ix2;
-    result.My = W * iy2;
-    result.Mxx = W * ix2 * ix2;
-    result.Mxy = W * ix2 * iy2;
-    result.Myy = W * iy2 * iy2;
-    result.W = W;
-    result.blob_index = p.blob_index();
-    return result;
+    return LineFitPoint::FromPoint(W, ix2, iy2, p.blob_index());
   }
 
   const uint8_t *decimated_image_device_;
@@ -685,15 +763,7 @@ struct TransformLineFitPoint {
 struct SumLineFitPoints {
   __host__ __device__ __forceinline__ LineFitPoint
   operator()(const LineFitPoint &a, const LineFitPoint &b) const {
-    LineFitPoint result;
-    result.Mx = a.Mx + b.Mx;
-    result.My = a.My + b.My;
-    result.Mxx = a.Mxx + b.Mxx;
-    result.Mxy = a.Mxy + b.Mxy;
-    result.Myy = a.Myy + b.Myy;
-    result.W = a.W + b.W;
-    result.blob_index = a.blob_index;
-    return result;
+    return a + b;
   }
 };
 
@@ -733,40 +803,17 @@ struct MergePeakExtents {
 
 }  // namespace
 
-void GpuDetector::Detect(const uint8_t *image) {
-  // const aos::monotonic_clock::time_point start_time =
-  //     aos::monotonic_clock::now();
-  start_.Record(&stream_);
-  color_image_device_.MemcpyAsyncFrom(image, &stream_);
-  after_image_memcpy_to_device_.Record(&stream_);
-
-  // Threshold the image.
-  CudaToGreyscaleAndDecimateHalide(
-      color_image_device_.get(), gray_image_device_.get(),
-      decimated_image_device_.get(), unfiltered_minmax_image_device_.get(),
-      minmax_image_device_.get(), thresholded_image_device_.get(), width_,
-      height_, tag_detector_->qtp.min_white_black_diff, &stream_);
-  after_threshold_.Record(&stream_);
-
-  gray_image_device_.MemcpyAsyncTo(&gray_image_host_, &stream_);
-
-  after_memcpy_gray_.Record(&stream_);
-
-  union_markers_size_device_.MemsetAsync(0u, &stream_);
-  after_memset_.Record(&stream_);
+template <typename Storage>
+void GpuDetector::FitBoundaryPoints(const BoundaryPointsDevice<Storage> &points,
+                                    int *num_compressed_union_marker_pair_host,
+                                    size_t *num_quads_host,
+                                    int *num_selected_blobs_host) {
+  using Point = BasicQuadBoundaryPoint<Storage>;
+  using SelectedPoint = BasicIndexPoint<Storage>;
 
-  // Unionfind the image.
-  LabelImage(ToGpuImage(thresholded_image_device_),
-             ToGpuImage(union_markers_device_),
-             ToGpuImage(union_markers_size_device_), stream_.get());
-
-  after_unionfinding_.Record(&stream_);
-
-  CHECK((width_ % 8) == 0);
-  CHECK((height_ % 8) == 0);
-
-  size_t decimated_width = width_ / 2;
-  size_t decimated_height = height_ / 2;
+  size_t decimated_width = decimated_width_;
+  size_t decimated_height = decimated_height_;
+  const uint32_t rep_bits = Point::RepBits(decimated_width * decimated_height);
 
   // TODO(austin): Tune for the global shutter camera.
   // 1280 -> 2 * 128 * 5
@@ -781,13 +828,10 @@ void GpuDetector::Detect(const uint8_t *image) {
     dim3 blocks((decimated_width + threads.x - 3) / (threads.x - 2),
                 (decimated_height + threads.y - 2) / (threads.y - 1), 1);
 
-    //  Make sure we fit in our mask.
-    CHECK_LT(width_ * height_, static_cast<size_t>(1 << 22));
-
     BlobDiff<kBlockWidth, kBlockHeight><<<blocks, threads, 0, stream_.get()>>>(
         thresholded_image_device_.get(), union_markers_device_.get(),
-        union_markers_size_device_.get(), union_marker_pair_device_.get(),
-        decimated_width, decimated_height);
+        union_markers_size_device_.get(), points.union_marker_pair.data(),
+        decimated_width, decimated_height, rep_bits);
     MaybeCheckAndSynchronize("BlobDiff");
   }
 
@@ -800,53 +844,51 @@ void GpuDetector::Detect(const uint8_t *image) {
     // Remove empty points which aren't to be considered before sorting to speed
     // things up.
     size_t temp_storage_bytes =
-        temp_storage_compressed_union_marker_pair_device_.size();
+        temp_storage_compact_device_.size();
     NonZero nz;
     CHECK_CUDA(cub::DeviceSelect::If(
-        temp_storage_compressed_union_marker_pair_device_.get(),
-        temp_storage_bytes, union_marker_pair_device_.get(),
-        compressed_union_marker_pair_device_.get(),
+        temp_storage_compact_device_.data(), temp_storage_bytes,
+        points.union_marker_pair.data(),
+        points.compressed_union_marker_pair.data(),
         num_compressed_union_marker_pair_device_.get(),
-        union_marker_pair_device_.size(), nz, stream_.get()));
+        points.union_marker_pair.size(), nz, stream_.get()));
 
     MaybeCheckAndSynchronize("cub::DeviceSelect::If");
   }
 
   after_compact_.Record(&stream_);
 
-  int num_compressed_union_marker_pair_host;
   {
     num_compressed_union_marker_pair_device_.MemcpyTo(
-        &num_compressed_union_marker_pair_host);
-    CHECK_LT(static_cast<size_t>(num_compressed_union_marker_pair_host),
-             union_marker_pair_device_.size());
-
-    // Now, sort just the keys to group like points.
-    size_t temp_storage_bytes = radix_sort_tmpstorage_device_.size();
-    QuadBoundaryPointDecomposer decomposer;
+        num_compressed_union_marker_pair_host);
+    CHECK_LT(static_cast<size_t>(*num_compressed_union_marker_pair_host),
+             points.union_marker_pair.size());
+
+    // Now, sort just the keys to group like points.  Only the bits a blob id
+    // can use at this resolution need sorting.
+    size_t temp_storage_bytes = temp_storage_sort_device_.size();
+    SortWordDecomposer<Point> decomposer;
     CHECK_CUDA(cub::DeviceRadixSort::SortKeys(
-        radix_sort_tmpstorage_device_.get(), temp_storage_bytes,
-        compressed_union_marker_pair_device_.get(),
-        sorted_union_marker_pair_device_.get(),
-        num_compressed_union_marker_pair_host, decomposer,
-        QuadBoundaryPoint::kRepEndBit, QuadBoundaryPoint::kBitsInKey,
-        stream_.get()));
+        temp_storage_sort_device_.data(), temp_storage_bytes,
+        points.compressed_union_marker_pair.data(),
+        points.sorted_union_marker_pair.data(),
+        *num_compressed_union_marker_pair_host, decomposer,
+        Point::kSortBeginBit, Point::SortEndBit(rep_bits), stream_.get()));
 
     MaybeCheckAndSynchronize("cub::DeviceRadixSort::SortKeys");
   }
 
   after_sort_.Record(&stream_);
 
-  size_t num_quads_host = 0;
   {
     // Our next step is to compute the extents and dot product so we can filter
     // blobs.
-    cub::ArgIndexInputIterator<QuadBoundaryPoint *> value_index_input_iterator(
-        sorted_union_marker_pair_device_.get());
+    cub::ArgIndexInputIterator<Point *> value_index_input_iterator(
+        points.sorted_union_marker_pair.data());
     TransformQuadBoundaryPointToMinMaxExtents min_max;
     cub::TransformInputIterator<MinMaxExtents,
                                 TransformQuadBoundaryPointToMinMaxExtents,
-                                cub::ArgIndexInputIterator<QuadBoundaryPoint *>>
+                                cub::ArgIndexInputIterator<Point *>>
         value_input_iterator(value_index_input_iterator, min_max);
 
     // Don't care about the output keys...
@@ -854,22 +896,21 @@ void GpuDetector::Detect(const uint8_t *image) {
 
     // Provide a mask to detect keys by rep01()
     MaskRep01 mask;
-    cub::TransformInputIterator<uint64_t, MaskRep01, QuadBoundaryPoint *>
-        key_input_iterator(sorted_union_marker_pair_device_.get(), mask);
+    cub::TransformInputIterator<uint64_t, MaskRep01, Point *>
+        key_input_iterator(points.sorted_union_marker_pair.data(), mask);
 
     // Reduction operator.
     QuadBoundaryPointExtents reduce;
 
-    size_t temp_storage_bytes =
-        temp_storage_bounds_reduce_by_key_device_.size();
+    size_t temp_storage_bytes = temp_storage_bounds_device_.size();
     cub::DeviceReduce::ReduceByKey(
-        temp_storage_bounds_reduce_by_key_device_.get(), temp_storage_bytes,
+        temp_storage_bounds_device_.data(), temp_storage_bytes,
         key_input_iterator, key_discard_iterator, value_input_iterator,
-        extents_device_.get(), num_quads_device_.get(), reduce,
-        num_compressed_union_marker_pair_host, stream_.get());
+        extents_device_.data(), num_quads_device_.get(), reduce,
+        *num_compressed_union_marker_pair_host, stream_.get());
     after_bounds_.Record(&stream_);
 
-    num_quads_device_.MemcpyTo(&num_quads_host);
+    num_quads_device_.MemcpyTo(num_quads_host);
   }
 
   // Longest april tag will be the full perimeter of the image.  Each point
@@ -889,7 +930,7 @@ void GpuDetector::Detect(const uint8_t *image) {
     // Clear the size of non-passing extents and the starting offset of all
     // extents.
     cub::ArgIndexInputIterator<MinMaxExtents *> value_index_input_iterator(
-        extents_device_.get());
+        extents_device_.data());
     TransformZeroFilteredBlobSizes rewrite(
         min_tag_width_, reversed_border_, normal_border_,
         tag_detector_->qtp.min_cluster_pixels, max_april_tag_perimeter);
@@ -908,45 +949,45 @@ void GpuDetector::Detect(const uint8_t *image) {
     size_t temp_storage_bytes =
         temp_storage_selected_extents_scan_device_.size();
     CHECK_CUDA(cub::DeviceScan::InclusiveScan(
-        temp_storage_selected_extents_scan_device_.get(), temp_storage_bytes,
+        temp_storage_selected_extents_scan_device_.data(), temp_storage_bytes,
         input_iterator, selected_extents_device_.get(), sum_points,
-        num_quads_host));
+        *num_quads_host));
 
     MaybeCheckAndSynchronize("cub::DeviceScan::InclusiveScan");
   }
 
   after_transform_extents_.Record(&stream_);
 
-  int num_selected_blobs_host;
   {
     // Now, copy over all points which pass our thresholds.
-    cub::ArgIndexInputIterator<QuadBoundaryPoint *> value_index_input_iterator(
-        sorted_union_marker_pair_device_.get());
-    RewriteToIndexPoint rewrite(extents_device_.get(), num_quads_host);
+    cub::ArgIndexInputIterator<Point *> value_index_input_iterator(
+        points.sorted_union_marker_pair.data());
+    RewriteToIndexPoint<Storage> rewrite(extents_device_.data(),
+                                         *num_quads_host);
 
-    cub::TransformInputIterator<IndexPoint, RewriteToIndexPoint,
-                                cub::ArgIndexInputIterator<QuadBoundaryPoint *>>
+    cub::TransformInputIterator<SelectedPoint, RewriteToIndexPoint<Storage>,
+                                cub::ArgIndexInputIterator<Point *>>
         input_iterator(value_index_input_iterator, rewrite);
 
-    AddThetaToIndexPoint add_theta(extents_device_.get(), num_quads_host);
+    AddThetaToIndexPoint<SelectedPoint> add_theta(extents_device_.data(),
+                                                  *num_quads_host);
 
-    TransformOutputIterator<IndexPoint, IndexPoint, AddThetaToIndexPoint>
-        output_iterator(selected_blobs_device_.get(), add_theta);
+    TransformOutputIterator<SelectedPoint, SelectedPoint,
+                            AddThetaToIndexPoint<SelectedPoint>>
+        output_iterator(points.selected_blobs.data(), add_theta);
 
     NonzeroBlobs select_blobs(selected_extents_device_.get());
 
-    size_t temp_storage_bytes =
-        temp_storage_compressed_filtered_blobs_device_.size();
+    size_t temp_storage_bytes = temp_storage_filter_device_.size();
 
     CHECK_CUDA(cub::DeviceSelect::If(
-        temp_storage_compressed_filtered_blobs_device_.get(),
-        temp_storage_bytes, input_iterator, output_iterator,
-        num_selected_blobs_device_.get(), num_compressed_union_marker_pair_host,
-        select_blobs, stream_.get()));
+        temp_storage_filter_device_.data(), temp_storage_bytes, input_iterator,
+        output_iterator, num_selected_blobs_device_.get(),
+        *num_compressed_union_marker_pair_host, select_blobs, stream_.get()));
 
     MaybeCheckAndSynchronize("cub::DeviceSelect::If");
 
-    num_selected_blobs_device_.MemcpyAsyncTo(&num_selected_blobs_host,
+    num_selected_blobs_device_.MemcpyAsyncTo(num_selected_blobs_host,
                                              &stream_);
     after_filter_.Record(&stream_);
     after_filter_.Synchronize();
@@ -954,14 +995,14 @@ void GpuDetector::Detect(const uint8_t *image) {
 
   {
     // Sort based on the angle.
-    size_t temp_storage_bytes = radix_sort_tmpstorage_device_.size();
-    QuadIndexPointDecomposer decomposer;
+    size_t temp_storage_bytes = temp_storage_filtered_sort_device_.size();
+    SortWordDecomposer<SelectedPoint> decomposer;
 
     CHECK_CUDA(cub::DeviceRadixSort::SortKeys(
-        radix_sort_tmpstorage_device_.get(), temp_storage_bytes,
-        selected_blobs_device_.get(), sorted_selected_blobs_device_.get(),
-        num_selected_blobs_host, decomposer, IndexPoint::kRepEndBit,
-        IndexPoint::kBitsInKey, stream_.get()));
+        temp_storage_filtered_sort_device_.data(), temp_storage_bytes,
+        points.selected_blobs.data(), points.sorted_selected_blobs.data(),
+        *num_selected_blobs_host, decomposer, SelectedPoint::kSortBeginBit,
+        SelectedPoint::kSortEndBit, stream_.get()));
 
     MaybeCheckAndSynchronize("cub::DeviceRadixSort::SortKeys");
   }
@@ -975,15 +1016,15 @@ void GpuDetector::Detect(const uint8_t *image) {
     //
     // Clear the size of non-passing extents and the starting offset of all
     // extents.
-    TransformLineFitPoint rewrite(decimated_image_device_.get(), width_ / 2,
-                                  height_ / 2);
+    TransformLineFitPoint rewrite(decimated_image_device_.get(),
+                                  decimated_width_, decimated_height_);
     cub::TransformInputIterator<LineFitPoint, TransformLineFitPoint,
-                                IndexPoint *>
-        input_iterator(sorted_selected_blobs_device_.get(), rewrite);
+                                SelectedPoint *>
+        input_iterator(points.sorted_selected_blobs.data(), rewrite);
 
     MaskBlobIndex mask;
-    cub::TransformInputIterator<uint32_t, MaskBlobIndex, IndexPoint *>
-        key_iterator(sorted_selected_blobs_device_.get(), mask);
+    cub::TransformInputIterator<uint32_t, MaskBlobIndex, SelectedPoint *>
+        key_iterator(points.sorted_selected_blobs.data(), mask);
 
     // Sum the counts of everything before us, and update the offset.
     SumLineFitPoints sum_points;
@@ -993,19 +1034,73 @@ void GpuDetector::Detect(const uint8_t *image) {
     size_t temp_storage_bytes = temp_storage_line_fit_scan_device_.size();
 
     CHECK_CUDA(cub::DeviceScan::InclusiveScanByKey(
-        temp_storage_line_fit_scan_device_.get(), temp_storage_bytes,
-        key_iterator, input_iterator, line_fit_points_device_.get(), sum_points,
-        num_selected_blobs_host));
+        temp_storage_line_fit_scan_device_.data(), temp_storage_bytes,
+        key_iterator, input_iterator, line_fit_points_device_.data(),
+        sum_points,
+        *num_selected_blobs_host));
 
     MaybeCheckAndSynchronize("cub::DeviceScan::InclusiveScanByKey");
   }
   after_line_fit_.Record(&stream_);
+}
+
+uint8_t *GpuDetector::FindQuads(const uint8_t *image, ImageFormat format,
+                                size_t slot, std::vector<FitQuad> *fit_quads) {
+  // const aos::monotonic_clock::time_point start_time =
+  //     aos::monotonic_clock::now();
+  start_.Record(&stream_);
+  // Only the luma rows are read, so skip copying the rest (row padding, or
+  // the chroma plane of NV12).  They are packed on the device whatever the
+  // stride.
+  color_image_device_.MemcpyAsync2DFrom(
+      image, RowStride(format, width_),
+      width_ * BytesPerPixel(format.pixel_format), height_, &stream_);
+  const ImageFormat device_format = {.pixel_format = format.pixel_format};
+  after_image_memcpy_to_device_.Record(&stream_);
+
+  // Threshold the image.
+  CudaToGreyscaleAndDecimateHalide(
+      color_image_device_.get(), gray_image_device_.get(),
+      decimated_image_device_.get(), unfiltered_minmax_image_device_.get(),
+      minmax_image_device_.get(), thresholded_image_device_.get(), width_,
+      height_, decimation_, device_format,
+      tag_detector_->qtp.min_white_black_diff,
+      &stream_);
+  after_threshold_.Record(&stream_);
+
+  HostMemory<uint8_t> *gray_image_host = gray_image_host_[slot].get();
+  gray_image_device_.MemcpyAsyncTo(gray_image_host, &stream_);
+
+  after_memcpy_gray_.Record(&stream_);
+
+  union_markers_size_device_.MemsetAsync(0u, &stream_);
+  after_memset_.Record(&stream_);
+
+  // Unionfind the image.
+  LabelImage(ToGpuImage(thresholded_image_device_),
+             ToGpuImage(union_markers_device_),
+             ToGpuImage(union_markers_size_device_), stream_.get());
+
+  after_unionfinding_.Record(&stream_);
+
+  int num_compressed_union_marker_pair_host;
+  size_t num_quads_host = 0;
+  int num_selected_blobs_host;
+  if (compact_points_) {
+    FitBoundaryPoints(compact_points_device_,
+                      &num_compressed_union_marker_pair_host, &num_quads_host,
+                      &num_selected_blobs_host);
+  } else {
+    FitBoundaryPoints(wide_points_device_,
+                      &num_compressed_union_marker_pair_host, &num_quads_host,
+                      &num_selected_blobs_host);
+  }
 
   {
-    FitLines(line_fit_points_device_.get(), num_selected_blobs_host,
-             selected_extents_device_.get(), num_quads_host, errs_device_.get(),
-             filtered_errs_device_.get(), filtered_is_local_peak_device_.get(),
-             &stream_);
+    FitLines(line_fit_points_device_.data(), num_selected_blobs_host,
+             selected_extents_device_.get(), num_quads_host,
+             errs_device_.data(), filtered_errs_device_.data(),
+             filtered_is_local_peak_device_.data(), &stream_);
   }
   after_line_filter_.Record(&stream_);
 
@@ -1013,13 +1108,12 @@ void GpuDetector::Detect(const uint8_t *image) {
   {
     // Remove empty points which aren't to be considered before sorting to speed
     // things up.
-    size_t temp_storage_bytes =
-        temp_storage_compressed_union_marker_pair_device_.size();
+    size_t temp_storage_bytes = temp_storage_compress_peaks_device_.size();
     ValidPeaks peak_filter;
     CHECK_CUDA(cub::DeviceSelect::If(
-        temp_storage_compressed_union_marker_pair_device_.get(),
-        temp_storage_bytes, filtered_is_local_peak_device_.get(),
-        compressed_peaks_device_.get(), num_compressed_peaks_device_.get(),
+        temp_storage_compress_peaks_device_.data(), temp_storage_bytes,
+        filtered_is_local_peak_device_.data(), compressed_peaks_device_.data(),
+        num_compressed_peaks_device_.get(),
         num_selected_blobs_host, peak_filter, stream_.get()));
 
     after_peak_compression_.Record(&stream_);
@@ -1032,12 +1126,12 @@ void GpuDetector::Detect(const uint8_t *image) {
 
   {
     // Sort based on the angle.
-    size_t temp_storage_bytes = radix_sort_tmpstorage_device_.size();
+    size_t temp_storage_bytes = temp_storage_sort_peaks_device_.size();
     PeakDecomposer decomposer;
 
     CHECK_CUDA(cub::DeviceRadixSort::SortKeys(
-        radix_sort_tmpstorage_device_.get(), temp_storage_bytes,
-        compressed_peaks_device_.get(), sorted_compressed_peaks_device_.get(),
+        temp_storage_sort_peaks_device_.data(), temp_storage_bytes,
+        compressed_peaks_device_.data(), sorted_compressed_peaks_device_.data(),
         num_compressed_peaks_host, decomposer, 0, PeakDecomposer::kBitsInKey,
         stream_.get()));
 
@@ -1053,7 +1147,7 @@ void GpuDetector::Detect(const uint8_t *image) {
     // Our next step is to compute the extents of each blob so we can filter
     // blobs.
     cub::ArgIndexInputIterator<Peak *> value_index_input_iterator(
-        sorted_compressed_peaks_device_.get());
+        sorted_compressed_peaks_device_.data());
     TransformToPeakExtents transform_extents;
     cub::TransformInputIterator<PeakExtents, TransformToPeakExtents,
                                 cub::ArgIndexInputIterator<Peak *>>
@@ -1065,15 +1159,14 @@ void GpuDetector::Detect(const uint8_t *image) {
     // Provide a mask to detect keys by rep01()
     MaskPeakExtentsByBlobId mask;
     cub::TransformInputIterator<uint32_t, MaskPeakExtentsByBlobId, Peak *>
-        key_input_iterator(sorted_compressed_peaks_device_.get(), mask);
+        key_input_iterator(sorted_compressed_peaks_device_.data(), mask);
 
     // Reduction operator.
     MergePeakExtents reduce;
 
-    size_t temp_storage_bytes =
-        temp_storage_bounds_reduce_by_key_device_.size();
+    size_t temp_storage_bytes = temp_storage_peak_extents_device_.size();
     cub::DeviceReduce::ReduceByKey(
-        temp_storage_bounds_reduce_by_key_device_.get(), temp_storage_bytes,
+        temp_storage_peak_extents_device_.data(), temp_storage_bytes,
         key_input_iterator, key_discard_iterator, value_input_iterator,
         peak_extents_device_.get(), num_quad_peaked_quads_device_.get(), reduce,
         num_compressed_peaks_host, stream_.get());
@@ -1090,9 +1183,9 @@ void GpuDetector::Detect(const uint8_t *image) {
 
   {
     apriltag::FitQuads(
-        sorted_compressed_peaks_device_.get(), num_compressed_peaks_host,
+        sorted_compressed_peaks_device_.data(), num_compressed_peaks_host,
         peak_extents_device_.get(), num_quad_peaked_quads_host,
-        line_fit_points_device_.get(), tag_detector_->qtp.max_nmaxima,
+        line_fit_points_device_.data(), tag_detector_->qtp.max_nmaxima,
         selected_extents_device_.get(), tag_detector_->qtp.max_line_fit_mse,
         tag_detector_->qtp.cos_critical_rad, fit_quads_device_.get(), &stream_);
     MaybeCheckAndSynchronize("FitQuads");
@@ -1100,20 +1193,13 @@ void GpuDetector::Detect(const uint8_t *image) {
   after_quad_fit_.Record(&stream_);
 
   {
-    fit_quads_host_.resize(num_quad_peaked_quads_host);
-    fit_quads_device_.MemcpyAsyncTo(fit_quads_host_.data(),
+    fit_quads->resize(num_quad_peaked_quads_host);
+    fit_quads_device_.MemcpyAsyncTo(fit_quads->data(),
                                     num_quad_peaked_quads_host, &stream_);
     after_quad_fit_memcpy_.Record(&stream_);
     after_quad_fit_memcpy_.Synchronize();
   }
 
-  // const aos::monotonic_clock::time_point before_fit_quads =
-  //     aos::monotonic_clock::now();
-  UpdateFitQuads();
-  AdjustPixelCenters();
-
-  DecodeTags();
-
   // const aos::monotonic_clock::time_point end_time =
   // aos::monotonic_clock::now();
 
@@ -1174,6 +1260,7 @@ void GpuDetector::Detect(const uint8_t *image) {
   }
 
   first_ = false;
+  return gray_image_host->get();
 }
 
 }  // namespace frc971::apriltag
@@ -2,14 +2,23 @@
 #define FRC971_ORIN_APRILTAGGPU_H_
 
 #include <cub/iterator/transform_input_iterator.cuh>
+#include <algorithm>
+#include <array>
+#include <memory>
+#include <span>
+#include <string_view>
+#include <type_traits>
+#include <vector>
 
 #include "apriltag.h"
 #include "cuda.h"
 #include "cuda_runtime.h"
+#include "detector_backend.h"
 #include "device_launch_parameters.h"
 #include "gpu_image.h"
 #include "line_fit_filter.h"
 #include "points.h"
+#include "scratch_arena.h"
 
 namespace frc971::apriltag {
 
@@ -52,90 +61,70 @@ class BlobExtentsIndexFinder {
   // TODO(austin): Cache the last one?
 };
 
-struct QuadCorners {
-  float corners[4][2];
-  bool reversed_border;
-  uint32_t blob_index;
-};
-
-struct CameraMatrix {
-  double fx;
-  double cx;
-  double fy;
-  double cy;
-};
-
-struct DistCoeffs {
-  double k1;
-  double k2;
-  double p1;
-  double p2;
-  double k3;
-};
-
 // GPU based april tag detector.
-class GpuDetector {
+class GpuDetector : public DetectorBackend {
  public:
-  // The number of blobs we will consider when counting april tags.
-  static constexpr size_t kMaxBlobs = IndexPoint::kMaxBlobs;
-
   // Constructs a detector, reserving space for detecting tags of the provided
   // with and height, using the provided detector options.
   GpuDetector(size_t width, size_t height, apriltag_detector_t *tag_detector,
               CameraMatrix camera_matrix, DistCoeffs distortion_coefficients);
   virtual ~GpuDetector();
 
-  // Detects april tags in the provided image.
-  void Detect(const uint8_t *image);
-
-  const std::vector<QuadCorners> &FitQuads() const;
-
-  const zarray_t *Detections() const { return detections_; }
-
-  void ReinitializeDetections();
-
   // Debug methods to expose internal state for testing.
-  void CopyGrayTo(uint8_t *output) const {
+  void CopyGrayTo(uint8_t *output) const override {
     gray_image_device_.MemcpyTo(output);
   }
-  void CopyDecimatedTo(uint8_t *output) const {
+  void CopyDecimatedTo(uint8_t *output) const override {
     decimated_image_device_.MemcpyTo(output);
   }
-  void CopyThresholdedTo(uint8_t *output) const {
+  void CopyThresholdedTo(uint8_t *output) const override {
     thresholded_image_device_.MemcpyTo(output);
   }
-  void CopyUnionMarkersTo(uint32_t *output) const {
+  void CopyUnionMarkersTo(uint32_t *output) const override {
     union_markers_device_.MemcpyTo(output);
   }
 
+  // The rest of the debug methods read scratch buffers which are only kept
+  // around after Detect when tag_detector->debug is set.  Points are handed
+  // out wide whichever layout is in use.
   void CopyUnionMarkerPairTo(QuadBoundaryPoint *output) const {
-    union_marker_pair_device_.MemcpyTo(output);
+    VisitBoundaryPoints([&](const auto &points) {
+      const std::vector<QuadBoundaryPoint> wide =
+          CopyScratchAs<QuadBoundaryPoint>(points.union_marker_pair,
+                                           points.union_marker_pair.size());
+      std::copy(wide.begin(), wide.end(), output);
+    });
   }
 
   void CopyCompressedUnionMarkerPairTo(QuadBoundaryPoint *output) const {
-    compressed_union_marker_pair_device_.MemcpyTo(output);
+    VisitBoundaryPoints([&](const auto &points) {
+      const std::vector<QuadBoundaryPoint> wide =
+          CopyScratchAs<QuadBoundaryPoint>(
+              points.compressed_union_marker_pair,
+              points.compressed_union_marker_pair.size());
+      std::copy(wide.begin(), wide.end(), output);
+    });
   }
 
   std::vector<QuadBoundaryPoint> CopySortedUnionMarkerPair() const {
-    std::vector<QuadBoundaryPoint> result;
-    int size = NumCompressedUnionMarkerPairs();
-    result.resize(size);
-    sorted_union_marker_pair_device_.MemcpyTo(result.data(), size);
-    return result;
+    return VisitBoundaryPoints([&](const auto &points) {
+      return CopyScratchAs<QuadBoundaryPoint>(points.sorted_union_marker_pair,
+                                              NumCompressedUnionMarkerPairs());
+    });
   }
 
   int NumCompressedUnionMarkerPairs() const {
     return num_compressed_union_marker_pair_device_.Copy()[0];
   }
 
-  void CopyUnionMarkersSizeTo(uint32_t *output) const {
+  void CopyUnionMarkersSizeTo(uint32_t *output) const override {
     union_markers_size_device_.MemcpyTo(output);
   }
 
   int NumQuads() const { return num_quads_device_.Copy()[0]; }
 
   std::vector<MinMaxExtents> CopyExtents() const {
-    return extents_device_.Copy(NumQuads());
+    return CopyScratch(extents_device_, NumQuads());
   }
 
   std::vector<cub::KeyValuePair<long, MinMaxExtents>> CopySelectedExtents()
@@ -146,26 +135,32 @@ class GpuDetector {
   int NumSelectedPairs() const { return num_selected_blobs_device_.Copy()[0]; }
 
   std::vector<IndexPoint> CopySelectedBlobs() const {
-    return selected_blobs_device_.Copy(NumSelectedPairs());
+    return VisitBoundaryPoints([&](const auto &points) {
+      return CopyScratchAs<IndexPoint>(points.selected_blobs,
+                                       NumSelectedPairs());
+    });
   }
 
   std::vector<IndexPoint> CopySortedSelectedBlobs() const {
-    return sorted_selected_blobs_device_.Copy(NumSelectedPairs());
+    return VisitBoundaryPoints([&](const auto &points) {
+      return CopyScratchAs<IndexPoint>(points.sorted_selected_blobs,
+                                       NumSelectedPairs());
+    });
   }
 
   std::vector<LineFitPoint> CopyLineFitPoints() const {
-    return line_fit_points_device_.Copy(NumSelectedPairs());
+    return CopyScratch(line_fit_points_device_, NumSelectedPairs());
   }
 
   std::vector<double> CopyErrors() const {
-    return errs_device_.Copy(NumSelectedPairs());
+    return CopyScratch(errs_device_, NumSelectedPairs());
   }
 
   std::vector<double> CopyFilteredErrors() const {
-    return filtered_errs_device_.Copy(NumSelectedPairs());
+    return CopyScratch(filtered_errs_device_, NumSelectedPairs());
   }
   std::vector<Peak> CopyPeaks() const {
-    return filtered_is_local_peak_device_.Copy(NumSelectedPairs());
+    return CopyScratch(filtered_is_local_peak_device_, NumSelectedPairs());
   }
 
   int NumCompressedPeaks() const {
@@ -173,7 +168,7 @@ class GpuDetector {
   }
 
   std::vector<Peak> CopyCompressedPeaks() const {
-    return compressed_peaks_device_.Copy(NumCompressedPeaks());
+    return CopyScratch(compressed_peaks_device_, NumCompressedPeaks());
   }
 
   int NumFitQuads() const { return num_quad_peaked_quads_device_.Copy()[0]; }
@@ -182,61 +177,137 @@ class GpuDetector {
     return fit_quads_device_.Copy(NumFitQuads());
   }
 
-  void AdjustCenter(float corners[4][2]) const;
-
-  // TODO(max): We probably don't want to use these after our test images are
-  // just orin images
-  void SetCameraMatrix(CameraMatrix camera_matrix) {
-    camera_matrix_ = camera_matrix;
-  }
-
-  void SetDistortionCoefficients(DistCoeffs distortion_coefficients) {
-    distortion_coefficients_ = distortion_coefficients;
-  }
-
-  // Undistort pixels based on our camera model, using iterative algorithm
-  // Returns false if we fail to converge
-  static bool UnDistort(double *u, double *v, const CameraMatrix *camera_matrix,
-                        const DistCoeffs *distortion_coefficients);
+  // Returns the layout of the scratch buffers, for reporting the footprint.
+  const ScratchLayout &scratch_layout() const { return scratch_.layout(); }
 
  private:
-  void UpdateFitQuads();
-
-  void AdjustPixelCenters();
+  // The per point scratch buffers in one of the point layouts.
+  template <typename Storage>
+  struct BoundaryPointsDevice {
+    // Full list of boundary points, densly stored but mostly zero.
+    std::span<BasicQuadBoundaryPoint<Storage>> union_marker_pair;
+    // Unsorted list of points with 0's removed.
+    std::span<BasicQuadBoundaryPoint<Storage>> compressed_union_marker_pair;
+    // Blob representation sorted list of points.
+    std::span<BasicQuadBoundaryPoint<Storage>> sorted_union_marker_pair;
+
+    // Compacted blobs which pass our threshold.
+    std::span<BasicIndexPoint<Storage>> selected_blobs;
+    // Sorted list of those points.
+    std::span<BasicIndexPoint<Storage>> sorted_selected_blobs;
+  };
+
+  // Handles to the scratch buffers whose size depends on the point layout.
+  struct BoundaryPointsScratch {
+    ScratchLayout::Buffer union_marker_pair;
+    ScratchLayout::Buffer compressed_union_marker_pair;
+    ScratchLayout::Buffer sorted_union_marker_pair;
+    ScratchLayout::Buffer selected_blobs;
+    ScratchLayout::Buffer sorted_selected_blobs;
+    ScratchLayout::Buffer temp_storage_compact;
+    ScratchLayout::Buffer temp_storage_sort;
+    ScratchLayout::Buffer temp_storage_filter;
+    ScratchLayout::Buffer temp_storage_filtered_sort;
+  };
+
+  uint8_t *FindQuads(const uint8_t *image, ImageFormat format, size_t slot,
+                     std::vector<FitQuad> *fit_quads) override;
+
+  // Runs the stages of FindQuads which work on boundary points, from BlobDiff
+  // through the line fit, filling in the number of points, blobs and
+  // selected points found.
+  template <typename Storage>
+  void FitBoundaryPoints(const BoundaryPointsDevice<Storage> &points,
+                         int *num_compressed_union_marker_pair_host,
+                         size_t *num_quads_host,
+                         int *num_selected_blobs_host);
+
+  // Adds the scratch buffers for max_points boundary points in the layout
+  // Storage describes.
+  template <typename Storage>
+  BoundaryPointsScratch AddBoundaryPointsScratch(size_t max_points);
+
+  // Sets points to the allocated scratch buffers.
+  template <typename Storage>
+  void GetBoundaryPointsScratch(const BoundaryPointsScratch &scratch,
+                                BoundaryPointsDevice<Storage> *points);
+
+  // Calls f with the boundary point buffers of the layout in use.
+  template <typename F>
+  std::invoke_result_t<F, const BoundaryPointsDevice<WidePointStorage> &>
+  VisitBoundaryPoints(F f) const {
+    return compact_points_ ? f(compact_points_device_)
+                           : f(wide_points_device_);
+  }
 
-  void DecodeTags();
+  // The stages of FindQuads after labeling, in order.  Each scratch buffer is
+  // live from the stage which writes it through the last stage which reads it.
+  enum Stage : size_t {
+    kBlobDiff,
+    kCompact,
+    kSort,
+    kBounds,
+    kSelectExtents,
+    kFilter,
+    kFilteredSort,
+    kLineFit,
+    kFitLines,
+    kCompressPeaks,
+    kSortPeaks,
+    kPeakExtents,
+    kFitQuads,
+    kNumStages,
+  };
+
+  // Adds a buffer of size objects of type T to the scratch arena, live from
+  // stage first through stage last.
+  template <typename T>
+  ScratchLayout::Buffer AddScratch(std::string_view name, size_t size,
+                                   Stage first, Stage last);
 
-  static void QuadDecodeTask(void *_u);
+  // Copies size objects out of a scratch buffer.
+  template <typename T>
+  static void CopyScratchTo(std::span<T> memory, T *output, size_t size) {
+    CHECK_LE(size, memory.size());
+    CHECK_CUDA(cudaMemcpy(reinterpret_cast<void *>(output), memory.data(),
+                          sizeof(T) * size, cudaMemcpyDeviceToHost));
+  }
+  template <typename T>
+  static std::vector<T> CopyScratch(std::span<T> memory, size_t size) {
+    std::vector<T> result(size);
+    CopyScratchTo(memory, result.data(), size);
+    return result;
+  }
+  // Copies size points out of a scratch buffer, converted to the To layout.
+  template <typename To, typename T>
+  static std::vector<To> CopyScratchAs(std::span<T> memory, size_t size) {
+    const std::vector<T> points = CopyScratch(memory, size);
+    return ConvertPoints<To>(points.data(), points.size());
+  }
 
   // Creates a GPU image wrapped around the provided memory.
   template <typename T>
   GpuImage<T> ToGpuImage(GpuMemory<T> &memory) {
-    if (memory.size() == width_ * height_) {
+    // Check the decimated shape first, with 1x decimation both match.
+    if (memory.size() == decimated_width_ * decimated_height_) {
       return GpuImage<T>{
           .data = memory.get(),
-          .rows = height_,
-          .cols = width_,
-          .step = width_,
+          .rows = decimated_height_,
+          .cols = decimated_width_,
+          .step = decimated_width_,
       };
-    } else if (memory.size() == width_ * height_ / 4) {
+    } else if (memory.size() == width_ * height_) {
       return GpuImage<T>{
           .data = memory.get(),
-          .rows = height_ / 2,
-          .cols = width_ / 2,
-          .step = width_ / 2,
+          .rows = height_,
+          .cols = width_,
+          .step = width_,
       };
     } else {
       LOG(FATAL) << "Unknown image shape";
     }
   }
 
-  // Size of the image.
-  const size_t width_;
-  const size_t height_;
-
-  // Detector parameters.
-  apriltag_detector_t *tag_detector_;
-
   // Stream to operate on.
   CudaStream stream_;
 
@@ -266,13 +337,14 @@ class GpuDetector {
 
   // TODO(austin): Remove this...
   HostMemory<uint8_t> color_image_host_;
-  HostMemory<uint8_t> gray_image_host_;
+  // Full size gray scale image of each slot.
+  std::array<std::unique_ptr<HostMemory<uint8_t>>, kSlots> gray_image_host_;
 
   // Starting color image.
   GpuMemory<uint8_t> color_image_device_;
   // Full size gray scale image.
   GpuMemory<uint8_t> gray_image_device_;
-  // Half resolution, gray, decimated image.
+  // Gray, decimated image.
   GpuMemory<uint8_t> decimated_image_device_;
   // Intermediates for thresholding.
   GpuMemory<uint8_t> unfiltered_minmax_image_device_;
@@ -285,61 +357,57 @@ class GpuDetector {
   // union marker id in union_markers_device_ aboe.
   GpuMemory<uint32_t> union_markers_size_device_;
 
-  // Full list of boundary points, densly stored but mostly zero.
-  GpuMemory<QuadBoundaryPoint> union_marker_pair_device_;
-  // Unsorted list of points with 0's removed.
-  GpuMemory<QuadBoundaryPoint> compressed_union_marker_pair_device_;
-  // Blob representation sorted list of points.
-  GpuMemory<QuadBoundaryPoint> sorted_union_marker_pair_device_;
   // Number of compressed points.
   GpuMemory<int> num_compressed_union_marker_pair_device_{
       /* allocate 1 integer...*/ 1};
 
   // Number of unique blob IDs.
   GpuMemory<size_t> num_quads_device_{/* allocate 1 integer...*/ 1};
-  // Bounds per blob, one blob per ID.
-  GpuMemory<MinMaxExtents> extents_device_;
   // Extents of all the blobs under consideration.
   GpuMemory<cub::KeyValuePair<long, MinMaxExtents>> selected_extents_device_;
 
-  // Number of keys in selected_blobs_device_.
+  // Number of points in the selected_blobs buffer.
   GpuMemory<int> num_selected_blobs_device_{/* allocate 1 integer...*/ 1};
 
-  // Compacted blobs which pass our threshold.
-  GpuMemory<IndexPoint> selected_blobs_device_;
-  // Sorted list of those points.
-  GpuMemory<IndexPoint> sorted_selected_blobs_device_;
-
-  // TODO(austin): Can we bound this better?  This is a lot of memory.
-  GpuMemory<LineFitPoint> line_fit_points_device_;
-
-  GpuMemory<double> errs_device_;
-  GpuMemory<double> filtered_errs_device_;
-  GpuMemory<Peak> filtered_is_local_peak_device_;
   GpuMemory<int> num_compressed_peaks_device_{/* allocate 1 integer...*/ 1};
-  GpuMemory<Peak> compressed_peaks_device_;
-  GpuMemory<Peak> sorted_compressed_peaks_device_;
 
   GpuMemory<int> num_quad_peaked_quads_device_{/* allocate 1 integer...*/ 1};
   GpuMemory<PeakExtents> peak_extents_device_;
 
-  CameraMatrix camera_matrix_;
-  DistCoeffs distortion_coefficients_;
-
   GpuMemory<FitQuad> fit_quads_device_;
 
-  std::vector<FitQuad> fit_quads_host_;
-  std::vector<QuadCorners> quad_corners_host_;
+  // Single allocation backing all the per point buffers and the cub temporary
+  // storage below.  Buffers which are never live at the same time share
+  // memory.
+  ScratchArena<GpuMemory<uint8_t>> scratch_;
+
+  // Only the layout compact_points_ picks has scratch.
+  BoundaryPointsDevice<WidePointStorage> wide_points_device_;
+  BoundaryPointsDevice<CompactPointStorage> compact_points_device_;
 
-  // Temporary storage for each of the steps.
-  // TODO(austin): Can we combine these and just use the max?
-  GpuMemory<uint32_t> radix_sort_tmpstorage_device_;
-  GpuMemory<uint8_t> temp_storage_compressed_union_marker_pair_device_;
-  GpuMemory<uint8_t> temp_storage_bounds_reduce_by_key_device_;
-  GpuMemory<uint8_t> temp_storage_dot_product_device_;
-  GpuMemory<uint8_t> temp_storage_compressed_filtered_blobs_device_;
-  GpuMemory<uint8_t> temp_storage_selected_extents_scan_device_;
-  GpuMemory<uint8_t> temp_storage_line_fit_scan_device_;
+  // Bounds per blob, one blob per ID.
+  std::span<MinMaxExtents> extents_device_;
+
+  // TODO(austin): Can we bound this better?  This is a lot of memory.
+  std::span<LineFitPoint> line_fit_points_device_;
+
+  std::span<double> errs_device_;
+  std::span<double> filtered_errs_device_;
+  std::span<Peak> filtered_is_local_peak_device_;
+  std::span<Peak> compressed_peaks_device_;
+  std::span<Peak> sorted_compressed_peaks_device_;
+
+  // Temporary storage for each of the cub calls.
+  std::span<uint8_t> temp_storage_compact_device_;
+  std::span<uint8_t> temp_storage_sort_device_;
+  std::span<uint8_t> temp_storage_bounds_device_;
+  std::span<uint8_t> temp_storage_selected_extents_scan_device_;
+  std::span<uint8_t> temp_storage_filter_device_;
+  std::span<uint8_t> temp_storage_filtered_sort_device_;
+  std::span<uint8_t> temp_storage_line_fit_scan_device_;
+  std::span<uint8_t> temp_storage_compress_peaks_device_;
+  std::span<uint8_t> temp_storage_sort_peaks_device_;
+  std::span<uint8_t> temp_storage_peak_extents_device_;
 
   // Cumulative duration of april tag detection.
   std::chrono::nanoseconds execution_duration_{0};
@@ -347,16 +415,6 @@ class GpuDetector {
   size_t execution_count_ = 0;
   // True if this is the first detection.
   bool first_ = true;
-
-  // Cached quantities used for tag filtering.
-  bool normal_border_ = false;
-  bool reversed_border_ = false;
-  int min_tag_width_ = 1000000;
-
-  zarray_t *poly0_;
-  zarray_t *poly1_;
-
-  zarray_t *detections_ = nullptr;
 };
 
 }  // namespace frc971::apriltag
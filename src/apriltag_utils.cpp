@@ -95,3 +95,31 @@ void print_detections(zarray_t *detections) {
     std::cout << std::endl;
   }
 }
+
+void captured_frame_to_bgr(const frc971::apriltag::CapturedFrame &frame,
+                           Mat &bgr) {
+  const size_t stride = frc971::apriltag::RowStride(frame.format, frame.width);
+  uint8_t *data = const_cast<uint8_t *>(frame.data);
+  switch (frame.format.pixel_format) {
+    case frc971::apriltag::PixelFormat::kGray8:
+      cvtColor(Mat(frame.height, frame.width, CV_8UC1, data, stride), bgr,
+               COLOR_GRAY2BGR);
+      break;
+    case frc971::apriltag::PixelFormat::kYuyv:
+      cvtColor(Mat(frame.height, frame.width, CV_8UC2, data, stride), bgr,
+               COLOR_YUV2BGR_YUYV);
+      break;
+    case frc971::apriltag::PixelFormat::kUyvy:
+      cvtColor(Mat(frame.height, frame.width, CV_8UC2, data, stride), bgr,
+               COLOR_YUV2BGR_UYVY);
+      break;
+    case frc971::apriltag::PixelFormat::kNv12:
+      // The UV plane follows the Y plane at the same stride.
+      cvtColor(Mat(frame.height * 3 / 2, frame.width, CV_8UC1, data, stride),
+               bgr, COLOR_YUV2BGR_NV12);
+      break;
+    case frc971::apriltag::PixelFormat::kBgr24:
+      Mat(frame.height, frame.width, CV_8UC3, data, stride).copyTo(bgr);
+      break;
+  }
+}
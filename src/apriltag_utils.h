@@ -1,6 +1,7 @@
 #ifndef APRILTAG_UTILS_H_
 #define APRILTAG_UTILS_H_
 
+#include "frame_source.h"
 #include "opencv2/opencv.hpp"
 
 extern "C" {
@@ -23,5 +24,8 @@ bool setup_tag_family(apriltag_family_t **tf, const char *famname);
 void teardown_tag_family(apriltag_family_t **tf, const char *famname);
 void draw_detection_outlines(Mat &im, zarray_t *detections);
 void print_detections(zarray_t *detections);
+// Converts a captured frame to BGR, for drawing on and display.
+void captured_frame_to_bgr(const frc971::apriltag::CapturedFrame &frame,
+                           Mat &bgr);
 
 #endif
\ No newline at end of file
@@ -0,0 +1,1080 @@
+// cpu_detector_test.cpp
+#include <glog/logging.h>
+#include <gtest/gtest.h>
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <random>
+#include <thread>
+#include <vector>
+
+#include "apriltag_cpu.h"
+#include "apriltag_utils.h"
+#include "decode_cache.h"
+#include "edge_refiner.h"
+#include "labeling_allegretti_2019_BKE_cpu.h"
+#include "line_fit_filter_cpu.h"
+#include "opencv2/opencv.hpp"
+#include "points.h"
+#include "undistort_map.h"
+#include "work_stealing_pool.h"
+
+extern "C" {
+#include "apriltag.h"
+#include "common/homography.h"
+}
+
+using namespace cv;
+
+// Every heap allocation made by this test, counted by replacing the global
+// allocation functions.
+std::atomic<size_t> heap_allocations{0};
+
+void *operator new(size_t size) {
+  heap_allocations.fetch_add(1, std::memory_order_relaxed);
+  if (void *p = std::malloc(size == 0 ? 1 : size)) {
+    return p;
+  }
+  throw std::bad_alloc();
+}
+
+void *operator new(size_t size, std::align_val_t alignment) {
+  heap_allocations.fetch_add(1, std::memory_order_relaxed);
+  const size_t align = static_cast<size_t>(alignment);
+  // aligned_alloc wants a multiple of the alignment.
+  if (void *p = std::aligned_alloc(align, (size + align - 1) / align * align)) {
+    return p;
+  }
+  throw std::bad_alloc();
+}
+
+void operator delete(void *p) noexcept { std::free(p); }
+void operator delete(void *p, size_t) noexcept { std::free(p); }
+void operator delete(void *p, std::align_val_t) noexcept { std::free(p); }
+void operator delete(void *p, size_t, std::align_val_t) noexcept {
+  std::free(p);
+}
+
+// libapriltag allocates with malloc and friends, so count those too where
+// glibc lets them be wrapped.  The sanitizers bring their own.
+#if defined(__GLIBC__) && !defined(__SANITIZE_ADDRESS__) && \
+    !defined(__SANITIZE_THREAD__)
+extern "C" {
+void *__libc_malloc(size_t size);
+void *__libc_calloc(size_t count, size_t size);
+void *__libc_realloc(void *p, size_t size);
+
+void *malloc(size_t size) noexcept {
+  heap_allocations.fetch_add(1, std::memory_order_relaxed);
+  return __libc_malloc(size);
+}
+
+void *calloc(size_t count, size_t size) noexcept {
+  heap_allocations.fetch_add(1, std::memory_order_relaxed);
+  return __libc_calloc(count, size);
+}
+
+void *realloc(void *p, size_t size) noexcept {
+  heap_allocations.fetch_add(1, std::memory_order_relaxed);
+  return __libc_realloc(p, size);
+}
+}
+#endif
+
+// Fixture for the CpuDetector tests
+class CpuDetectorTest : public ::testing::Test {
+ protected:
+  Mat yuyv_img, bgr_img, yuyv_img_notags, bgr_img_notags;
+
+  apriltag_family_t *tf = nullptr;
+  apriltag_detector_t *td = nullptr;
+  const char *tag_family = "tag36h11";
+  frc971::apriltag::CameraMatrix cam;
+  frc971::apriltag::DistCoeffs dist;
+
+  void SetUp() override {
+    // Read in the image
+    bgr_img = cv::imread("../data/colorimage.jpg", cv::IMREAD_COLOR);
+    cvtColor(bgr_img, yuyv_img, COLOR_BGR2YUV_YUYV);
+
+    bgr_img_notags =
+        cv::imread("../data/colorimage_notags.jpg", cv::IMREAD_COLOR);
+    cvtColor(bgr_img_notags, yuyv_img_notags, COLOR_BGR2YUV_YUYV);
+
+    // Setup Tag Family and tag detector
+    setup_tag_family(&tf, tag_family);
+    td = apriltag_detector_create();
+    apriltag_detector_add_family(td, tf);
+
+    // Setup Tag Detector
+    td->quad_decimate = 2.0;
+    td->quad_sigma = 0.0;
+    td->nthreads = 4;
+    td->debug = false;
+    td->refine_edges = true;
+    td->wp = workerpool_create(4);
+
+    // Setup Camera Matrix
+    cam.fx = 905.495617;
+    cam.fy = 907.909470;
+    cam.cx = 609.916016;
+    cam.cy = 352.682645;
+
+    // Setup Distortion Coefficients
+    dist.k1 = 0.059238;
+    dist.k2 = -0.075154;
+    dist.p1 = -0.003801;
+    dist.p2 = 0.001113;
+    dist.k3 = 0.0;
+  }
+
+  void TearDown() override {
+    // Cleanup code here if needed
+    apriltag_detector_destroy(td);
+    teardown_tag_family(&tf, tag_family);
+  }
+};
+
+TEST_F(CpuDetectorTest, CpuBackendDetectsAprilTag) {
+  int width = yuyv_img.cols;
+  int height = yuyv_img.rows;
+  frc971::apriltag::CpuDetector detector(width, height, td, cam, dist);
+  detector.Detect(yuyv_img.data);
+  const zarray_t *detections = detector.Detections();
+
+  ASSERT_EQ(1, zarray_size(detections));
+}
+
+TEST_F(CpuDetectorTest, CpuBackendNoAprilTagDetections) {
+  int width = yuyv_img_notags.cols;
+  int height = yuyv_img_notags.rows;
+  frc971::apriltag::CpuDetector detector(width, height, td, cam, dist);
+  detector.Detect(yuyv_img_notags.data);
+  const zarray_t *detections = detector.Detections();
+
+  ASSERT_EQ(0, zarray_size(detections));
+}
+
+TEST_F(CpuDetectorTest, MakeDetectorReturnsCpuBackend) {
+  frc971::apriltag::DetectorBackendType type;
+  ASSERT_TRUE(frc971::apriltag::ParseBackendType("cpu", &type));
+  ASSERT_TRUE(frc971::apriltag::BackendAvailable(type));
+
+  std::unique_ptr<frc971::apriltag::DetectorBackend> detector =
+      frc971::apriltag::MakeDetector(type, yuyv_img.cols, yuyv_img.rows, td,
+                                     cam, dist);
+  detector->Detect(yuyv_img.data);
+
+  ASSERT_EQ(1, zarray_size(detector->Detections()));
+}
+
+// Every supported pixel format holding the same luma should produce the same
+// detections as the YUYV image.
+TEST_F(CpuDetectorTest, PixelFormatsMatchYuyv) {
+  int width = yuyv_img.cols;
+  int height = yuyv_img.rows;
+  frc971::apriltag::CpuDetector detector(width, height, td, cam, dist);
+  detector.Detect(yuyv_img.data);
+  ASSERT_EQ(1, zarray_size(detector.Detections()));
+  apriltag_detection_t *yuyv_det;
+  zarray_get(detector.Detections(), 0, &yuyv_det);
+  const int id = yuyv_det->id;
+  const double c[2] = {yuyv_det->c[0], yuyv_det->c[1]};
+
+  // Pull the luma out of the YUYV image so every format sees the same pixels.
+  Mat luma(height, width, CV_8UC1);
+  Mat uyvy(height, width, CV_8UC2);
+  for (int row = 0; row < height; ++row) {
+    const uint8_t *yuyv_row = yuyv_img.ptr<uint8_t>(row);
+    uint8_t *uyvy_row = uyvy.ptr<uint8_t>(row);
+    for (int col = 0; col < width; ++col) {
+      luma.at<uint8_t>(row, col) = yuyv_row[col * 2];
+      uyvy_row[col * 2] = yuyv_row[col * 2 + 1];
+      uyvy_row[col * 2 + 1] = yuyv_row[col * 2];
+    }
+  }
+
+  // Pad the gray rows to exercise the stride.
+  Mat padded_luma(height, width + 64, CV_8UC1, Scalar(0));
+  luma.copyTo(padded_luma(Rect(0, 0, width, height)));
+
+  // NV12 is the luma plane followed by a half height interleaved chroma plane.
+  Mat nv12(height * 3 / 2, width, CV_8UC1, Scalar(128));
+  luma.copyTo(nv12(Rect(0, 0, width, height)));
+
+  const std::vector<std::pair<const uint8_t *, frc971::apriltag::ImageFormat>>
+      images = {
+          {luma.data, {frc971::apriltag::PixelFormat::kGray8, 0}},
+          {padded_luma.data,
+           {frc971::apriltag::PixelFormat::kGray8, padded_luma.step}},
+          {uyvy.data, {frc971::apriltag::PixelFormat::kUyvy, 0}},
+          {nv12.data, {frc971::apriltag::PixelFormat::kNv12, 0}},
+      };
+  for (const auto &[image, format] : images) {
+    detector.Detect(image, format);
+    const zarray_t *detections = detector.Detections();
+    ASSERT_EQ(1, zarray_size(detections));
+    apriltag_detection_t *det;
+    zarray_get(detections, 0, &det);
+    ASSERT_EQ(id, det->id);
+    ASSERT_EQ(c[0], det->c[0]);
+    ASSERT_EQ(c[1], det->c[1]);
+  }
+
+  // BGR is converted with the same weights as cvtColor, so it won't match the
+  // YUYV luma exactly.
+  detector.Detect(bgr_img.data, {frc971::apriltag::PixelFormat::kBgr24, 0});
+  ASSERT_EQ(1, zarray_size(detector.Detections()));
+  apriltag_detection_t *bgr_det;
+  zarray_get(detector.Detections(), 0, &bgr_det);
+  ASSERT_EQ(id, bgr_det->id);
+  ASSERT_NEAR(c[0], bgr_det->c[0], 0.5);
+  ASSERT_NEAR(c[1], bgr_det->c[1], 0.5);
+  const double bgr_c[2] = {bgr_det->c[0], bgr_det->c[1]};
+
+  // Padded BGR rows, like a cv::Mat ROI or a driver buffer with a wide
+  // bytesperline, find exactly the same tag.
+  Mat padded_bgr(height, width + 16, CV_8UC3, Scalar(0, 0, 0));
+  bgr_img.copyTo(padded_bgr(Rect(0, 0, width, height)));
+  detector.Detect(padded_bgr.data,
+                  {frc971::apriltag::PixelFormat::kBgr24, padded_bgr.step});
+  ASSERT_EQ(1, zarray_size(detector.Detections()));
+  zarray_get(detector.Detections(), 0, &bgr_det);
+  ASSERT_EQ(id, bgr_det->id);
+  ASSERT_EQ(bgr_c[0], bgr_det->c[0]);
+  ASSERT_EQ(bgr_c[1], bgr_det->c[1]);
+}
+
+// Rows which overlap are a caller bug, so they die with a clear error rather
+// than reading the wrong pixels.
+TEST_F(CpuDetectorTest, RejectsOverlappingRows) {
+  int width = yuyv_img.cols;
+  int height = yuyv_img.rows;
+  frc971::apriltag::CpuDetector detector(width, height, td, cam, dist);
+  EXPECT_DEATH(detector.Detect(bgr_img.data,
+                               {frc971::apriltag::PixelFormat::kBgr24,
+                                static_cast<size_t>(width) * 2}),
+               "overlap");
+}
+
+// Every supported decimation should find the same tag as apriltag_detect with
+// the same quad_decimate.
+TEST_F(CpuDetectorTest, DecimationMatchesAprilRobotics) {
+  Mat gray;
+  cvtColor(bgr_img, gray, COLOR_BGR2GRAY);
+
+  for (int decimation = 1; decimation <= 4; ++decimation) {
+    SCOPED_TRACE(decimation);
+    td->quad_decimate = decimation;
+
+    image_u8_t im = {gray.cols, gray.rows, gray.cols, gray.data};
+    zarray_t *reference_detections = apriltag_detector_detect(td, &im);
+    ASSERT_EQ(1, zarray_size(reference_detections));
+
+    frc971::apriltag::CpuDetector detector(gray.cols, gray.rows, td, cam,
+                                           dist);
+    ASSERT_EQ(decimation, detector.decimation());
+    detector.Detect(gray.data, {frc971::apriltag::PixelFormat::kGray8, 0});
+    const zarray_t *cpu_detections = detector.Detections();
+    ASSERT_EQ(1, zarray_size(cpu_detections));
+
+    apriltag_detection_t *cpudet;
+    zarray_get(cpu_detections, 0, &cpudet);
+    apriltag_detection_t *refdet;
+    zarray_get(reference_detections, 0, &refdet);
+
+    EXPECT_EQ(refdet->id, cpudet->id);
+    for (int row = 0; row < 4; row++) {
+      for (int col = 0; col < 2; col++) {
+        EXPECT_NEAR(refdet->p[row][col], cpudet->p[row][col], 0.5);
+      }
+    }
+
+    apriltag_detections_destroy(reference_detections);
+  }
+  td->quad_decimate = 2.0;
+}
+
+// Blob ids in a 12 MP image don't fit in 20 bits, make sure the wider
+// QuadBoundaryPoint keeps them apart.
+TEST_F(CpuDetectorTest, TwelveMegapixelImage) {
+  Mat gray, large_gray;
+  cvtColor(bgr_img, gray, COLOR_BGR2GRAY);
+  resize(gray, large_gray, Size(4000, 3000));
+
+  frc971::apriltag::CpuDetector detector(large_gray.cols, large_gray.rows, td,
+                                         cam, dist);
+  ASSERT_GT(detector.decimated_width() * detector.decimated_height(),
+            1u << 20);
+  EXPECT_FALSE(detector.compact_points());
+  detector.Detect(large_gray.data,
+                  {frc971::apriltag::PixelFormat::kGray8, 0});
+  const zarray_t *detections = detector.Detections();
+  ASSERT_EQ(1, zarray_size(detections));
+
+  // The tag should land where it was in the original image, scaled up.
+  frc971::apriltag::CpuDetector small_detector(gray.cols, gray.rows, td, cam,
+                                               dist);
+  small_detector.Detect(gray.data, {frc971::apriltag::PixelFormat::kGray8, 0});
+  ASSERT_EQ(1, zarray_size(small_detector.Detections()));
+
+  apriltag_detection_t *det;
+  zarray_get(detections, 0, &det);
+  apriltag_detection_t *small_det;
+  zarray_get(small_detector.Detections(), 0, &small_det);
+  EXPECT_EQ(small_det->id, det->id);
+  EXPECT_NEAR(small_det->c[0] * large_gray.cols / gray.cols, det->c[0], 4.0);
+  EXPECT_NEAR(small_det->c[1] * large_gray.rows / gray.rows, det->c[1], 4.0);
+}
+
+// Frames which fit the 64 bit points should use them, so they move and sort no
+// more data than before points were widened for large frames.
+TEST_F(CpuDetectorTest, SmallFramesUseCompactPoints) {
+  using frc971::apriltag::CompactIndexPoint;
+  using frc971::apriltag::CompactQuadBoundaryPoint;
+  using frc971::apriltag::IndexPoint;
+  using frc971::apriltag::QuadBoundaryPoint;
+
+  EXPECT_EQ(8u, sizeof(CompactQuadBoundaryPoint));
+  EXPECT_EQ(8u, sizeof(CompactIndexPoint));
+  EXPECT_EQ(2 * sizeof(CompactQuadBoundaryPoint), sizeof(QuadBoundaryPoint));
+  EXPECT_EQ(2 * sizeof(CompactIndexPoint), sizeof(IndexPoint));
+
+  frc971::apriltag::CpuDetector detector(yuyv_img.cols, yuyv_img.rows, td,
+                                         cam, dist);
+  ASSERT_TRUE(detector.compact_points());
+
+  // The radix sorts cover just the blob ids either way.
+  const uint32_t rep_bits = CompactQuadBoundaryPoint::RepBits(
+      detector.decimated_width() * detector.decimated_height());
+  EXPECT_EQ(2 * rep_bits, CompactQuadBoundaryPoint::SortEndBit(rep_bits) -
+                              CompactQuadBoundaryPoint::kSortBeginBit);
+  EXPECT_EQ(CompactIndexPoint::kSortEndBit - CompactIndexPoint::kSortBeginBit,
+            IndexPoint::kSortEndBit - IndexPoint::kSortBeginBit);
+
+  detector.Detect(yuyv_img.data);
+  EXPECT_EQ(1, zarray_size(detector.Detections()));
+}
+
+// The union find and sorts run on the worker pool, make sure the answer
+// doesn't depend on how many threads we have.
+TEST_F(CpuDetectorTest, ThreadCountDoesNotChangeResult) {
+  int width = yuyv_img.cols;
+  int height = yuyv_img.rows;
+  frc971::apriltag::CpuDetector detector(width, height, td, cam, dist);
+  detector.Detect(yuyv_img.data);
+
+  // Rerun with a single threaded worker pool.
+  workerpool_t *wp = td->wp;
+  td->nthreads = 1;
+  td->wp = workerpool_create(1);
+
+  frc971::apriltag::CpuDetector single_detector(width, height, td, cam, dist);
+  single_detector.Detect(yuyv_img.data);
+
+  workerpool_destroy(td->wp);
+  td->wp = wp;
+  td->nthreads = 4;
+
+  const size_t decimated_size = width / 2 * height / 2;
+  std::vector<uint32_t> union_markers(decimated_size);
+  std::vector<uint32_t> single_union_markers(decimated_size);
+  detector.CopyUnionMarkersTo(union_markers.data());
+  single_detector.CopyUnionMarkersTo(single_union_markers.data());
+  ASSERT_EQ(union_markers, single_union_markers);
+
+  std::vector<uint32_t> union_markers_size(decimated_size);
+  std::vector<uint32_t> single_union_markers_size(decimated_size);
+  detector.CopyUnionMarkersSizeTo(union_markers_size.data());
+  single_detector.CopyUnionMarkersSizeTo(single_union_markers_size.data());
+  ASSERT_EQ(union_markers_size, single_union_markers_size);
+
+  const std::vector<frc971::apriltag::QuadCorners> &quads =
+      detector.FitQuads();
+  const std::vector<frc971::apriltag::QuadCorners> &single_quads =
+      single_detector.FitQuads();
+  ASSERT_EQ(quads.size(), single_quads.size());
+  for (size_t i = 0; i < quads.size(); ++i) {
+    ASSERT_EQ(quads[i].blob_index, single_quads[i].blob_index);
+    for (int corner = 0; corner < 4; ++corner) {
+      ASSERT_EQ(quads[i].corners[corner][0],
+                single_quads[i].corners[corner][0]);
+      ASSERT_EQ(quads[i].corners[corner][1],
+                single_quads[i].corners[corner][1]);
+    }
+  }
+}
+
+// Labels a noisy image, which has blobs crossing every strip border, with
+// differing numbers of strips.
+TEST_F(CpuDetectorTest, LabelingStripCountDoesNotChangeResult) {
+  constexpr size_t kRows = 360;
+  constexpr size_t kCols = 320;
+  std::mt19937 rng(971);
+  std::vector<uint8_t> thresholded(kRows * kCols);
+  for (uint8_t &pixel : thresholded) {
+    const uint32_t value = rng() % 16;
+    pixel = value < 7 ? 0 : value < 14 ? 255 : 127;
+  }
+  const GpuImage<uint8_t> input{thresholded.data(), kRows, kCols, kCols};
+
+  std::vector<uint32_t> single_union_markers(kRows * kCols);
+  std::vector<uint32_t> single_union_markers_size(kRows * kCols, 0);
+  CpuLabelImage(input, {single_union_markers.data(), kRows, kCols, kCols},
+                {single_union_markers_size.data(), kRows, kCols, kCols},
+                nullptr);
+
+  for (int threads : {2, 3, 7}) {
+    workerpool_t *wp = workerpool_create(threads);
+    std::vector<uint32_t> union_markers(kRows * kCols);
+    std::vector<uint32_t> union_markers_size(kRows * kCols, 0);
+    CpuLabelImage(input, {union_markers.data(), kRows, kCols, kCols},
+                  {union_markers_size.data(), kRows, kCols, kCols}, wp);
+    workerpool_destroy(wp);
+
+    ASSERT_EQ(union_markers, single_union_markers) << threads;
+    ASSERT_EQ(union_markers_size, single_union_markers_size) << threads;
+  }
+}
+
+TEST_F(CpuDetectorTest, CpuBackendAndAprilRoboticsEqual) {
+  // Reference Detection
+  Mat gray;
+  cvtColor(bgr_img, gray, COLOR_BGR2GRAY);
+  image_u8_t im = {gray.cols, gray.rows, gray.cols, gray.data};
+  zarray_t *reference_detections = apriltag_detector_detect(td, &im);
+
+  ASSERT_EQ(1, zarray_size(reference_detections));
+
+  // CPU backend Detection
+  int width = yuyv_img.cols;
+  int height = yuyv_img.rows;
+  frc971::apriltag::CpuDetector detector(width, height, td, cam, dist);
+  detector.Detect(yuyv_img.data);
+  const zarray_t *cpu_detections = detector.Detections();
+
+  ASSERT_EQ(1, zarray_size(cpu_detections));
+
+  for (int i = 0; i < zarray_size(reference_detections); i++) {
+    apriltag_detection_t *cpudet;
+    zarray_get(cpu_detections, i, &cpudet);
+
+    apriltag_detection_t *refdet;
+    zarray_get(reference_detections, i, &refdet);
+
+    ASSERT_EQ(refdet->id, cpudet->id);
+    ASSERT_NEAR(refdet->c[0], cpudet->c[0], 0.5);
+    ASSERT_NEAR(refdet->c[1], cpudet->c[1], 0.5);
+
+    for (int row = 0; row < 4; row++) {
+      for (int col = 0; col < 2; col++) {
+        ASSERT_NEAR(refdet->p[row][col], cpudet->p[row][col], 0.5);
+      }
+    }
+  }
+
+  apriltag_detections_destroy(reference_detections);
+}
+
+// The lookup table should stay within a small fraction of a pixel of the
+// iterative solver, on and off the grid.
+TEST_F(CpuDetectorTest, UndistortMapMatchesSolver) {
+  const size_t width = yuyv_img.cols;
+  const size_t height = yuyv_img.rows;
+  frc971::apriltag::UndistortMap map(width, height, cam, dist);
+
+  const frc971::apriltag::UndistortMap::Accuracy accuracy =
+      map.MeasureAccuracy();
+  EXPECT_EQ(accuracy.unconverged_nodes, 0u);
+  EXPECT_GT(accuracy.samples, 0u);
+  EXPECT_LT(accuracy.max_error, 0.01) << accuracy.ToString();
+
+  // An odd count so the batch has a tail, with some points off the image.
+  std::mt19937 rng(971);
+  std::uniform_real_distribution<double> x_distribution(-10.0, width + 10.0);
+  std::uniform_real_distribution<double> y_distribution(-10.0, height + 10.0);
+  std::vector<double> u(1001);
+  std::vector<double> v(u.size());
+  for (size_t i = 0; i < u.size(); ++i) {
+    u[i] = x_distribution(rng);
+    v[i] = y_distribution(rng);
+  }
+  std::vector<double> solver_u = u;
+  std::vector<double> solver_v = v;
+
+  map.Undistort(u.data(), v.data(), u.size());
+  for (size_t i = 0; i < u.size(); ++i) {
+    frc971::apriltag::DetectorBackend::UnDistort(&solver_u[i], &solver_v[i],
+                                                 &cam, &dist);
+    ASSERT_NEAR(u[i], solver_u[i], 0.01) << "Point " << i;
+    ASSERT_NEAR(v[i], solver_v[i], 0.01) << "Point " << i;
+  }
+}
+
+// Refining edges with the lookup table should land on the same corners.
+TEST_F(CpuDetectorTest, UndistortMapDetectionsMatchSolver) {
+  int width = yuyv_img.cols;
+  int height = yuyv_img.rows;
+  frc971::apriltag::CpuDetector solver_detector(width, height, td, cam, dist);
+  solver_detector.Detect(yuyv_img.data);
+
+  frc971::apriltag::CpuDetector map_detector(width, height, td, cam, dist);
+  map_detector.SetUndistortMapStep(
+      frc971::apriltag::UndistortMap::kDefaultStep);
+  ASSERT_NE(map_detector.undistort_map(), nullptr);
+  map_detector.Detect(yuyv_img.data);
+
+  const zarray_t *solver_detections = solver_detector.Detections();
+  const zarray_t *map_detections = map_detector.Detections();
+  ASSERT_EQ(1, zarray_size(map_detections));
+  ASSERT_EQ(zarray_size(solver_detections), zarray_size(map_detections));
+  for (int i = 0; i < zarray_size(solver_detections); i++) {
+    apriltag_detection_t *solver_det;
+    zarray_get(solver_detections, i, &solver_det);
+    apriltag_detection_t *map_det;
+    zarray_get(map_detections, i, &map_det);
+
+    ASSERT_EQ(solver_det->id, map_det->id);
+    for (int row = 0; row < 4; row++) {
+      for (int col = 0; col < 2; col++) {
+        ASSERT_NEAR(solver_det->p[row][col], map_det->p[row][col], 0.05);
+      }
+    }
+  }
+}
+
+// Refining a whole frame's quads as one batch should put the corners in
+// exactly the same place as refining them one at a time.
+TEST_F(CpuDetectorTest, BatchedEdgeRefinementMatchesScalar) {
+  int width = yuyv_img.cols;
+  int height = yuyv_img.rows;
+  frc971::apriltag::CpuDetector detector(width, height, td, cam, dist);
+  detector.Detect(yuyv_img.data);
+  std::vector<uint8_t> gray(width * height);
+  detector.CopyGrayTo(gray.data());
+  image_u8_t im{
+      .width = width,
+      .height = height,
+      .stride = width,
+      .buf = gray.data(),
+  };
+
+  std::vector<struct quad> quads;
+  for (const frc971::apriltag::QuadCorners &corners : detector.FitQuads()) {
+    struct quad quad;
+    std::memcpy(quad.p, corners.corners, sizeof(corners.corners));
+    quad.reversed_border = corners.reversed_border;
+    quads.push_back(quad);
+  }
+  ASSERT_GT(quads.size(), 0u);
+  // One hanging off the corner of the image, so some samples go off it.
+  quads.push_back(quads.front());
+  const float corner_quad[4][2] = {{-8, -8}, {40, -8}, {40, 40}, {-8, 40}};
+  std::memcpy(quads.back().p, corner_quad, sizeof(corner_quad));
+
+  const frc971::apriltag::UndistortMap map(width, height, cam, dist);
+  for (const frc971::apriltag::UndistortMap *undistort_map :
+       {static_cast<const frc971::apriltag::UndistortMap *>(nullptr), &map}) {
+    const double range = td->quad_decimate + 1;
+    frc971::apriltag::EdgeRefiner refiner;
+    refiner.Start(range);
+    for (const struct quad &quad : quads) {
+      refiner.AddQuad(quad);
+    }
+    // Odd sized chunks, so some blocks of samples are partial.
+    constexpr size_t kChunk = 37;
+    for (size_t begin = 0; begin < refiner.sample_count(); begin += kChunk) {
+      refiner.FindEdges(&im, begin,
+                        std::min(refiner.sample_count(), begin + kChunk));
+    }
+
+    for (size_t i = 0; i < quads.size(); ++i) {
+      struct quad batched = quads[i];
+      refiner.FitQuad(i, &batched, &cam, &dist, undistort_map);
+      struct quad scalar = quads[i];
+      frc971::apriltag::RefineEdges(range, &im, &scalar, &cam, &dist,
+                                    undistort_map);
+      for (int corner = 0; corner < 4; ++corner) {
+        for (int axis = 0; axis < 2; ++axis) {
+          ASSERT_EQ(std::memcmp(&scalar.p[corner][axis],
+                                &batched.p[corner][axis], sizeof(float)),
+                    0)
+              << "Quad " << i << " corner " << corner << ": "
+              << scalar.p[corner][axis] << " vs " << batched.p[corner][axis];
+        }
+      }
+    }
+  }
+}
+
+// Decoding on a pool shared between detectors, or on a single thread, should
+// find the same tags as each detector's own pool.
+TEST_F(CpuDetectorTest, DecodePoolDoesNotChangeResult) {
+  int width = yuyv_img.cols;
+  int height = yuyv_img.rows;
+  frc971::apriltag::CpuDetector reference(width, height, td, cam, dist);
+  reference.Detect(yuyv_img.data);
+  ASSERT_EQ(1, zarray_size(reference.Detections()));
+
+  for (size_t threads : {1, 3}) {
+    auto pool = std::make_shared<frc971::apriltag::WorkStealingPool>(threads);
+    frc971::apriltag::CpuDetector detector_a(width, height, td, cam, dist);
+    frc971::apriltag::CpuDetector detector_b(width, height, td, cam, dist);
+    // Detectors don't start a pool of their own before they need it.
+    EXPECT_EQ(detector_a.decode_pool(), nullptr);
+    detector_a.SetDecodePool(pool);
+    detector_b.SetDecodePool(pool);
+    EXPECT_EQ(detector_a.decode_pool(), pool.get());
+    for (frc971::apriltag::CpuDetector *detector : {&detector_a, &detector_b}) {
+      detector->Detect(yuyv_img.data);
+      ASSERT_EQ(zarray_size(reference.Detections()),
+                zarray_size(detector->Detections()));
+      for (int i = 0; i < zarray_size(reference.Detections()); i++) {
+        apriltag_detection_t *expected;
+        zarray_get(reference.Detections(), i, &expected);
+        apriltag_detection_t *actual;
+        zarray_get(detector->Detections(), i, &actual);
+        ASSERT_EQ(expected->id, actual->id);
+        for (int row = 0; row < 4; row++) {
+          for (int col = 0; col < 2; col++) {
+            ASSERT_EQ(expected->p[row][col], actual->p[row][col]);
+          }
+        }
+      }
+    }
+  }
+}
+
+// Detecting the same image again should reuse the first frame's decodes and
+// find exactly the same tags.
+TEST_F(CpuDetectorTest, DecodeCacheHitsOnStaticScene) {
+  int width = yuyv_img.cols;
+  int height = yuyv_img.rows;
+  frc971::apriltag::CpuDetector reference(width, height, td, cam, dist);
+  reference.Detect(yuyv_img.data);
+  ASSERT_EQ(1, zarray_size(reference.Detections()));
+
+  frc971::apriltag::CpuDetector detector(width, height, td, cam, dist);
+  detector.SetDecodeCache(frc971::apriltag::DecodeCache::kDefaultMaxEntries,
+                          frc971::apriltag::DecodeCache::kDefaultTolerance);
+  ASSERT_NE(detector.decode_cache(), nullptr);
+
+  detector.Detect(yuyv_img.data);
+  EXPECT_EQ(0u, detector.decode_cache()->stats().hits);
+  ASSERT_GE(detector.decode_cache()->stats().entries, 1u);
+
+  for (int frame = 0; frame < 3; ++frame) {
+    detector.Detect(yuyv_img.data);
+    ASSERT_EQ(zarray_size(reference.Detections()),
+              zarray_size(detector.Detections()));
+    for (int i = 0; i < zarray_size(reference.Detections()); i++) {
+      apriltag_detection_t *expected;
+      zarray_get(reference.Detections(), i, &expected);
+      apriltag_detection_t *actual;
+      zarray_get(detector.Detections(), i, &actual);
+      ASSERT_EQ(expected->id, actual->id);
+      ASSERT_EQ(expected->hamming, actual->hamming);
+      ASSERT_NEAR(expected->c[0], actual->c[0], 1e-3);
+      ASSERT_NEAR(expected->c[1], actual->c[1], 1e-3);
+      for (int row = 0; row < 4; row++) {
+        for (int col = 0; col < 2; col++) {
+          ASSERT_NEAR(expected->p[row][col], actual->p[row][col], 1e-3);
+        }
+      }
+    }
+  }
+  const size_t hits = detector.decode_cache()->stats().hits;
+  EXPECT_GE(hits, 3u);
+  EXPECT_EQ(0u, detector.decode_cache()->stats().verify_failures);
+
+  // A scene without the tag in it has nothing to hit on.
+  detector.Detect(yuyv_img_notags.data);
+  EXPECT_EQ(0, zarray_size(detector.Detections()));
+  EXPECT_EQ(hits, detector.decode_cache()->stats().hits);
+  EXPECT_EQ(0u, detector.decode_cache()->stats().entries);
+}
+
+// A tag which failed to decode while partly covered should be found again as
+// soon as it is uncovered, whether or not failures are remembered.
+TEST_F(CpuDetectorTest, DecodeCacheFindsUncoveredTag) {
+  int width = yuyv_img.cols;
+  int height = yuyv_img.rows;
+  frc971::apriltag::CpuDetector reference(width, height, td, cam, dist);
+  reference.Detect(yuyv_img.data);
+  ASSERT_EQ(1, zarray_size(reference.Detections()));
+  apriltag_detection_t *tag;
+  zarray_get(reference.Detections(), 0, &tag);
+  const int id = tag->id;
+
+  // Cover the middle of the tag, leaving its border alone so the quad is still
+  // found.
+  std::vector<Point> covered_corners;
+  for (const auto &[x, y] : {std::pair{-0.6, -0.6}, std::pair{0.6, -0.6},
+                             std::pair{0.6, 0.6}, std::pair{-0.6, 0.6}}) {
+    double px, py;
+    homography_project(tag->H, x, y, &px, &py);
+    covered_corners.emplace_back(std::lround(px), std::lround(py));
+  }
+  Mat covered_bgr = bgr_img.clone();
+  fillConvexPoly(covered_bgr, covered_corners, Scalar(128, 128, 128));
+  Mat covered;
+  cvtColor(covered_bgr, covered, COLOR_BGR2YUV_YUYV);
+
+  for (const bool remember_failures : {false, true}) {
+    frc971::apriltag::CpuDetector detector(width, height, td, cam, dist);
+    detector.SetDecodeCache(frc971::apriltag::DecodeCache::kDefaultMaxEntries,
+                            frc971::apriltag::DecodeCache::kDefaultTolerance,
+                            remember_failures);
+    for (int frame = 0; frame < 2; ++frame) {
+      detector.Detect(covered.data);
+      ASSERT_EQ(0, zarray_size(detector.Detections()));
+    }
+    detector.Detect(yuyv_img.data);
+    ASSERT_EQ(1, zarray_size(detector.Detections()))
+        << ": remember_failures " << remember_failures;
+    apriltag_detection_t *det;
+    zarray_get(detector.Detections(), 0, &det);
+    EXPECT_EQ(id, det->id);
+    if (!remember_failures) {
+      EXPECT_EQ(0u, detector.decode_cache()->stats().empty_hits);
+    }
+  }
+}
+
+// Once a static scene is in the decode cache, detecting it again shouldn't
+// touch the heap, or call into quad_decode_index, which allocates.
+TEST_F(CpuDetectorTest, StaticSceneDoesNotAllocate) {
+  int width = yuyv_img.cols;
+  int height = yuyv_img.rows;
+  frc971::apriltag::CpuDetector detector(width, height, td, cam, dist);
+  // Big enough to hold every quad, and remembering the quads which aren't
+  // tags so they aren't decoded again either.
+  detector.SetDecodeCache(frc971::apriltag::DetectorBackend::kMaxBlobs,
+                          frc971::apriltag::DecodeCache::kDefaultTolerance,
+                          /*remember_failures=*/true);
+
+  // The first frame decodes everything and grows every buffer, and the second
+  // hands out what the first recycled.
+  detector.Detect(yuyv_img.data);
+  detector.Detect(yuyv_img.data);
+  ASSERT_EQ(1, zarray_size(detector.Detections()));
+  const size_t allocations = detector.detection_pool().allocations();
+  const size_t misses = detector.decode_cache()->stats().misses;
+  const size_t heap = heap_allocations.load();
+
+  constexpr size_t kFrames = 10;
+  for (size_t frame = 0; frame < kFrames; ++frame) {
+    detector.Detect(yuyv_img.data);
+    ASSERT_EQ(1, zarray_size(detector.Detections()));
+    // Handing them back early should be just as cheap.
+    if (frame % 2 == 0) {
+      detector.ReinitializeDetections();
+    }
+  }
+  EXPECT_EQ(heap, heap_allocations.load());
+  EXPECT_EQ(allocations, detector.detection_pool().allocations());
+  EXPECT_EQ(misses, detector.decode_cache()->stats().misses);
+}
+
+// Without the decode cache, which is the default, every quad goes through
+// quad_decode_index, which allocates inside libapriltag, so frames aren't
+// free.  Everything of ours should still stop growing after the first frames,
+// so a static scene allocates the same amount every frame.
+TEST_F(CpuDetectorTest, DefaultConfigurationAllocatesSteadily) {
+  int width = yuyv_img.cols;
+  int height = yuyv_img.rows;
+  frc971::apriltag::CpuDetector detector(width, height, td, cam, dist);
+  ASSERT_EQ(nullptr, detector.decode_cache());
+
+  detector.Detect(yuyv_img.data);
+  detector.Detect(yuyv_img.data);
+  size_t heap = heap_allocations.load();
+  detector.Detect(yuyv_img.data);
+  const size_t per_frame = heap_allocations.load() - heap;
+
+  constexpr size_t kFrames = 10;
+  for (size_t frame = 0; frame < kFrames; ++frame) {
+    heap = heap_allocations.load();
+    detector.Detect(yuyv_img.data);
+    ASSERT_EQ(1, zarray_size(detector.Detections()));
+    EXPECT_EQ(per_frame, heap_allocations.load() - heap);
+  }
+  // Nothing is decoded without quad_decode_index, so the pool is never used.
+  EXPECT_EQ(0u, detector.detection_pool().allocations());
+}
+
+// Submitting frames should find the same tags as Detect, handing them back in
+// order while the next frame is in flight.
+TEST_F(CpuDetectorTest, SubmitPollMatchesDetect) {
+  int width = yuyv_img.cols;
+  int height = yuyv_img.rows;
+  frc971::apriltag::CpuDetector reference(width, height, td, cam, dist);
+  frc971::apriltag::CpuDetector detector(width, height, td, cam, dist);
+  EXPECT_EQ(nullptr, detector.Poll(true));
+
+  // The image is only read during Submit, so reuse one buffer for every frame.
+  Mat image = yuyv_img.clone();
+  const std::vector<const Mat *> frames = {&yuyv_img, &yuyv_img_notags,
+                                           &yuyv_img, &yuyv_img,
+                                           &yuyv_img_notags};
+  size_t polled = 0;
+  auto check_next = [&](const zarray_t *detections) {
+    ASSERT_NE(nullptr, detections);
+    reference.Detect(frames[polled]->data);
+    ++polled;
+    ASSERT_EQ(zarray_size(reference.Detections()), zarray_size(detections))
+        << ": frame " << polled - 1;
+    for (int i = 0; i < zarray_size(reference.Detections()); i++) {
+      apriltag_detection_t *expected;
+      zarray_get(reference.Detections(), i, &expected);
+      apriltag_detection_t *actual;
+      zarray_get(const_cast<zarray_t *>(detections), i, &actual);
+      ASSERT_EQ(expected->id, actual->id);
+      for (int row = 0; row < 4; row++) {
+        for (int col = 0; col < 2; col++) {
+          ASSERT_EQ(expected->p[row][col], actual->p[row][col]);
+        }
+      }
+    }
+  };
+
+  for (const Mat *frame : frames) {
+    if (!detector.CanSubmit()) {
+      check_next(detector.Poll(true));
+    }
+    frame->copyTo(image);
+    detector.Submit(image.data);
+    image.setTo(0);
+  }
+  EXPECT_FALSE(detector.CanSubmit());
+  while (detector.in_flight() > 0) {
+    check_next(detector.Poll(true));
+  }
+  EXPECT_EQ(frames.size(), polled);
+  EXPECT_EQ(nullptr, detector.Poll(false));
+
+  // Detect still works once everything has been polled.
+  detector.Detect(yuyv_img.data);
+  ASSERT_EQ(1, zarray_size(detector.Detections()));
+}
+
+// Copies of a frame's detections should outlive the detector recycling its
+// own, since the pose stage reads them while the next frame is detected.
+TEST_F(CpuDetectorTest, DetectionCopiesOutliveDetector) {
+  int width = yuyv_img.cols;
+  int height = yuyv_img.rows;
+  frc971::apriltag::CpuDetector reference(width, height, td, cam, dist);
+  reference.Detect(yuyv_img.data);
+  ASSERT_EQ(1, zarray_size(reference.Detections()));
+  apriltag_detection_t *expected;
+  zarray_get(reference.Detections(), 0, &expected);
+
+  frc971::apriltag::CpuDetector detector(width, height, td, cam, dist);
+  frc971::apriltag::DetectionCopies copies;
+  for (int frame = 0; frame < 3; ++frame) {
+    detector.Detect(yuyv_img.data);
+    copies.CopyFrom(detector.Detections());
+    detector.ReinitializeDetections();
+    // The detector hands its recycled detections out again here.
+    detector.Detect(yuyv_img_notags.data);
+    ASSERT_EQ(0, zarray_size(detector.Detections()));
+
+    ASSERT_EQ(1, zarray_size(copies.detections()));
+    apriltag_detection_t *actual;
+    zarray_get(const_cast<zarray_t *>(copies.detections()), 0, &actual);
+    EXPECT_EQ(expected->id, actual->id);
+    EXPECT_EQ(expected->hamming, actual->hamming);
+    for (int row = 0; row < 4; row++) {
+      for (int col = 0; col < 2; col++) {
+        EXPECT_EQ(expected->p[row][col], actual->p[row][col]);
+      }
+    }
+    ASSERT_NE(expected->H, actual->H);
+    for (int i = 0; i < 9; ++i) {
+      EXPECT_EQ(expected->H->data[i], actual->H->data[i]);
+    }
+    detector.ReinitializeDetections();
+  }
+  // Only the first frame should have needed a new detection.
+  EXPECT_EQ(1u, copies.allocations());
+
+  copies.Clear();
+  EXPECT_EQ(0, zarray_size(copies.detections()));
+  EXPECT_EQ(1u, copies.allocations());
+}
+
+// Every index should run exactly once, and a worker should never run two
+// tasks at once, even when a few tasks are much slower than the rest.
+TEST(WorkStealingPoolTest, RunsEveryIndexOnce) {
+  for (size_t threads : {1, 2, 3, 8}) {
+    frc971::apriltag::WorkStealingPool pool(threads);
+    for (size_t n : {0, 1, 2, 7, 1000}) {
+      std::vector<std::atomic<int>> runs(n);
+      std::vector<std::atomic<bool>> busy(pool.threads());
+      pool.ForEach(n, [&](size_t index, size_t worker) {
+        ASSERT_LT(worker, pool.threads());
+        ASSERT_FALSE(busy[worker].exchange(true));
+        if (index % 97 == 0) {
+          std::this_thread::sleep_for(std::chrono::microseconds(200));
+        }
+        runs[index].fetch_add(1);
+        busy[worker].store(false);
+      });
+      for (size_t i = 0; i < n; ++i) {
+        ASSERT_EQ(runs[i].load(), 1) << "Index " << i << " with " << threads
+                                     << " threads";
+      }
+    }
+  }
+}
+
+// Batches from callers sharing a pool should run in the order they were
+// started, so no caller is starved while another keeps the pool busy.
+TEST(WorkStealingPoolTest, BatchesRunInArrivalOrder) {
+  frc971::apriltag::WorkStealingPool pool(2);
+  std::atomic<bool> release{false};
+  std::thread blocker([&]() {
+    pool.ForEach(1, [&](size_t, size_t) {
+      while (!release.load()) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+      }
+    });
+  });
+  std::this_thread::sleep_for(std::chrono::milliseconds(20));
+
+  // Queue up callers one after another behind the running batch.
+  std::mutex order_mutex;
+  std::vector<int> order;
+  std::vector<std::thread> callers;
+  for (int caller = 0; caller < 4; ++caller) {
+    callers.emplace_back([&, caller]() {
+      pool.ForEach(1, [&](size_t, size_t) {
+        std::lock_guard<std::mutex> lock(order_mutex);
+        order.push_back(caller);
+      });
+    });
+    std::this_thread::sleep_for(std::chrono::milliseconds(20));
+  }
+
+  release.store(true);
+  blocker.join();
+  for (std::thread &caller : callers) {
+    caller.join();
+  }
+  EXPECT_EQ(order, (std::vector<int>{0, 1, 2, 3}));
+}
+
+// The moments of the points between index0 and index1 inclusive, wrapping
+// around the end of the blob, summed one point at a time.  This is how the
+// moments were accumulated before LineFitPoint was bit packed.
+frc971::apriltag::LineFitMoments ReferenceMoments(
+    const std::vector<std::array<uint32_t, 3>> &points, size_t index0,
+    size_t index1) {
+  frc971::apriltag::LineFitMoments result = {};
+  for (size_t i = index0;; i = (i + 1) % points.size()) {
+    const int64_t W = points[i][0];
+    const int64_t ix2 = points[i][1];
+    const int64_t iy2 = points[i][2];
+    result.Mx += W * ix2;
+    result.My += W * iy2;
+    result.W += W;
+    result.Mxx += W * ix2 * ix2;
+    result.Myy += W * iy2 * iy2;
+    result.Mxy += W * ix2 * iy2;
+    ++result.N;
+    if (i == index1) {
+      return result;
+    }
+  }
+}
+
+TEST(LineFitPointTest, PackedMomentsMatchReference) {
+  using frc971::apriltag::LineFitMoments;
+  using frc971::apriltag::LineFitPoint;
+
+  // A 12 MP image at full resolution is the largest the packing has to hold.
+  constexpr uint32_t kWidth = 4000;
+  constexpr uint32_t kHeight = 3000;
+  constexpr uint32_t kMaxPoints = 2 * (kWidth + kHeight);
+  constexpr uint32_t kMaxCoordinate = 2 * kWidth + 1;
+  static_assert(LineFitPoint::Fits(kMaxPoints, kMaxCoordinate));
+
+  std::mt19937 rng(971);
+  for (int blob = 0; blob < 20; ++blob) {
+    // The first blob is the worst case, every point maxed out.
+    const size_t count = blob == 0 ? kMaxPoints : 24 + rng() % 2000;
+    std::vector<std::array<uint32_t, 3>> points(count);
+    for (std::array<uint32_t, 3> &point : points) {
+      if (blob == 0) {
+        point = {LineFitPoint::kMaxWeight, kMaxCoordinate, kMaxCoordinate};
+      } else {
+        point = {1 + static_cast<uint32_t>(rng() % LineFitPoint::kMaxWeight),
+                 1 + static_cast<uint32_t>(rng() % kMaxCoordinate),
+                 1 + static_cast<uint32_t>(rng() % (2 * kHeight + 1))};
+      }
+    }
+
+    std::vector<LineFitPoint> line_fit_points(count);
+    for (size_t i = 0; i < count; ++i) {
+      line_fit_points[i] = LineFitPoint::FromPoint(points[i][0], points[i][1],
+                                                   points[i][2], blob);
+      if (i > 0) {
+        line_fit_points[i] = line_fit_points[i - 1] + line_fit_points[i];
+      }
+      ASSERT_EQ(line_fit_points[i].blob_index(), static_cast<uint32_t>(blob));
+    }
+
+    for (int trial = 0; trial < 200; ++trial) {
+      size_t index0 = rng() % count;
+      size_t index1 = rng() % count;
+      if (trial == 0) {
+        index0 = 0;
+        index1 = count - 1;
+      } else if (index0 == index1) {
+        continue;
+      }
+
+      const LineFitMoments expected = ReferenceMoments(points, index0, index1);
+      const LineFitMoments moments = frc971::apriltag::HostReadMoments(
+          line_fit_points.data(), count, index0, index1);
+      ASSERT_EQ(moments.Mx, expected.Mx);
+      ASSERT_EQ(moments.My, expected.My);
+      ASSERT_EQ(moments.W, expected.W);
+      ASSERT_EQ(moments.Mxx, expected.Mxx);
+      ASSERT_EQ(moments.Myy, expected.Myy);
+      ASSERT_EQ(moments.Mxy, expected.Mxy);
+      ASSERT_EQ(moments.N, expected.N);
+
+      if (blob == 0) {
+        continue;
+      }
+      // Identical moments have to fit identical lines, so the quad corners
+      // can't move.
+      double expected_lines[4], lines[4];
+      double expected_err, expected_mse, err, mse;
+      frc971::apriltag::HostFitLine(expected, expected_lines,
+                                    expected_lines + 2, &expected_err,
+                                    &expected_mse);
+      frc971::apriltag::HostFitLine(moments, lines, lines + 2, &err, &mse);
+      for (int i = 0; i < 4; ++i) {
+        ASSERT_EQ(lines[i], expected_lines[i]);
+      }
+      ASSERT_EQ(err, expected_err);
+      ASSERT_EQ(mse, expected_mse);
+    }
+  }
+}
+
+// Main function to run the tests
+int main(int argc, char **argv) {
+  ::testing::InitGoogleTest(&argc, argv);
+  google::InitGoogleLogging(argv[0]);
+  return RUN_ALL_TESTS();
+}
@@ -127,10 +127,22 @@ class GpuMemory {
 
   // Copies data from host memory to this memory asynchronously on the provided
   // stream.
-  void MemcpyAsyncFrom(const T *host_memory, CudaStream *stream) {
-    CHECK_CUDA(cudaMemcpyAsync(memory_, host_memory, sizeof(T) * size_,
+  void MemcpyAsyncFrom(const T *host_memory, size_t size, CudaStream *stream) {
+    CHECK_CUDA(cudaMemcpyAsync(memory_, host_memory, sizeof(T) * size,
                                cudaMemcpyHostToDevice, stream->get()));
   }
+  void MemcpyAsyncFrom(const T *host_memory, CudaStream *stream) {
+    MemcpyAsyncFrom(host_memory, size_, stream);
+  }
+  // Copies height rows of width objects, host_pitch bytes apart in host
+  // memory, into this memory with no gaps between them.
+  void MemcpyAsync2DFrom(const T *host_memory, size_t host_pitch, size_t width,
+                         size_t height, CudaStream *stream) {
+    CHECK_LE(width * height, size_);
+    CHECK_CUDA(cudaMemcpy2DAsync(memory_, sizeof(T) * width, host_memory,
+                                 host_pitch, sizeof(T) * width, height,
+                                 cudaMemcpyHostToDevice, stream->get()));
+  }
   void MemcpyAsyncFrom(const HostMemory<T> *host_memory, CudaStream *stream) {
     MemcpyAsyncFrom(host_memory->get(), stream);
   }
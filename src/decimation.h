@@ -0,0 +1,26 @@
+#ifndef FRC971_ORIN_DECIMATION_H_
+#define FRC971_ORIN_DECIMATION_H_
+
+#include <stddef.h>
+
+#include "host_device.h"
+
+namespace frc971::apriltag {
+
+// Largest decimation factor the detector supports.  The decimated image is
+// formed by keeping every decimation'th pixel of every decimation'th row, like
+// image_u8_decimate.
+constexpr size_t kMaxDecimation = 4;
+
+// Returns the size of the decimated image along an axis of the full resolution
+// image.  The decimated image is trimmed down to a multiple of the 4x4
+// threshold tiles, which drops at most 4 * decimation - 1 pixels off the right
+// and bottom edges.
+__host__ __device__ constexpr size_t DecimatedSize(size_t size,
+                                                   size_t decimation) {
+  return size / decimation / 4 * 4;
+}
+
+}  // namespace frc971::apriltag
+
+#endif  // FRC971_ORIN_DECIMATION_H_
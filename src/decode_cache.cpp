@@ -0,0 +1,403 @@
+#include "decode_cache.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdlib>
+#include <numeric>
+#include <sstream>
+
+#include "common/matd.h"
+#include "glog/logging.h"
+
+namespace frc971::apriltag {
+namespace {
+
+// Bits closer together than this when recorded are too noisy to check
+// against.
+constexpr double kMinContrast = 16.0;
+
+// How much a pixel inside a quad which didn't decode can change by before it
+// is decoded again.
+constexpr double kMaxEmptyChange = 16.0;
+
+// How far the cached detection may be from the decoded one when recorded, in
+// pixels.
+constexpr double kMaxReprojectionError = 1e-3;
+
+// Computes the homography from tag coordinates ([-1, 1] on both axes, corner
+// 0 at (-1, -1) and corner 1 at (1, -1)) to the refined quad.  This is the
+// closed form square to quad mapping, so unlike homography_compute2 nothing is
+// allocated.  It only matches quad_decode_index's homography up to scale, which
+// is fine since everything is stored relative to it.  Returns false if the
+// quad is degenerate.
+bool QuadHomography(const struct quad &quad, double H[3][3]) {
+  const double x0 = quad.p[0][0], y0 = quad.p[0][1];
+  const double x1 = quad.p[1][0], y1 = quad.p[1][1];
+  const double x2 = quad.p[2][0], y2 = quad.p[2][1];
+  const double x3 = quad.p[3][0], y3 = quad.p[3][1];
+  const double sx = x0 - x1 + x2 - x3;
+  const double sy = y0 - y1 + y2 - y3;
+  const double dx1 = x1 - x2, dx2 = x3 - x2;
+  const double dy1 = y1 - y2, dy2 = y3 - y2;
+  const double den = dx1 * dy2 - dx2 * dy1;
+  if (std::abs(den) < 1e-9) {
+    return false;
+  }
+  const double g = (sx * dy2 - dx2 * sy) / den;
+  const double h = (dx1 * sy - sx * dy1) / den;
+
+  // Maps the unit square onto the quad.
+  const double unit[3][3] = {
+      {x1 - x0 + g * x1, x3 - x0 + h * x3, x0},
+      {y1 - y0 + g * y1, y3 - y0 + h * y3, y0},
+      {g, h, 1.0},
+  };
+  // Then [-1, 1] onto the unit square.
+  for (int row = 0; row < 3; ++row) {
+    H[row][0] = 0.5 * unit[row][0];
+    H[row][1] = 0.5 * unit[row][1];
+    H[row][2] = 0.5 * (unit[row][0] + unit[row][1]) + unit[row][2];
+  }
+  return true;
+}
+
+void Project(const double H[3][3], double x, double y, double *px,
+             double *py) {
+  const double z = H[2][0] * x + H[2][1] * y + H[2][2];
+  *px = (H[0][0] * x + H[0][1] * y + H[0][2]) / z;
+  *py = (H[1][0] * x + H[1][1] * y + H[1][2]) / z;
+}
+
+void Multiply(const double a[3][3], const double b[3][3], double result[3][3]) {
+  for (int row = 0; row < 3; ++row) {
+    for (int col = 0; col < 3; ++col) {
+      result[row][col] = a[row][0] * b[0][col] + a[row][1] * b[1][col] +
+                         a[row][2] * b[2][col];
+    }
+  }
+}
+
+// Returns false if m is singular.
+bool Invert(const double m[3][3], double result[3][3]) {
+  const double c00 = m[1][1] * m[2][2] - m[1][2] * m[2][1];
+  const double c01 = m[1][2] * m[2][0] - m[1][0] * m[2][2];
+  const double c02 = m[1][0] * m[2][1] - m[1][1] * m[2][0];
+  const double det = m[0][0] * c00 + m[0][1] * c01 + m[0][2] * c02;
+  if (std::abs(det) < 1e-12) {
+    return false;
+  }
+  const double inverse_det = 1.0 / det;
+  result[0][0] = c00 * inverse_det;
+  result[0][1] = (m[0][2] * m[2][1] - m[0][1] * m[2][2]) * inverse_det;
+  result[0][2] = (m[0][1] * m[1][2] - m[0][2] * m[1][1]) * inverse_det;
+  result[1][0] = c01 * inverse_det;
+  result[1][1] = (m[0][0] * m[2][2] - m[0][2] * m[2][0]) * inverse_det;
+  result[1][2] = (m[0][2] * m[1][0] - m[0][0] * m[1][2]) * inverse_det;
+  result[2][0] = c02 * inverse_det;
+  result[2][1] = (m[0][1] * m[2][0] - m[0][0] * m[2][1]) * inverse_det;
+  result[2][2] = (m[0][0] * m[1][1] - m[0][1] * m[1][0]) * inverse_det;
+  return true;
+}
+
+// Bilinearly samples the image at (x, y), with pixel centers at + 0.5.
+// Returns false if any of the 4 pixels is off the image.
+bool Sample(const image_u8_t *im, double x, double y, double *value) {
+  const double fx = x - 0.5;
+  const double fy = y - 0.5;
+  // Written so NaN is rejected too.
+  if (!(fx >= 0.0 && fy >= 0.0 && fx < im->width - 1 && fy < im->height - 1)) {
+    return false;
+  }
+  const int x0 = static_cast<int>(fx);
+  const int y0 = static_cast<int>(fy);
+  const double ax = fx - x0;
+  const double ay = fy - y0;
+  const uint8_t *row0 = im->buf + y0 * im->stride + x0;
+  const uint8_t *row1 = row0 + im->stride;
+  const double top = row0[0] + ax * (row0[1] - row0[0]);
+  const double bottom = row1[0] + ax * (row1[1] - row1[0]);
+  *value = top + ay * (bottom - top);
+  return true;
+}
+
+// Returns the center of data bit i in tag coordinates.
+void BitCenter(const apriltag_family_t *family, size_t i, double *x,
+               double *y) {
+  *x = 2.0 * ((family->bit_x[i] + 0.5) / family->width_at_border - 0.5);
+  *y = 2.0 * ((family->bit_y[i] + 0.5) / family->width_at_border - 0.5);
+}
+
+// Samples a 3x3 grid spread over the inside of the quad with homography H
+// into samples[0, 9).  Returns false if any of it is off the image.
+bool SampleGrid(const image_u8_t *im, const double H[3][3], double *samples) {
+  for (int row = 0; row < 3; ++row) {
+    for (int col = 0; col < 3; ++col) {
+      double px, py;
+      Project(H, 0.5 * (col - 1), 0.5 * (row - 1), &px, &py);
+      if (!Sample(im, px, py, &samples[row * 3 + col])) {
+        return false;
+      }
+    }
+  }
+  return true;
+}
+
+}  // namespace
+
+DecodeCache::DecodeCache(size_t max_entries, double tolerance,
+                         bool remember_failures)
+    : max_entries_(max_entries),
+      tolerance_(tolerance),
+      remember_failures_(remember_failures) {
+  CHECK_GT(max_entries, 0u);
+  CHECK_GE(tolerance, 0.0);
+  entries_.reserve(max_entries);
+}
+
+void DecodeCache::StartFrame(size_t quad_count) {
+  slots_.clear();
+  slots_.resize(quad_count);
+}
+
+bool DecodeCache::Matches(const Entry &entry,
+                          const QuadCorners &corners) const {
+  if (entry.reversed_border != corners.reversed_border) {
+    return false;
+  }
+  for (int i = 0; i < 4; ++i) {
+    if (std::abs(entry.corners[i][0] - corners.corners[i][0]) > tolerance_ ||
+        std::abs(entry.corners[i][1] - corners.corners[i][1]) > tolerance_) {
+      return false;
+    }
+  }
+  return true;
+}
+
+bool DecodeCache::Lookup(size_t quad_index, const QuadCorners &corners,
+                         const struct quad &quad, const image_u8_t *im,
+                         DetectionPool *detection_pool, zarray_t *detections) {
+  Slot &slot = slots_[quad_index];
+  slot.looked_up = true;
+
+  double quad_H[3][3];
+  bool have_quad_H = false;
+  for (const Entry &entry : entries_) {
+    if (!Matches(entry, corners)) {
+      continue;
+    }
+    if (!have_quad_H) {
+      if (!QuadHomography(quad, quad_H)) {
+        return false;
+      }
+      have_quad_H = true;
+    }
+
+    if (!entry.decoded) {
+      // Still nothing there as long as the inside looks the same.
+      std::array<double, kEmptySamples> samples;
+      bool same = SampleGrid(im, quad_H, samples.data());
+      for (size_t i = 0; same && i < kEmptySamples; ++i) {
+        same = std::abs(samples[i] - entry.samples[i]) <= kMaxEmptyChange;
+      }
+      if (!same) {
+        slot.verify_failed = true;
+        continue;
+      }
+      slot.hit = true;
+      slot.empty_hit = true;
+      slot.recorded = true;
+      slot.entry = entry;
+      std::copy(&corners.corners[0][0], &corners.corners[0][0] + 8,
+                &slot.entry.corners[0][0]);
+      return true;
+    }
+
+    double H[3][3];
+    Multiply(quad_H, entry.rotation, H);
+
+    // The bits have to split the same way they did when the entry was
+    // recorded, with most of the contrast left.
+    double min_white = 255.0;
+    double max_black = 0.0;
+    bool on_image = true;
+    for (const VerifyBit &bit : entry.bits) {
+      double px, py, value;
+      Project(H, bit.x, bit.y, &px, &py);
+      if (!Sample(im, px, py, &value)) {
+        on_image = false;
+        break;
+      }
+      if (bit.white) {
+        min_white = std::min(min_white, value);
+      } else {
+        max_black = std::max(max_black, value);
+      }
+    }
+    if (!on_image || min_white - max_black < entry.contrast / 4) {
+      slot.verify_failed = true;
+      continue;
+    }
+
+    apriltag_detection_t *det = detection_pool->Acquire();
+    det->family = entry.family;
+    det->id = entry.id;
+    det->hamming = entry.hamming;
+    det->decision_margin = entry.decision_margin;
+    for (int row = 0; row < 3; ++row) {
+      for (int col = 0; col < 3; ++col) {
+        MATD_EL(det->H, row, col) = H[row][col];
+      }
+    }
+    Project(H, entry.tag_points[4][0], entry.tag_points[4][1], &det->c[0],
+            &det->c[1]);
+    for (int i = 0; i < 4; ++i) {
+      Project(H, entry.tag_points[i][0], entry.tag_points[i][1], &det->p[i][0],
+              &det->p[i][1]);
+    }
+    zarray_add(detections, &det);
+
+    // Follow the tag as it drifts.
+    slot.hit = true;
+    slot.recorded = true;
+    slot.entry = entry;
+    std::copy(&corners.corners[0][0], &corners.corners[0][0] + 8,
+              &slot.entry.corners[0][0]);
+    return true;
+  }
+  return false;
+}
+
+void DecodeCache::Record(size_t quad_index, const QuadCorners &corners,
+                         const struct quad &quad, const image_u8_t *im,
+                         const zarray_t *detections, int first_detection) {
+  const int added = zarray_size(detections) - first_detection;
+  if (added > 1 || (added == 0 && !remember_failures_)) {
+    return;
+  }
+  double quad_H[3][3];
+  if (!QuadHomography(quad, quad_H)) {
+    return;
+  }
+
+  Slot &slot = slots_[quad_index];
+  Entry &entry = slot.entry;
+  std::copy(&corners.corners[0][0], &corners.corners[0][0] + 8,
+            &entry.corners[0][0]);
+  entry.reversed_border = corners.reversed_border;
+  entry.decoded = added == 1;
+
+  if (!entry.decoded) {
+    slot.recorded = SampleGrid(im, quad_H, entry.samples.data());
+    return;
+  }
+
+  apriltag_detection_t *det;
+  zarray_get(detections, first_detection, &det);
+  const apriltag_family_t *family = det->family;
+  const size_t nbits = family->nbits;
+  if (nbits < kVerifyBits || nbits > kMaxBits) {
+    return;
+  }
+
+  double det_H[3][3];
+  for (int row = 0; row < 3; ++row) {
+    for (int col = 0; col < 3; ++col) {
+      det_H[row][col] = MATD_EL(det->H, row, col);
+    }
+  }
+  double det_H_inverse[3][3];
+  double quad_H_inverse[3][3];
+  if (!Invert(det_H, det_H_inverse) || !Invert(quad_H, quad_H_inverse)) {
+    return;
+  }
+
+  entry.family = det->family;
+  entry.id = det->id;
+  entry.hamming = det->hamming;
+  entry.decision_margin = det->decision_margin;
+  Multiply(quad_H_inverse, det_H, entry.rotation);
+
+  // Remember where the corners and center are in tag coordinates rather than
+  // assuming an order, and make sure projecting them back through the quad
+  // lands where quad_decode_index put them.
+  double H[3][3];
+  Multiply(quad_H, entry.rotation, H);
+  for (int i = 0; i < 5; ++i) {
+    const double *point = i < 4 ? det->p[i] : det->c;
+    Project(det_H_inverse, point[0], point[1], &entry.tag_points[i][0],
+            &entry.tag_points[i][1]);
+    double px, py;
+    Project(H, entry.tag_points[i][0], entry.tag_points[i][1], &px, &py);
+    if (!(std::hypot(px - point[0], py - point[1]) < kMaxReprojectionError)) {
+      return;
+    }
+  }
+
+  // Check the bits which are furthest from the threshold.
+  std::array<double, kMaxBits> values;
+  for (size_t i = 0; i < nbits; ++i) {
+    double x, y, px, py;
+    BitCenter(family, i, &x, &y);
+    Project(det_H, x, y, &px, &py);
+    if (!Sample(im, px, py, &values[i])) {
+      return;
+    }
+  }
+  std::array<size_t, kMaxBits> order;
+  std::iota(order.begin(), order.begin() + nbits, 0);
+  std::sort(order.begin(), order.begin() + nbits,
+            [&values](size_t a, size_t b) { return values[a] < values[b]; });
+  constexpr size_t kHalf = kVerifyBits / 2;
+  for (size_t i = 0; i < kVerifyBits; ++i) {
+    const bool white = i >= kHalf;
+    const size_t bit = white ? order[nbits - kVerifyBits + i] : order[i];
+    BitCenter(family, bit, &entry.bits[i].x, &entry.bits[i].y);
+    entry.bits[i].white = white;
+  }
+  entry.contrast = values[order[nbits - kHalf]] - values[order[kHalf - 1]];
+  if (entry.contrast < kMinContrast) {
+    return;
+  }
+
+  slot.recorded = true;
+}
+
+void DecodeCache::FinishFrame() {
+  for (const Slot &slot : slots_) {
+    if (slot.hit) {
+      ++stats_.hits;
+      if (slot.empty_hit) {
+        ++stats_.empty_hits;
+      }
+    } else if (slot.looked_up) {
+      ++stats_.misses;
+      if (slot.verify_failed) {
+        ++stats_.verify_failures;
+      }
+    }
+  }
+
+  // Tags first, since they are what is expensive to lose.
+  entries_.clear();
+  for (bool decoded : {true, false}) {
+    for (const Slot &slot : slots_) {
+      if (entries_.size() == max_entries_) {
+        break;
+      }
+      if (slot.recorded && slot.entry.decoded == decoded) {
+        entries_.push_back(slot.entry);
+      }
+    }
+  }
+  stats_.entries = entries_.size();
+}
+
+std::string DecodeCache::Stats::ToString() const {
+  std::ostringstream os;
+  os << hits << " hits (" << empty_hits << " empty), " << misses
+     << " misses (" << verify_failures << " failed verification), " << entries
+     << " entries";
+  return os.str();
+}
+
+}  // namespace frc971::apriltag
@@ -0,0 +1,163 @@
+#ifndef FRC971_ORIN_DECODE_CACHE_H_
+#define FRC971_ORIN_DECODE_CACHE_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <array>
+#include <string>
+#include <vector>
+
+#include "apriltag.h"
+#include "detection_pool.h"
+#include "detector_backend.h"
+
+namespace frc971::apriltag {
+
+// Remembers what each quad decoded to last frame, so a tag which hasn't moved
+// doesn't have to go through quad_decode_index again.  A quad whose corners
+// are all within tolerance of a quad decoded last frame reuses its id and
+// rotation, once a handful of the bits sampled through the new corners still
+// read the same.  Quads which don't match, or fail the check, are decoded as
+// usual and recorded for the next frame.
+//
+// With remember_failures, quads which didn't decode to anything are
+// remembered too, and skipped for as long as the pixels inside them stay about
+// the same.  That saves decoding the many quads in a scene which aren't tags,
+// but a tag which failed to decode once, to motion blur or a partial
+// occlusion, stays missing until enough of its pixels change, so it is off by
+// default.
+//
+// Nothing is allocated on a hit, so a static scene with remember_failures
+// decodes without touching the heap.
+//
+// Each frame is bracketed by StartFrame and FinishFrame.  In between, Lookup
+// and Record can be called from several threads at once as long as each
+// quad_index is only handled by one of them.
+class DecodeCache {
+ public:
+  // Default number of quads remembered.  Quads which decoded are kept over
+  // quads which didn't.
+  static constexpr size_t kDefaultMaxEntries = 256;
+  // Default distance in pixels each unrefined corner may move by.
+  static constexpr double kDefaultTolerance = 1.0;
+
+  DecodeCache(size_t max_entries, double tolerance,
+              bool remember_failures = false);
+
+  // Prepares for a frame with quad_count quads.  Doesn't allocate once the
+  // cache has seen that many quads in a frame.
+  void StartFrame(size_t quad_count);
+
+  // Looks up the quad with the provided unrefined corners, and refined corners
+  // quad.  On a hit, adds the cached detection re-projected through quad to
+  // detections, if there was one, and returns true.  Detections come out of
+  // detection_pool.
+  bool Lookup(size_t quad_index, const QuadCorners &corners,
+              const struct quad &quad, const image_u8_t *im,
+              DetectionPool *detection_pool, zarray_t *detections);
+
+  // Remembers what quad_decode_index added to detections from index
+  // first_detection on for the next frame.  Only quads which decoded to
+  // exactly one tag, or to nothing with remember_failures, are remembered.
+  void Record(size_t quad_index, const QuadCorners &corners,
+              const struct quad &quad, const image_u8_t *im,
+              const zarray_t *detections, int first_detection);
+
+  // Replaces last frame's entries with this frame's, and updates the stats.
+  void FinishFrame();
+
+  struct Stats {
+    // Quads which reused a cached decode.
+    size_t hits = 0;
+    // Hits which had decoded to nothing.
+    size_t empty_hits = 0;
+    // Quads which had to be decoded.
+    size_t misses = 0;
+    // Misses where the corners matched an entry but the bits didn't.
+    size_t verify_failures = 0;
+    // Number of entries kept from the last frame.
+    size_t entries = 0;
+
+    std::string ToString() const;
+  };
+
+  // Totals since the cache was created.
+  const Stats &stats() const { return stats_; }
+
+  size_t max_entries() const { return max_entries_; }
+  double tolerance() const { return tolerance_; }
+  bool remember_failures() const { return remember_failures_; }
+
+ private:
+  // Number of bits checked on a hit, half of them white and half black.
+  static constexpr size_t kVerifyBits = 8;
+  // Codes are 64 bit.
+  static constexpr size_t kMaxBits = 64;
+
+  // Number of pixels sampled inside a quad which didn't decode, on a 3x3 grid.
+  static constexpr size_t kEmptySamples = 9;
+
+  // A bit sampled to check a hit, in tag coordinates.
+  struct VerifyBit {
+    double x;
+    double y;
+    bool white;
+  };
+
+  struct Entry {
+    // Unrefined corners the entry is matched on.
+    float corners[4][2];
+    bool reversed_border;
+
+    // False if the quad didn't decode to anything, in which case only
+    // samples is filled out.
+    bool decoded;
+    // Pixels on a grid inside the quad.
+    std::array<double, kEmptySamples> samples;
+
+    apriltag_family_t *family;
+    int id;
+    int hamming;
+    float decision_margin;
+
+    // Maps tag coordinates of the detection to tag coordinates of the quad
+    // homography, so the detection's homography is the quad's times this.
+    double rotation[3][3];
+    // The detection's corners, then its center, in its tag coordinates.
+    double tag_points[5][2];
+
+    std::array<VerifyBit, kVerifyBits> bits;
+    // Darkest white bit minus brightest black bit when recorded.  A hit needs
+    // at least a quarter of it, so lighting can change a bit.
+    double contrast;
+  };
+
+  // What happened to one quad this frame.
+  struct Slot {
+    bool looked_up = false;
+    bool hit = false;
+    bool empty_hit = false;
+    bool verify_failed = false;
+    bool recorded = false;
+    Entry entry;
+  };
+
+  // Returns true if every corner is within tolerance of the entry.
+  bool Matches(const Entry &entry, const QuadCorners &corners) const;
+
+  const size_t max_entries_;
+  const double tolerance_;
+  const bool remember_failures_;
+
+  // Last frame's entries.  Only read between StartFrame and FinishFrame.
+  std::vector<Entry> entries_;
+  // One per quad this frame.
+  std::vector<Slot> slots_;
+
+  Stats stats_;
+};
+
+}  // namespace frc971::apriltag
+
+#endif  // FRC971_ORIN_DECODE_CACHE_H_
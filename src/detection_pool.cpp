@@ -0,0 +1,90 @@
+#include "detection_pool.h"
+
+#include <algorithm>
+#include <cstdlib>
+
+#include "common/matd.h"
+#include "common/zarray.h"
+#include "glog/logging.h"
+
+namespace frc971::apriltag {
+
+DetectionPool::DetectionPool(size_t capacity) : capacity_(capacity) {
+  free_.reserve(capacity);
+}
+
+DetectionPool::~DetectionPool() {
+  Settle();
+  for (apriltag_detection_t *det : free_) {
+    apriltag_detection_destroy(det);
+  }
+}
+
+apriltag_detection_t *DetectionPool::Acquire() {
+  const size_t taken = taken_.fetch_add(1, std::memory_order_relaxed);
+  if (taken < free_.size()) {
+    return free_[free_.size() - 1 - taken];
+  }
+
+  allocations_.fetch_add(1, std::memory_order_relaxed);
+  apriltag_detection_t *det = static_cast<apriltag_detection_t *>(
+      calloc(1, sizeof(apriltag_detection_t)));
+  det->H = matd_create(3, 3);
+  return det;
+}
+
+void DetectionPool::Recycle(apriltag_detection_t *det) {
+  DCHECK_EQ(taken_.load(std::memory_order_relaxed), 0u)
+      << ": Settle before recycling";
+  if (free_.size() >= capacity_ || det->H == nullptr || det->H->nrows != 3 ||
+      det->H->ncols != 3) {
+    apriltag_detection_destroy(det);
+    return;
+  }
+  free_.push_back(det);
+}
+
+void DetectionPool::Settle() {
+  const size_t taken =
+      std::min(taken_.exchange(0, std::memory_order_relaxed), free_.size());
+  free_.resize(free_.size() - taken);
+}
+
+DetectionCopies::DetectionCopies()
+    : detections_(zarray_create(sizeof(apriltag_detection_t *))) {}
+
+void DetectionCopies::CopyFrom(const zarray_t *detections) {
+  Clear();
+  const int size = zarray_size(detections);
+  while (storage_.size() < static_cast<size_t>(size)) {
+    apriltag_detection_t *det = static_cast<apriltag_detection_t *>(
+        calloc(1, sizeof(apriltag_detection_t)));
+    det->H = matd_create(3, 3);
+    storage_.emplace_back(det);
+  }
+  for (int i = 0; i < size; ++i) {
+    apriltag_detection_t *source;
+    zarray_get(detections, i, &source);
+    CHECK(source->H != nullptr && source->H->nrows == 3 &&
+          source->H->ncols == 3);
+    apriltag_detection_t *copy = storage_[i].get();
+    matd_t *H = copy->H;
+    *copy = *source;
+    copy->H = H;
+    std::copy(source->H->data, source->H->data + 9, H->data);
+    zarray_add(detections_.get(), &copy);
+  }
+}
+
+void DetectionCopies::Clear() { zarray_truncate(detections_.get(), 0); }
+
+void DetectionCopies::DestroyDetection::operator()(
+    apriltag_detection_t *det) const {
+  apriltag_detection_destroy(det);
+}
+
+void DetectionCopies::DestroyZarray::operator()(zarray_t *detections) const {
+  zarray_destroy(detections);
+}
+
+}  // namespace frc971::apriltag
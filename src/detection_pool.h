@@ -0,0 +1,98 @@
+#ifndef FRC971_ORIN_DETECTION_POOL_H_
+#define FRC971_ORIN_DETECTION_POOL_H_
+
+#include <stddef.h>
+
+#include <atomic>
+#include <memory>
+#include <vector>
+
+#include "apriltag.h"
+
+namespace frc971::apriltag {
+
+// Free list of apriltag_detection_t, so detections and their homographies can
+// be reused across frames instead of going back to the heap.  Detections are
+// allocated the same way libapriltag allocates them, so anything in the pool
+// can still be freed with apriltag_detection_destroy and the detections
+// quad_decode_index returns can be recycled into it.  quad_decode_index
+// allocates its own detections, so only detections built without it, like
+// DecodeCache hits, come out of the pool.
+//
+// Acquire can be called from several threads at once.  Recycle and Settle
+// can't run at the same time as anything else.
+class DetectionPool {
+ public:
+  // Keeps at most capacity free detections around.
+  explicit DetectionPool(size_t capacity);
+  ~DetectionPool();
+
+  DetectionPool(const DetectionPool &) = delete;
+  DetectionPool &operator=(const DetectionPool &) = delete;
+
+  // Returns a detection with a 3x3 H.  Everything else is left over from its
+  // last use.  Only allocates once the free list runs out.
+  apriltag_detection_t *Acquire();
+
+  // Takes back a detection which is no longer used.
+  void Recycle(apriltag_detection_t *det);
+
+  // Drops the detections handed out by Acquire since the last Settle from the
+  // free list.  Must be called before the next Recycle.
+  void Settle();
+
+  // Number of detections allocated since the pool was created.
+  size_t allocations() const {
+    return allocations_.load(std::memory_order_relaxed);
+  }
+
+  // Number of free detections.
+  size_t free() const { return free_.size(); }
+
+ private:
+  const size_t capacity_;
+
+  std::vector<apriltag_detection_t *> free_;
+  // Number of detections taken off the back of free_ since the last Settle.
+  std::atomic<size_t> taken_{0};
+
+  std::atomic<size_t> allocations_{0};
+};
+
+// Copies of a frame's detections, homographies included, which stay valid
+// after the detector has recycled its own.  The copies are reused from one
+// frame to the next, so once a frame has had as many detections as the most
+// so far, copying doesn't allocate.  Can be moved between threads along with
+// the frame it belongs to.
+class DetectionCopies {
+ public:
+  DetectionCopies();
+
+  // Replaces the copies with copies of detections.
+  void CopyFrom(const zarray_t *detections);
+
+  // Drops the copies, keeping their memory for the next CopyFrom.
+  void Clear();
+
+  const zarray_t *detections() const { return detections_.get(); }
+
+  // Number of detections allocated since this was created.
+  size_t allocations() const { return storage_.size(); }
+
+ private:
+  struct DestroyDetection {
+    void operator()(apriltag_detection_t *det) const;
+  };
+  struct DestroyZarray {
+    void operator()(zarray_t *detections) const;
+  };
+
+  std::vector<std::unique_ptr<apriltag_detection_t, DestroyDetection>>
+      storage_;
+  // Points into storage_.
+  std::unique_ptr<zarray_t, DestroyZarray> detections_;
+};
+
+}  // namespace frc971::apriltag
+
+#endif  // FRC971_ORIN_DETECTION_POOL_H_
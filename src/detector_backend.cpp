@@ -0,0 +1,349 @@
+#include "detector_backend.h"
+
+#include <algorithm>
+#include <chrono>
+#include <utility>
+
+#include "apriltag_cpu.h"
+#include "decode_cache.h"
+#include "edge_refiner.h"
+#include "g2d.h"
+#include "glog/logging.h"
+#include "parallel_for.h"
+#include "undistort_map.h"
+#include "work_stealing_pool.h"
+
+namespace frc971::apriltag {
+namespace {
+
+static_assert(IndexPoint::kMaxBlobs <= (1u << LineFitPoint::kBlobIndexBits),
+              "LineFitPoint can't hold every blob index");
+
+// Returns the integer decimation factor requested by the detector options.
+size_t DecimationFactor(const apriltag_detector_t *tag_detector) {
+  const float quad_decimate = tag_detector->quad_decimate;
+  CHECK(quad_decimate >= 1 && quad_decimate <= kMaxDecimation &&
+        quad_decimate == static_cast<size_t>(quad_decimate))
+      << ": quad_decimate must be an integer from 1 to " << kMaxDecimation
+      << ", got " << quad_decimate;
+  return static_cast<size_t>(quad_decimate);
+}
+
+}  // namespace
+
+DetectorBackend::DetectorBackend(size_t width, size_t height,
+                                 apriltag_detector_t *tag_detector,
+                                 CameraMatrix camera_matrix,
+                                 DistCoeffs distortion_coefficients)
+    : width_(width),
+      height_(height),
+      decimation_(DecimationFactor(tag_detector)),
+      decimated_width_(DecimatedSize(width, decimation_)),
+      decimated_height_(DecimatedSize(height, decimation_)),
+      compact_points_(
+          CompactQuadBoundaryPoint::Fits(decimated_width_, decimated_height_)),
+      tag_detector_(tag_detector),
+      camera_matrix_(camera_matrix),
+      distortion_coefficients_(distortion_coefficients),
+      edge_refiner_(std::make_unique<EdgeRefiner>()) {
+  // BlobDiff needs a 1 pixel border around the blobs.
+  CHECK_GE(decimated_width_, 4u);
+  CHECK_GE(decimated_height_, 4u);
+  // Wide points pack the decimated coordinates into 14 bits each.  The blob
+  // ids are sized to fit.  Frames small enough for compact points use those.
+  CHECK_LE(decimated_width_, QuadBoundaryPoint::kMaxCoordinate)
+      << ": Image too wide for decimation " << decimation_;
+  CHECK_LE(decimated_height_, QuadBoundaryPoint::kMaxCoordinate)
+      << ": Image too tall for decimation " << decimation_;
+  // LineFitPoint packs the moments of each blob into fixed width fields.  Blobs
+  // have at most 2 * (width + height) points (see GpuDetector::FindQuads), and
+  // the doubled coordinates go up to 2 * size + 1.
+  CHECK(LineFitPoint::Fits(
+      2 * (width_ + height_),
+      2 * std::max(decimated_width_, decimated_height_) + 1))
+      << ": Image too large for decimation " << decimation_
+      << " to line fit without overflow";
+
+  fit_quads_host_.reserve(kMaxBlobs);
+  quad_corners_host_.reserve(kMaxBlobs);
+
+  for (int i = 0; i < zarray_size(tag_detector_->tag_families); i++) {
+    apriltag_family_t *family;
+    zarray_get(tag_detector_->tag_families, i, &family);
+    if (family->width_at_border < min_tag_width_) {
+      min_tag_width_ = family->width_at_border;
+    }
+    normal_border_ |= !family->reversed_border;
+    reversed_border_ |= family->reversed_border;
+  }
+  min_tag_width_ /= tag_detector_->quad_decimate;
+  if (min_tag_width_ < 3) {
+    min_tag_width_ = 3;
+  }
+
+  poly0_ = g2d_polygon_create_zeros(4);
+  poly1_ = g2d_polygon_create_zeros(4);
+
+  detections_ = zarray_create(sizeof(apriltag_detection_t *));
+  zarray_ensure_capacity(detections_, kMaxBlobs);
+  for (Slot &slot : slots_) {
+    slot.fit_quads.reserve(kMaxBlobs);
+    slot.detections = zarray_create(sizeof(apriltag_detection_t *));
+    zarray_ensure_capacity(slot.detections, kMaxBlobs);
+  }
+}
+
+DetectorBackend::~DetectorBackend() {
+  StopDecodeThread();
+
+  auto destroy_detections = [](zarray_t *detections) {
+    for (int i = 0; i < zarray_size(detections); ++i) {
+      apriltag_detection_t *det;
+      zarray_get(detections, i, &det);
+      apriltag_detection_destroy(det);
+    }
+  };
+  destroy_detections(detections_);
+  for (Slot &slot : slots_) {
+    destroy_detections(slot.detections);
+    zarray_destroy(slot.detections);
+  }
+
+  for (DecodeOutput &output : decode_outputs_) {
+    zarray_destroy(output.scratch);
+  }
+
+  zarray_destroy(detections_);
+  zarray_destroy(poly1_);
+  zarray_destroy(poly0_);
+}
+
+void DetectorBackend::SetDecodePool(
+    std::shared_ptr<WorkStealingPool> decode_pool) {
+  CHECK(decode_pool);
+  decode_pool_ = std::move(decode_pool);
+  ResizeDecodeOutputs();
+}
+
+void DetectorBackend::SetDecodeCache(size_t max_entries, double tolerance,
+                                     bool remember_failures) {
+  if (max_entries == 0) {
+    decode_cache_.reset();
+    return;
+  }
+  decode_cache_ = std::make_unique<DecodeCache>(max_entries, tolerance,
+                                                remember_failures);
+}
+
+void DetectorBackend::ResizeDecodeOutputs() {
+  for (DecodeOutput &output : decode_outputs_) {
+    zarray_destroy(output.scratch);
+  }
+  decode_outputs_.clear();
+  decode_outputs_.resize(decode_pool_->threads());
+  for (DecodeOutput &output : decode_outputs_) {
+    output.scratch = zarray_create(sizeof(apriltag_detection_t *));
+    output.detections.reserve(kMaxBlobs);
+  }
+  merged_detections_.reserve(kMaxBlobs);
+  merged_scratch_.reserve(kMaxBlobs);
+}
+
+void DetectorBackend::SetUndistortMapStep(size_t step) {
+  undistort_map_step_ = step;
+  RebuildUndistortMap();
+}
+
+void DetectorBackend::RebuildUndistortMap() {
+  if (undistort_map_step_ == 0) {
+    undistort_map_.reset();
+    return;
+  }
+  undistort_map_ = std::make_unique<UndistortMap>(
+      width_, height_, camera_matrix_, distortion_coefficients_,
+      undistort_map_step_);
+  LOG(INFO) << "Undistortion map with " << undistort_map_step_
+            << " px steps, " << undistort_map_->MeasureAccuracy().ToString();
+}
+
+void DetectorBackend::Detect(const uint8_t *image, ImageFormat format) {
+  CHECK_EQ(in_flight(), 0u) << ": Poll every submitted frame before Detect";
+  CheckImageFormat(format);
+  DecodeFrame(FindQuads(image, format, 0, &fit_quads_host_));
+}
+
+void DetectorBackend::CheckImageFormat(ImageFormat format) const {
+  const size_t row_bytes = width_ * BytesPerPixel(format.pixel_format);
+  CHECK_GE(RowStride(format, width_), row_bytes)
+      << ": Rows " << format.stride << " bytes apart overlap, a " << width_
+      << " pixel row takes " << row_bytes << " bytes";
+}
+
+void DetectorBackend::Submit(const uint8_t *image, ImageFormat format) {
+  CHECK(CanSubmit()) << ": Only " << kSlots << " frames can be in flight";
+  CheckImageFormat(format);
+  if (!decode_thread_.joinable()) {
+    decode_thread_ = std::thread([this]() { DecodeThreadMain(); });
+  }
+
+  // The slot's last frame has been polled, so the decode thread is done with
+  // it.
+  const size_t slot_index = submitted_ % kSlots;
+  Slot &slot = slots_[slot_index];
+  slot.gray_image = FindQuads(image, format, slot_index, &slot.fit_quads);
+  {
+    std::lock_guard<std::mutex> lock(decode_mutex_);
+    ++submitted_;
+  }
+  decode_condition_.notify_all();
+}
+
+const zarray_t *DetectorBackend::Poll(bool wait) {
+  if (in_flight() == 0) {
+    return nullptr;
+  }
+  {
+    std::unique_lock<std::mutex> lock(decode_mutex_);
+    if (wait) {
+      decode_condition_.wait(lock, [this]() { return decoded_ > polled_; });
+    } else if (decoded_ == polled_) {
+      return nullptr;
+    }
+  }
+  return slots_[polled_++ % kSlots].detections;
+}
+
+void DetectorBackend::StopDecodeThread() {
+  if (!decode_thread_.joinable()) {
+    return;
+  }
+  {
+    std::lock_guard<std::mutex> lock(decode_mutex_);
+    quit_decode_thread_ = true;
+  }
+  decode_condition_.notify_all();
+  decode_thread_.join();
+}
+
+void DetectorBackend::DecodeFrame(uint8_t *gray_image) {
+  const std::chrono::steady_clock::time_point start =
+      std::chrono::steady_clock::now();
+  if (decode_pool_ == nullptr) {
+    // Made on first use, so detectors handed a shared pool never start
+    // threads of their own.
+    SetDecodePool(
+        std::make_shared<WorkStealingPool>(WorkerCount(tag_detector_->wp)));
+  }
+  UpdateFitQuads();
+  AdjustPixelCenters();
+  DecodeTags(gray_image);
+  VLOG(1) << "    Decode "
+          << std::chrono::duration<float, std::milli>(
+                 std::chrono::steady_clock::now() - start)
+                 .count()
+          << "ms";
+}
+
+void DetectorBackend::DecodeThreadMain() {
+  std::unique_lock<std::mutex> lock(decode_mutex_);
+  while (true) {
+    decode_condition_.wait(lock, [this]() {
+      return quit_decode_thread_ || decoded_ < submitted_;
+    });
+    if (quit_decode_thread_) {
+      return;
+    }
+    Slot &slot = slots_[decoded_ % kSlots];
+    lock.unlock();
+
+    // Decode straight into the slot, so the detections of the frame before
+    // stay put until it is polled.  DecodeTags recycles whatever the slot
+    // held from kSlots frames ago.
+    std::swap(fit_quads_host_, slot.fit_quads);
+    std::swap(detections_, slot.detections);
+    DecodeFrame(slot.gray_image);
+    std::swap(detections_, slot.detections);
+    std::swap(fit_quads_host_, slot.fit_quads);
+
+    lock.lock();
+    ++decoded_;
+    decode_condition_.notify_all();
+  }
+}
+
+void DetectorBackend::ReinitializeDetections() { RecycleDetections(); }
+
+void DetectorBackend::RecycleDetections() {
+  for (int i = 0; i < zarray_size(detections_); ++i) {
+    apriltag_detection_t *det;
+    zarray_get(detections_, i, &det);
+    detection_pool_.Recycle(det);
+  }
+  zarray_truncate(detections_, 0);
+}
+
+bool BackendAvailable(DetectorBackendType type) {
+  switch (type) {
+    case DetectorBackendType::kCuda:
+#ifdef FRC971_APRILTAG_CUDA
+      return true;
+#else
+      return false;
+#endif
+    case DetectorBackendType::kCpu:
+      return true;
+  }
+  return false;
+}
+
+bool ParseBackendType(std::string_view name, DetectorBackendType *type) {
+  if (name == "cuda") {
+    *type = DetectorBackendType::kCuda;
+    return true;
+  } else if (name == "cpu") {
+    *type = DetectorBackendType::kCpu;
+    return true;
+  }
+  return false;
+}
+
+bool ParsePixelFormat(std::string_view name, PixelFormat *pixel_format) {
+  if (name == "gray8") {
+    *pixel_format = PixelFormat::kGray8;
+  } else if (name == "yuyv") {
+    *pixel_format = PixelFormat::kYuyv;
+  } else if (name == "uyvy") {
+    *pixel_format = PixelFormat::kUyvy;
+  } else if (name == "nv12") {
+    *pixel_format = PixelFormat::kNv12;
+  } else if (name == "bgr24") {
+    *pixel_format = PixelFormat::kBgr24;
+  } else {
+    return false;
+  }
+  return true;
+}
+
+std::unique_ptr<DetectorBackend> MakeDetector(
+    DetectorBackendType type, size_t width, size_t height,
+    apriltag_detector_t *tag_detector, CameraMatrix camera_matrix,
+    DistCoeffs distortion_coefficients) {
+  CHECK(BackendAvailable(type))
+      << ": Requested a backend which wasn't compiled in, rebuild with CUDA.";
+  switch (type) {
+    case DetectorBackendType::kCuda:
+#ifdef FRC971_APRILTAG_CUDA
+      return MakeGpuDetector(width, height, tag_detector, camera_matrix,
+                             distortion_coefficients);
+#else
+      break;
+#endif
+    case DetectorBackendType::kCpu:
+      return std::make_unique<CpuDetector>(width, height, tag_detector,
+                                           camera_matrix,
+                                           distortion_coefficients);
+  }
+  LOG(FATAL) << "Unknown backend " << static_cast<int>(type);
+}
+
+}  // namespace frc971::apriltag
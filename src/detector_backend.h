@@ -0,0 +1,354 @@
+#ifndef FRC971_ORIN_DETECTOR_BACKEND_H_
+#define FRC971_ORIN_DETECTOR_BACKEND_H_
+
+#include <stdint.h>
+
+#include <array>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <string_view>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "apriltag.h"
+#include "decimation.h"
+#include "detection_pool.h"
+#include "line_fit_filter.h"
+#include "pixel_format.h"
+#include "points.h"
+
+namespace frc971::apriltag {
+
+class DecodeCache;
+class EdgeRefiner;
+class UndistortMap;
+class WorkStealingPool;
+
+struct QuadCorners {
+  float corners[4][2];
+  bool reversed_border;
+  uint32_t blob_index;
+};
+
+struct CameraMatrix {
+  double fx;
+  double cx;
+  double fy;
+  double cy;
+};
+
+struct DistCoeffs {
+  double k1;
+  double k2;
+  double p1;
+  double p2;
+  double k3;
+};
+
+// Base class for an april tag detector.  A backend implements the image
+// processing half of the pipeline (threshold, union find, blob extraction, line
+// and quad fitting) and fills out fit_quads_host_.  The host half (quad
+// filtering, edge refinement and decoding) is shared by every backend and lives
+// here so all backends return the same FitQuads() and Detections().
+class DetectorBackend {
+ public:
+  // The number of blobs we will consider when counting april tags.
+  static constexpr size_t kMaxBlobs = IndexPoint::kMaxBlobs;
+
+  // Frames which can be in flight between Submit and Poll.
+  static constexpr size_t kSlots = 2;
+
+  // Constructs a detector, reserving space for detecting tags of the provided
+  // with and height, using the provided detector options.
+  // tag_detector->quad_decimate must be 1, 2, 3 or 4.
+  DetectorBackend(size_t width, size_t height,
+                  apriltag_detector_t *tag_detector, CameraMatrix camera_matrix,
+                  DistCoeffs distortion_coefficients);
+  virtual ~DetectorBackend();
+
+  DetectorBackend(const DetectorBackend &) = delete;
+  DetectorBackend &operator=(const DetectorBackend &) = delete;
+
+  // Detects april tags in the provided image.  Luma is read straight out of
+  // the image in the first stage, so no conversion is needed beforehand.  Rows
+  // may be padded to any stride at least as wide as the row.
+  void Detect(const uint8_t *image, ImageFormat format);
+
+  // Detects april tags in the provided packed YUYV image.
+  void Detect(const uint8_t *image) { Detect(image, ImageFormat{}); }
+
+  // Starts detecting april tags in the provided image, and returns as soon as
+  // the quads have been found, so the next frame's quads can be found while
+  // this one is decoded on a thread of the detector's own.  The image isn't
+  // read after Submit returns.  At most kSlots frames can be in flight, so
+  // Poll before submitting another one once CanSubmit returns false.  Don't
+  // change settings or call Detect while frames are in flight.
+  void Submit(const uint8_t *image, ImageFormat format);
+
+  // Submits the provided packed YUYV image.
+  void Submit(const uint8_t *image) { Submit(image, ImageFormat{}); }
+
+  // Returns true if another frame can be submitted without polling first.
+  bool CanSubmit() const { return submitted_ - polled_ < kSlots; }
+
+  // Returns the number of frames submitted and not polled yet.
+  size_t in_flight() const { return submitted_ - polled_; }
+
+  // Returns the detections of the oldest submitted frame which hasn't been
+  // polled, so frames come back in the order they were submitted.  Returns
+  // nullptr if nothing is in flight, or if wait is false and the frame is
+  // still being decoded.  The detections belong to the detector and stay
+  // valid until the next Submit.
+  const zarray_t *Poll(bool wait);
+
+  // Returns the quads from the last Detect.  Not for use with Submit, which
+  // fits quads on another thread.
+  const std::vector<QuadCorners> &FitQuads() const;
+
+  // Returns the detections from the last Detect.  They belong to the detector
+  // and are reused by the next Detect.
+  const zarray_t *Detections() const { return detections_; }
+
+  // Hands the detections from Detect back to the detector early.
+  void ReinitializeDetections();
+
+  // Debug methods to expose internal state for testing.
+  virtual void CopyGrayTo(uint8_t *output) const = 0;
+  virtual void CopyDecimatedTo(uint8_t *output) const = 0;
+  virtual void CopyThresholdedTo(uint8_t *output) const = 0;
+  virtual void CopyUnionMarkersTo(uint32_t *output) const = 0;
+  virtual void CopyUnionMarkersSizeTo(uint32_t *output) const = 0;
+
+  void AdjustCenter(float corners[4][2]) const;
+
+  // TODO(max): We probably don't want to use these after our test images are
+  // just orin images
+  void SetCameraMatrix(CameraMatrix camera_matrix) {
+    camera_matrix_ = camera_matrix;
+    RebuildUndistortMap();
+  }
+
+  void SetDistortionCoefficients(DistCoeffs distortion_coefficients) {
+    distortion_coefficients_ = distortion_coefficients;
+    RebuildUndistortMap();
+  }
+
+  // Undistort pixels based on our camera model, using iterative algorithm
+  // Returns false if we fail to converge
+  static bool UnDistort(double *u, double *v, const CameraMatrix *camera_matrix,
+                        const DistCoeffs *distortion_coefficients);
+
+  // Undistorts edge refinement samples with a lookup table with nodes step
+  // pixels apart instead of the iterative solver, and logs how far the table
+  // is from the solver.  step 0 goes back to the solver.
+  void SetUndistortMapStep(size_t step);
+
+  // Returns the lookup table, or nullptr when using the solver.
+  const UndistortMap *undistort_map() const { return undistort_map_.get(); }
+
+  // Decodes quads on the provided pool instead of the one the detector
+  // creates for itself, so several detectors can share threads.  Call before
+  // the first frame, or the detector will have started its own.
+  void SetDecodePool(std::shared_ptr<WorkStealingPool> decode_pool);
+
+  // Returns the pool quads are decoded on, or nullptr until the first frame
+  // if none was provided.
+  const WorkStealingPool *decode_pool() const { return decode_pool_.get(); }
+
+  // Reuses last frame's decode for quads whose corners moved less than
+  // tolerance pixels, remembering up to max_entries tags.  max_entries 0 turns
+  // the cache off, which is the default.  remember_failures also skips quads
+  // which didn't decode while they look the same, see DecodeCache.
+  void SetDecodeCache(size_t max_entries, double tolerance,
+                      bool remember_failures = false);
+
+  // Returns the decode cache, or nullptr when it is off.
+  const DecodeCache *decode_cache() const { return decode_cache_.get(); }
+
+  // Returns the pool detections are recycled through.
+  const DetectionPool &detection_pool() const { return detection_pool_; }
+
+  size_t width() const { return width_; }
+  size_t height() const { return height_; }
+
+  // Returns the decimation factor and the size of the decimated image the
+  // quads are found in.
+  size_t decimation() const { return decimation_; }
+  size_t decimated_width() const { return decimated_width_; }
+  size_t decimated_height() const { return decimated_height_; }
+
+  // Returns true if the quads are found with 64 bit compact points, rather
+  // than 128 bit wide ones.  See points.h.
+  bool compact_points() const { return compact_points_; }
+
+ protected:
+  // Runs the image processing half of the pipeline on image, filling out
+  // fit_quads.  Returns the full resolution gray image to decode them against,
+  // which must stay untouched until FindQuads is next called with the same
+  // slot.  slot is below kSlots.
+  virtual uint8_t *FindQuads(const uint8_t *image, ImageFormat format,
+                             size_t slot, std::vector<FitQuad> *fit_quads) = 0;
+
+  // Stops the decode thread Submit starts.  Backends call this first thing in
+  // their destructors, since the thread reads the gray images they own.
+  void StopDecodeThread();
+
+  // Converts fit_quads_host_ into quad_corners_host_, rejecting quads which
+  // are too small or have bad angles.
+  void UpdateFitQuads();
+
+  // Moves the quad corners from decimated to full resolution pixel space.
+  void AdjustPixelCenters();
+
+  // Decodes quad_corners_host_ against the full resolution gray image into
+  // detections_.
+  void DecodeTags(uint8_t *gray_image);
+
+  // Fits the refined edges of quad_corners_host_[quad_index] and decodes it,
+  // adding what it finds to detections.
+  void DecodeQuad(size_t quad_index, image_u8_t *im, zarray_t *detections);
+
+  // Moves every detection back into detection_pool_.
+  void RecycleDetections();
+
+  // Like libapriltag's reconcile_detections, drops detections which overlap
+  // another detection of the same tag and keeps the best one.  The dropped
+  // ones go back into detection_pool_ instead of being freed.
+  void ReconcileDetections();
+
+  // Dies if rows of the image would overlap.
+  void CheckImageFormat(ImageFormat format) const;
+
+  // Makes one DecodeOutput per decode_pool_ worker.
+  void ResizeDecodeOutputs();
+
+  // Filters, refines and decodes fit_quads_host_ into detections_.
+  void DecodeFrame(uint8_t *gray_image);
+
+  // Decodes submitted frames in order until StopDecodeThread.
+  void DecodeThreadMain();
+
+  // Rebuilds undistort_map_ for the current camera model.
+  void RebuildUndistortMap();
+
+  // Size of the image.
+  const size_t width_;
+  const size_t height_;
+
+  // Decimation factor, and the size of the decimated image.
+  const size_t decimation_;
+  const size_t decimated_width_;
+  const size_t decimated_height_;
+  // True if every boundary point of the decimated image fits in a
+  // CompactQuadBoundaryPoint.
+  const bool compact_points_;
+
+  // Detector parameters.
+  apriltag_detector_t *tag_detector_;
+
+  CameraMatrix camera_matrix_;
+  DistCoeffs distortion_coefficients_;
+
+  // Refines the edges of every quad in a frame in one batch.
+  std::unique_ptr<EdgeRefiner> edge_refiner_;
+
+  // Spacing of the undistortion lookup table nodes, 0 when it is disabled.
+  size_t undistort_map_step_ = 0;
+  std::unique_ptr<UndistortMap> undistort_map_;
+
+  std::vector<FitQuad> fit_quads_host_;
+  std::vector<QuadCorners> quad_corners_host_;
+
+  // Cached quantities used for tag filtering.
+  bool normal_border_ = false;
+  bool reversed_border_ = false;
+  int min_tag_width_ = 1000000;
+
+ private:
+  // What one decode worker found.  Workers only touch their own, so nothing is
+  // locked while decoding.
+  struct DecodeOutput {
+    // quad_decode_index appends here, and the detections are then moved to
+    // detections tagged with the quad they came from.
+    zarray_t *scratch = nullptr;
+    std::vector<std::pair<size_t, apriltag_detection_t *>> detections;
+  };
+
+  // Threads the quads are decoded on, one task per quad.  Created on the
+  // first decode unless SetDecodePool provided one.
+  std::shared_ptr<WorkStealingPool> decode_pool_;
+  std::vector<DecodeOutput> decode_outputs_;
+  // Every worker's detections, sorted back into quad order.
+  std::vector<std::pair<size_t, apriltag_detection_t *>> merged_detections_;
+  std::vector<std::pair<size_t, apriltag_detection_t *>> merged_scratch_;
+
+  std::unique_ptr<DecodeCache> decode_cache_;
+
+  // Everything detected is recycled through here, so a static scene with the
+  // decode cache on and remembering failures doesn't allocate.  Only cache
+  // hits draw from it.  Every quad which goes through quad_decode_index, which
+  // is every quad without the cache, still allocates inside libapriltag.
+  DetectionPool detection_pool_{kMaxBlobs};
+
+  zarray_t *poly0_;
+  zarray_t *poly1_;
+
+  zarray_t *detections_ = nullptr;
+
+  // A frame between Submit and Poll.
+  struct Slot {
+    std::vector<FitQuad> fit_quads;
+    uint8_t *gray_image = nullptr;
+    zarray_t *detections = nullptr;
+  };
+  std::array<Slot, kSlots> slots_;
+
+  // Frames submitted, decoded and polled so far.  Frame n goes in slot
+  // n % kSlots.  submitted_ and polled_ are only written by the thread calling
+  // Submit and Poll, and decoded_ by the decode thread.
+  size_t submitted_ = 0;
+  size_t decoded_ = 0;
+  size_t polled_ = 0;
+
+  // Protects the counts for the decode thread, which is started by the first
+  // Submit.
+  std::mutex decode_mutex_;
+  std::condition_variable decode_condition_;
+  std::thread decode_thread_;
+  bool quit_decode_thread_ = false;
+};
+
+// The implementations of the image processing half of the pipeline.
+enum class DetectorBackendType {
+  // CUDA kernels, only available when built with a CUDA compiler.
+  kCuda,
+  // Multithreaded host implementation, runs on tag_detector->wp.
+  kCpu,
+};
+
+// Returns true if the provided backend was compiled in.
+bool BackendAvailable(DetectorBackendType type);
+
+// Parses "cuda" or "cpu" into a backend type.  Returns false if the name is
+// unknown.
+bool ParseBackendType(std::string_view name, DetectorBackendType *type);
+
+// Constructs a detector running on the requested backend.
+std::unique_ptr<DetectorBackend> MakeDetector(
+    DetectorBackendType type, size_t width, size_t height,
+    apriltag_detector_t *tag_detector, CameraMatrix camera_matrix,
+    DistCoeffs distortion_coefficients);
+
+#ifdef FRC971_APRILTAG_CUDA
+// Constructs a GpuDetector.  Defined in apriltag_gpu.cu so host only code can
+// create one without pulling in the CUDA headers.
+std::unique_ptr<DetectorBackend> MakeGpuDetector(
+    size_t width, size_t height, apriltag_detector_t *tag_detector,
+    CameraMatrix camera_matrix, DistCoeffs distortion_coefficients);
+#endif
+
+}  // namespace frc971::apriltag
+
+#endif  // FRC971_ORIN_DETECTOR_BACKEND_H_
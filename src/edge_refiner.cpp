@@ -0,0 +1,514 @@
+#include "edge_refiner.h"
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define FRC971_EDGE_REFINER_AVX2
+#elif defined(__aarch64__)
+#include <arm_neon.h>
+#define FRC971_EDGE_REFINER_NEON
+#endif
+
+#include "glog/logging.h"
+
+namespace frc971::apriltag {
+namespace {
+
+// Dewarps points from the image based on various constants
+// Algorithm mainly taken from
+// https://docs.opencv.org/4.0.0/d9/d0c/group__calib3d.html#ga7dfb72c9cf9780a347fbe3d1c47e5d5a
+void ReDistort(double *x, double *y, const CameraMatrix *camera_matrix,
+               const DistCoeffs *distortion_coefficients) {
+  double k1 = distortion_coefficients->k1;
+  double k2 = distortion_coefficients->k2;
+  double p1 = distortion_coefficients->p1;
+  double p2 = distortion_coefficients->p2;
+  double k3 = distortion_coefficients->k3;
+
+  double fx = camera_matrix->fx;
+  double cx = camera_matrix->cx;
+  double fy = camera_matrix->fy;
+  double cy = camera_matrix->cy;
+
+  double xP = (*x - cx) / fx;
+  double yP = (*y - cy) / fy;
+
+  double rSq = xP * xP + yP * yP;
+
+  double linCoef = 1 + k1 * rSq + k2 * rSq * rSq + k3 * rSq * rSq * rSq;
+  double xPP = xP * linCoef + 2 * p1 * xP * yP + p2 * (rSq + 2 * xP * xP);
+  double yPP = yP * linCoef + p1 * (rSq + 2 * yP * yP) + 2 * p2 * xP * yP;
+
+  *x = xPP * fx + cx;
+  *y = yPP * fy + cy;
+}
+
+// Undistorts the n points (x[i], y[i]) in place.
+void UndistortSamples(double *x, double *y, size_t n,
+                      const CameraMatrix *camera_matrix,
+                      const DistCoeffs *distortion_coefficients,
+                      const UndistortMap *undistort_map) {
+  if (undistort_map != nullptr) {
+    undistort_map->Undistort(x, y, n);
+  } else {
+    for (size_t i = 0; i < n; ++i) {
+      DetectorBackend::UnDistort(&x[i], &y[i], camera_matrix,
+                                 distortion_coefficients);
+    }
+  }
+}
+
+// Computes the normal of the edge of quad from corner a to corner b, pointing
+// out of the tag, and the number of samples to take along it.
+void EdgeNormal(const struct quad &quad, int a, int b, float *nx, float *ny,
+                int *nsamples) {
+  // compute the normal to the current line estimate
+  *nx = quad.p[b][1] - quad.p[a][1];
+  *ny = -quad.p[b][0] + quad.p[a][0];
+  float mag = sqrtf(*nx * *nx + *ny * *ny);
+  *nx /= mag;
+  *ny /= mag;
+
+  if (quad.reversed_border) {
+    *nx = -*nx;
+    *ny = -*ny;
+  }
+
+  // we will now fit a NEW line by sampling points near
+  // our original line that have large gradients. On really big tags,
+  // we're willing to sample more to get an even better estimate.
+  *nsamples = std::max<int>(16, mag / 8);  // XXX tunable
+}
+
+// Computes sample point s of nsamples along the edge from corner a to corner
+// b.  Note, we're avoiding sampling *right* at the corners, since those
+// points are the least reliable.
+void EdgeSample(const struct quad &quad, int a, int b, int s, int nsamples,
+                double *x0, double *y0) {
+  double alpha = (1.0 + s) / (nsamples + 1);
+  *x0 = alpha * quad.p[a][0] + (1 - alpha) * quad.p[b][0];
+  *y0 = alpha * quad.p[a][1] + (1 - alpha) * quad.p[b][1];
+}
+
+// Fits a line through each edge's undistorted samples, and moves the corners
+// of quad to where the lines intersect.  The samples for edge i are
+// [begin[i], end[i]).
+void FitCorners(const double *sample_x, const double *sample_y,
+                const size_t begin[4], const size_t end[4], struct quad *quad,
+                const CameraMatrix *camera_matrix,
+                const DistCoeffs *distortion_coefficients) {
+  double lines[4][4];  // for each line, [Ex Ey nx ny]
+
+  for (int edge = 0; edge < 4; edge++) {
+    // stats for fitting a line...
+    double Mx = 0, My = 0, Mxx = 0, Mxy = 0, Myy = 0, N = 0;
+
+    for (size_t i = begin[edge]; i < end[edge]; ++i) {
+      double bestx = sample_x[i];
+      double besty = sample_y[i];
+
+      // update our line fit statistics
+      Mx += bestx;
+      My += besty;
+      Mxx += bestx * bestx;
+      Mxy += bestx * besty;
+      Myy += besty * besty;
+      N++;
+    }
+
+    // fit a line
+    double Ex = Mx / N, Ey = My / N;
+    double Cxx = Mxx / N - Ex * Ex;
+    double Cxy = Mxy / N - Ex * Ey;
+    double Cyy = Myy / N - Ey * Ey;
+
+    // TODO: Can replace this with same code as in fit_line.
+    double normal_theta = .5 * atan2f(-2 * Cxy, (Cyy - Cxx));
+    float nx = cosf(normal_theta);
+    float ny = sinf(normal_theta);
+    lines[edge][0] = Ex;
+    lines[edge][1] = Ey;
+    lines[edge][2] = nx;
+    lines[edge][3] = ny;
+  }
+
+  // now refit the corners of the quad
+  for (int i = 0; i < 4; i++) {
+    // solve for the intersection of lines (i) and (i+1)&3.
+    double A00 = lines[i][3], A01 = -lines[(i + 1) & 3][3];
+    double A10 = -lines[i][2], A11 = lines[(i + 1) & 3][2];
+    double B0 = -lines[i][0] + lines[(i + 1) & 3][0];
+    double B1 = -lines[i][1] + lines[(i + 1) & 3][1];
+
+    double det = A00 * A11 - A10 * A01;
+
+    // inverse.
+    if (fabs(det) > 0.001) {
+      // solve
+      double W00 = A11 / det, W01 = -A01 / det;
+
+      double L0 = W00 * B0 + W01 * B1;
+
+      // Compute intersection. Note that line i represents the line from corner
+      // i to (i+1)&3, so the intersection of line i with line (i+1)&3
+      // represents corner (i+1)&3.
+      double px = lines[i][0] + L0 * A00;
+      double py = lines[i][1] + L0 * A10;
+
+      ReDistort(&px, &py, camera_matrix, distortion_coefficients);
+      quad->p[(i + 1) & 3][0] = px;
+      quad->p[(i + 1) & 3][1] = py;
+    } else {
+      // this is a bad sign. We'll just keep the corner we had.
+      //            debug_print("bad det: %15f %15f %15f %15f %15f\n", A00, A11,
+      //            A10, A01, det);
+    }
+  }
+}
+
+}  // namespace
+
+// Mostly stolen from aprilrobotics, but modified to implement the dewarp.
+//
+// The samples for all 4 edges are found first and then undistorted in one
+// batch, so undistort_map (if not nullptr) can work on several at a time.
+void RefineEdges(double range, const image_u8_t *im_orig, struct quad *quad,
+                 const CameraMatrix *camera_matrix,
+                 const DistCoeffs *distortion_coefficients,
+                 const UndistortMap *undistort_map) {
+  // Sample points along all the edges.  The samples for edge i are
+  // [edge_begin[i], edge_begin[i + 1]).
+  std::vector<double> sample_x;
+  std::vector<double> sample_y;
+  size_t edge_begin[5];
+
+  for (int edge = 0; edge < 4; edge++) {
+    int a = edge, b = (edge + 1) & 3;  // indices of the end points.
+    edge_begin[edge] = sample_x.size();
+
+    float nx, ny;
+    int nsamples;
+    EdgeNormal(*quad, a, b, &nx, &ny, &nsamples);
+    sample_x.reserve(sample_x.size() + nsamples);
+    sample_y.reserve(sample_y.size() + nsamples);
+
+    for (int s = 0; s < nsamples; s++) {
+      double x0, y0;
+      EdgeSample(*quad, a, b, s, nsamples, &x0, &y0);
+
+      // search along the normal to this line, looking at the
+      // gradients along the way. We're looking for a strong
+      // response.
+      double Mn = 0;
+      double Mcount = 0;
+
+      // XXX tunable step size.
+      for (double n = -range; n <= range; n += 0.25) {
+        // Because of the guaranteed winding order of the
+        // points in the quad, we will start inside the white
+        // portion of the quad and work our way outward.
+        //
+        // sample to points (x1,y1) and (x2,y2) XXX tunable:
+        // how far +/- to look? Small values compute the
+        // gradient more precisely, but are more sensitive to
+        // noise.
+        double grange = 1;
+        int x1 = x0 + (n + grange) * nx;
+        int y1 = y0 + (n + grange) * ny;
+        if (x1 < 0 || x1 >= im_orig->width || y1 < 0 || y1 >= im_orig->height)
+          continue;
+
+        int x2 = x0 + (n - grange) * nx;
+        int y2 = y0 + (n - grange) * ny;
+        if (x2 < 0 || x2 >= im_orig->width || y2 < 0 || y2 >= im_orig->height)
+          continue;
+
+        int g1 = im_orig->buf[y1 * im_orig->stride + x1];
+        int g2 = im_orig->buf[y2 * im_orig->stride + x2];
+
+        if (g1 < g2)  // reject points whose gradient is "backwards". They can
+                      // only hurt us.
+          continue;
+
+        double weight =
+            (g2 - g1) *
+            (g2 - g1);  // XXX tunable. What shape for weight=f(g2-g1)?
+
+        // compute weighted average of the gradient at this point.
+        Mn += weight * n;
+        Mcount += weight;
+      }
+
+      // what was the average point along the line?
+      if (Mcount == 0) continue;
+
+      double n0 = Mn / Mcount;
+
+      // where is the point along the line?
+      sample_x.push_back(x0 + n0 * nx);
+      sample_y.push_back(y0 + n0 * ny);
+    }
+  }
+  edge_begin[4] = sample_x.size();
+
+  UndistortSamples(sample_x.data(), sample_y.data(), sample_x.size(),
+                   camera_matrix, distortion_coefficients, undistort_map);
+  FitCorners(sample_x.data(), sample_y.data(), edge_begin, edge_begin + 1,
+             quad, camera_matrix, distortion_coefficients);
+}
+
+EdgeRefiner::EdgeRefiner() {
+#ifdef FRC971_EDGE_REFINER_AVX2
+  use_avx2_ = __builtin_cpu_supports("avx2");
+#endif
+}
+
+void EdgeRefiner::Start(double range) {
+  CHECK(range >= 0.0 && range <= kMaxRange) << ": Bad range " << range;
+  CHECK_EQ(range * 4, std::floor(range * 4))
+      << ": range must be a multiple of 0.25, got " << range;
+  range_ = range;
+  offsets_ = static_cast<size_t>(range * 8) + 1;
+  x0_.clear();
+  y0_.clear();
+  nx_.clear();
+  ny_.clear();
+  quads_.clear();
+}
+
+void EdgeRefiner::AddQuad(const struct quad &quad) {
+  std::array<size_t, 5> &edges = quads_.emplace_back();
+  for (int edge = 0; edge < 4; edge++) {
+    int a = edge, b = (edge + 1) & 3;
+    edges[edge] = x0_.size();
+
+    float nx, ny;
+    int nsamples;
+    EdgeNormal(quad, a, b, &nx, &ny, &nsamples);
+    for (int s = 0; s < nsamples; s++) {
+      double x0, y0;
+      EdgeSample(quad, a, b, s, nsamples, &x0, &y0);
+      x0_.push_back(x0);
+      y0_.push_back(y0);
+      nx_.push_back(nx);
+      ny_.push_back(ny);
+    }
+  }
+  edges[4] = x0_.size();
+  edge_x_.resize(x0_.size());
+  edge_y_.resize(x0_.size());
+}
+
+void EdgeRefiner::FindEdges(const image_u8_t *im, size_t begin, size_t end) {
+  CHECK_LE(end, sample_count());
+
+  // Step k of a profile is the pixel (k - 4) / 4 - range past the sample
+  // point along the normal, so the search offset n = i / 4 - range compares
+  // step i + 8 (1 pixel out) to step i (1 pixel in).
+  const size_t steps = offsets_ + 8;
+  const double width = im->width;
+  const double height = im->height;
+  alignas(32) int32_t profile[kMaxProfile * kLanes];
+  alignas(32) int32_t valid[kMaxProfile * kLanes];
+
+  for (size_t block = begin; block < end; block += kLanes) {
+    const size_t lanes = std::min(kLanes, end - block);
+    for (size_t lane = 0; lane < kLanes; ++lane) {
+      if (lane >= lanes) {
+        for (size_t k = 0; k < steps; ++k) {
+          valid[k * kLanes + lane] = 0;
+          profile[k * kLanes + lane] = 0;
+        }
+        continue;
+      }
+      const double x0 = x0_[block + lane];
+      const double y0 = y0_[block + lane];
+      const double nx = nx_[block + lane];
+      const double ny = ny_[block + lane];
+      for (size_t k = 0; k < steps; ++k) {
+        const double t = -range_ - 1 + 0.25 * k;
+        const double x = x0 + t * nx;
+        const double y = y0 + t * ny;
+        // Truncating towards zero puts (-1, 0) on pixel 0.  Written so NaN is
+        // off the image too.
+        const bool in_image =
+            x > -1.0 && x < width && y > -1.0 && y < height;
+        profile[k * kLanes + lane] =
+            in_image ? im->buf[static_cast<int>(y) * im->stride +
+                               static_cast<int>(x)]
+                     : 0;
+        valid[k * kLanes + lane] = in_image ? -1 : 0;
+      }
+    }
+
+#if defined(FRC971_EDGE_REFINER_AVX2)
+    if (use_avx2_) {
+      Avx2Score(profile, valid, block, lanes);
+      continue;
+    }
+#elif defined(FRC971_EDGE_REFINER_NEON)
+    NeonScore(profile, valid, block, lanes);
+    continue;
+#endif
+    ScoreScalar(profile, valid, block, lanes);
+  }
+}
+
+// The weights are whole numbers and the offsets multiples of 0.25, so the
+// weighted sum RefineEdges builds up one offset at a time is exactly
+// -range * sum(weight) + 0.25 * sum(weight * i).  Both sums fit in 32 bits
+// (255^2 * (8 * kMaxRange + 1)^2 < 2^31), so they are accumulated as integers
+// and the result is bit for bit the same.
+void EdgeRefiner::FinishSample(size_t sample, int32_t weight,
+                               int32_t weighted_step) {
+  // what was the average point along the line?
+  if (weight == 0) {
+    edge_x_[sample] = std::numeric_limits<double>::quiet_NaN();
+    edge_y_[sample] = std::numeric_limits<double>::quiet_NaN();
+    return;
+  }
+  const double Mcount = weight;
+  const double Mn = -range_ * Mcount + 0.25 * weighted_step;
+  const double n0 = Mn / Mcount;
+  edge_x_[sample] = x0_[sample] + n0 * nx_[sample];
+  edge_y_[sample] = y0_[sample] + n0 * ny_[sample];
+}
+
+void EdgeRefiner::ScoreScalar(const int32_t *profile, const int32_t *valid,
+                              size_t begin, size_t lanes) {
+  for (size_t lane = 0; lane < lanes; ++lane) {
+    int32_t weight = 0;
+    int32_t weighted_step = 0;
+    for (size_t i = 0; i < offsets_; ++i) {
+      const int32_t g2 = profile[i * kLanes + lane];
+      const int32_t g1 = profile[(i + 8) * kLanes + lane];
+      if (!valid[i * kLanes + lane] || !valid[(i + 8) * kLanes + lane] ||
+          g1 < g2) {
+        continue;
+      }
+      const int32_t w = (g2 - g1) * (g2 - g1);
+      weight += w;
+      weighted_step += w * static_cast<int32_t>(i);
+    }
+    FinishSample(begin + lane, weight, weighted_step);
+  }
+}
+
+#ifdef FRC971_EDGE_REFINER_AVX2
+
+#define FRC971_AVX2_TARGET __attribute__((target("avx2")))
+
+FRC971_AVX2_TARGET void EdgeRefiner::Avx2Score(const int32_t *profile,
+                                               const int32_t *valid,
+                                               size_t begin, size_t lanes) {
+  static_assert(kLanes == 8);
+  __m256i weight = _mm256_setzero_si256();
+  __m256i weighted_step = _mm256_setzero_si256();
+  for (size_t i = 0; i < offsets_; ++i) {
+    const __m256i g2 = _mm256_load_si256(
+        reinterpret_cast<const __m256i *>(profile + i * kLanes));
+    const __m256i g1 = _mm256_load_si256(
+        reinterpret_cast<const __m256i *>(profile + (i + 8) * kLanes));
+    const __m256i both_valid = _mm256_and_si256(
+        _mm256_load_si256(reinterpret_cast<const __m256i *>(valid + i * kLanes)),
+        _mm256_load_si256(
+            reinterpret_cast<const __m256i *>(valid + (i + 8) * kLanes)));
+    // Backwards gradients are rejected.
+    const __m256i keep =
+        _mm256_andnot_si256(_mm256_cmpgt_epi32(g2, g1), both_valid);
+    const __m256i diff = _mm256_sub_epi32(g2, g1);
+    const __m256i w = _mm256_and_si256(_mm256_mullo_epi32(diff, diff), keep);
+    weight = _mm256_add_epi32(weight, w);
+    weighted_step = _mm256_add_epi32(
+        weighted_step,
+        _mm256_mullo_epi32(w, _mm256_set1_epi32(static_cast<int32_t>(i))));
+  }
+
+  alignas(32) int32_t weights[kLanes];
+  alignas(32) int32_t weighted_steps[kLanes];
+  _mm256_store_si256(reinterpret_cast<__m256i *>(weights), weight);
+  _mm256_store_si256(reinterpret_cast<__m256i *>(weighted_steps),
+                     weighted_step);
+  for (size_t lane = 0; lane < lanes; ++lane) {
+    FinishSample(begin + lane, weights[lane], weighted_steps[lane]);
+  }
+}
+
+#undef FRC971_AVX2_TARGET
+
+#endif  // FRC971_EDGE_REFINER_AVX2
+
+#ifdef FRC971_EDGE_REFINER_NEON
+
+void EdgeRefiner::NeonScore(const int32_t *profile, const int32_t *valid,
+                            size_t begin, size_t lanes) {
+  static_assert(kLanes == 8);
+  int32x4_t weight[2] = {vdupq_n_s32(0), vdupq_n_s32(0)};
+  int32x4_t weighted_step[2] = {vdupq_n_s32(0), vdupq_n_s32(0)};
+  for (size_t i = 0; i < offsets_; ++i) {
+    for (size_t half = 0; half < 2; ++half) {
+      const size_t in = i * kLanes + half * 4;
+      const size_t out = (i + 8) * kLanes + half * 4;
+      const int32x4_t g2 = vld1q_s32(profile + in);
+      const int32x4_t g1 = vld1q_s32(profile + out);
+      const uint32x4_t both_valid =
+          vreinterpretq_u32_s32(vandq_s32(vld1q_s32(valid + in),
+                                          vld1q_s32(valid + out)));
+      // Backwards gradients are rejected.
+      const uint32x4_t keep = vbicq_u32(both_valid, vcgtq_s32(g2, g1));
+      const int32x4_t diff = vsubq_s32(g2, g1);
+      const int32x4_t w = vandq_s32(vmulq_s32(diff, diff),
+                                    vreinterpretq_s32_u32(keep));
+      weight[half] = vaddq_s32(weight[half], w);
+      weighted_step[half] =
+          vmlaq_n_s32(weighted_step[half], w, static_cast<int32_t>(i));
+    }
+  }
+
+  int32_t weights[kLanes];
+  int32_t weighted_steps[kLanes];
+  for (size_t half = 0; half < 2; ++half) {
+    vst1q_s32(weights + half * 4, weight[half]);
+    vst1q_s32(weighted_steps + half * 4, weighted_step[half]);
+  }
+  for (size_t lane = 0; lane < lanes; ++lane) {
+    FinishSample(begin + lane, weights[lane], weighted_steps[lane]);
+  }
+}
+
+#endif  // FRC971_EDGE_REFINER_NEON
+
+void EdgeRefiner::FitQuad(size_t quad_index, struct quad *quad,
+                          const CameraMatrix *camera_matrix,
+                          const DistCoeffs *distortion_coefficients,
+                          const UndistortMap *undistort_map) {
+  const std::array<size_t, 5> &edges = quads_[quad_index];
+
+  // Drop the samples without an edge, keeping each edge's samples at the
+  // front of its range.
+  size_t begin[4];
+  size_t end[4];
+  for (int edge = 0; edge < 4; edge++) {
+    begin[edge] = edges[edge];
+    end[edge] = edges[edge];
+    for (size_t i = edges[edge]; i < edges[edge + 1]; ++i) {
+      if (std::isnan(edge_x_[i])) {
+        continue;
+      }
+      edge_x_[end[edge]] = edge_x_[i];
+      edge_y_[end[edge]] = edge_y_[i];
+      ++end[edge];
+    }
+    UndistortSamples(edge_x_.data() + begin[edge], edge_y_.data() + begin[edge],
+                     end[edge] - begin[edge], camera_matrix,
+                     distortion_coefficients, undistort_map);
+  }
+
+  FitCorners(edge_x_.data(), edge_y_.data(), begin, end, quad, camera_matrix,
+             distortion_coefficients);
+}
+
+}  // namespace frc971::apriltag
@@ -0,0 +1,112 @@
+#ifndef FRC971_ORIN_EDGE_REFINER_H_
+#define FRC971_ORIN_EDGE_REFINER_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <array>
+#include <vector>
+
+#include "apriltag.h"
+#include "detector_backend.h"
+#include "undistort_map.h"
+
+namespace frc971::apriltag {
+
+// Moves the corners of quad onto the strongest gradient along each edge,
+// searching range pixels either side of it, one sample at a time.  This is the
+// reference EdgeRefiner has to match.  undistort_map is used to undistort the
+// samples if it isn't nullptr.
+void RefineEdges(double range, const image_u8_t *im, struct quad *quad,
+                 const CameraMatrix *camera_matrix,
+                 const DistCoeffs *distortion_coefficients,
+                 const UndistortMap *undistort_map);
+
+// Refines the edges of a whole frame's worth of quads as one batch, with the
+// same result as RefineEdges.
+//
+// RefineEdges searches along the normal at each sample point, comparing the
+// pixels 1 pixel in and 1 pixel out at 0.25 pixel steps.  That reads each
+// pixel on the normal twice, so instead the pixels along the normal are loaded
+// once into a profile, with the profiles of 8 sample points interleaved.
+// Every offset for those 8 samples is then scored at once from contiguous rows
+// of the profiles, without any gathers.
+//
+// Usage is Start, AddQuad for every quad, FindEdges over [0, sample_count()),
+// and then FitQuad for every quad.  FindEdges on disjoint ranges, and FitQuad
+// on different quads, can run in parallel.
+class EdgeRefiner {
+ public:
+  // The largest search range supported.
+  static constexpr double kMaxRange = 8.0;
+
+  EdgeRefiner();
+
+  // Starts a new batch, searching range pixels either side of each edge.
+  // range has to be a multiple of 0.25.
+  void Start(double range);
+
+  // Adds the samples along the edges of quad to the batch.  Quads are numbered
+  // in the order they are added.
+  void AddQuad(const struct quad &quad);
+
+  size_t quad_count() const { return quads_.size(); }
+  size_t sample_count() const { return x0_.size(); }
+
+  // Finds the edge for samples [begin, end).
+  void FindEdges(const image_u8_t *im, size_t begin, size_t end);
+
+  // Fits new lines through the edges found for quad_index, and moves the
+  // corners of quad to where they intersect.
+  void FitQuad(size_t quad_index, struct quad *quad,
+               const CameraMatrix *camera_matrix,
+               const DistCoeffs *distortion_coefficients,
+               const UndistortMap *undistort_map);
+
+ private:
+  // Number of sample points searched at once.
+  static constexpr size_t kLanes = 8;
+
+  // Number of pixels 1 step apart along the normal covering 1 pixel either
+  // side of the largest search range.
+  static constexpr size_t kMaxProfile =
+      static_cast<size_t>(8 * kMaxRange) + 9;
+
+  // Scores every offset for the kLanes samples starting at begin.  profile and
+  // valid hold kLanes entries per step along the normal.
+  void ScoreScalar(const int32_t *profile, const int32_t *valid, size_t begin,
+                   size_t lanes);
+#if defined(__x86_64__) || defined(__i386__)
+  void Avx2Score(const int32_t *profile, const int32_t *valid, size_t begin,
+                 size_t lanes);
+#endif
+#if defined(__aarch64__)
+  void NeonScore(const int32_t *profile, const int32_t *valid, size_t begin,
+                 size_t lanes);
+#endif
+
+  // Turns the weighted sums for one sample into its edge point.
+  void FinishSample(size_t sample, int32_t weight, int32_t weighted_step);
+
+  double range_ = 0.0;
+  // Number of offsets searched, 0.25 apart.
+  size_t offsets_ = 0;
+
+  // Where each sample point is, and the normal searched along.
+  std::vector<double> x0_;
+  std::vector<double> y0_;
+  std::vector<double> nx_;
+  std::vector<double> ny_;
+  // The edge point found for each sample, or NaN if there wasn't one.
+  std::vector<double> edge_x_;
+  std::vector<double> edge_y_;
+
+  // The samples for edge i of quad are [quads_[quad][i], quads_[quad][i + 1]).
+  std::vector<std::array<size_t, 5>> quads_;
+
+  bool use_avx2_ = false;
+};
+
+}  // namespace frc971::apriltag
+
+#endif  // FRC971_ORIN_EDGE_REFINER_H_
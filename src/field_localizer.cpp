@@ -0,0 +1,309 @@
+#include "field_localizer.h"
+
+#include <algorithm>
+#include <cmath>
+#include <fstream>
+#include <limits>
+#include <nlohmann/json.hpp>
+#include <utility>
+
+#include "common/zarray.h"
+#include "glog/logging.h"
+
+namespace frc971::apriltag {
+namespace {
+
+// Takes WPILib tag coordinates (x out of the face, y left, z up) to apriltag
+// tag coordinates (x right, y down, z into the face).
+constexpr Mat3 kWpilibToTag = {0, 1, 0, 0, 0, -1, -1, 0, 0};
+
+// Reprojection errors below this many pixels^2 are as good as converged.
+constexpr double kNegligibleError = 1e-12;
+
+// Points closer to the camera plane than this many m can't be projected.
+constexpr double kMinDepth = 1e-6;
+
+}  // namespace
+
+void FieldLayout::Add(int id, const Mat3 &rotation, const Vec3 &translation) {
+  CHECK_GE(id, 0);
+  if (static_cast<size_t>(id) >= tags_.size()) {
+    tags_.resize(id + 1);
+    present_.resize(id + 1, false);
+  }
+  if (!present_[id]) {
+    ++size_;
+  }
+  tags_[id] = Tag{.rotation = rotation, .translation = translation};
+  present_[id] = true;
+}
+
+const FieldLayout::Tag *FieldLayout::Find(int id) const {
+  if (id < 0 || static_cast<size_t>(id) >= tags_.size() || !present_[id]) {
+    return nullptr;
+  }
+  return &tags_[id];
+}
+
+bool LoadFieldLayout(const std::string &path, FieldLayout *layout) {
+  std::ifstream f(path);
+  if (!f) {
+    LOG(ERROR) << "Unable to open field layout " << path;
+    return false;
+  }
+  const nlohmann::json data = nlohmann::json::parse(f, nullptr, false);
+  if (data.is_discarded()) {
+    LOG(ERROR) << "Field layout " << path << " isn't JSON.";
+    return false;
+  }
+  if (!data.contains("tags")) {
+    LOG(ERROR) << "key \"tags\" not found in field layout.";
+    return false;
+  }
+
+  try {
+    for (const nlohmann::json &tag : data.at("tags")) {
+      const nlohmann::json &translation = tag.at("pose").at("translation");
+      const nlohmann::json &quaternion =
+          tag.at("pose").at("rotation").at("quaternion");
+      layout->Add(
+          tag.at("ID").get<int>(),
+          QuaternionToRotation({quaternion.at("W").get<double>(),
+                                quaternion.at("X").get<double>(),
+                                quaternion.at("Y").get<double>(),
+                                quaternion.at("Z").get<double>()}),
+          {translation.at("x").get<double>(), translation.at("y").get<double>(),
+           translation.at("z").get<double>()});
+    }
+  } catch (const nlohmann::json::exception &e) {
+    LOG(ERROR) << "Bad tag in field layout " << path << ": " << e.what();
+    return false;
+  }
+  VLOG(1) << "Loaded " << layout->size() << " tags from " << path;
+  return true;
+}
+
+FieldLocalizer::FieldLocalizer(CameraMatrix camera_matrix,
+                               DistCoeffs distortion_coefficients,
+                               TagSizes tag_sizes, FieldLayout layout)
+    : camera_matrix_(camera_matrix),
+      distortion_coefficients_(distortion_coefficients),
+      tag_sizes_(std::move(tag_sizes)),
+      layout_(std::move(layout)) {}
+
+double FieldLocalizer::ReprojectionError(const Mat3 &rotation,
+                                         const Vec3 &translation) const {
+  const Mat3 camera_from_field = Transpose(rotation);
+  double error = 0;
+  for (size_t i = 0; i < field_points_.size(); ++i) {
+    const Vec3 p =
+        Multiply(camera_from_field, Subtract(field_points_[i], translation));
+    if (p[2] < kMinDepth) {
+      return std::numeric_limits<double>::infinity();
+    }
+    const double du = camera_matrix_.fx * p[0] / p[2] + camera_matrix_.cx -
+                      image_points_[i][0];
+    const double dv = camera_matrix_.fy * p[1] / p[2] + camera_matrix_.cy -
+                      image_points_[i][1];
+    error += du * du + dv * dv;
+  }
+  return error;
+}
+
+const FieldPose &FieldLocalizer::Localize(
+    const zarray_t *detections,
+    std::chrono::steady_clock::time_point timestamp) {
+  field_points_.clear();
+  image_points_.clear();
+
+  // Gather the corners of every tag on the field, and the camera pose each one
+  // implies on its own as a starting point.
+  candidates_.clear();
+  if (pose_.valid) {
+    candidates_.emplace_back(pose_.rotation, pose_.translation);
+  }
+  pose_ = FieldPose{.timestamp = timestamp};
+  for (int i = 0; i < zarray_size(detections); ++i) {
+    apriltag_detection_t *det;
+    zarray_get(const_cast<zarray_t *>(detections), i, &det);
+    const FieldLayout::Tag *tag = layout_.Find(det->id);
+    if (tag == nullptr) {
+      continue;
+    }
+    ++pose_.tags;
+
+    const double tagsize = tag_sizes_.Get(det->id);
+    const double scale = tagsize / 2.0;
+    constexpr double kTagCorners[4][2] = {{-1, 1}, {1, 1}, {1, -1}, {-1, -1}};
+    for (int j = 0; j < 4; ++j) {
+      field_points_.push_back(
+          Add(Multiply(tag->rotation, Vec3{0, kTagCorners[j][0] * scale,
+                                           -kTagCorners[j][1] * scale}),
+              tag->translation));
+      double u = det->p[j][0];
+      double v = det->p[j][1];
+      DetectorBackend::UnDistort(&u, &v, &camera_matrix_,
+                                 &distortion_coefficients_);
+      image_points_.push_back({u, v});
+    }
+
+    const TagPose tag_pose =
+        PoseEstimator::HomographyTag(det, tagsize, camera_matrix_);
+    const Mat3 camera_from_field = Multiply(
+        Multiply(tag_pose.rotation, kWpilibToTag), Transpose(tag->rotation));
+    const Mat3 field_from_camera = Transpose(camera_from_field);
+    candidates_.emplace_back(
+        field_from_camera,
+        Subtract(tag->translation,
+                 Multiply(field_from_camera, tag_pose.translation)));
+  }
+  if (pose_.tags == 0) {
+    return pose_;
+  }
+
+  Mat3 R;
+  Vec3 c;
+  double error = std::numeric_limits<double>::infinity();
+  for (const auto &[rotation, translation] : candidates_) {
+    const double candidate_error = ReprojectionError(rotation, translation);
+    if (candidate_error < error) {
+      error = candidate_error;
+      R = rotation;
+      c = translation;
+    }
+  }
+  if (!std::isfinite(error)) {
+    return pose_;
+  }
+
+  // Damped Gauss-Newton on the pose (R, c), perturbing the rotation by
+  // exp([w]x) R in the field frame.  A field point X is at R' (X - c) in the
+  // camera, so the point moves by R' [X - c]x w and -R' dc.
+  auto linearize = [&](const Mat3 &rotation, const Vec3 &translation,
+                       double JtJ[6][6], double Jtr[6]) {
+    const Mat3 Rt = Transpose(rotation);
+    for (int a = 0; a < 6; ++a) {
+      Jtr[a] = 0;
+      for (int b = 0; b < 6; ++b) {
+        JtJ[a][b] = 0;
+      }
+    }
+    for (size_t i = 0; i < field_points_.size(); ++i) {
+      const Vec3 d = Subtract(field_points_[i], translation);
+      const Vec3 p = Multiply(Rt, d);
+      const double inv_z = 1.0 / p[2];
+      const double residual[2] = {
+          camera_matrix_.fx * p[0] * inv_z + camera_matrix_.cx -
+              image_points_[i][0],
+          camera_matrix_.fy * p[1] * inv_z + camera_matrix_.cy -
+              image_points_[i][1]};
+      // Derivative of the pixel with respect to the point in the camera.
+      const Vec3 dpixel[2] = {
+          {camera_matrix_.fx * inv_z, 0,
+           -camera_matrix_.fx * p[0] * inv_z * inv_z},
+          {0, camera_matrix_.fy * inv_z,
+           -camera_matrix_.fy * p[1] * inv_z * inv_z}};
+      const Mat3 d_cross = {0, -d[2], d[1], d[2], 0, -d[0], -d[1], d[0], 0};
+      const Mat3 dp_dw = Multiply(Rt, d_cross);
+      for (int k = 0; k < 2; ++k) {
+        double row[6];
+        for (int j = 0; j < 3; ++j) {
+          row[j] = dpixel[k][0] * At(dp_dw, 0, j) +
+                   dpixel[k][1] * At(dp_dw, 1, j) +
+                   dpixel[k][2] * At(dp_dw, 2, j);
+          row[j + 3] = -(dpixel[k][0] * At(Rt, 0, j) +
+                         dpixel[k][1] * At(Rt, 1, j) +
+                         dpixel[k][2] * At(Rt, 2, j));
+        }
+        for (int a = 0; a < 6; ++a) {
+          Jtr[a] += row[a] * residual[k];
+          for (int b = 0; b <= a; ++b) {
+            JtJ[a][b] += row[a] * row[b];
+          }
+        }
+      }
+    }
+    for (int a = 0; a < 6; ++a) {
+      for (int b = 0; b < a; ++b) {
+        JtJ[b][a] = JtJ[a][b];
+      }
+    }
+  };
+
+  double damping = 1e-6;
+  for (int step = 0; step < kMaxIterations; ++step) {
+    ++pose_.iterations;
+    double JtJ[6][6], Jtr[6], rhs[6], delta[6];
+    linearize(R, c, JtJ, Jtr);
+    for (int a = 0; a < 6; ++a) {
+      rhs[a] = -Jtr[a];
+      JtJ[a][a] *= 1.0 + damping;
+    }
+    if (!SolveSymmetric6(JtJ, rhs, delta)) {
+      break;
+    }
+    const Mat3 new_R = Multiply(Rodrigues({delta[0], delta[1], delta[2]}), R);
+    const Vec3 new_c = Add(c, {delta[3], delta[4], delta[5]});
+    const double new_error = ReprojectionError(new_R, new_c);
+    if (!(new_error <= error)) {
+      // Overshot, so take a shorter step.
+      damping *= 10;
+      continue;
+    }
+    damping = std::max(damping * 0.1, 1e-9);
+    const bool converged =
+        error - new_error <= 1e-6 * std::max(new_error, kNegligibleError);
+    R = new_R;
+    c = new_c;
+    error = new_error;
+    if (converged) {
+      break;
+    }
+  }
+
+  // Covariance from the fit, scaling the pixel noise to the residual left over
+  // with 2 measurements per corner and 6 degrees of freedom.
+  double JtJ[6][6], Jtr[6];
+  linearize(R, c, JtJ, Jtr);
+  const size_t n = field_points_.size();
+  const double sigma_squared =
+      std::max(error, kNegligibleError) / (2.0 * n - 6.0);
+  for (int column = 0; column < 6; ++column) {
+    double a[6][6];
+    std::copy(&JtJ[0][0], &JtJ[0][0] + 36, &a[0][0]);
+    double e[6] = {};
+    e[column] = sigma_squared;
+    double x[6];
+    if (!SolveSymmetric6(a, e, x)) {
+      LOG(WARNING) << "Field pose is degenerate.";
+      return pose_;
+    }
+    for (int row = 0; row < 6; ++row) {
+      pose_.covariance[row * 6 + column] = x[row];
+    }
+  }
+
+  pose_.valid = true;
+  pose_.rotation = R;
+  pose_.translation = c;
+  pose_.rms_error = std::sqrt(error / n);
+  VLOG(1) << "Field pose from " << pose_.tags << " tags in "
+          << pose_.iterations << " steps, " << pose_.rms_error << " px rms";
+  return pose_;
+}
+
+bool FieldLocalizer::TagInCamera(int id, Mat3 *rotation,
+                                 Vec3 *translation) const {
+  const FieldLayout::Tag *tag = layout_.Find(id);
+  if (!pose_.valid || tag == nullptr) {
+    return false;
+  }
+  const Mat3 camera_from_field = Transpose(pose_.rotation);
+  *rotation = Multiply(Multiply(camera_from_field, tag->rotation),
+                       Transpose(kWpilibToTag));
+  *translation = Multiply(camera_from_field,
+                          Subtract(tag->translation, pose_.translation));
+  return true;
+}
+
+}  // namespace frc971::apriltag
@@ -0,0 +1,122 @@
+#ifndef FRC971_ORIN_FIELD_LOCALIZER_H_
+#define FRC971_ORIN_FIELD_LOCALIZER_H_
+
+#include <stddef.h>
+
+#include <array>
+#include <chrono>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "apriltag.h"
+#include "detector_backend.h"
+#include "pose_estimator.h"
+#include "pose_math.h"
+
+namespace frc971::apriltag {
+
+// Where each tag is on the field.  Tag poses use WPILib's conventions: the
+// field frame is z up, and each tag's frame has x pointing out of its face, y
+// to its left and z up.
+class FieldLayout {
+ public:
+  struct Tag {
+    // Rotation from the tag frame to the field frame, and the tag's center in
+    // the field frame.
+    Mat3 rotation;
+    Vec3 translation;
+  };
+
+  void Add(int id, const Mat3 &rotation, const Vec3 &translation);
+
+  // Returns the tag, or nullptr if it isn't on the field.
+  const Tag *Find(int id) const;
+
+  size_t size() const { return size_; }
+
+ private:
+  // Indexed by tag ID.
+  std::vector<Tag> tags_;
+  std::vector<bool> present_;
+  size_t size_ = 0;
+};
+
+// Loads a layout in the JSON format of WPILib's AprilTagFieldLayout.  Returns
+// false if the file doesn't look like one.
+bool LoadFieldLayout(const std::string &path, FieldLayout *layout);
+
+// Pose of the camera on the field.
+struct FieldPose {
+  // When the frame was captured.
+  std::chrono::steady_clock::time_point timestamp;
+  // False if no tags on the field were seen, or the solve failed.
+  bool valid = false;
+
+  // Rotation from the camera frame to the field frame, and the camera's
+  // position in the field frame.  The camera frame is the usual one, x right,
+  // y down and z forwards.
+  Mat3 rotation;
+  Vec3 translation;
+  // Row major covariance of the pose, with the rotation as a small rotation
+  // vector about the field axes in radians first and then the position in m.
+  std::array<double, 36> covariance;
+
+  // RMS reprojection error of the corners in pixels.
+  double rms_error = 0;
+  // Tags used.
+  int tags = 0;
+  // Solver steps taken.
+  int iterations = 0;
+};
+
+// Solves for the pose of the camera on the field from every tag in a frame at
+// once, rather than a pose per tag.  All the corners of every tag in the layout
+// go into a single PnP, which starts from the best of each tag's homography and
+// last frame's pose and is refined by damped Gauss-Newton on the undistorted
+// reprojection error.
+class FieldLocalizer {
+ public:
+  // Maximum Gauss-Newton steps per frame.
+  static constexpr int kMaxIterations = 10;
+
+  FieldLocalizer(CameraMatrix camera_matrix, DistCoeffs distortion_coefficients,
+                 TagSizes tag_sizes, FieldLayout layout);
+
+  // Solves for the camera pose from the detections in the frame captured at
+  // timestamp, which is also left in pose().
+  const FieldPose &Localize(const zarray_t *detections,
+                            std::chrono::steady_clock::time_point timestamp);
+
+  const FieldPose &pose() const { return pose_; }
+
+  // Returns the pose in the camera frame of tag id implied by the last
+  // solution, in the same frame as TagPose, or false if there isn't one.
+  bool TagInCamera(int id, Mat3 *rotation, Vec3 *translation) const;
+
+  const FieldLayout &layout() const { return layout_; }
+
+ private:
+  // Returns the sum of squared reprojection errors in pixels of the camera
+  // pose rotation and translation.
+  double ReprojectionError(const Mat3 &rotation,
+                           const Vec3 &translation) const;
+
+  CameraMatrix camera_matrix_;
+  DistCoeffs distortion_coefficients_;
+  TagSizes tag_sizes_;
+  FieldLayout layout_;
+
+  // Corners this frame, on the field and undistorted in the image.  Reused
+  // between frames.
+  std::vector<Vec3> field_points_;
+  std::vector<std::array<double, 2>> image_points_;
+  // Camera poses to start the solve from, as (rotation, translation).
+  std::vector<std::pair<Mat3, Vec3>> candidates_;
+
+  FieldPose pose_;
+};
+
+}  // namespace frc971::apriltag
+
+#endif  // FRC971_ORIN_FIELD_LOCALIZER_H_
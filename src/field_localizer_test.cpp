@@ -0,0 +1,256 @@
+// field_localizer_test.cpp
+#include "field_localizer.h"
+
+#include <glog/logging.h>
+#include <gtest/gtest.h>
+
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <fstream>
+#include <random>
+#include <string>
+
+extern "C" {
+#include "common/matd.h"
+#include "common/zarray.h"
+}
+
+namespace frc971::apriltag {
+namespace {
+
+constexpr CameraMatrix kCamera = {
+    .fx = 924.09, .cx = 612.90, .fy = 929.80, .cy = 475.76};
+constexpr DistCoeffs kDistortion = {
+    .k1 = 0.05, .k2 = -0.1, .p1 = 0, .p2 = 0, .k3 = 0};
+constexpr double kTagSize = 0.1651;
+
+// Camera looking down -x from in front of the tags, with its x axis along +y
+// and its y axis along -z.
+constexpr Mat3 kLookingAtWall = {0, 0, -1, 1, 0, 0, 0, -1, 0};
+
+// Takes WPILib tag coordinates to apriltag tag coordinates.
+constexpr Mat3 kWpilibToTag = {0, 1, 0, 0, 0, -1, -1, 0, 0};
+
+// Three tags on a wall at x = 0 facing +x, and one on the side wall facing -y.
+FieldLayout MakeLayout() {
+  FieldLayout layout;
+  layout.Add(1, kIdentity, {0, 0, 0.5});
+  layout.Add(2, kIdentity, {0, 1, 0.5});
+  layout.Add(3, kIdentity, {0, 0.5, 1.2});
+  layout.Add(4, QuaternionToRotation({M_SQRT1_2, 0, 0, -M_SQRT1_2}),
+             {1, 1.8, 0.5});
+  return layout;
+}
+
+// Applies the radial distortion UnDistort takes out.
+void Distort(double *u, double *v) {
+  const double x = (*u - kCamera.cx) / kCamera.fx;
+  const double y = (*v - kCamera.cy) / kCamera.fy;
+  const double r2 = x * x + y * y;
+  const double radial = 1 + kDistortion.k1 * r2 + kDistortion.k2 * r2 * r2 +
+                        kDistortion.k3 * r2 * r2 * r2;
+  *u = x * radial * kCamera.fx + kCamera.cx;
+  *v = y * radial * kCamera.fy + kCamera.cy;
+}
+
+// Makes a detection of tag id from the layout as seen by a camera at
+// field_from_camera and position, with corner_noise pixels of noise.
+apriltag_detection_t *MakeDetection(std::mt19937 *rng,
+                                    const FieldLayout &layout, int id,
+                                    const Mat3 &field_from_camera,
+                                    const Vec3 &position, double corner_noise) {
+  std::normal_distribution<double> noise(0.0, corner_noise);
+  const FieldLayout::Tag *tag = layout.Find(id);
+  const Mat3 camera_from_field = Transpose(field_from_camera);
+  const Mat3 R = Multiply(Multiply(camera_from_field, tag->rotation),
+                          Transpose(kWpilibToTag));
+  const Vec3 t =
+      Multiply(camera_from_field, Subtract(tag->translation, position));
+
+  apriltag_detection_t *det = static_cast<apriltag_detection_t *>(
+      calloc(1, sizeof(apriltag_detection_t)));
+  det->id = id;
+  det->H = matd_create(3, 3);
+  const double K[3][3] = {
+      {kCamera.fx, 0, kCamera.cx}, {0, kCamera.fy, kCamera.cy}, {0, 0, 1}};
+  const double scale = kTagSize / 2;
+  const double Rt[3][3] = {{At(R, 0, 0) * scale, At(R, 0, 1) * scale, t[0]},
+                           {At(R, 1, 0) * scale, At(R, 1, 1) * scale, t[1]},
+                           {At(R, 2, 0) * scale, At(R, 2, 1) * scale, t[2]}};
+  for (int i = 0; i < 3; ++i) {
+    for (int j = 0; j < 3; ++j) {
+      MATD_EL(det->H, i, j) =
+          K[i][0] * Rt[0][j] + K[i][1] * Rt[1][j] + K[i][2] * Rt[2][j];
+    }
+  }
+
+  constexpr double kTagCorners[4][2] = {{-1, 1}, {1, 1}, {1, -1}, {-1, -1}};
+  for (int i = 0; i < 4; ++i) {
+    double xyz[3];
+    for (int j = 0; j < 3; ++j) {
+      xyz[j] = MATD_EL(det->H, j, 0) * kTagCorners[i][0] +
+               MATD_EL(det->H, j, 1) * kTagCorners[i][1] +
+               MATD_EL(det->H, j, 2);
+    }
+    double u = xyz[0] / xyz[2];
+    double v = xyz[1] / xyz[2];
+    Distort(&u, &v);
+    det->p[i][0] = u + noise(*rng);
+    det->p[i][1] = v + noise(*rng);
+  }
+  return det;
+}
+
+// Returns the angle in radians between two rotations.
+double AngleBetween(const Mat3 &a, const Mat3 &b) {
+  const Mat3 d = Multiply(Transpose(a), b);
+  return std::acos(std::clamp((d[0] + d[4] + d[8] - 1) / 2, -1.0, 1.0));
+}
+
+// Tests that the camera pose comes out of several tags at once, with a
+// covariance which covers the error, and that each tag's pose in the camera
+// follows from it.
+TEST(FieldLocalizerTest, LocalizesFromAllTags) {
+  const FieldLayout layout = MakeLayout();
+  FieldLocalizer localizer(kCamera, kDistortion, TagSizes(kTagSize), layout);
+
+  std::mt19937 rng(971);
+  const auto start = std::chrono::steady_clock::now();
+  for (int frame = 0; frame < 20; ++frame) {
+    const Mat3 rotation =
+        Multiply(Rodrigues({0.02 * frame, -0.1, 0.05}), kLookingAtWall);
+    const Vec3 position = {2.5 + 0.01 * frame, 0.6, 0.7};
+
+    zarray_t *detections = zarray_create(sizeof(apriltag_detection_t *));
+    for (int id = 1; id <= 3; ++id) {
+      apriltag_detection_t *det =
+          MakeDetection(&rng, layout, id, rotation, position, 0.3);
+      zarray_add(detections, &det);
+    }
+    // Tags which aren't on the field are left out.
+    apriltag_detection_t *unknown =
+        MakeDetection(&rng, layout, 1, rotation, position, 0.3);
+    unknown->id = 100;
+    zarray_add(detections, &unknown);
+
+    const FieldPose &pose = localizer.Localize(
+        detections, start + std::chrono::milliseconds(20 * frame));
+    ASSERT_TRUE(pose.valid) << ": frame " << frame;
+    EXPECT_EQ(pose.timestamp, start + std::chrono::milliseconds(20 * frame));
+    EXPECT_EQ(pose.tags, 3);
+    EXPECT_LE(pose.iterations, FieldLocalizer::kMaxIterations);
+    EXPECT_LT(pose.rms_error, 1.0);
+    EXPECT_LT(AngleBetween(pose.rotation, rotation), 0.01)
+        << ": frame " << frame;
+    for (int i = 0; i < 3; ++i) {
+      const double sigma = std::sqrt(pose.covariance[(i + 3) * 7]);
+      EXPECT_GT(sigma, 0.0);
+      EXPECT_LT(sigma, 0.05);
+      EXPECT_NEAR(pose.translation[i], position[i], std::max(5 * sigma, 1e-3))
+          << ": frame " << frame;
+      EXPECT_NEAR(pose.covariance[i * 6 + i + 3],
+                  pose.covariance[(i + 3) * 6 + i], 1e-12);
+    }
+
+    Mat3 tag_rotation;
+    Vec3 tag_translation;
+    ASSERT_TRUE(localizer.TagInCamera(2, &tag_rotation, &tag_translation));
+    apriltag_detection_t *det;
+    zarray_get(detections, 1, &det);
+    const TagPose expected =
+        PoseEstimator::HomographyTag(det, kTagSize, kCamera);
+    EXPECT_LT(AngleBetween(tag_rotation, expected.rotation), 0.05);
+    for (int i = 0; i < 3; ++i) {
+      EXPECT_NEAR(tag_translation[i], expected.translation[i], 0.05);
+    }
+    EXPECT_FALSE(localizer.TagInCamera(100, &tag_rotation, &tag_translation));
+
+    apriltag_detections_destroy(detections);
+  }
+}
+
+// Tests that a single tag is enough, even one on another wall, and that no
+// tags on the field means no pose.
+TEST(FieldLocalizerTest, SingleTagAndNoTags) {
+  const FieldLayout layout = MakeLayout();
+  FieldLocalizer localizer(kCamera, kDistortion, TagSizes(kTagSize), layout);
+  std::mt19937 rng(254);
+
+  // Looking down +y at tag 4.
+  const Mat3 rotation = Multiply(
+      QuaternionToRotation({M_SQRT1_2, 0, 0, -M_SQRT1_2}), kLookingAtWall);
+  const Vec3 position = {1.1, 0.3, 0.6};
+  zarray_t *detections = zarray_create(sizeof(apriltag_detection_t *));
+  apriltag_detection_t *det =
+      MakeDetection(&rng, layout, 4, rotation, position, 0.1);
+  zarray_add(detections, &det);
+  const FieldPose &pose =
+      localizer.Localize(detections, std::chrono::steady_clock::now());
+  ASSERT_TRUE(pose.valid);
+  EXPECT_EQ(pose.tags, 1);
+  EXPECT_LT(AngleBetween(pose.rotation, rotation), 0.02);
+  for (int i = 0; i < 3; ++i) {
+    EXPECT_NEAR(pose.translation[i], position[i], 0.03);
+  }
+  apriltag_detections_destroy(detections);
+
+  detections = zarray_create(sizeof(apriltag_detection_t *));
+  det = MakeDetection(&rng, layout, 1, kLookingAtWall, {2, 0, 0.5}, 0.1);
+  det->id = 50;
+  zarray_add(detections, &det);
+  EXPECT_FALSE(
+      localizer.Localize(detections, std::chrono::steady_clock::now()).valid);
+  EXPECT_EQ(localizer.pose().tags, 0);
+  apriltag_detections_destroy(detections);
+}
+
+// Tests loading a layout in WPILib's format.
+TEST(FieldLocalizerTest, LoadsWpilibLayout) {
+  const std::string path = ::testing::TempDir() + "field_layout.json";
+  {
+    std::ofstream f(path);
+    f << R"({"tags": [
+      {"ID": 1, "pose": {"translation": {"x": 15.08, "y": 0.25, "z": 1.36},
+       "rotation": {"quaternion": {"W": 0.5, "X": 0.0, "Y": 0.0,
+                                   "Z": 0.8660254037844386}}}},
+      {"ID": 7, "pose": {"translation": {"x": 16.58, "y": 5.55, "z": 1.45},
+       "rotation": {"quaternion": {"W": 0.0, "X": 0.0, "Y": 0.0, "Z": 1.0}}}}],
+      "field": {"length": 16.54, "width": 8.21}})";
+  }
+
+  FieldLayout layout;
+  ASSERT_TRUE(LoadFieldLayout(path, &layout));
+  EXPECT_EQ(layout.size(), 2u);
+  EXPECT_EQ(layout.Find(2), nullptr);
+  ASSERT_NE(layout.Find(7), nullptr);
+  EXPECT_EQ(layout.Find(7)->translation, (Vec3{16.58, 5.55, 1.45}));
+  // Facing -x.
+  EXPECT_NEAR(layout.Find(7)->rotation[0], -1.0, 1e-12);
+  EXPECT_NEAR(layout.Find(7)->rotation[4], -1.0, 1e-12);
+  EXPECT_NEAR(layout.Find(7)->rotation[8], 1.0, 1e-12);
+  // And 120 degrees about z.
+  const std::array<double, 4> q =
+      RotationToQuaternion(layout.Find(1)->rotation);
+  EXPECT_NEAR(q[0], 0.5, 1e-12);
+  EXPECT_NEAR(q[3], 0.8660254037844386, 1e-12);
+
+  {
+    std::ofstream f(path);
+    f << R"({"tags": [{"ID": 1}]})";
+  }
+  FieldLayout bad;
+  EXPECT_FALSE(LoadFieldLayout(path, &bad));
+  std::remove(path.c_str());
+}
+
+}  // namespace
+}  // namespace frc971::apriltag
+
+int main(int argc, char **argv) {
+  ::testing::InitGoogleTest(&argc, argv);
+  google::InitGoogleLogging(argv[0]);
+  return RUN_ALL_TESTS();
+}
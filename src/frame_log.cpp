@@ -0,0 +1,300 @@
+#include "frame_log.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <array>
+
+#include "glog/logging.h"
+
+namespace frc971::apriltag {
+namespace {
+
+constexpr std::array<uint8_t, kRecordAlignment> kPadding = {};
+
+// Like writev, but keeps going after short writes.
+bool WriteAll(int fd, std::vector<iovec> *iov) {
+  size_t next = 0;
+  while (next < iov->size()) {
+    const ssize_t written =
+        writev(fd, iov->data() + next, std::min<size_t>(iov->size() - next,
+                                                        IOV_MAX));
+    if (written == -1) {
+      if (errno == EINTR) {
+        continue;
+      }
+      PLOG(ERROR) << "Unable to write to frame log";
+      return false;
+    }
+    size_t remaining = written;
+    while (next < iov->size() && remaining >= (*iov)[next].iov_len) {
+      remaining -= (*iov)[next].iov_len;
+      ++next;
+    }
+    if (remaining > 0) {
+      (*iov)[next].iov_base =
+          static_cast<uint8_t *>((*iov)[next].iov_base) + remaining;
+      (*iov)[next].iov_len -= remaining;
+    }
+  }
+  return true;
+}
+
+}  // namespace
+
+uint8_t *RecordBuffer::Append(RecordType type, size_t size) {
+  const size_t padded = PadRecord(sizeof(RecordHeader) + size);
+  CHECK_LE(padded, remaining());
+  uint8_t *record = data_.data() + size_;
+  *reinterpret_cast<RecordHeader *>(record) = RecordHeader{
+      .type = static_cast<uint32_t>(type), .reserved = 0, .size = size};
+  memset(record + sizeof(RecordHeader) + size, 0,
+         padded - sizeof(RecordHeader) - size);
+  size_ += padded;
+  return record + sizeof(RecordHeader);
+}
+
+void RecordBuffer::Reserve(size_t capacity) {
+  if (capacity > data_.size()) {
+    data_.resize(capacity);
+  }
+}
+
+std::unique_ptr<FrameLogWriter> FrameLogWriter::Create(
+    const std::string &path) {
+  const int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,
+                      0644);
+  if (fd == -1) {
+    PLOG(ERROR) << "Unable to create frame log " << path;
+    return nullptr;
+  }
+  std::unique_ptr<FrameLogWriter> writer(new FrameLogWriter(fd));
+
+  FrameLogHeader header = {};
+  memcpy(header.magic, kFrameLogMagic, sizeof(header.magic));
+  header.version = kFrameLogVersion;
+  std::vector<iovec> iov = {{&header, sizeof(header)}};
+  if (!WriteAll(fd, &iov)) {
+    return nullptr;
+  }
+  writer->bytes_written_ = sizeof(header);
+  return writer;
+}
+
+FrameLogWriter::~FrameLogWriter() { close(fd_); }
+
+bool FrameLogWriter::WriteFrame(const CapturedFrame &frame) {
+  const FrameRecord record = {
+      .timestamp_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                          frame.timestamp.time_since_epoch())
+                          .count(),
+      .sequence = frame.sequence,
+      .pixel_format = static_cast<uint32_t>(frame.format.pixel_format),
+      .width = static_cast<uint32_t>(frame.width),
+      .height = static_cast<uint32_t>(frame.height),
+      .stride = RowStride(frame.format, frame.width),
+      .bytes = frame.bytes,
+      .reserved = 0,
+  };
+  const std::array<std::span<const uint8_t>, 2> parts = {
+      std::span<const uint8_t>(reinterpret_cast<const uint8_t *>(&record),
+                               sizeof(record)),
+      std::span<const uint8_t>(frame.data, frame.bytes)};
+  return WriteRecord(RecordType::kFrame, parts);
+}
+
+bool FrameLogWriter::WriteRecord(
+    RecordType type, std::span<const std::span<const uint8_t>> parts) {
+  RecordHeader header = {
+      .type = static_cast<uint32_t>(type), .reserved = 0, .size = 0};
+  std::vector<iovec> iov = {{&header, sizeof(header)}};
+  for (std::span<const uint8_t> part : parts) {
+    header.size += part.size();
+    iov.push_back({const_cast<uint8_t *>(part.data()), part.size()});
+  }
+  const size_t size = PadRecord(sizeof(header) + header.size);
+  iov.push_back({const_cast<uint8_t *>(kPadding.data()),
+                 size - sizeof(header) - header.size});
+  if (!WriteAll(fd_, &iov)) {
+    return false;
+  }
+  bytes_written_ += size;
+  return true;
+}
+
+bool FrameLogWriter::WriteRecords(std::span<const uint8_t> records) {
+  CHECK_EQ(records.size() % kRecordAlignment, 0u);
+  std::vector<iovec> iov = {
+      {const_cast<uint8_t *>(records.data()), records.size()}};
+  if (!WriteAll(fd_, &iov)) {
+    return false;
+  }
+  bytes_written_ += records.size();
+  return true;
+}
+
+std::unique_ptr<FrameLogReader> FrameLogReader::Open(const std::string &path,
+                                                     bool preload) {
+  const int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd == -1) {
+    PLOG(ERROR) << "Unable to open frame log " << path;
+    return nullptr;
+  }
+  struct stat st;
+  if (fstat(fd, &st) == -1 ||
+      static_cast<size_t>(st.st_size) < sizeof(FrameLogHeader)) {
+    LOG(ERROR) << path << " is too short to be a frame log";
+    close(fd);
+    return nullptr;
+  }
+  void *data = mmap(nullptr, st.st_size, PROT_READ,
+                    MAP_PRIVATE | (preload ? MAP_POPULATE : 0), fd, 0);
+  close(fd);
+  if (data == MAP_FAILED) {
+    PLOG(ERROR) << "Unable to map frame log " << path;
+    return nullptr;
+  }
+  if (!preload) {
+    madvise(data, st.st_size, MADV_SEQUENTIAL);
+  }
+  std::unique_ptr<FrameLogReader> reader(
+      new FrameLogReader(static_cast<const uint8_t *>(data), st.st_size));
+
+  const FrameLogHeader *header =
+      reinterpret_cast<const FrameLogHeader *>(reader->data_);
+  if (memcmp(header->magic, kFrameLogMagic, sizeof(header->magic)) != 0) {
+    LOG(ERROR) << path << " isn't a frame log";
+    return nullptr;
+  }
+  if (header->version != kFrameLogVersion) {
+    LOG(ERROR) << path << " is frame log version " << header->version
+               << ", expected " << kFrameLogVersion;
+    return nullptr;
+  }
+  if (!reader->Index()) {
+    LOG(ERROR) << "Frame log " << path << " is corrupt";
+    return nullptr;
+  }
+  return reader;
+}
+
+FrameLogReader::~FrameLogReader() {
+  munmap(const_cast<uint8_t *>(data_), size_);
+}
+
+bool FrameLogReader::Index() {
+  size_t offset = sizeof(FrameLogHeader);
+  // True if the next record is the image of the last result.
+  bool awaiting_frame = false;
+  while (offset + sizeof(RecordHeader) <= size_) {
+    const RecordHeader *header =
+        reinterpret_cast<const RecordHeader *>(data_ + offset);
+    if (header->size > size_ - offset - sizeof(RecordHeader)) {
+      LOG(WARNING) << "Frame log cut short at byte " << offset;
+      return true;
+    }
+    const uint8_t *payload = reinterpret_cast<const uint8_t *>(header + 1);
+    switch (static_cast<RecordType>(header->type)) {
+      case RecordType::kFrame: {
+        const FrameRecord *record =
+            reinterpret_cast<const FrameRecord *>(payload);
+        if (header->size < sizeof(FrameRecord) ||
+            record->bytes > header->size - sizeof(FrameRecord) ||
+            record->pixel_format >
+                static_cast<uint32_t>(PixelFormat::kBgr24) ||
+            record->width == 0 || record->height == 0 ||
+            record->bytes <
+                LumaBytes(ImageFormat{.pixel_format = static_cast<PixelFormat>(
+                                          record->pixel_format),
+                                      .stride = record->stride},
+                          record->width, record->height)) {
+          LOG(ERROR) << "Bad frame record at byte " << offset;
+          return false;
+        }
+        if (awaiting_frame) {
+          results_.back().frame = frames_.size();
+        }
+        frames_.push_back(offset + sizeof(RecordHeader));
+        break;
+      }
+      case RecordType::kChunk:
+        if (header->size < sizeof(ChunkRecord)) {
+          LOG(ERROR) << "Bad chunk record at byte " << offset;
+          return false;
+        }
+        chunks_.push_back(reinterpret_cast<const ChunkRecord *>(payload));
+        break;
+      case RecordType::kResult: {
+        const ResultRecord *record =
+            reinterpret_cast<const ResultRecord *>(payload);
+        if (header->size < sizeof(ResultRecord) ||
+            (header->size - sizeof(ResultRecord)) / sizeof(DetectionRecord) <
+                record->detections ||
+            (header->size - sizeof(ResultRecord) -
+             record->detections * sizeof(DetectionRecord)) /
+                    sizeof(PoseRecord) <
+                record->poses) {
+          LOG(ERROR) << "Bad result record at byte " << offset;
+          return false;
+        }
+        const DetectionRecord *detections =
+            reinterpret_cast<const DetectionRecord *>(record + 1);
+        const PoseRecord *poses = reinterpret_cast<const PoseRecord *>(
+            detections + record->detections);
+        results_.push_back(RecordedResult{
+            .record = record,
+            .detections = std::span<const DetectionRecord>(
+                detections, record->detections),
+            .poses = std::span<const PoseRecord>(poses, record->poses),
+        });
+        break;
+      }
+      default:
+        // Records of other types are skipped.
+        break;
+    }
+    awaiting_frame =
+        header->type == static_cast<uint32_t>(RecordType::kResult) &&
+        results_.back().record->triggers != 0;
+    offset += PadRecord(sizeof(RecordHeader) + header->size);
+  }
+  return true;
+}
+
+size_t FrameLogReader::FindResult(
+    std::chrono::steady_clock::time_point timestamp) const {
+  return std::partition_point(results_.begin(), results_.end(),
+                              [&](const RecordedResult &result) {
+                                return result.timestamp() < timestamp;
+                              }) -
+         results_.begin();
+}
+
+CapturedFrame FrameLogReader::frame(size_t i) const {
+  CHECK_LT(i, frames_.size());
+  const FrameRecord *record =
+      reinterpret_cast<const FrameRecord *>(data_ + frames_[i]);
+  return CapturedFrame{
+      .data = reinterpret_cast<const uint8_t *>(record + 1),
+      .bytes = record->bytes,
+      .width = record->width,
+      .height = record->height,
+      .format = ImageFormat{.pixel_format =
+                                static_cast<PixelFormat>(record->pixel_format),
+                            .stride = record->stride},
+      .timestamp = std::chrono::steady_clock::time_point(
+          std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+              std::chrono::nanoseconds(record->timestamp_ns))),
+      .sequence = record->sequence,
+      .buffer = static_cast<int>(i),
+  };
+}
+
+}  // namespace frc971::apriltag
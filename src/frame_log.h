@@ -0,0 +1,258 @@
+#ifndef FRC971_ORIN_FRAME_LOG_H_
+#define FRC971_ORIN_FRAME_LOG_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <chrono>
+#include <memory>
+#include <span>
+#include <string>
+#include <vector>
+
+#include "frame_source.h"
+
+namespace frc971::apriltag {
+
+// A frame log is a FrameLogHeader followed by records.  Each record is a
+// RecordHeader and its payload, padded out to kRecordAlignment bytes so the
+// pixels of a frame in a mapped log are aligned like a driver buffer's.  Logs
+// are only ever appended to, so one cut short by a crash is still good up to
+// its last whole record.  Everything is in host byte order.
+//
+// Logs from the Recorder also hold a kResult record for each frame detected,
+// followed by a kFrame record when the frame's image was kept.  Their records
+// are grouped into chunks, each starting with a kChunk record which gives the
+// chunk's size and time span, so a reader can skip straight over the chunks
+// it doesn't want.
+inline constexpr char kFrameLogMagic[8] = {'F', 'R', 'C', '9',
+                                           '7', '1', 'F', 'L'};
+inline constexpr uint32_t kFrameLogVersion = 1;
+inline constexpr size_t kRecordAlignment = 64;
+
+struct FrameLogHeader {
+  char magic[8];
+  uint32_t version;
+  uint32_t reserved[13];
+};
+static_assert(sizeof(FrameLogHeader) == kRecordAlignment);
+
+enum class RecordType : uint32_t {
+  kFrame = 1,
+  kChunk = 2,
+  kResult = 3,
+};
+
+struct RecordHeader {
+  uint32_t type;
+  uint32_t reserved;
+  // Bytes of payload, not counting the padding.
+  uint64_t size;
+};
+
+// The payload of a kFrame record, followed by the image.
+struct FrameRecord {
+  // steady_clock time of capture.
+  int64_t timestamp_ns;
+  uint32_t sequence;
+  // The PixelFormat's value.
+  uint32_t pixel_format;
+  uint32_t width;
+  uint32_t height;
+  uint64_t stride;
+  uint64_t bytes;
+  uint64_t reserved;
+};
+static_assert(sizeof(RecordHeader) + sizeof(FrameRecord) == kRecordAlignment);
+
+// The payload of a kChunk record.
+struct ChunkRecord {
+  // Bytes of records in the chunk after this one, padding included.
+  uint64_t size;
+  uint32_t records;
+  uint32_t reserved;
+  // steady_clock times of the first and last results in the chunk.
+  int64_t first_timestamp_ns;
+  int64_t last_timestamp_ns;
+};
+
+// Why a frame's image was kept, as bits of ResultRecord::triggers.
+enum ResultTrigger : uint32_t {
+  // Kept to sample the images at a steady rate.
+  kTriggerSampled = 1 << 0,
+  // A tag seen in the last frame wasn't found in this one.
+  kTriggerTagLost = 1 << 1,
+  // A tag only decoded after correcting bit errors.
+  kTriggerBitErrors = 1 << 2,
+  // Capture to pose latency was over the limit.
+  kTriggerLatency = 1 << 3,
+};
+
+// The payload of a kResult record, followed by its DetectionRecords and then
+// its PoseRecords.  A result with any triggers set is followed by a kFrame
+// record of its image.
+struct ResultRecord {
+  // steady_clock time of capture.
+  int64_t timestamp_ns;
+  uint32_t sequence;
+  uint32_t triggers;
+  // Capture to the start of detection, detection, and pose estimation.
+  int64_t queued_ns;
+  int64_t detect_ns;
+  int64_t pose_ns;
+  uint32_t detections;
+  uint32_t poses;
+  // The FieldPose, if the frame was localized on the field.
+  uint32_t field_pose_valid;
+  uint32_t field_pose_tags;
+  double field_rotation[9];
+  double field_translation[3];
+  double field_covariance[36];
+  double field_rms_error;
+};
+
+struct DetectionRecord {
+  int32_t id;
+  int32_t hamming;
+  float decision_margin;
+  uint32_t reserved;
+  double center[2];
+  double corners[4][2];
+};
+
+struct PoseRecord {
+  int32_t id;
+  uint32_t reserved;
+  // Row major.
+  double rotation[9];
+  double translation[3];
+  double error;
+};
+
+// Returns size rounded up to a whole number of records.
+constexpr size_t PadRecord(size_t size) {
+  return (size + kRecordAlignment - 1) / kRecordAlignment * kRecordAlignment;
+}
+
+// Lays out records in memory so a whole chunk of them can go to the log in one
+// write.  The buffer is allocated up front and reused.
+class RecordBuffer {
+ public:
+  explicit RecordBuffer(size_t capacity) : data_(capacity) {}
+
+  // Appends a record with size bytes of payload and returns where the payload
+  // goes.  The padding is zeroed, the payload is left for the caller.  The
+  // record has to fit.
+  uint8_t *Append(RecordType type, size_t size);
+
+  // Grows the buffer to hold at least capacity bytes.
+  void Reserve(size_t capacity);
+
+  void Clear() { size_ = 0; }
+
+  uint8_t *data() { return data_.data(); }
+  std::span<const uint8_t> records() const {
+    return std::span<const uint8_t>(data_.data(), size_);
+  }
+  size_t size() const { return size_; }
+  size_t remaining() const { return data_.size() - size_; }
+
+ private:
+  std::vector<uint8_t> data_;
+  size_t size_ = 0;
+};
+
+// Appends records to a frame log.  Each write goes straight to the file.
+class FrameLogWriter {
+ public:
+  // Creates the log, replacing any file at path.  Returns nullptr if it can't
+  // be created.
+  static std::unique_ptr<FrameLogWriter> Create(const std::string &path);
+
+  ~FrameLogWriter();
+
+  FrameLogWriter(const FrameLogWriter &) = delete;
+  FrameLogWriter &operator=(const FrameLogWriter &) = delete;
+
+  // Appends a frame, all frame.bytes of it.  Returns false if the write
+  // failed.
+  bool WriteFrame(const CapturedFrame &frame);
+
+  // Appends a record made of the concatenated parts.
+  bool WriteRecord(RecordType type,
+                   std::span<const std::span<const uint8_t>> parts);
+
+  // Appends records laid out by a RecordBuffer.
+  bool WriteRecords(std::span<const uint8_t> records);
+
+  size_t bytes_written() const { return bytes_written_; }
+
+ private:
+  explicit FrameLogWriter(int fd) : fd_(fd) {}
+
+  const int fd_;
+  size_t bytes_written_ = 0;
+};
+
+// A kResult record read from a frame log.
+struct RecordedResult {
+  const ResultRecord *record;
+  std::span<const DetectionRecord> detections;
+  std::span<const PoseRecord> poses;
+  // Index of the frame record holding the image, or -1 if it wasn't kept.
+  int frame = -1;
+
+  std::chrono::steady_clock::time_point timestamp() const {
+    return std::chrono::steady_clock::time_point(
+        std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+            std::chrono::nanoseconds(record->timestamp_ns)));
+  }
+};
+
+// Reads a frame log by mapping it, so frames are read in place.
+class FrameLogReader {
+ public:
+  // Maps and indexes the log.  With preload, every page is read in up front
+  // so page faults don't land in the middle of a replay.  Returns nullptr if
+  // the log can't be read.
+  static std::unique_ptr<FrameLogReader> Open(const std::string &path,
+                                              bool preload = false);
+
+  ~FrameLogReader();
+
+  FrameLogReader(const FrameLogReader &) = delete;
+  FrameLogReader &operator=(const FrameLogReader &) = delete;
+
+  size_t frames() const { return frames_.size(); }
+
+  // Returns frame i, pointing into the mapped log.
+  CapturedFrame frame(size_t i) const;
+
+  size_t results() const { return results_.size(); }
+  const RecordedResult &result(size_t i) const { return results_[i]; }
+
+  size_t chunks() const { return chunks_.size(); }
+  const ChunkRecord &chunk(size_t i) const { return *chunks_[i]; }
+
+  // Returns the index of the first result captured at or after timestamp, or
+  // results() if there is none.  Results have to be in capture order.
+  size_t FindResult(std::chrono::steady_clock::time_point timestamp) const;
+
+ private:
+  FrameLogReader(const uint8_t *data, size_t size) : data_(data), size_(size) {}
+
+  // Walks the records, indexing them.  Returns false if the log is
+  // corrupt, rather than cut short.
+  bool Index();
+
+  const uint8_t *const data_;
+  const size_t size_;
+  // Offsets of each frame's FrameRecord.
+  std::vector<size_t> frames_;
+  std::vector<RecordedResult> results_;
+  std::vector<const ChunkRecord *> chunks_;
+};
+
+}  // namespace frc971::apriltag
+
+#endif  // FRC971_ORIN_FRAME_LOG_H_
@@ -0,0 +1,55 @@
+#ifndef FRC971_ORIN_FRAME_SOURCE_H_
+#define FRC971_ORIN_FRAME_SOURCE_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <chrono>
+
+#include "pixel_format.h"
+
+namespace frc971::apriltag {
+
+// A frame handed out by a FrameSource, in memory the source owns.
+struct CapturedFrame {
+  const uint8_t *data = nullptr;
+  size_t bytes = 0;
+  size_t width = 0;
+  size_t height = 0;
+  ImageFormat format;
+  // When the frame was captured, on the steady_clock.
+  std::chrono::steady_clock::time_point timestamp;
+  // Counts up by one per frame captured, including dropped ones.
+  uint32_t sequence = 0;
+  // Which of the source's buffers holds the frame, for Release.
+  int buffer = -1;
+};
+
+// Somewhere frames come from, like a camera or a recorded log, so the same
+// pipeline can run live or offline.
+class FrameSource {
+ public:
+  virtual ~FrameSource() = default;
+
+  // Waits for the next frame.  The frame is the caller's until it is passed to
+  // Release.  Returns false if there is no frame, because a camera timed out
+  // or failed or because the source is finished.
+  virtual bool Next(CapturedFrame *frame) = 0;
+
+  // Hands the frame's buffer back to the source.
+  virtual void Release(const CapturedFrame &frame) = 0;
+
+  // True once Next will never return another frame.
+  virtual bool finished() const { return false; }
+
+  virtual size_t width() const = 0;
+  virtual size_t height() const = 0;
+  virtual ImageFormat format() const = 0;
+
+  // Frames lost before they got to Next.
+  virtual size_t dropped() const { return 0; }
+};
+
+}  // namespace frc971::apriltag
+
+#endif  // FRC971_ORIN_FRAME_SOURCE_H_
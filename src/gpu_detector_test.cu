@@ -2,6 +2,7 @@
 #include <glog/logging.h>
 #include <gtest/gtest.h>
 
+#include "apriltag_cpu.h"
 #include "apriltag_gpu.h"
 #include "apriltag_utils.h"
 #include "opencv2/opencv.hpp"
@@ -142,6 +143,88 @@ TEST_F(GpuDetectorTest, CpuAndGpuEqual) {
   }
 }
 
+// The CPU backend should reproduce every stage of the GPU pipeline.
+TEST_F(GpuDetectorTest, CpuBackendAndGpuEqual) {
+  int width = yuyv_img.cols;
+  int height = yuyv_img.rows;
+  frc971::apriltag::GpuDetector gpu_detector(width, height, td, cam, dist);
+  gpu_detector.Detect(yuyv_img.data);
+
+  frc971::apriltag::CpuDetector cpu_detector(width, height, td, cam, dist);
+  cpu_detector.Detect(yuyv_img.data);
+
+  const size_t decimated_size = width / 2 * height / 2;
+  std::vector<uint8_t> gpu_thresholded(decimated_size);
+  std::vector<uint8_t> cpu_thresholded(decimated_size);
+  gpu_detector.CopyThresholdedTo(gpu_thresholded.data());
+  cpu_detector.CopyThresholdedTo(cpu_thresholded.data());
+  ASSERT_EQ(gpu_thresholded, cpu_thresholded);
+
+  std::vector<uint32_t> gpu_union_markers(decimated_size);
+  std::vector<uint32_t> cpu_union_markers(decimated_size);
+  gpu_detector.CopyUnionMarkersTo(gpu_union_markers.data());
+  cpu_detector.CopyUnionMarkersTo(cpu_union_markers.data());
+  ASSERT_EQ(gpu_union_markers, cpu_union_markers);
+
+  std::vector<uint32_t> gpu_union_markers_size(decimated_size);
+  std::vector<uint32_t> cpu_union_markers_size(decimated_size);
+  gpu_detector.CopyUnionMarkersSizeTo(gpu_union_markers_size.data());
+  cpu_detector.CopyUnionMarkersSizeTo(cpu_union_markers_size.data());
+  ASSERT_EQ(gpu_union_markers_size, cpu_union_markers_size);
+
+  ASSERT_EQ(gpu_detector.NumCompressedUnionMarkerPairs(),
+            cpu_detector.NumCompressedUnionMarkerPairs());
+  ASSERT_EQ(gpu_detector.NumQuads(), cpu_detector.NumQuads());
+
+  const std::vector<frc971::apriltag::QuadCorners> &gpu_quads =
+      gpu_detector.FitQuads();
+  const std::vector<frc971::apriltag::QuadCorners> &cpu_quads =
+      cpu_detector.FitQuads();
+  ASSERT_EQ(gpu_quads.size(), cpu_quads.size());
+  for (size_t i = 0; i < gpu_quads.size(); ++i) {
+    ASSERT_EQ(gpu_quads[i].blob_index, cpu_quads[i].blob_index);
+    for (int corner = 0; corner < 4; ++corner) {
+      ASSERT_NEAR(gpu_quads[i].corners[corner][0],
+                  cpu_quads[i].corners[corner][0], 1e-3);
+      ASSERT_NEAR(gpu_quads[i].corners[corner][1],
+                  cpu_quads[i].corners[corner][1], 1e-3);
+    }
+  }
+
+  ASSERT_EQ(zarray_size(gpu_detector.Detections()),
+            zarray_size(cpu_detector.Detections()));
+}
+
+// Padded BGR rows, like a cv::Mat ROI or a driver buffer with a wide
+// bytesperline, should upload and threshold exactly like packed ones.
+TEST_F(GpuDetectorTest, GpuPaddedBgrMatchesPacked) {
+  int width = bgr_img.cols;
+  int height = bgr_img.rows;
+  frc971::apriltag::GpuDetector detector(width, height, td, cam, dist);
+  detector.Detect(bgr_img.data, {frc971::apriltag::PixelFormat::kBgr24, 0});
+  ASSERT_EQ(1, zarray_size(detector.Detections()));
+  apriltag_detection_t *det;
+  zarray_get(detector.Detections(), 0, &det);
+  const int id = det->id;
+  const double c[2] = {det->c[0], det->c[1]};
+  const size_t decimated_size = width / 2 * height / 2;
+  std::vector<uint8_t> packed_thresholded(decimated_size);
+  detector.CopyThresholdedTo(packed_thresholded.data());
+
+  Mat padded_bgr(height, width + 16, CV_8UC3, Scalar(0, 0, 0));
+  bgr_img.copyTo(padded_bgr(Rect(0, 0, width, height)));
+  detector.Detect(padded_bgr.data,
+                  {frc971::apriltag::PixelFormat::kBgr24, padded_bgr.step});
+  std::vector<uint8_t> padded_thresholded(decimated_size);
+  detector.CopyThresholdedTo(padded_thresholded.data());
+  ASSERT_EQ(packed_thresholded, padded_thresholded);
+  ASSERT_EQ(1, zarray_size(detector.Detections()));
+  zarray_get(detector.Detections(), 0, &det);
+  ASSERT_EQ(id, det->id);
+  ASSERT_EQ(c[0], det->c[0]);
+  ASSERT_EQ(c[1], det->c[1]);
+}
+
 // Main function to run the tests
 int main(int argc, char **argv) {
   ::testing::InitGoogleTest(&argc, argv);
@@ -0,0 +1,25 @@
+#ifndef FRC971_ORIN_HOST_DEVICE_H_
+#define FRC971_ORIN_HOST_DEVICE_H_
+
+// Lets the point and line fit types be shared between the CUDA kernels and the
+// host-only CPU backend.  When nvcc or clang is compiling CUDA, the real
+// qualifiers come from the CUDA headers.  Otherwise, they compile away.
+#ifdef __CUDACC__
+#include "cuda_runtime.h"
+#include "device_launch_parameters.h"
+#else
+#ifndef __host__
+#define __host__
+#endif
+#ifndef __device__
+#define __device__
+#endif
+#ifndef __forceinline__
+#define __forceinline__ inline __attribute__((always_inline))
+#endif
+#ifndef __align__
+#define __align__(n) __attribute__((aligned(n)))
+#endif
+#endif
+
+#endif  // FRC971_ORIN_HOST_DEVICE_H_
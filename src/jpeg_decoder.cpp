@@ -0,0 +1,102 @@
+#include "jpeg_decoder.h"
+
+#include <setjmp.h>
+#include <stdio.h>
+
+#include <jpeglib.h>
+
+#include <algorithm>
+
+#include "glog/logging.h"
+
+namespace frc971::apriltag {
+namespace {
+
+// Rows asked of libjpeg at a time.
+constexpr size_t kRowsPerRead = 16;
+
+struct ErrorManager {
+  jpeg_error_mgr manager;
+  jmp_buf jump;
+};
+
+// libjpeg's errors can't return, so jump back out to DecodeLuma.
+void ErrorExit(j_common_ptr info) {
+  char message[JMSG_LENGTH_MAX];
+  (*info->err->format_message)(info, message);
+  VLOG(1) << "Bad JPEG: " << message;
+  longjmp(reinterpret_cast<ErrorManager *>(info->err)->jump, 1);
+}
+
+// Counts warnings, like a JPEG cut short, without printing them.
+void EmitMessage(j_common_ptr info, int level) {
+  if (level < 0) {
+    ++info->err->num_warnings;
+  }
+}
+
+}  // namespace
+
+struct JpegDecoder::State {
+  jpeg_decompress_struct info;
+  ErrorManager error;
+};
+
+JpegDecoder::JpegDecoder() : state_(std::make_unique<State>()) {
+  state_->info.err = jpeg_std_error(&state_->error.manager);
+  state_->error.manager.error_exit = ErrorExit;
+  state_->error.manager.emit_message = EmitMessage;
+  jpeg_create_decompress(&state_->info);
+}
+
+JpegDecoder::~JpegDecoder() { jpeg_destroy_decompress(&state_->info); }
+
+bool JpegDecoder::DecodeLuma(std::span<const uint8_t> jpeg, size_t width,
+                             size_t height, size_t scale, uint8_t *gray,
+                             size_t stride) {
+  CHECK(scale == 1 || scale == 2 || scale == 4 || scale == 8)
+      << ": scale must be 1, 2, 4 or 8, got " << scale;
+  if (setjmp(state_->error.jump)) {
+    jpeg_abort_decompress(&state_->info);
+    return false;
+  }
+  return Decode(jpeg, width, height, scale, gray, stride);
+}
+
+bool JpegDecoder::Decode(std::span<const uint8_t> jpeg, size_t width,
+                         size_t height, size_t scale, uint8_t *gray,
+                         size_t stride) {
+  jpeg_decompress_struct *info = &state_->info;
+  info->err->num_warnings = 0;
+  // libjpeg-turbo fills in the standard Huffman tables which MJPEG frames
+  // usually leave out.
+  jpeg_mem_src(info, jpeg.data(), jpeg.size());
+  jpeg_read_header(info, TRUE);
+  if (info->image_width != width || info->image_height != height) {
+    VLOG(1) << "JPEG is " << info->image_width << "x" << info->image_height
+            << ", expected " << width << "x" << height;
+    jpeg_abort_decompress(info);
+    return false;
+  }
+
+  info->out_color_space = JCS_GRAYSCALE;
+  info->scale_num = 1;
+  info->scale_denom = scale;
+  jpeg_start_decompress(info);
+  CHECK_EQ(info->output_width, ScaledSize(width, scale));
+  CHECK_EQ(info->output_height, ScaledSize(height, scale));
+
+  JSAMPROW rows[kRowsPerRead];
+  while (info->output_scanline < info->output_height) {
+    const size_t count = std::min<size_t>(
+        kRowsPerRead, info->output_height - info->output_scanline);
+    for (size_t i = 0; i < count; ++i) {
+      rows[i] = gray + (info->output_scanline + i) * stride;
+    }
+    jpeg_read_scanlines(info, rows, count);
+  }
+  jpeg_finish_decompress(info);
+  return info->err->num_warnings == 0;
+}
+
+}  // namespace frc971::apriltag
@@ -0,0 +1,52 @@
+#ifndef FRC971_ORIN_JPEG_DECODER_H_
+#define FRC971_ORIN_JPEG_DECODER_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <memory>
+#include <span>
+
+namespace frc971::apriltag {
+
+// Decodes just the luma of JPEGs, like the frames of an MJPEG camera, straight
+// into a gray image for the detector.  Asking libjpeg for gray output skips
+// the inverse DCT, upsampling and color conversion of the chroma, which is
+// most of the work of a full color decode, and DCT scaling can shrink the
+// image in the inverse DCT itself for a fraction of the cost.  The decoder is
+// reused from frame to frame so nothing is allocated per frame.
+class JpegDecoder {
+ public:
+  JpegDecoder();
+  ~JpegDecoder();
+
+  JpegDecoder(const JpegDecoder &) = delete;
+  JpegDecoder &operator=(const JpegDecoder &) = delete;
+
+  // Returns the size along an axis of an image size pixels across decoded at
+  // 1 / scale.
+  static constexpr size_t ScaledSize(size_t size, size_t scale) {
+    return (size + scale - 1) / scale;
+  }
+
+  // Decodes the luma of jpeg, scaled down by scale (1, 2, 4 or 8), into gray,
+  // with rows stride bytes apart.  The JPEG has to be width by height before
+  // scaling.  Returns false, leaving gray partly written, if the JPEG is
+  // corrupt, cut short or the wrong size.
+  bool DecodeLuma(std::span<const uint8_t> jpeg, size_t width, size_t height,
+                  size_t scale, uint8_t *gray, size_t stride);
+
+ private:
+  struct State;
+
+  // Does the part of DecodeLuma which libjpeg can longjmp out of on an error,
+  // so it mustn't own anything with a destructor.
+  bool Decode(std::span<const uint8_t> jpeg, size_t width, size_t height,
+              size_t scale, uint8_t *gray, size_t stride);
+
+  const std::unique_ptr<State> state_;
+};
+
+}  // namespace frc971::apriltag
+
+#endif  // FRC971_ORIN_JPEG_DECODER_H_
@@ -0,0 +1,132 @@
+// jpeg_decoder_test.cpp
+#include "jpeg_decoder.h"
+
+#include <glog/logging.h>
+#include <gtest/gtest.h>
+#include <stdio.h>
+
+#include <jpeglib.h>
+
+#include <cmath>
+#include <cstdlib>
+#include <vector>
+
+namespace frc971::apriltag {
+namespace {
+
+constexpr size_t kWidth = 66;
+constexpr size_t kHeight = 50;
+constexpr uint8_t kPadding = 0xaa;
+
+// Returns the luma of pixel (row, col) of the test image, which only has
+// smooth gradients so DCT scaling matches averaging.
+double Luma(size_t row, size_t col) {
+  return 0.299 * (col * 3) + 0.587 * (row * 4) + 0.114 * 128;
+}
+
+// Encodes the test image as a 4:2:0 JPEG, like an MJPEG camera's.
+std::vector<uint8_t> EncodeJpeg(size_t width, size_t height) {
+  std::vector<uint8_t> rgb(width * height * 3);
+  for (size_t row = 0; row < height; ++row) {
+    for (size_t col = 0; col < width; ++col) {
+      uint8_t *pixel = &rgb[(row * width + col) * 3];
+      pixel[0] = col * 3;
+      pixel[1] = row * 4;
+      pixel[2] = 128;
+    }
+  }
+
+  jpeg_compress_struct info;
+  jpeg_error_mgr error;
+  info.err = jpeg_std_error(&error);
+  jpeg_create_compress(&info);
+  unsigned char *buffer = nullptr;
+  unsigned long size = 0;
+  jpeg_mem_dest(&info, &buffer, &size);
+  info.image_width = width;
+  info.image_height = height;
+  info.input_components = 3;
+  info.in_color_space = JCS_RGB;
+  jpeg_set_defaults(&info);
+  jpeg_set_quality(&info, 100, TRUE);
+  jpeg_start_compress(&info, TRUE);
+  while (info.next_scanline < info.image_height) {
+    JSAMPROW row = &rgb[info.next_scanline * width * 3];
+    jpeg_write_scanlines(&info, &row, 1);
+  }
+  jpeg_finish_compress(&info);
+  jpeg_destroy_compress(&info);
+
+  std::vector<uint8_t> jpeg(buffer, buffer + size);
+  free(buffer);
+  return jpeg;
+}
+
+// Tests that the luma decodes at every scale, matching the average of the
+// pixels each output pixel covers, and that the row padding is left alone.
+TEST(JpegDecoderTest, DecodesLuma) {
+  const std::vector<uint8_t> jpeg = EncodeJpeg(kWidth, kHeight);
+  JpegDecoder decoder;
+  for (size_t scale : {1, 2, 4, 8}) {
+    const size_t width = JpegDecoder::ScaledSize(kWidth, scale);
+    const size_t height = JpegDecoder::ScaledSize(kHeight, scale);
+    const size_t stride = width + 8;
+    std::vector<uint8_t> gray(stride * height, kPadding);
+    ASSERT_TRUE(decoder.DecodeLuma(jpeg, kWidth, kHeight, scale, gray.data(),
+                                   stride));
+
+    for (size_t row = 0; row < height; ++row) {
+      // The last row and column cover pixels past the edge, which are filled
+      // in by repeating the edge.
+      for (size_t col = 0; col + 1 < width && row + 1 < height; ++col) {
+        double expected = 0;
+        for (size_t i = 0; i < scale; ++i) {
+          for (size_t j = 0; j < scale; ++j) {
+            expected += Luma(row * scale + i, col * scale + j);
+          }
+        }
+        expected /= scale * scale;
+        EXPECT_NEAR(gray[row * stride + col], expected, 2.0)
+            << "scale " << scale << " at " << row << ", " << col;
+      }
+      for (size_t col = width; col < stride; ++col) {
+        ASSERT_EQ(gray[row * stride + col], kPadding);
+      }
+    }
+  }
+}
+
+// Tests that bad JPEGs are turned away, and that the decoder still works
+// after one.
+TEST(JpegDecoderTest, RejectsBadJpegs) {
+  const std::vector<uint8_t> jpeg = EncodeJpeg(kWidth, kHeight);
+  JpegDecoder decoder;
+  std::vector<uint8_t> gray(kWidth * kHeight);
+
+  // Cut short, like a torn MJPEG frame.
+  EXPECT_FALSE(decoder.DecodeLuma(
+      std::span<const uint8_t>(jpeg.data(), jpeg.size() / 2), kWidth,
+      kHeight, 1, gray.data(), kWidth));
+  // Not a JPEG at all.
+  const std::vector<uint8_t> garbage(1000, 0x55);
+  EXPECT_FALSE(
+      decoder.DecodeLuma(garbage, kWidth, kHeight, 1, gray.data(), kWidth));
+  EXPECT_FALSE(decoder.DecodeLuma(std::span<const uint8_t>(), kWidth, kHeight,
+                                  1, gray.data(), kWidth));
+  // The wrong size.
+  EXPECT_FALSE(decoder.DecodeLuma(jpeg, kWidth - 2, kHeight, 1, gray.data(),
+                                  kWidth));
+
+  EXPECT_TRUE(
+      decoder.DecodeLuma(jpeg, kWidth, kHeight, 1, gray.data(), kWidth));
+  EXPECT_NEAR(gray[10 * kWidth + 20], Luma(10, 20), 2.0);
+}
+
+}  // namespace
+}  // namespace frc971::apriltag
+
+int main(int argc, char **argv) {
+  ::testing::InitGoogleTest(&argc, argv);
+  google::InitGoogleLogging(argv[0]);
+  return RUN_ALL_TESTS();
+}
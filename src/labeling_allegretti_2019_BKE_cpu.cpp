@@ -0,0 +1,592 @@
+// Host port of labeling_allegretti_2019_BKE.cu.  See that file for the
+// description of the algorithm and how it differs from YACCLAB.
+//
+// The image is split into one horizontal strip of block rows per worker.  Each
+// worker runs InitLabeling, Compression, Merge and Compression over its own
+// strip as if the strip were the whole image, so none of that needs atomics.
+// The links across the top row of each strip are then added with an atomic
+// union, and a final compression and labeling pass runs over the whole image.
+//
+// The union find links the larger root to the smaller one, so every tree is
+// rooted at the smallest index in its component no matter which order the
+// links are added in.  The final labels therefore match the GPU exactly.
+
+#include "labeling_allegretti_2019_BKE_cpu.h"
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+
+#include "glog/logging.h"
+#include "parallel_for.h"
+
+namespace {
+
+using frc971::apriltag::kMaxParallelChunks;
+using frc971::apriltag::ParallelFor;
+using frc971::apriltag::WorkerCount;
+
+// Smallest strip of block rows to hand to a worker.  Each strip adds a border
+// to stitch, so there is no point in making them tiny.
+constexpr size_t kMinBlockRows = 8;
+
+//         This is a block-based algorithm.
+// Blocks are 2x2 sized, with internal pixels named as:
+//                       +---+
+//                       |a b|
+//                       |c d|
+//                       +---+
+//
+//       Neighbour blocks of block X are named as:
+//                      +-+-+-+
+//                      |P|Q|R|
+//                      +-+-+-+
+//                      |S|X|
+//                      +-+-+
+
+enum class Info : uint8_t {
+  a = 0,
+  b = 1,
+  c = 2,
+  d = 3,
+  P = 4,
+  Q = 5,
+  R = 6,
+  S = 7
+};
+
+// Only use it with unsigned numeric types
+template <typename T>
+inline uint8_t HasBit(const T bitmap, Info pos) {
+  return (bitmap >> static_cast<uint8_t>(pos)) & 1;
+}
+
+template <typename T>
+inline uint8_t HasBit(const T bitmap, uint8_t pos) {
+  return (bitmap >> pos) & 1;
+}
+
+// Only use it with unsigned numeric types
+inline void SetBit(uint8_t &bitmap, Info pos) {
+  bitmap |= (1 << static_cast<uint8_t>(pos));
+}
+
+// How the union find trees are accessed.  While labeling a strip, a worker is
+// the only one touching the trees in it.  Once the strips are stitched
+// together, other workers walk and compress the same trees, so every access
+// goes through an atomic.
+enum class Access { kLocal, kShared };
+
+template <Access kAccess>
+inline uint32_t Load(uint32_t *s_buf, uint32_t n) {
+  if constexpr (kAccess == Access::kLocal) {
+    return s_buf[n];
+  } else {
+    return std::atomic_ref<uint32_t>(s_buf[n]).load(std::memory_order_relaxed);
+  }
+}
+
+template <Access kAccess>
+inline void Store(uint32_t *s_buf, uint32_t n, uint32_t value) {
+  if constexpr (kAccess == Access::kLocal) {
+    s_buf[n] = value;
+  } else {
+    std::atomic_ref<uint32_t>(s_buf[n]).store(value,
+                                              std::memory_order_relaxed);
+  }
+}
+
+// Sets s_buf[n] to min(s_buf[n], value) and returns the old value.
+template <Access kAccess>
+inline uint32_t AtomicMin(uint32_t *s_buf, uint32_t n, uint32_t value) {
+  if constexpr (kAccess == Access::kLocal) {
+    const uint32_t old = s_buf[n];
+    if (value < old) {
+      s_buf[n] = value;
+    }
+    return old;
+  } else {
+    std::atomic_ref<uint32_t> ref(s_buf[n]);
+    uint32_t old = ref.load(std::memory_order_relaxed);
+    while (value < old &&
+           !ref.compare_exchange_weak(old, value, std::memory_order_relaxed)) {
+    }
+    return old;
+  }
+}
+
+// Returns the root index of the UFTree
+template <Access kAccess>
+uint32_t Find(uint32_t *s_buf, uint32_t n) {
+  uint32_t parent;
+  while ((parent = Load<kAccess>(s_buf, n)) != n) {
+    n = parent;
+  }
+  return n;
+}
+
+// Returns the root index of the UFTree, re-assigning ourselves as we go.
+template <Access kAccess>
+uint32_t FindAndCompress(uint32_t *s_buf, uint32_t n) {
+  uint32_t id = n;
+  uint32_t parent;
+  while ((parent = Load<kAccess>(s_buf, n)) != n) {
+    n = parent;
+    Store<kAccess>(s_buf, id, n);
+  }
+  return n;
+}
+
+// Merges the UFTrees of a and b, linking one root to the other
+template <Access kAccess>
+void Union(uint32_t *s_buf, uint32_t a, uint32_t b) {
+  bool done;
+
+  do {
+    a = Find<kAccess>(s_buf, a);
+    b = Find<kAccess>(s_buf, b);
+
+    if (a < b) {
+      uint32_t old = AtomicMin<kAccess>(s_buf, b, a);
+      done = (old == b);
+      b = old;
+    } else if (b < a) {
+      uint32_t old = AtomicMin<kAccess>(s_buf, a, b);
+      done = (old == a);
+      a = old;
+    } else {
+      done = true;
+    }
+
+  } while (!done);
+}
+
+// Writes a pair of labels to the 2 adjacent slots starting at index.  This is
+// the host equivalent of the 64 bit stores in the kernels.
+inline void StorePair(uint32_t *data, uint32_t index, uint32_t low,
+                      uint32_t high) {
+  data[index] = low;
+  data[index + 1] = high;
+}
+
+// Initializes the labels for a block to hold the masks, info, and UF tree
+// pointers needed for the next steps.  top_row is the first pixel row of the
+// strip.  Blocks above it belong to another strip and are linked in by
+// MergeStripBorder instead.
+void InitLabeling(const GpuImage<uint8_t> img, GpuImage<uint32_t> labels,
+                  unsigned top_row, unsigned row, unsigned col) {
+  const uint32_t img_index = row * img.step + col;
+  const uint32_t foreground_labels_index = row * labels.step + col;
+  const uint32_t background_labels_index = (row + 1) * labels.step + col;
+
+  uint32_t P_foreground = 0;
+  uint32_t P_background = 0;
+
+  // Bitmask representing two kinds of information
+  // Bits 0, 1, 2, 3 are set if pixel a, b, c, d are foreground, respectively
+  // Bits 4, 5, 6, 7 are set if block P, Q, R, S need to be merged to X in
+  // Merge phase
+  uint8_t info_foreground = 0;
+  uint8_t info_left_background = 0;
+  uint8_t info_right_background = 0;
+
+  const uint8_t buffer[4] = {
+      img.data[img_index],
+      img.data[img_index + 1],
+      img.data[img_index + img.step],
+      img.data[img_index + img.step + 1],
+  };
+
+  // P is a bitmask saying where to check.
+  //
+  //                     0  1  2  3
+  //                       +----+
+  //                     4 |a  b| 7
+  //                     8 |c  d| 11
+  //                       +----+
+  //                    12  13 14 15
+  if (buffer[0] == 255u) {
+    P_foreground |= 0x777;
+    SetBit(info_foreground, Info::a);
+  } else if (buffer[0] == 0u) {
+    // This is the background, we are only doing 4 way connectivity, only look
+    // in the 4 directions.
+    P_background |= 0x272;
+    SetBit(info_left_background, Info::a);
+  }
+
+  if (buffer[1] == 255u) {
+    P_foreground |= (0x777 << 1);
+    SetBit(info_foreground, Info::b);
+  } else if (buffer[1] == 0u) {
+    P_background |= (0x272 << 1);
+    SetBit(info_right_background, Info::b);
+  }
+
+  if (buffer[2] == 255u) {
+    P_foreground |= (0x777 << 4);
+    SetBit(info_foreground, Info::c);
+  } else if (buffer[2] == 0u) {
+    P_background |= (0x272 << 4);
+    SetBit(info_left_background, Info::c);
+  }
+
+  if (buffer[3] == 255u) {
+    SetBit(info_foreground, Info::d);
+  } else if (buffer[3] == 0u) {
+    SetBit(info_right_background, Info::d);
+  }
+
+  if (col == 0) {
+    P_foreground &= 0xEEEE;
+    P_background &= 0xEEEE;
+  }
+  if (col + 2 >= img.cols) {
+    P_foreground &= 0x7777;
+    P_background &= 0x7777;
+  }
+
+  if (row == top_row) {
+    P_foreground &= 0xFFF0;
+    P_background &= 0xFFF0;
+  }
+  if (row + 2 >= img.rows) {
+    P_foreground &= 0x0FFF;
+    P_background &= 0x0FFF;
+  }
+
+  // P is now ready to be used to find neighbour blocks
+  // P value avoids range errors
+  int father_offset_foreground = 0;
+  int father_offset_left_background = 0;
+  int father_offset_right_background = 0;
+
+  // P square
+  if (HasBit(P_foreground, 0) && img.data[img_index - img.step - 1] == 255u) {
+    father_offset_foreground = -(2 * (labels.step) + 2);
+  }
+
+  // Q square
+  if ((HasBit(P_foreground, 1) && img.data[img_index - img.step] == 255u) ||
+      (HasBit(P_foreground, 2) && img.data[img_index + 1 - img.step] == 255u)) {
+    if (!father_offset_foreground) {
+      father_offset_foreground = -(2 * (labels.step));
+    } else {
+      SetBit(info_foreground, Info::Q);
+    }
+  }
+  if ((HasBit(P_background, 1) && img.data[img_index - img.step] == 0u)) {
+    father_offset_left_background = -2 * labels.step;
+  }
+  if ((HasBit(P_background, 2) && img.data[img_index + 1 - img.step] == 0u)) {
+    father_offset_right_background = -2 * labels.step;
+  }
+
+  // R square
+  if (HasBit(P_foreground, 3) && img.data[img_index + 2 - img.step] == 255u) {
+    if (!father_offset_foreground) {
+      father_offset_foreground = -(2 * (labels.step) - 2);
+    } else {
+      SetBit(info_foreground, Info::R);
+    }
+  }
+
+  // S square
+  if ((HasBit(P_foreground, 4) && img.data[img_index - 1] == 255u) ||
+      (HasBit(P_foreground, 8) && img.data[img_index + img.step - 1] == 255u)) {
+    if (!father_offset_foreground) {
+      father_offset_foreground = -2;
+    } else {
+      SetBit(info_foreground, Info::S);
+    }
+  }
+  if ((HasBit(P_background, 4) && img.data[img_index - 1] == 0u) ||
+      (HasBit(P_background, 8) && img.data[img_index + img.step - 1] == 0u)) {
+    if (!father_offset_left_background) {
+      father_offset_left_background = -1;
+    } else {
+      SetBit(info_left_background, Info::S);
+    }
+  }
+
+  if ((HasBit(info_left_background, Info::a) &&
+       HasBit(info_right_background, Info::b)) ||
+      (HasBit(info_left_background, Info::c) &&
+       HasBit(info_right_background, Info::d))) {
+    if (!father_offset_right_background) {
+      father_offset_right_background = -1;
+    } else {
+      SetBit(info_right_background, Info::S);
+    }
+  }
+
+  // Now, write everything back out to memory.
+  StorePair(labels.data, foreground_labels_index,
+            foreground_labels_index + father_offset_foreground,
+            static_cast<uint32_t>(info_foreground) |
+                (static_cast<uint32_t>(info_left_background) << 8) |
+                (static_cast<uint32_t>(info_right_background) << 16));
+
+  StorePair(labels.data, background_labels_index,
+            background_labels_index + father_offset_left_background,
+            background_labels_index + father_offset_right_background + 1);
+}
+
+template <Access kAccess>
+void Compression(GpuImage<uint32_t> labels, unsigned row, unsigned col) {
+  const uint32_t foreground_labels_index = row * labels.step + col;
+  const uint32_t background_labels_index = (row + 1) * labels.step + col;
+
+  FindAndCompress<kAccess>(labels.data, foreground_labels_index);
+  FindAndCompress<kAccess>(labels.data, background_labels_index);
+  FindAndCompress<kAccess>(labels.data, background_labels_index + 1);
+}
+
+// Merges the trees within a strip.
+void Merge(GpuImage<uint32_t> labels, unsigned row, unsigned col) {
+  const uint32_t foreground_labels_index = row * labels.step + col;
+  const uint32_t background_labels_index = (row + 1) * labels.step + col;
+
+  const uint32_t info = labels.data[foreground_labels_index + 1];
+
+  const uint8_t info_foreground = info & 0xff;
+  const uint8_t info_left_background = (info >> 8) & 0xff;
+  const uint8_t info_right_background = (info >> 16) & 0xff;
+
+  if (HasBit(info_foreground, Info::Q)) {
+    Union<Access::kLocal>(labels.data, foreground_labels_index,
+                          foreground_labels_index - 2 * (labels.step));
+  }
+
+  if (HasBit(info_foreground, Info::R)) {
+    Union<Access::kLocal>(labels.data, foreground_labels_index,
+                          foreground_labels_index - 2 * (labels.step) + 2);
+  }
+
+  if (HasBit(info_foreground, Info::S)) {
+    Union<Access::kLocal>(labels.data, foreground_labels_index,
+                          foreground_labels_index - 2);
+  }
+
+  if (HasBit(info_left_background, Info::S)) {
+    Union<Access::kLocal>(labels.data, background_labels_index,
+                          background_labels_index - 1);
+  }
+  if (HasBit(info_right_background, Info::S)) {
+    Union<Access::kLocal>(labels.data, background_labels_index + 1,
+                          background_labels_index);
+  }
+}
+
+// Links a block in the top row of a strip to the blocks above it in the
+// previous strip.  These are the same P, Q and R links InitLabeling masks off
+// at the top of the strip.
+void MergeStripBorder(const GpuImage<uint8_t> img, GpuImage<uint32_t> labels,
+                      unsigned row, unsigned col) {
+  const uint32_t img_index = row * img.step + col;
+  const uint32_t foreground_labels_index = row * labels.step + col;
+  const uint32_t background_labels_index = (row + 1) * labels.step + col;
+
+  const uint8_t a = img.data[img_index];
+  const uint8_t b = img.data[img_index + 1];
+  const uint8_t above_a = img.data[img_index - img.step];
+  const uint8_t above_b = img.data[img_index + 1 - img.step];
+
+  // Foreground is 8 way connected, so a reaches P and Q, and b reaches Q and
+  // R.
+  if (a == 255u && col > 0 && img.data[img_index - img.step - 1] == 255u) {
+    Union<Access::kShared>(labels.data, foreground_labels_index,
+                           foreground_labels_index - 2 * labels.step - 2);
+  }
+  if ((a == 255u || b == 255u) && (above_a == 255u || above_b == 255u)) {
+    Union<Access::kShared>(labels.data, foreground_labels_index,
+                           foreground_labels_index - 2 * labels.step);
+  }
+  if (b == 255u && col + 2 < img.cols &&
+      img.data[img_index - img.step + 2] == 255u) {
+    Union<Access::kShared>(labels.data, foreground_labels_index,
+                           foreground_labels_index - 2 * labels.step + 2);
+  }
+
+  // Background is 4 way connected, so a and b only reach the pixel directly
+  // above, which is in the matching background tree of Q.
+  if (a == 0u && above_a == 0u) {
+    Union<Access::kShared>(labels.data, background_labels_index,
+                           background_labels_index - 2 * labels.step);
+  }
+  if (b == 0u && above_b == 0u) {
+    Union<Access::kShared>(labels.data, background_labels_index + 1,
+                           background_labels_index + 1 - 2 * labels.step);
+  }
+}
+
+inline void AtomicAdd(uint32_t *data, uint32_t index, uint32_t count) {
+  std::atomic_ref<uint32_t>(data[index])
+      .fetch_add(count, std::memory_order_relaxed);
+}
+
+void FinalLabeling(GpuImage<uint32_t> labels,
+                   GpuImage<uint32_t> union_markers_size, unsigned row,
+                   unsigned col) {
+  const uint32_t foreground_labels_index = row * labels.step + col;
+  const uint32_t background_labels_index = (row + 1) * labels.step + col;
+
+  const uint32_t foreground_label = labels.data[foreground_labels_index];
+  const uint32_t info = labels.data[foreground_labels_index + 1];
+  const uint8_t foreground_info = info & 0xFF;
+  const uint32_t background_left_label = labels.data[background_labels_index];
+  const uint32_t background_right_label =
+      labels.data[background_labels_index + 1];
+  const uint8_t background_left_info = (info >> 8) & 0xFF;
+  const uint8_t background_right_info = (info >> 16) & 0xFF;
+
+  uint32_t a_label;
+  uint32_t b_label;
+  uint32_t c_label;
+  uint32_t d_label;
+
+  if ((foreground_info & 0xf) == 0u && (background_left_info & 0xf) == 0u &&
+      (background_right_info & 0xf) == 0u) {
+    a_label = foreground_labels_index;
+    b_label = foreground_labels_index + 1;
+    c_label = background_labels_index;
+    d_label = background_labels_index + 1;
+    StorePair(labels.data, foreground_labels_index, a_label, b_label);
+    StorePair(labels.data, background_labels_index, c_label, d_label);
+    return;
+  } else {
+    a_label = (HasBit(foreground_info, Info::a) * foreground_label +
+               HasBit(background_left_info, Info::a) * background_left_label);
+    b_label = HasBit(foreground_info, Info::b) * foreground_label +
+              HasBit(background_right_info, Info::b) * background_right_label;
+    c_label = HasBit(foreground_info, Info::c) * foreground_label +
+              HasBit(background_left_info, Info::c) * background_left_label;
+    d_label = HasBit(foreground_info, Info::d) * foreground_label +
+              HasBit(background_right_info, Info::d) * background_right_label;
+
+    StorePair(labels.data, foreground_labels_index, a_label, b_label);
+    StorePair(labels.data, background_labels_index, c_label, d_label);
+  }
+
+  if ((foreground_info & 0xf) != 0u) {
+    // We've got foreground!
+    uint32_t count = HasBit(foreground_info, Info::a) +
+                     HasBit(foreground_info, Info::b) +
+                     HasBit(foreground_info, Info::c) +
+                     HasBit(foreground_info, Info::d);
+
+    AtomicAdd(union_markers_size.data, foreground_label, count);
+  }
+
+  if ((background_left_info & 0xf) == 0u &&
+      (background_right_info & 0xf) == 0u) {
+    return;
+  }
+
+  if ((background_left_info & 0xf) != 0u &&
+      (background_right_info & 0xf) != 0u &&
+      background_left_label == background_right_label) {
+    // They are all populated and match, go for it.
+    uint32_t count = HasBit(background_left_info, Info::a) +
+                     HasBit(background_right_info, Info::b) +
+                     HasBit(background_left_info, Info::c) +
+                     HasBit(background_right_info, Info::d);
+
+    AtomicAdd(union_markers_size.data, background_left_label, count);
+    return;
+  }
+
+  if ((background_left_info & 0xf) != 0u) {
+    uint32_t count = HasBit(background_left_info, Info::a) +
+                     HasBit(background_left_info, Info::c);
+    AtomicAdd(union_markers_size.data, background_left_label, count);
+  }
+
+  if ((background_right_info & 0xf) != 0u) {
+    uint32_t count = HasBit(background_right_info, Info::b) +
+                     HasBit(background_right_info, Info::d);
+    AtomicAdd(union_markers_size.data, background_right_label, count);
+  }
+}
+
+// Runs fn(row, col) for every 2x2 block in block rows [begin, end).
+template <typename F>
+void ForEachBlock(size_t begin, size_t end, size_t cols, const F &fn) {
+  for (size_t block_row = begin; block_row < end; ++block_row) {
+    for (size_t col = 0; col < cols; col += 2) {
+      fn(block_row * 2, col);
+    }
+  }
+}
+
+}  // namespace
+
+void CpuLabelImage(const GpuImage<uint8_t> input, GpuImage<uint32_t> output,
+                   GpuImage<uint32_t> union_markers_size, workerpool_t *wp) {
+  CHECK_NE(input.rows, 1u);
+  CHECK_NE(input.cols, 1u);
+
+  // Need an even number of rows and colums, we don't need to solve the actual
+  // hard problems...
+  CHECK_EQ(input.rows % 2, 0u);
+  CHECK_EQ(input.cols % 2, 0u);
+
+  const size_t block_rows = output.rows / 2;
+  const size_t cols = output.cols;
+  const size_t strips = std::max<size_t>(
+      1, std::min({WorkerCount(wp), block_rows / kMinBlockRows,
+                   kMaxParallelChunks}));
+  // Block row each strip starts at.
+  std::array<size_t, kMaxParallelChunks + 1> strip_begin;
+  for (size_t i = 0; i <= strips; ++i) {
+    strip_begin[i] = block_rows * i / strips;
+  }
+
+  // Label each strip on its own.
+  ParallelFor(wp, 0, strips, 1, [&](size_t begin, size_t end) {
+    for (size_t strip = begin; strip < end; ++strip) {
+      const size_t first = strip_begin[strip];
+      const size_t last = strip_begin[strip + 1];
+      const unsigned top_row = first * 2;
+      ForEachBlock(first, last, cols, [&](unsigned row, unsigned col) {
+        InitLabeling(input, output, top_row, row, col);
+      });
+      ForEachBlock(first, last, cols, [&](unsigned row, unsigned col) {
+        Compression<Access::kLocal>(output, row, col);
+      });
+      ForEachBlock(first, last, cols, [&](unsigned row, unsigned col) {
+        Merge(output, row, col);
+      });
+      ForEachBlock(first, last, cols, [&](unsigned row, unsigned col) {
+        Compression<Access::kLocal>(output, row, col);
+      });
+    }
+  });
+
+  // Stitch the strips together.  A blob can cross several borders, so the
+  // borders share trees.
+  ParallelFor(wp, 1, strips, 1, [&](size_t begin, size_t end) {
+    for (size_t strip = begin; strip < end; ++strip) {
+      const size_t first = strip_begin[strip];
+      ForEachBlock(first, first + 1, cols, [&](unsigned row, unsigned col) {
+        MergeStripBorder(input, output, row, col);
+      });
+    }
+  });
+
+  // Point everything at the final roots before any block overwrites its tree
+  // pointers with labels.
+  ParallelFor(wp, 0, strips, 1, [&](size_t begin, size_t end) {
+    ForEachBlock(strip_begin[begin], strip_begin[end], cols,
+                 [&](unsigned row, unsigned col) {
+                   Compression<Access::kShared>(output, row, col);
+                 });
+  });
+
+  ParallelFor(wp, 0, strips, 1, [&](size_t begin, size_t end) {
+    ForEachBlock(strip_begin[begin], strip_begin[end], cols,
+                 [&](unsigned row, unsigned col) {
+                   FinalLabeling(output, union_markers_size, row, col);
+                 });
+  });
+}
@@ -0,0 +1,17 @@
+#ifndef FRC971_ORIN_LABELING_ALLEGRETTI_2019_BKE_CPU_H_
+#define FRC971_ORIN_LABELING_ALLEGRETTI_2019_BKE_CPU_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "apriltag.h"
+#include "gpu_image.h"
+
+// Host version of LabelImage.  Runs the same block based union find on the
+// worker pool, labeling a strip of rows per worker and then merging across the
+// strip borders, and produces identical labels and blob sizes.
+// union_markers_size must be zeroed before calling.
+void CpuLabelImage(const GpuImage<uint8_t> input, GpuImage<uint32_t> output,
+                   GpuImage<uint32_t> union_markers_size, workerpool_t *wp);
+
+#endif  // FRC971_ORIN_LABELING_ALLEGRETTI_2019_BKE_CPU_H_
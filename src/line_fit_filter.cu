@@ -9,7 +9,7 @@
 
 namespace frc971::apriltag {
 
-static_assert(sizeof(LineFitPoint) == 40, "Size of LineFitPoint changed");
+static_assert(sizeof(LineFitPoint) == 32, "Size of LineFitPoint changed");
 static_assert(sizeof(int4) == 16, "Size of int4 changed");
 
 constexpr size_t kPointsPerBlock = 256;
@@ -106,7 +106,7 @@ class ErrorCalculator {
   __host__ __device__ void LoadExtents(size_t index) {
     const size_t current_blob_index =
         storage_->tmp_storage[index + (blockIdx.x == 0 ? 0 : kErrorsBuffer)]
-            .blob_index;
+            .blob_index();
     if (current_blob_index != blob_index_) {
       starting_offset_ =
           selected_extents_device_[current_blob_index].value.starting_offset;
@@ -226,58 +226,31 @@ class ErrorCalculator {
     const size_t global_i0 = i0 + starting_offset_;
     const size_t global_i1 = i1 + starting_offset_;
 
-    int32_t Mx, My, W;
-    int64_t Mxx, Myy, Mxy;
+    LineFitPoint sum;
     int N;  // how many points are included in the set?
 
     if (i0 < i1) {
       N = i1 - i0 + 1;
 
-      LineFitPoint lf1 = GetPoint(global_i1);
-
-      Mx = lf1.Mx;
-      My = lf1.My;
-      Mxx = lf1.Mxx;
-      Mxy = lf1.Mxy;
-      Myy = lf1.Myy;
-      W = lf1.W;
+      sum = GetPoint(global_i1);
 
       if (i0 > 0) {
-        LineFitPoint lf0 = GetPoint(global_i0 - 1);
-
-        Mx -= lf0.Mx;
-        My -= lf0.My;
-        Mxx -= lf0.Mxx;
-        Mxy -= lf0.Mxy;
-        Myy -= lf0.Myy;
-        W -= lf0.W;
+        sum = sum - GetPoint(global_i0 - 1);
       }
     } else {
       // i0 > i1, e.g. [15, 2]. Wrap around.
       LineFitPoint lf0 = GetPoint(global_i0 - 1, print);
       LineFitPoint lfsz = GetPoint(starting_offset_ + count_ - 1, print);
-
-      Mx = lfsz.Mx - lf0.Mx;
-      My = lfsz.My - lf0.My;
-      Mxx = lfsz.Mxx - lf0.Mxx;
-      Mxy = lfsz.Mxy - lf0.Mxy;
-      Myy = lfsz.Myy - lf0.Myy;
-      W = lfsz.W - lf0.W;
-
       LineFitPoint lf1 = GetPoint(global_i1, print);
 
-      Mx += lf1.Mx;
-      My += lf1.My;
-      Mxx += lf1.Mxx;
-      Mxy += lf1.Mxy;
-      Myy += lf1.Myy;
-      W += lf1.W;
+      sum = lfsz - lf0 + lf1;
 
       N = count_ - i0 + i1 + 1;
     }
 
     // And now fit it.
-    return FitLineError(N, Mx, My, Mxx, Myy, Mxy, W);
+    return FitLineError(N, sum.Mx(), sum.My(), sum.Mxx(), sum.Myy(), sum.Mxy(),
+                        sum.W());
   }
 
   // Returns the starting global index of the region we are responsible for
@@ -447,12 +420,12 @@ __global__ void DoFitLines(
     for (int i = (int)calculator.global_block_index_cache_start_;
          i < (int)calculator.global_block_index_cache_end_; ++ i) {
       auto x = calculator.GetPoint(i);
-      if (x.blob_index == DEBUG_BLOB_NUMBER) {
+      if (x.blob_index() == DEBUG_BLOB_NUMBER) {
         printf("Block %d Thread %d   Loading global %d, relative %d, Mx: %f\n",
                blockIdx.x, threadIdx.x, i,
-               (int)(i - calculator.selected_extents_device_[x.blob_index]
+               (int)(i - calculator.selected_extents_device_[x.blob_index()]
                              .value.starting_offset),
-               x.Mx / 2.0);
+               x.Mx() / 2.0);
       }
     }
   }
@@ -749,54 +722,22 @@ __device__ __host__ cuda::std::pair<uint, uint> GetM0M1(uint tid) {
 __host__ __device__ __forceinline__ LineFitMoments
 ReadMoments(const LineFitPoint *line_fit_points_device, size_t blob_point_count,
             size_t index0, size_t index1) {
-  LineFitMoments result;
-
   if (index0 < index1) {
-    result.N = index1 - index0 + 1;
-
-    LineFitPoint lf1 = line_fit_points_device[index1];
-
-    result.Mx = lf1.Mx;
-    result.My = lf1.My;
-    result.Mxx = lf1.Mxx;
-    result.Mxy = lf1.Mxy;
-    result.Myy = lf1.Myy;
-    result.W = lf1.W;
+    LineFitPoint sum = line_fit_points_device[index1];
 
     if (index0 > 0) {
-      LineFitPoint lf0 = line_fit_points_device[index0 - 1];
-
-      result.Mx -= lf0.Mx;
-      result.My -= lf0.My;
-      result.Mxx -= lf0.Mxx;
-      result.Mxy -= lf0.Mxy;
-      result.Myy -= lf0.Myy;
-      result.W -= lf0.W;
+      sum = sum - line_fit_points_device[index0 - 1];
     }
+    return sum.ToMoments(index1 - index0 + 1);
   } else {
     // index0 > index1, e.g. [15, 2]. Wrap around.
     LineFitPoint lf0 = line_fit_points_device[index0 - 1];
     LineFitPoint lfsz = line_fit_points_device[blob_point_count - 1];
-
-    result.Mx = lfsz.Mx - lf0.Mx;
-    result.My = lfsz.My - lf0.My;
-    result.Mxx = lfsz.Mxx - lf0.Mxx;
-    result.Mxy = lfsz.Mxy - lf0.Mxy;
-    result.Myy = lfsz.Myy - lf0.Myy;
-    result.W = lfsz.W - lf0.W;
-
     LineFitPoint lf1 = line_fit_points_device[index1];
 
-    result.Mx += lf1.Mx;
-    result.My += lf1.My;
-    result.Mxx += lf1.Mxx;
-    result.Mxy += lf1.Mxy;
-    result.Myy += lf1.Myy;
-    result.W += lf1.W;
-
-    result.N = blob_point_count - index0 + index1 + 1;
+    return (lfsz - lf0 + lf1)
+        .ToMoments(blob_point_count - index0 + index1 + 1);
   }
-  return result;
 }
 
 __device__ void FitLine(LineFitMoments moments, double *lineparam01,
@@ -1217,16 +1158,4 @@ void FitQuads(
       fit_quads_device);
 }
 
-std::ostream &operator<<(std::ostream &os,
-                         const frc971::apriltag::LineFitMoments &moments) {
-  os << "{Mx:" << std::setprecision(20) << moments.Mx / 2.
-     << ", My:" << std::setprecision(20) << moments.My / 2.
-     << ", Mxx:" << std::setprecision(20) << moments.Mxx / 4.
-     << ", Mxy:" << std::setprecision(20) << moments.Mxy / 4.
-     << ", Myy:" << std::setprecision(20) << moments.Myy / 4.
-     << ", W:" << std::setprecision(20) << moments.W << ", N:" << moments.N
-     << "}";
-  return os;
-}
-
 }  // namespace frc971::apriltag
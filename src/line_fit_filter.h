@@ -1,12 +1,19 @@
 #ifndef FRC971_ORIN_LINE_FIT_FILTER_H_
 #define FRC971_ORIN_LINE_FIT_FILTER_H_
 
+#include <stdint.h>
+
+#include <array>
+#include <ostream>
+
+#ifdef __CUDACC__
 #include <cub/iterator/transform_input_iterator.cuh>
 #include <cuda/std/tuple>
 
 #include "cuda_frc971.h"
-#include "cuda_runtime.h"
-#include "device_launch_parameters.h"
+#endif
+
+#include "host_device.h"
 
 namespace frc971::apriltag {
 
@@ -58,34 +65,10 @@ struct MinMaxExtents {
   }
 };
 
-__align__(16) struct LineFitPoint {
-  // TODO(austin): How much precision do we actually need?  The less, the
-  // faster...  The less memory too, the faster.
-  //
-  // Is it the double's or the memory which makes us slow?  Could probably bit
-  // pack ints in here...
-  int64_t Mxx;
-  int64_t Myy;
-  int64_t Mxy;
-  // TODO(austin): These both fit in 4 byte numbers :)
-  // There are at most 2 * (width + height) -> 13 bits points in a blob.
-  // The weight can be at most 8 bits (probably 9 because it has a sign).
-  // A point has 11 bits of position data in it.
-  //
-  // To do this with sub bit precision:
-  //   2 * (1088 + 1456) * 1456 * 255 -> 0x7098f600
-  //
-  // Which is < 31 bits, so we can hold a sign bit too!
-  int32_t Mx;
-  int32_t My;
-  int32_t W;
-  uint32_t blob_index;
-};
-
 struct LineFitMoments {
   // See LineFitPoint for more info.
-  int32_t Mx;
-  int32_t My;
+  int64_t Mx;
+  int64_t My;
   int32_t W;
   int64_t Mxx;
   int64_t Myy;
@@ -93,6 +76,169 @@ struct LineFitMoments {
   int N;  // how many points are included in the set?
 };
 
+// The cumulative weighted moments of the points in a blob, from the first point
+// up to and including this one.  Coordinates are doubled to keep the half
+// pixel precision, and the weight is the gradient magnitude.
+//
+// All the moments are non-negative integers with a known upper bound, so
+// rather than spending 64 bits on each, they are bit packed into a single 256
+// bit integer:
+//
+//   bits   0 -  22  W    (23 bits)
+//   bits  23 -  59  Mx   (37 bits)
+//   bits  60 -  96  My   (37 bits)
+//   bits  97 - 145  Mxx  (49 bits)
+//   bits 146 - 194  Myy  (49 bits)
+//   bits 195 - 243  Mxy  (49 bits)
+//   bits 244 - 255  blob index (12 bits)
+//
+// Adding or subtracting two points is then a single 256 bit add or subtract.
+// As long as no field overflows (see Fits), no carry or borrow crosses from one
+// field into the next.  This is 32 bytes instead of the 40 bytes it takes to
+// hold each moment in its own integer, and the scans and loads move that much
+// less memory.
+struct __align__(16) LineFitPoint {
+  // Largest weight a single point can have.  The weight is hypot(gx, gy) + 1
+  // with gx and gy between -255 and 255.
+  static constexpr uint64_t kMaxWeight = 361;
+
+  static constexpr uint32_t kWBits = 23;
+  static constexpr uint32_t kFirstMomentBits = 37;
+  static constexpr uint32_t kSecondMomentBits = 49;
+
+  static constexpr uint32_t kWOffset = 0;
+  static constexpr uint32_t kMxOffset = kWOffset + kWBits;
+  static constexpr uint32_t kMyOffset = kMxOffset + kFirstMomentBits;
+  static constexpr uint32_t kMxxOffset = kMyOffset + kFirstMomentBits;
+  static constexpr uint32_t kMyyOffset = kMxxOffset + kSecondMomentBits;
+  static constexpr uint32_t kMxyOffset = kMyyOffset + kSecondMomentBits;
+  static constexpr uint32_t kBlobIndexOffset = kMxyOffset + kSecondMomentBits;
+  static constexpr uint32_t kBlobIndexBits = 256 - kBlobIndexOffset;
+
+  // Returns true if the moments of blobs with up to max_points points, all
+  // with doubled coordinates up to max_coordinate, fit in their fields.
+  static constexpr bool Fits(uint64_t max_points, uint64_t max_coordinate) {
+    const uint64_t max_w = max_points * kMaxWeight;
+    return max_w < (uint64_t(1) << kWBits) &&
+           max_w * max_coordinate < (uint64_t(1) << kFirstMomentBits) &&
+           max_w * max_coordinate * max_coordinate <
+               (uint64_t(1) << kSecondMomentBits);
+  }
+
+  // Returns the moments of a single point with weight W at the doubled
+  // coordinates (ix2, iy2).
+  __host__ __device__ static LineFitPoint FromPoint(uint32_t W, uint32_t ix2,
+                                                    uint32_t iy2,
+                                                    uint32_t blob_index) {
+    LineFitPoint result = {};
+    const uint64_t Mx = static_cast<uint64_t>(W) * ix2;
+    const uint64_t My = static_cast<uint64_t>(W) * iy2;
+    result.Insert(kWOffset, W);
+    result.Insert(kMxOffset, Mx);
+    result.Insert(kMyOffset, My);
+    result.Insert(kMxxOffset, Mx * ix2);
+    result.Insert(kMyyOffset, My * iy2);
+    result.Insert(kMxyOffset, Mx * iy2);
+    result.Insert(kBlobIndexOffset, blob_index);
+    return result;
+  }
+
+  __host__ __device__ __forceinline__ int32_t W() const {
+    return static_cast<int32_t>(Extract(kWOffset, kWBits));
+  }
+  __host__ __device__ __forceinline__ int64_t Mx() const {
+    return Extract(kMxOffset, kFirstMomentBits);
+  }
+  __host__ __device__ __forceinline__ int64_t My() const {
+    return Extract(kMyOffset, kFirstMomentBits);
+  }
+  __host__ __device__ __forceinline__ int64_t Mxx() const {
+    return Extract(kMxxOffset, kSecondMomentBits);
+  }
+  __host__ __device__ __forceinline__ int64_t Myy() const {
+    return Extract(kMyyOffset, kSecondMomentBits);
+  }
+  __host__ __device__ __forceinline__ int64_t Mxy() const {
+    return Extract(kMxyOffset, kSecondMomentBits);
+  }
+  __host__ __device__ __forceinline__ uint32_t blob_index() const {
+    return static_cast<uint32_t>(Extract(kBlobIndexOffset, kBlobIndexBits));
+  }
+
+  // Returns the moments held in this point, for the N points they were summed
+  // from.
+  __host__ __device__ __forceinline__ LineFitMoments ToMoments(int N) const {
+    LineFitMoments result;
+    result.Mx = Mx();
+    result.My = My();
+    result.W = W();
+    result.Mxx = Mxx();
+    result.Myy = Myy();
+    result.Mxy = Mxy();
+    result.N = N;
+    return result;
+  }
+
+  // Adds and subtracts the moments of other.  The blob index of the left hand
+  // side is kept.
+  __host__ __device__ __forceinline__ LineFitPoint
+  operator+(const LineFitPoint &other) const {
+    LineFitPoint result;
+    uint64_t carry = 0;
+    for (int i = 0; i < 4; ++i) {
+      const uint64_t b = i == 3 ? other.bits[i] & kMomentsMask : other.bits[i];
+      const uint64_t sum = bits[i] + b;
+      result.bits[i] = sum + carry;
+      carry = (sum < b) | (result.bits[i] < sum);
+    }
+    return result;
+  }
+
+  __host__ __device__ __forceinline__ LineFitPoint
+  operator-(const LineFitPoint &other) const {
+    LineFitPoint result;
+    uint64_t borrow = 0;
+    for (int i = 0; i < 4; ++i) {
+      const uint64_t b = i == 3 ? other.bits[i] & kMomentsMask : other.bits[i];
+      const uint64_t difference = bits[i] - b;
+      result.bits[i] = difference - borrow;
+      borrow = (bits[i] < b) | (difference < borrow);
+    }
+    return result;
+  }
+
+  uint64_t bits[4];
+
+ private:
+  // Mask of the moments in the top word.
+  static constexpr uint64_t kMomentsMask =
+      (uint64_t(1) << (kBlobIndexOffset - 192)) - 1;
+
+  // Returns the width bits starting at bit offset.  width must be below 64,
+  // so the field spans at most 2 words.
+  __host__ __device__ __forceinline__ uint64_t Extract(uint32_t offset,
+                                                       uint32_t width) const {
+    const uint32_t word = offset / 64;
+    const uint32_t shift = offset % 64;
+    uint64_t result = bits[word] >> shift;
+    if (shift + width > 64) {
+      result |= bits[word + 1] << (64 - shift);
+    }
+    return result & ((uint64_t(1) << width) - 1);
+  }
+
+  // Ors value into the field starting at bit offset.  The field must be zero.
+  __host__ __device__ __forceinline__ void Insert(uint32_t offset,
+                                                  uint64_t value) {
+    const uint32_t word = offset / 64;
+    const uint32_t shift = offset % 64;
+    bits[word] |= value << shift;
+    if (shift != 0 && word + 1 < 4) {
+      bits[word + 1] |= value >> (64 - shift);
+    }
+  }
+};
+
 std::ostream &operator<<(std::ostream &os,
                          const frc971::apriltag::LineFitMoments &moments);
 
@@ -111,6 +257,7 @@ struct PeakExtents {
   uint32_t count;
 };
 
+#ifdef __CUDACC__
 struct PeakDecomposer {
   static constexpr size_t kBitsInKey = 16 + 32;
   __host__ __device__ ::cuda::std::tuple<uint16_t &, float &> operator()(
@@ -118,6 +265,7 @@ struct PeakDecomposer {
     return {key.blob_index, key.error};
   }
 };
+#endif  // __CUDACC__
 
 constexpr std::array<float, 7> FilterCoefficients() {
   return std::array<float, 7>{
@@ -134,6 +282,7 @@ struct FitQuad {
   LineFitMoments moments[4];
 };
 
+#ifdef __CUDACC__
 __device__ void FitLine(LineFitMoments moments, double *lineparam01,
                         double *lineparam23, double *err, double *mse);
 
@@ -156,6 +305,8 @@ void FitQuads(
 //
 // This lets us distribute work amoung the cuda threads and get back the index.
 __host__ __device__ std::tuple<uint, uint, uint, uint> Unrank(uint i);
+#endif  // __CUDACC__
+
 // The max number of work elements for a max maxes of 10.
 constexpr size_t MaxRankedIndex() { return 210; }
 
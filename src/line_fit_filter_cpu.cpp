@@ -0,0 +1,391 @@
+#include "line_fit_filter_cpu.h"
+
+#include <algorithm>
+#include <cmath>
+#include <iomanip>
+#include <limits>
+
+#include "glog/logging.h"
+#include "parallel_for.h"
+
+namespace frc971::apriltag {
+namespace {
+
+constexpr int kNMaxima = 10;
+
+// Number of points to hand to a worker at a time.
+constexpr size_t kMinPointsPerTask = 1024;
+
+double FitLineError(size_t N, int64_t Mx, int64_t My, int64_t Mxx, int64_t Myy,
+                    int64_t Mxy, int64_t W) {
+  int64_t Cxx = Mxx * W - Mx * Mx;
+  int64_t Cxy = Mxy * W - Mx * My;
+  int64_t Cyy = Myy * W - My * My;
+
+  // Pose it as an eigenvalue problem.
+  float eig_small = ((Cxx + Cyy) - std::hypotf((Cxx - Cyy), 2 * Cxy)) /
+                    static_cast<float>(W * W * 8.0);
+  return N * eig_small;
+}
+
+// Calculates the line fit error centered on the provided index in the blob
+// holding count points starting at blob_points.
+double CalculateError(const LineFitPoint *blob_points, size_t count, size_t ksz,
+                      size_t blob_index) {
+  // Index into the blob list for the current key.
+  const size_t i0 = (blob_index + 2 * count - ksz) % count;
+  const size_t i1 = (blob_index + count + ksz) % count;
+
+  LineFitPoint sum;
+  int N;  // how many points are included in the set?
+
+  if (i0 < i1) {
+    N = i1 - i0 + 1;
+
+    sum = blob_points[i1];
+
+    if (i0 > 0) {
+      sum = sum - blob_points[i0 - 1];
+    }
+  } else {
+    // i0 > i1, e.g. [15, 2]. Wrap around.
+    sum = blob_points[count - 1] - blob_points[i0 - 1] + blob_points[i1];
+
+    N = count - i0 + i1 + 1;
+  }
+
+  // And now fit it.
+  return FitLineError(N, sum.Mx(), sum.My(), sum.Mxx(), sum.Myy(), sum.Mxy(),
+                      sum.W());
+}
+
+struct QuadError {
+  uint8_t m0;
+  uint8_t m1;
+  uint8_t m2;
+  uint8_t m3;
+  double error;
+};
+
+// Fits the best quad to a single blob.  This follows DoFitQuads, with the work
+// of each thread in the block done in order.
+void FitBlobQuad(const Peak *peaks, const PeakExtents &extents,
+                 const MinMaxExtents &selected_extent,
+                 const LineFitPoint *line_fit_points, float max_line_fit_mse,
+                 double max_dot, FitQuad *fit_quad) {
+  const LineFitPoint *blob_points =
+      line_fit_points + selected_extent.starting_offset;
+  const uint32_t sz = selected_extent.count;
+
+  // Step 1, unsort the maxima back by point index.
+  constexpr size_t kItems = 16;
+  uint16_t point_indices[kItems];
+  for (size_t i = 0; i < kItems; ++i) {
+    if (i >= extents.count || i >= kNMaxima) {
+      point_indices[i] = std::numeric_limits<uint16_t>::max();
+    } else {
+      point_indices[i] =
+          peaks[i + extents.starting_offset].filtered_point_index -
+          selected_extent.starting_offset;
+    }
+  }
+  std::sort(point_indices, point_indices + kItems);
+
+  double errorm0m1[kNMaxima - 3][kNMaxima - 3];
+  double lineparams23m0m1[kNMaxima - 3][kNMaxima - 3][2];
+
+  if (extents.count >= 4) {
+    for (uint m0 = 0; m0 < kNMaxima - 3; m0++) {
+      for (uint m1 = m0 + 1; m1 < kNMaxima - 2; m1++) {
+        if (m1 < extents.count) {
+          double err01;
+          double mse01;
+          HostFitLine(HostReadMoments(blob_points, sz, point_indices[m0],
+                                      point_indices[m1]),
+                      nullptr, lineparams23m0m1[m0][m1 - 1], &err01, &mse01);
+
+          if (mse01 > max_line_fit_mse) {
+            err01 = std::numeric_limits<double>::max();
+          }
+
+          errorm0m1[m0][m1 - 1] = err01;
+        } else {
+          errorm0m1[m0][m1 - 1] = std::numeric_limits<double>::max();
+        }
+      }
+    }
+  }
+
+  // Scores a single combination of maxima.
+  auto fit_lines = [&](uint m0, uint m1, uint m2, uint m3) -> double {
+    if (extents.count < 4) {
+      return std::numeric_limits<double>::max();
+    }
+
+    if (m3 >= kNMaxima || m3 >= extents.count) {
+      return std::numeric_limits<double>::max();
+    }
+
+    const double errm0m1 = errorm0m1[m0][m1 - 1];
+    if (errm0m1 == std::numeric_limits<double>::max()) {
+      return std::numeric_limits<double>::max();
+    }
+
+    const double *paramsm0m123 = lineparams23m0m1[m0][m1 - 1];
+
+    double errm1m2;
+    double msem1m2;
+    double paramsm1m223[2];
+
+    const int i1 = point_indices[m1];
+    const int i2 = point_indices[m2];
+    HostFitLine(HostReadMoments(blob_points, sz, i1, i2), nullptr,
+                paramsm1m223, &errm1m2, &msem1m2);
+    if (msem1m2 > max_line_fit_mse) {
+      return std::numeric_limits<double>::max();
+    }
+
+    const double dot =
+        paramsm0m123[0] * paramsm1m223[0] + paramsm0m123[1] * paramsm1m223[1];
+    if (fabs(dot) > max_dot) {
+      return std::numeric_limits<double>::max();
+    }
+
+    const int i3 = point_indices[m3];
+
+    double errm2m3;
+    double msem2m3;
+    HostFitLine(HostReadMoments(blob_points, sz, i2, i3), nullptr, nullptr,
+                &errm2m3, &msem2m3);
+    if (msem2m3 > max_line_fit_mse) {
+      return std::numeric_limits<double>::max();
+    }
+
+    const int i0 = point_indices[m0];
+    double errm3m0;
+    double msem3m0;
+    HostFitLine(HostReadMoments(blob_points, sz, i3, i0), nullptr, nullptr,
+                &errm3m0, &msem3m0);
+    if (msem3m0 > max_line_fit_mse) {
+      return std::numeric_limits<double>::max();
+    }
+
+    return errm0m1 + errm1m2 + errm2m3 + errm3m0;
+  };
+
+  // Visit the combinations in the same order as Unrank, keeping the first of
+  // any ties like the block reduction does.
+  QuadError min_error;
+  bool first = true;
+  for (uint m0 = 0; m0 < kNMaxima - 3; ++m0) {
+    for (uint m1 = m0 + 1; m1 < kNMaxima - 2; ++m1) {
+      for (uint m2 = m1 + 1; m2 < kNMaxima - 1; ++m2) {
+        for (uint m3 = m2 + 1; m3 < kNMaxima; ++m3) {
+          QuadError quad_error;
+          quad_error.m0 = m0;
+          quad_error.m1 = m1;
+          quad_error.m2 = m2;
+          quad_error.m3 = m3;
+          quad_error.error = fit_lines(m0, m1, m2, m3);
+          if (first || !(min_error.error <= quad_error.error)) {
+            min_error = quad_error;
+            first = false;
+          }
+        }
+      }
+    }
+  }
+
+  const bool valid = min_error.error < max_line_fit_mse * sz;
+  fit_quad->valid = valid;
+  fit_quad->blob_index = extents.blob_index;
+  const uint32_t indices[4] = {
+      point_indices[min_error.m0],
+      point_indices[min_error.m1],
+      point_indices[min_error.m2],
+      point_indices[min_error.m3],
+  };
+  for (int i = 0; i < 4; ++i) {
+    fit_quad->indices[i] = indices[i];
+  }
+  for (int i = 0; i < 4; ++i) {
+    const uint32_t index0 = indices[i];
+    const uint32_t index1 = indices[(i + 1) % 4];
+    if (index0 < sz && index1 < sz) {
+      fit_quad->moments[i] = HostReadMoments(blob_points, sz, index0, index1);
+    } else {
+      // Blobs with less than 4 peaks are never valid, and have no points to
+      // read.
+      fit_quad->moments[i] = LineFitMoments{};
+    }
+  }
+}
+
+}  // namespace
+
+void HostFitLine(LineFitMoments moments, double *lineparam01,
+                 double *lineparam23, double *err, double *mse) {
+  int64_t Cxx = moments.Mxx * moments.W - static_cast<int64_t>(moments.Mx) *
+                                              static_cast<int64_t>(moments.Mx);
+  int64_t Cxy = moments.Mxy * moments.W - static_cast<int64_t>(moments.Mx) *
+                                              static_cast<int64_t>(moments.My);
+  int64_t Cyy = moments.Myy * moments.W - static_cast<int64_t>(moments.My) *
+                                              static_cast<int64_t>(moments.My);
+
+  // Pose it as an eigenvalue problem.
+  const float hypot_cached = std::hypotf((Cxx - Cyy), 2 * Cxy);
+  const float eight_w_squared = static_cast<float>(
+      static_cast<int64_t>(moments.W) * static_cast<int64_t>(moments.W) * 8.0);
+  const float eig_small = (Cxx + Cyy - hypot_cached) / eight_w_squared;
+
+  if (lineparam01) {
+    lineparam01[0] =
+        static_cast<float>(moments.Mx) / static_cast<float>(moments.W * 2);
+    lineparam01[1] =
+        static_cast<float>(moments.My) / static_cast<float>(moments.W * 2);
+  }
+  if (lineparam23) {
+    // These don't match the originals at all, but the math should come out
+    // right.  n{xy}{12} end up being multiplied by 8 W^2, and we compare the
+    // square but use hypot on nx, ny directly.  (and let the W^2 term come out
+    // as common to both the hypot and nxy terms.)
+    const float nx1 = static_cast<float>(Cxx - Cyy) - hypot_cached;
+    const float ny1 = Cxy * 2;
+    const float M1 = nx1 * nx1 + ny1 * ny1;
+    const float nx2 = Cxy * 2;
+    const float ny2 = static_cast<float>(Cyy - Cxx) - hypot_cached;
+    const float M2 = nx2 * nx2 + ny2 * ny2;
+
+    float nx, ny;
+    if (M1 > M2) {
+      nx = nx1;
+      ny = ny1;
+    } else {
+      nx = nx2;
+      ny = ny2;
+    }
+
+    float length = std::hypotf(nx, ny);
+    lineparam23[0] = nx / length;
+    lineparam23[1] = ny / length;
+  }
+
+  // sum of squared errors
+  *err = moments.N * eig_small;
+
+  // mean squared error
+  *mse = eig_small;
+}
+
+LineFitMoments HostReadMoments(const LineFitPoint *line_fit_points,
+                               size_t blob_point_count, size_t index0,
+                               size_t index1) {
+  if (index0 < index1) {
+    LineFitPoint sum = line_fit_points[index1];
+
+    if (index0 > 0) {
+      sum = sum - line_fit_points[index0 - 1];
+    }
+    return sum.ToMoments(index1 - index0 + 1);
+  } else {
+    // index0 > index1, e.g. [15, 2]. Wrap around.
+    const LineFitPoint sum = line_fit_points[blob_point_count - 1] -
+                             line_fit_points[index0 - 1] +
+                             line_fit_points[index1];
+    return sum.ToMoments(blob_point_count - index0 + index1 + 1);
+  }
+}
+
+void CpuFitLines(const LineFitPoint *line_fit_points, size_t points,
+                 const MinMaxExtents *selected_extents, double *errs,
+                 double *filtered_errs, Peak *peaks, workerpool_t *wp) {
+  // Compute the error of a line fit centered on each point.
+  ParallelFor(wp, 0, points, kMinPointsPerTask, [&](size_t begin, size_t end) {
+    for (size_t i = begin; i < end; ++i) {
+      const MinMaxExtents &extents =
+          selected_extents[line_fit_points[i].blob_index()];
+      const size_t ksz = std::min<int>(20, extents.count / 12);
+      errs[i] = CalculateError(line_fit_points + extents.starting_offset,
+                               extents.count, ksz,
+                               i - extents.starting_offset);
+    }
+  });
+
+  // Smooth the errors, wrapping around the blob.
+  ParallelFor(wp, 0, points, kMinPointsPerTask, [&](size_t begin, size_t end) {
+    for (size_t i = begin; i < end; ++i) {
+      const MinMaxExtents &extents =
+          selected_extents[line_fit_points[i].blob_index()];
+      const size_t count = extents.count;
+      const size_t blob_index = i - extents.starting_offset;
+
+      double accumulated_error = 0.0;
+      for (size_t j = 0; j < FilterCoefficients().size(); ++j) {
+        const size_t index = (blob_index + count + j -
+                              FilterCoefficients().size() / 2) %
+                             count;
+        accumulated_error +=
+            errs[index + extents.starting_offset] * FilterCoefficients()[j];
+      }
+      filtered_errs[i] = accumulated_error;
+    }
+  });
+
+  // And find the peaks.
+  ParallelFor(wp, 0, points, kMinPointsPerTask, [&](size_t begin, size_t end) {
+    for (size_t i = begin; i < end; ++i) {
+      const uint32_t blob = line_fit_points[i].blob_index();
+      const MinMaxExtents &extents = selected_extents[blob];
+      const size_t count = extents.count;
+      const size_t blob_index = i - extents.starting_offset;
+
+      const double before_error =
+          filtered_errs[(blob_index + count - 1) % count +
+                        extents.starting_offset];
+      const double my_error = filtered_errs[i];
+      const double after_error =
+          filtered_errs[(blob_index + 1) % count + extents.starting_offset];
+
+      const bool is_peak = my_error > before_error && my_error > after_error;
+
+      Peak peak;
+      peak.error = -my_error;
+      peak.blob_index = is_peak ? blob : Peak::kNoPeak();
+      peak.filtered_point_index = i;
+
+      peaks[i] = peak;
+    }
+  });
+}
+
+void CpuFitQuads(const Peak *peaks, const PeakExtents *peak_extents,
+                 size_t num_extents, const LineFitPoint *line_fit_points,
+                 int nmaxima, const MinMaxExtents *selected_extents,
+                 float max_line_fit_mse, double cos_critical_rad,
+                 FitQuad *fit_quads, workerpool_t *wp) {
+  CHECK_EQ(nmaxima, kNMaxima)
+      << ": Quad fitting is written for a fixed nmaxima, please update it if "
+         "you want to change it.";
+  ParallelFor(wp, 0, num_extents, 8, [&](size_t begin, size_t end) {
+    for (size_t i = begin; i < end; ++i) {
+      FitBlobQuad(peaks, peak_extents[i],
+                  selected_extents[peak_extents[i].blob_index],
+                  line_fit_points, max_line_fit_mse, cos_critical_rad,
+                  &fit_quads[i]);
+    }
+  });
+}
+
+std::ostream &operator<<(std::ostream &os,
+                         const frc971::apriltag::LineFitMoments &moments) {
+  os << "{Mx:" << std::setprecision(20) << moments.Mx / 2.
+     << ", My:" << std::setprecision(20) << moments.My / 2.
+     << ", Mxx:" << std::setprecision(20) << moments.Mxx / 4.
+     << ", Mxy:" << std::setprecision(20) << moments.Mxy / 4.
+     << ", Myy:" << std::setprecision(20) << moments.Myy / 4.
+     << ", W:" << std::setprecision(20) << moments.W << ", N:" << moments.N
+     << "}";
+  return os;
+}
+
+}  // namespace frc971::apriltag
@@ -0,0 +1,39 @@
+#ifndef FRC971_ORIN_LINE_FIT_FILTER_CPU_H_
+#define FRC971_ORIN_LINE_FIT_FILTER_CPU_H_
+
+#include <stddef.h>
+
+#include "apriltag.h"
+#include "line_fit_filter.h"
+
+namespace frc971::apriltag {
+
+// Fits a line to the provided moments.  Matches the math in the FitLine
+// kernel.
+void HostFitLine(LineFitMoments moments, double *lineparam01,
+                 double *lineparam23, double *err, double *mse);
+
+// Returns the moments of the points between index0 and index1 inclusive,
+// wrapping around the end of the blob if index1 < index0.  line_fit_points is
+// the cumulative sum of the points in the blob.
+LineFitMoments HostReadMoments(const LineFitPoint *line_fit_points,
+                               size_t blob_point_count, size_t index0,
+                               size_t index1);
+
+// Host version of FitLines.  selected_extents is indexed by blob index, and
+// holds the starting offset and count of each blob in line_fit_points.
+void CpuFitLines(const LineFitPoint *line_fit_points, size_t points,
+                 const MinMaxExtents *selected_extents, double *errs,
+                 double *filtered_errs, Peak *peaks, workerpool_t *wp);
+
+// Host version of FitQuads.  Picks the best 4 of the top nmaxima peaks for
+// each entry in peak_extents.
+void CpuFitQuads(const Peak *peaks, const PeakExtents *peak_extents,
+                 size_t num_extents, const LineFitPoint *line_fit_points,
+                 int nmaxima, const MinMaxExtents *selected_extents,
+                 float max_line_fit_mse, double cos_critical_rad,
+                 FitQuad *fit_quads, workerpool_t *wp);
+
+}  // namespace frc971::apriltag
+
+#endif  // FRC971_ORIN_LINE_FIT_FILTER_CPU_H_
@@ -6,6 +6,7 @@
 #include "apriltag_gpu.h"
 #include "apriltag_utils.h"
 #include "opencv2/opencv.hpp"
+#include "replay_source.h"
 
 extern "C" {
 #include "apriltag.h"
@@ -35,6 +36,10 @@ DEFINE_bool(refine_edges, true,
             "Spend more time trying to align edges of tags");
 DEFINE_bool(verbose, false, "Print out april tag detection results");
 DEFINE_bool(cpuonly, false, "Use the CPU instead of CUDA");
+DEFINE_string(replay, "",
+              "Run on the frames in this frame log instead of the camera");
+DEFINE_string(replay_mode, "realtime",
+              "How to play back --replay: realtime, fast or step");
 
 int main(int argc, char *argv[]) {
   gflags::ParseCommandLineFlags(&argc, &argv, true);
@@ -68,21 +73,36 @@ int main(int argc, char *argv[]) {
   cout << "Detector " << FLAGS_family << " initialized in " << std::fixed
        << std::setprecision(3) << meter.getTimeSec() << " seconds" << endl;
 
-  // Initialize camera
-  cout << "Enabling video capture" << endl;
-  VideoCapture cap(FLAGS_camera, CAP_V4L);
-  if (!cap.isOpened()) {
-    cerr << "Couldn't open video capture device" << endl;
-    return -1;
+  // Initialize camera, or the replay.
+  std::unique_ptr<frc971::apriltag::ReplaySource> replay;
+  VideoCapture cap;
+  if (!FLAGS_replay.empty()) {
+    frc971::apriltag::ReplaySource::Options options;
+    if (!frc971::apriltag::ParseReplayMode(FLAGS_replay_mode, &options.mode)) {
+      cerr << "Unknown replay mode " << FLAGS_replay_mode << endl;
+      return -1;
+    }
+    replay = frc971::apriltag::ReplaySource::Open(FLAGS_replay, options);
+    if (replay == nullptr) {
+      cerr << "Couldn't replay " << FLAGS_replay << endl;
+      return -1;
+    }
+  } else {
+    cout << "Enabling video capture" << endl;
+    cap.open(FLAGS_camera, CAP_V4L);
+    if (!cap.isOpened()) {
+      cerr << "Couldn't open video capture device" << endl;
+      return -1;
+    }
+    cap.set(CAP_PROP_CONVERT_RGB, false);
+    // cap.set(CAP_PROP_MODE, CV_CAP_MODE_YUYV);
+    cap.set(CAP_PROP_FRAME_WIDTH, 1920);
+    cap.set(CAP_PROP_FRAME_HEIGHT, 1080);
+
+    cout << "  " << cap.get(CAP_PROP_FRAME_WIDTH) << "x"
+         << cap.get(CAP_PROP_FRAME_HEIGHT) << " @" << cap.get(CAP_PROP_FPS)
+         << "FPS" << endl;
   }
-  cap.set(CAP_PROP_CONVERT_RGB, false);
-  // cap.set(CAP_PROP_MODE, CV_CAP_MODE_YUYV);
-  cap.set(CAP_PROP_FRAME_WIDTH, 1920);
-  cap.set(CAP_PROP_FRAME_HEIGHT, 1080);
-
-  cout << "  " << cap.get(CAP_PROP_FRAME_WIDTH) << "x"
-       << cap.get(CAP_PROP_FRAME_HEIGHT) << " @" << cap.get(CAP_PROP_FPS)
-       << "FPS" << endl;
 
   if (FLAGS_cpuonly) {
     cout << "Running in CPU only mode" << endl;
@@ -102,14 +122,29 @@ int main(int argc, char *argv[]) {
   dist.p2 = 0.001113;
   dist.k3 = 0.0;
 
-  int width = cap.get(CAP_PROP_FRAME_WIDTH);
-  int height = cap.get(CAP_PROP_FRAME_HEIGHT);
+  int width = replay ? replay->width() : cap.get(CAP_PROP_FRAME_WIDTH);
+  int height = replay ? replay->height() : cap.get(CAP_PROP_FRAME_HEIGHT);
 
   Mat bgr_img, bgr_img_copy, yuyv_img, gray;
+  frc971::apriltag::CapturedFrame frame;
   while (true) {
     errno = 0;
-    cap >> yuyv_img;
-    cvtColor(yuyv_img, bgr_img, COLOR_YUV2BGR_YUYV);
+    if (replay) {
+      if (!replay->Next(&frame)) {
+        if (replay->finished()) {
+          break;
+        }
+        continue;
+      }
+      captured_frame_to_bgr(frame, bgr_img);
+    } else {
+      cap >> yuyv_img;
+      cvtColor(yuyv_img, bgr_img, COLOR_YUV2BGR_YUYV);
+      frame.data = yuyv_img.data;
+      frame.format = frc971::apriltag::ImageFormat{
+          .pixel_format = frc971::apriltag::PixelFormat::kYuyv,
+          .stride = yuyv_img.step};
+    }
     bgr_img_copy = bgr_img.clone();
 
     if (FLAGS_cpuonly) {
@@ -123,13 +158,16 @@ int main(int argc, char *argv[]) {
       apriltag_detections_destroy(detections);
     } else {
       frc971::apriltag::GpuDetector detector(width, height, td, cam, dist);
-      detector.Detect(yuyv_img.data);
+      detector.Detect(frame.data, frame.format);
       const zarray_t *detections = detector.Detections();
       if (FLAGS_verbose) {
         print_detections(const_cast<zarray_t *>(detections));
       }
       draw_detection_outlines(bgr_img, const_cast<zarray_t *>(detections));
     }
+    if (replay) {
+      replay->Release(frame);
+    }
 
     if (errno == EAGAIN) {
       printf("Unable to create the %d threads requested.\n", td->nthreads);
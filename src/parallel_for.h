@@ -0,0 +1,193 @@
+#ifndef FRC971_ORIN_PARALLEL_FOR_H_
+#define FRC971_ORIN_PARALLEL_FOR_H_
+
+#include <stddef.h>
+
+#include <algorithm>
+#include <array>
+#include <numeric>
+#include <vector>
+
+#include "apriltag.h"
+
+namespace frc971::apriltag {
+
+// Most chunks ParallelFor and friends split a range into.  Their bookkeeping
+// lives on the stack, so they don't allocate.
+inline constexpr size_t kMaxParallelChunks = 64;
+
+// Returns the number of threads available in the worker pool, treating a null
+// pool as a single thread.
+inline size_t WorkerCount(workerpool_t *wp) {
+  if (wp == nullptr) {
+    return 1;
+  }
+  return std::max(1, workerpool_get_nthreads(wp));
+}
+
+// Splits [begin, end) into at most one chunk per worker (and at most
+// kMaxParallelChunks), each at least min_chunk long, and calls
+// fn(chunk_begin, chunk_end) for each on the worker pool.  Returns once every
+// chunk has run.
+template <typename F>
+void ParallelFor(workerpool_t *wp, size_t begin, size_t end, size_t min_chunk,
+                 const F &fn) {
+  if (end <= begin) {
+    return;
+  }
+  const size_t n = end - begin;
+  const size_t chunks = std::max<size_t>(
+      1, std::min({WorkerCount(wp), n / std::max<size_t>(1, min_chunk),
+                   kMaxParallelChunks}));
+  if (chunks == 1) {
+    fn(begin, end);
+    return;
+  }
+
+  struct Task {
+    const F *fn;
+    size_t begin;
+    size_t end;
+  };
+  std::array<Task, kMaxParallelChunks> tasks;
+  for (size_t i = 0; i < chunks; ++i) {
+    tasks[i] = Task{
+        .fn = &fn,
+        .begin = begin + n * i / chunks,
+        .end = begin + n * (i + 1) / chunks,
+    };
+    workerpool_add_task(
+        wp,
+        [](void *p) {
+          const Task *task = reinterpret_cast<const Task *>(p);
+          (*task->fn)(task->begin, task->end);
+        },
+        &tasks[i]);
+  }
+  workerpool_run(wp);
+}
+
+// Stable sorts data using scratch, which must hold size elements, in place of
+// the buffer std::stable_sort allocates on every call.  Short runs are
+// insertion sorted and then merged back and forth between data and scratch.
+template <typename T, typename Compare>
+void StableSort(T *data, size_t size, T *scratch, Compare comp) {
+  constexpr size_t kRun = 32;
+  for (size_t run = 0; run < size; run += kRun) {
+    T *const first = data + run;
+    T *const last = data + std::min(size, run + kRun);
+    for (T *i = first + 1; i < last; ++i) {
+      T value = *i;
+      T *j = i;
+      for (; j > first && comp(value, *(j - 1)); --j) {
+        *j = *(j - 1);
+      }
+      *j = value;
+    }
+  }
+
+  T *from = data;
+  T *to = scratch;
+  for (size_t width = kRun; width < size; width *= 2) {
+    for (size_t begin = 0; begin < size; begin += 2 * width) {
+      const size_t middle = std::min(size, begin + width);
+      const size_t end = std::min(size, begin + 2 * width);
+      std::merge(from + begin, from + middle, from + middle, from + end,
+                 to + begin, comp);
+    }
+    std::swap(from, to);
+  }
+  if (from != data) {
+    std::copy(from, from + size, data);
+  }
+}
+
+// Stable sorts data on the worker pool.  Each worker stable sorts a contiguous
+// chunk, and then neighboring chunks are merged pairwise, so the result is
+// identical to std::stable_sort.  scratch is grown to size, so once it has
+// seen the largest sort nothing is allocated.
+template <typename T, typename Compare>
+void ParallelStableSort(workerpool_t *wp, T *data, size_t size,
+                        std::vector<T> *scratch, Compare comp) {
+  // Below this, the bookkeeping costs more than it saves.
+  constexpr size_t kMinChunk = 4096;
+  if (scratch->size() < size) {
+    scratch->resize(size);
+  }
+  T *const buffer = scratch->data();
+  size_t chunks = std::max<size_t>(
+      1, std::min({WorkerCount(wp), size / kMinChunk, kMaxParallelChunks}));
+  std::array<size_t, kMaxParallelChunks + 1> bounds;
+  for (size_t i = 0; i <= chunks; ++i) {
+    bounds[i] = size * i / chunks;
+  }
+
+  ParallelFor(wp, 0, chunks, 1, [&](size_t begin, size_t end) {
+    for (size_t i = begin; i < end; ++i) {
+      StableSort(data + bounds[i], bounds[i + 1] - bounds[i],
+                 buffer + bounds[i], comp);
+    }
+  });
+
+  while (chunks > 1) {
+    const size_t pairs = chunks / 2;
+    ParallelFor(wp, 0, pairs, 1, [&](size_t begin, size_t end) {
+      for (size_t i = begin; i < end; ++i) {
+        std::merge(data + bounds[2 * i], data + bounds[2 * i + 1],
+                   data + bounds[2 * i + 1], data + bounds[2 * i + 2],
+                   buffer + bounds[2 * i], comp);
+        std::copy(buffer + bounds[2 * i], buffer + bounds[2 * i + 2],
+                  data + bounds[2 * i]);
+      }
+    });
+
+    // Drop every other boundary now that those chunks are merged.  An odd
+    // chunk at the end is carried along to the next round.
+    size_t merged_chunks = 0;
+    for (size_t i = 2; i <= chunks; i += 2) {
+      bounds[++merged_chunks] = bounds[i];
+    }
+    if (chunks % 2 == 1) {
+      bounds[++merged_chunks] = bounds[chunks];
+    }
+    chunks = merged_chunks;
+  }
+}
+
+// Copies the elements of input which pass pred to output, preserving their
+// order, and returns the number copied.  Produces the same result as
+// std::copy_if.
+template <typename T, typename Predicate>
+size_t ParallelCopyIf(workerpool_t *wp, const T *input, size_t size,
+                      T *output, Predicate pred) {
+  constexpr size_t kMinChunk = 16384;
+  const size_t chunks = std::max<size_t>(
+      1, std::min({WorkerCount(wp), size / kMinChunk, kMaxParallelChunks}));
+  if (chunks == 1) {
+    return std::copy_if(input, input + size, output, pred) - output;
+  }
+
+  // Count each chunk, and then write each chunk out at the sum of the counts
+  // before it.
+  std::array<size_t, kMaxParallelChunks + 1> offsets = {};
+  ParallelFor(wp, 0, chunks, 1, [&](size_t begin, size_t end) {
+    for (size_t i = begin; i < end; ++i) {
+      offsets[i + 1] = std::count_if(input + size * i / chunks,
+                                     input + size * (i + 1) / chunks, pred);
+    }
+  });
+  std::partial_sum(offsets.begin(), offsets.begin() + chunks + 1,
+                   offsets.begin());
+
+  ParallelFor(wp, 0, chunks, 1, [&](size_t begin, size_t end) {
+    for (size_t i = begin; i < end; ++i) {
+      std::copy_if(input + size * i / chunks, input + size * (i + 1) / chunks,
+                   output + offsets[i], pred);
+    }
+  });
+  return offsets[chunks];
+}
+
+}  // namespace frc971::apriltag
+
+#endif  // FRC971_ORIN_PARALLEL_FOR_H_
@@ -0,0 +1,97 @@
+#ifndef FRC971_ORIN_PIXEL_FORMAT_H_
+#define FRC971_ORIN_PIXEL_FORMAT_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <string_view>
+
+#include "host_device.h"
+
+namespace frc971::apriltag {
+
+// Layouts of the images which can be handed to Detect.  Only the luma is used,
+// so the chroma in the color formats is never read.
+enum class PixelFormat {
+  // 8 bit gray.
+  kGray8,
+  // Packed 4:2:2, Y0 U Y1 V.
+  kYuyv,
+  // Packed 4:2:2, U Y0 V Y1.
+  kUyvy,
+  // 8 bit Y plane followed by an interleaved UV plane.
+  kNv12,
+  // Packed 8 bit B G R.
+  kBgr24,
+};
+
+// Describes the memory layout of an image.
+struct ImageFormat {
+  PixelFormat pixel_format = PixelFormat::kYuyv;
+  // Bytes between the start of each row of the image (or of the Y plane for
+  // planar formats).  0 means the rows are tightly packed.
+  size_t stride = 0;
+};
+
+// Returns the number of bytes per pixel in the (luma) plane.
+__host__ __device__ constexpr size_t BytesPerPixel(PixelFormat pixel_format) {
+  switch (pixel_format) {
+    case PixelFormat::kGray8:
+    case PixelFormat::kNv12:
+      return 1;
+    case PixelFormat::kYuyv:
+    case PixelFormat::kUyvy:
+      return 2;
+    case PixelFormat::kBgr24:
+      return 3;
+  }
+  return 1;
+}
+
+// Returns the number of bytes between rows of an image of the provided width.
+__host__ __device__ constexpr size_t RowStride(ImageFormat format,
+                                               size_t width) {
+  return format.stride == 0 ? width * BytesPerPixel(format.pixel_format)
+                            : format.stride;
+}
+
+// Returns the number of bytes of the image the detector reads.  Chroma planes
+// are skipped entirely.
+__host__ __device__ constexpr size_t LumaBytes(ImageFormat format,
+                                               size_t width, size_t height) {
+  return RowStride(format, width) * (height - 1) +
+         width * BytesPerPixel(format.pixel_format);
+}
+
+// Converts BGR to gray with the same fixed point math as OpenCV's
+// COLOR_BGR2GRAY.
+__host__ __device__ __forceinline__ uint8_t BgrToGray(uint8_t b, uint8_t g,
+                                                      uint8_t r) {
+  return (b * 1868 + g * 9617 + r * 4899 + (1 << 13)) >> 14;
+}
+
+// Returns the luma of pixel col in the provided row.
+__host__ __device__ __forceinline__ uint8_t ReadLuma(const uint8_t *row,
+                                                     size_t col,
+                                                     PixelFormat pixel_format) {
+  switch (pixel_format) {
+    case PixelFormat::kGray8:
+    case PixelFormat::kNv12:
+      return row[col];
+    case PixelFormat::kYuyv:
+      return row[col * 2];
+    case PixelFormat::kUyvy:
+      return row[col * 2 + 1];
+    case PixelFormat::kBgr24:
+      return BgrToGray(row[col * 3], row[col * 3 + 1], row[col * 3 + 2]);
+  }
+  return 0;
+}
+
+// Parses "gray8", "yuyv", "uyvy", "nv12" or "bgr24" into a pixel format.
+// Returns false if the name is unknown.
+bool ParsePixelFormat(std::string_view name, PixelFormat *pixel_format);
+
+}  // namespace frc971::apriltag
+
+#endif  // FRC971_ORIN_PIXEL_FORMAT_H_
@@ -5,29 +5,38 @@
 
 namespace frc971::apriltag {
 
-std::ostream &operator<<(std::ostream &os, const QuadBoundaryPoint &point) {
+template <typename Storage>
+std::ostream &operator<<(std::ostream &os,
+                         const BasicQuadBoundaryPoint<Storage> &point) {
   std::ios_base::fmtflags original_flags = os.flags();
 
-  os << "key:" << std::hex << std::setw(16) << std::setfill('0') << point.key
-     << " rep01:" << std::setw(10) << point.rep01() << " pt:" << std::setw(6)
-     << point.point_bits();
+  os << "key:" << std::hex << std::setw(16) << std::setfill('0')
+     << point.sort_key() << " rep01:" << std::setw(16) << point.rep01()
+     << " pt:" << std::setw(8) << point.point_bits();
   os.flags(original_flags);
   return os;
 }
 
-static_assert(sizeof(QuadBoundaryPoint) == 8,
-              "QuadBoundaryPoint didn't pack right.");
+template std::ostream &operator<<(std::ostream &os,
+                                  const QuadBoundaryPoint &point);
+template std::ostream &operator<<(std::ostream &os,
+                                  const CompactQuadBoundaryPoint &point);
 
-std::ostream &operator<<(std::ostream &os, const IndexPoint &point) {
+template <typename Storage>
+std::ostream &operator<<(std::ostream &os,
+                         const BasicIndexPoint<Storage> &point) {
   std::ios_base::fmtflags original_flags = os.flags();
 
-  os << "key:" << std::hex << std::setw(16) << std::setfill('0') << point.key
-     << " i:" << std::setw(3) << point.blob_index() << " t:" << std::setw(7)
-     << point.theta() << " p:" << std::setw(6) << point.point_bits();
+  os << "key:" << std::hex << std::setw(16) << std::setfill('0')
+     << point.sort_key() << " i:" << std::setw(3) << point.blob_index()
+     << " t:" << std::setw(7) << point.theta() << " p:" << std::setw(8)
+     << point.point_bits();
   os.flags(original_flags);
   return os;
 }
 
-static_assert(sizeof(IndexPoint) == 8, "IndexPoint didn't pack right.");
+template std::ostream &operator<<(std::ostream &os, const IndexPoint &point);
+template std::ostream &operator<<(std::ostream &os,
+                                  const CompactIndexPoint &point);
 
 }  // namespace frc971::apriltag
@@ -1,87 +1,190 @@
 #ifndef FRC971_ORIN_POINTS_H_
 #define FRC971_ORIN_POINTS_H_
 
+#include <stddef.h>
 #include <stdint.h>
 
-#include <cub/iterator/transform_input_iterator.cuh>
-#include <cuda/std/tuple>
 #include <iomanip>
 #include <ostream>
+#include <vector>
 
-#include "cuda_runtime.h"
-#include "device_launch_parameters.h"
+#ifdef __CUDACC__
+#include <cub/iterator/transform_input_iterator.cuh>
+#include <cuda/std/tuple>
+#endif
+
+#include "host_device.h"
 
 namespace frc971::apriltag {
 
-// Class to hold the 2 adjacent blob IDs, a point in decimated image space, the
-// half pixel offset, and the gradient.
+// The points below come in two layouts, picked per image size.  Both hold a
+// sort key and a position word:
 //
-// rep0 and rep1 are the two blob ids, and are each allocated 20 bits.
-// point is the base point and is allocated 10 bits for x and 10 bits for y.
-// dx and dy are allocated 2 bits, and can only take on set values.
-// black_to_white captures the direction of the gradient in 1 bit.
+// The position word holds the base x and y, kCoordinateBits each.  dx and dy
+// are allocated 2 bits, and can only take on set values.  black_to_white
+// captures the direction of the gradient in 1 bit.
 //
-// This adds up to 63 bits so we can load this with one big load.
-struct QuadBoundaryPoint {
-  static constexpr size_t kRepEndBit = 24;
-  static constexpr size_t kBitsInKey = 64;
+// Wide points keep a 64 bit key next to a 32 bit position word with 14 bit
+// coordinates.  This adds up to 96 bits, padded to 128 so we can load this
+// with one big load.
+struct __align__(16) WidePointStorage {
+  // Bits of the position word holding each of base x and y.
+  static constexpr uint32_t kCoordinateBits = 14;
+  // Most bits the sort key can take up.
+  static constexpr uint32_t kMaxKeyBits = 64;
+  // First bit of sort_word() holding the sort key.
+  static constexpr uint32_t kKeyShift = 0;
 
-  __forceinline__ __host__ __device__ QuadBoundaryPoint() : key(0) {}
+  __forceinline__ __host__ __device__ WidePointStorage()
+      : key(0), point(0), padding(0) {}
 
-  // Sets rep0, the 0th blob id.  This only respects the bottom 20 bits.
-  __forceinline__ __host__ __device__ void set_rep0(uint32_t rep0) {
-    key = (key & 0xfffff00000ffffffull) |
-          (static_cast<uint64_t>(rep0 & 0xfffff) << 24);
-  }
-  // Returns rep0.
-  __forceinline__ __host__ __device__ uint32_t rep0() const {
-    return ((key >> 24) & 0xfffff);
+  __forceinline__ __host__ __device__ uint64_t sort_key() const { return key; }
+  __forceinline__ __host__ __device__ void set_sort_key(uint64_t sort_key) {
+    key = sort_key;
   }
 
-  // Sets rep1, the 1st blob id.  This only respects the bottom 20 bits.
-  __forceinline__ __host__ __device__ void set_rep1(uint32_t rep1) {
-    key = (key & 0xfffffffffffull) |
-          (static_cast<uint64_t>(rep1 & 0xfffff) << 44);
+  // Returns all the bits used to hold position and gradient information.
+  __forceinline__ __host__ __device__ uint32_t point_bits() const {
+    return point;
   }
-  // Returns rep1.
-  __forceinline__ __host__ __device__ uint32_t rep1() const {
-    return ((key >> 44) & 0xfffff);
+  __forceinline__ __host__ __device__ void set_point_bits(uint32_t point_bits) {
+    point = point_bits;
   }
 
-  // Returns both rep0 and rep1 concatenated into a single 40 bit number.
-  __forceinline__ __host__ __device__ uint64_t rep01() const {
-    return ((key >> 24) & 0xffffffffff);
+  // Returns the word radix sorts should sort by.
+  __forceinline__ __host__ __device__ uint64_t &sort_word() { return key; }
+
+  // The key and point.  These shouldn't be parsed directly.
+  uint64_t key;
+  uint32_t point;
+  uint32_t padding;
+};
+
+// Compact points pack the key above a 24 bit position word with 10 bit
+// coordinates in a single 64 bit word, so they take half the memory bandwidth
+// of wide points.  Sorting the word by its top bits sorts by key.
+struct __align__(8) CompactPointStorage {
+  static constexpr uint32_t kCoordinateBits = 10;
+  static constexpr uint32_t kKeyShift = 4 + 2 * kCoordinateBits;
+  static constexpr uint32_t kMaxKeyBits = 64 - kKeyShift;
+
+  __forceinline__ __host__ __device__ CompactPointStorage() : word(0) {}
+
+  __forceinline__ __host__ __device__ uint64_t sort_key() const {
+    return word >> kKeyShift;
+  }
+  __forceinline__ __host__ __device__ void set_sort_key(uint64_t sort_key) {
+    word = (sort_key << kKeyShift) | (word & kPointMask);
   }
 
-  // Returns all the bits used to hold position and gradient information.
   __forceinline__ __host__ __device__ uint32_t point_bits() const {
-    return key & 0xffffff;
+    return word & kPointMask;
+  }
+  __forceinline__ __host__ __device__ void set_point_bits(uint32_t point_bits) {
+    word = (word & ~kPointMask) | (point_bits & kPointMask);
+  }
+
+  __forceinline__ __host__ __device__ uint64_t &sort_word() { return word; }
+
+  // The key and point.  This shouldn't be parsed directly.
+  uint64_t word;
+
+ private:
+  static constexpr uint64_t kPointMask = (uint64_t{1} << kKeyShift) - 1;
+};
+
+// Class to hold the 2 adjacent blob IDs, a point in decimated image space, the
+// half pixel offset, and the gradient, laid out as Storage says.
+//
+// The sort key holds the two blob ids packed as rep0 << rep_bits | rep1, where
+// rep_bits is just enough bits to hold any decimated pixel index (see
+// RepBits).  Sorting and reducing by blob pair only needs the bottom
+// 2 * rep_bits bits of the key, so small images don't pay for the bits large
+// images need.
+template <typename Storage>
+struct BasicQuadBoundaryPoint : public Storage {
+  // Most bits a blob id can take up.
+  static constexpr uint32_t kMaxRepBits =
+      Storage::kMaxKeyBits / 2 < 32 ? Storage::kMaxKeyBits / 2 : 32;
+  // Largest decimated image width or height a point can describe.
+  static constexpr size_t kMaxCoordinate = size_t{1}
+                                           << Storage::kCoordinateBits;
+  // First bit of sort_word() to sort by.
+  static constexpr uint32_t kSortBeginBit = Storage::kKeyShift;
+
+  __forceinline__ __host__ __device__ BasicQuadBoundaryPoint() {}
+
+  // Returns the number of bits needed for a blob id in an image with
+  // num_pixels pixels.
+  static constexpr uint32_t RepBits(size_t num_pixels) {
+    uint32_t bits = 1;
+    while (bits < 32 && (static_cast<size_t>(1) << bits) < num_pixels) {
+      ++bits;
+    }
+    return bits;
   }
 
-  // Sets the 10 bit x and y.
+  // Returns true if every point in a decimated image of the provided size fits
+  // in this layout.
+  static constexpr bool Fits(size_t width, size_t height) {
+    return width <= kMaxCoordinate && height <= kMaxCoordinate &&
+           RepBits(width * height) <= kMaxRepBits;
+  }
+
+  // Returns the bit of sort_word() to stop sorting at for the provided
+  // rep_bits.
+  static constexpr uint32_t SortEndBit(uint32_t rep_bits) {
+    return kSortBeginBit + rep_bits * 2;
+  }
+
+  // Sets rep0 and rep1, the 0th and 1st blob ids.  rep0 must be less than
+  // rep1, and both must fit in rep_bits.
+  __forceinline__ __host__ __device__ void set_rep01(uint32_t rep0,
+                                                     uint32_t rep1,
+                                                     uint32_t rep_bits) {
+    this->set_sort_key((static_cast<uint64_t>(rep0) << rep_bits) | rep1);
+  }
+  // Returns rep0 and rep1.
+  __forceinline__ __host__ __device__ uint32_t rep0(uint32_t rep_bits) const {
+    return this->sort_key() >> rep_bits;
+  }
+  __forceinline__ __host__ __device__ uint32_t rep1(uint32_t rep_bits) const {
+    return this->sort_key() & ((static_cast<uint64_t>(1) << rep_bits) - 1);
+  }
+
+  // Returns both rep0 and rep1 concatenated into a single number.
+  __forceinline__ __host__ __device__ uint64_t rep01() const {
+    return this->sort_key();
+  }
+
+  // Sets the base x and y.
   __forceinline__ __host__ __device__ void set_base_xy(uint32_t x, uint32_t y) {
-    key = (key & 0xffffffffff00000full) |
-          (static_cast<uint64_t>(x & 0x3ff) << 14) |
-          (static_cast<uint64_t>(y & 0x3ff) << 4);
+    this->set_point_bits((this->point_bits() & 0x0000000fu) |
+                         ((x & kCoordinateMask) << kXShift) |
+                         ((y & kCoordinateMask) << 4));
   }
 
-  // Returns the base 10 bit x and y.
+  // Returns the base x and y.
   __forceinline__ __host__ __device__ uint32_t base_x() const {
-    return ((key >> 14) & 0x3ff);
+    return (this->point_bits() >> kXShift) & kCoordinateMask;
   }
   __forceinline__ __host__ __device__ uint32_t base_y() const {
-    return ((key >> 4) & 0x3ff);
+    return (this->point_bits() >> 4) & kCoordinateMask;
   }
 
-  // Sets dxy, the integer representing which of the 4 search directions we
-  // went.
+  // Sets and gets dxy, the integer representing which of the 4 search
+  // directions we went.
   __forceinline__ __host__ __device__ void set_dxy(uint64_t dxy) {
-    key = (key & 0xfffffffffffffffcull) | (static_cast<uint64_t>(dxy & 0x3));
+    this->set_point_bits((this->point_bits() & 0xfffffffcu) |
+                         static_cast<uint32_t>(dxy & 0x3));
+  }
+  __forceinline__ __host__ __device__ uint32_t dxy() const {
+    return this->point_bits() & 0x3;
   }
 
   // Returns the change in x derived from the search direction.
   __forceinline__ __host__ __device__ int32_t dx() const {
-    switch (key & 0x3) {
+    switch (dxy()) {
       case 0:
         return 1;
       case 1:
@@ -96,7 +199,7 @@ struct QuadBoundaryPoint {
 
   // Returns the change in y derived from the search direction.
   __forceinline__ __host__ __device__ int32_t dy() const {
-    switch (key & 0x3) {
+    switch (dxy()) {
       case 0:
         return 0;
       case 1:
@@ -127,102 +230,131 @@ struct QuadBoundaryPoint {
   // Returns the black to white or white to black bit.
   __forceinline__ __host__ __device__ void set_black_to_white(
       bool black_to_white) {
-    key = (key & 0xfffffffffffffff7ull) |
-          (static_cast<uint64_t>(black_to_white) << 3);
+    this->set_point_bits((this->point_bits() & 0xfffffff7u) |
+                         (static_cast<uint32_t>(black_to_white) << 3));
   }
   __forceinline__ __host__ __device__ bool black_to_white() const {
-    return (key & 0x8) != 0;
+    return (this->point_bits() & 0x8) != 0;
   }
 
   // Various operators to make it easy to compare points.
   __forceinline__ __host__ __device__ bool operator!=(
-      const QuadBoundaryPoint other) const {
-    return other.key != key;
+      const BasicQuadBoundaryPoint other) const {
+    return !(other == *this);
   }
   __forceinline__ __host__ __device__ bool operator==(
-      const QuadBoundaryPoint other) const {
-    return other.key == key;
+      const BasicQuadBoundaryPoint other) const {
+    return other.sort_key() == this->sort_key() &&
+           other.point_bits() == this->point_bits();
   }
   __forceinline__ __host__ __device__ bool operator<(
-      const QuadBoundaryPoint other) const {
-    return key < other.key;
+      const BasicQuadBoundaryPoint other) const {
+    return this->sort_key() < other.sort_key() ||
+           (this->sort_key() == other.sort_key() &&
+            this->point_bits() < other.point_bits());
   }
 
-  // Returns true if this point has been set.  Zero is reserved for "invalid"
+  // Returns true if this point has been set.  Zero is reserved for "invalid".
+  // The two blob ids are always different, so a set key is never zero.
   __forceinline__ __host__ __device__ bool nonzero() const {
-    return key != 0ull;
+    return this->sort_key() != 0ull;
   }
 
   // Returns true if this point is about the other point.
-  bool near(QuadBoundaryPoint other) const { return other == *this; }
+  bool near(BasicQuadBoundaryPoint other) const { return other == *this; }
 
-  // The key.  This shouldn't be parsed directly.
-  uint64_t key;
+ private:
+  static constexpr uint32_t kCoordinateMask =
+      (1u << Storage::kCoordinateBits) - 1;
+  static constexpr uint32_t kXShift = 4 + Storage::kCoordinateBits;
 };
 
-std::ostream &operator<<(std::ostream &os, const QuadBoundaryPoint &point);
+using QuadBoundaryPoint = BasicQuadBoundaryPoint<WidePointStorage>;
+using CompactQuadBoundaryPoint = BasicQuadBoundaryPoint<CompactPointStorage>;
+
+static_assert(sizeof(QuadBoundaryPoint) == 16,
+              "QuadBoundaryPoint didn't pack right.");
+static_assert(sizeof(CompactQuadBoundaryPoint) == 8,
+              "CompactQuadBoundaryPoint didn't pack right.");
+
+template <typename Storage>
+std::ostream &operator<<(std::ostream &os,
+                         const BasicQuadBoundaryPoint<Storage> &point);
 
 // Holds a compacted blob index, the angle to the X axis from the center of the
-// blob, and the coordinate of the point.
+// blob, and the coordinate of the point, laid out as Storage says.
 //
-// The blob index is 12 bits, the angle is 28 bits, and the point is 24 bits.
-struct IndexPoint {
+// The blob index is 12 bits and the angle is 28 bits, packed into the bottom
+// 40 bits of the sort key so sorts only have to look at those.  The position
+// word holds the point bits from the BasicQuadBoundaryPoint of the same
+// layout.
+template <typename Storage>
+struct BasicIndexPoint : public Storage {
   // Max number of blob IDs we can hold.
   static constexpr size_t kMaxBlobs = 2048;
 
-  static constexpr size_t kRepEndBit = 24;
-  static constexpr size_t kBitsInKey = 64;
+  // Number of bits of the sort key to sort by.
+  static constexpr size_t kBitsInKey = 40;
+  static_assert(kBitsInKey <= Storage::kMaxKeyBits);
+
+  // Bits of sort_word() to sort by.
+  static constexpr uint32_t kSortBeginBit = Storage::kKeyShift;
+  static constexpr uint32_t kSortEndBit = kSortBeginBit + kBitsInKey;
 
-  __forceinline__ __host__ __device__ IndexPoint() : key(0) {}
+  __forceinline__ __host__ __device__ BasicIndexPoint() {}
 
   // Constructor to build a point with just the blob index, and point bits.  The
-  // point bits should be grabbed from a QuadBoundaryPoint rather than built up
-  // by hand.
-  __forceinline__ __host__ __device__ IndexPoint(uint32_t blob_index,
-                                                 uint32_t point_bits)
-      : key((static_cast<uint64_t>(blob_index & 0xfff) << 52) |
-            (static_cast<uint64_t>(point_bits & 0xffffff))) {}
+  // point bits should be grabbed from a BasicQuadBoundaryPoint<Storage> rather
+  // than built up by hand.
+  __forceinline__ __host__ __device__ BasicIndexPoint(uint32_t blob_index,
+                                                      uint32_t point_bits) {
+    this->set_sort_key(static_cast<uint64_t>(blob_index & 0xfff) << 28);
+    this->set_point_bits(point_bits);
+  }
 
   // Sets and gets the 12 bit blob index.
   __forceinline__ __host__ __device__ void set_blob_index(uint32_t blob_index) {
-    key = (key & 0x000fffffffffffffull) |
-          (static_cast<uint64_t>(blob_index & 0xfff) << 52);
+    this->set_sort_key((this->sort_key() & 0x000000000fffffffull) |
+                       (static_cast<uint64_t>(blob_index & 0xfff) << 28));
   }
   __forceinline__ __host__ __device__ uint32_t blob_index() const {
-    return ((key >> 52) & 0xfff);
+    return ((this->sort_key() >> 28) & 0xfff);
   }
 
   // Sets and gets the 28 bit angle.
   __forceinline__ __host__ __device__ void set_theta(uint32_t theta) {
-    key = (key & 0xfff0000000ffffffull) |
-          (static_cast<uint64_t>(theta & 0xfffffff) << 24);
+    this->set_sort_key((this->sort_key() & 0xfffffffff0000000ull) |
+                       (theta & 0xfffffff));
   }
   __forceinline__ __host__ __device__ uint32_t theta() const {
-    return ((key >> 24) & 0xfffffff);
+    return (this->sort_key() & 0xfffffff);
   }
 
-  // See QuadBoundaryPoint for a description of the rest of these.
-  // Sets the 10 bit x and y.
+  // See BasicQuadBoundaryPoint for a description of the rest of these.
   __forceinline__ __host__ __device__ void set_base_xy(uint32_t x, uint32_t y) {
-    key = (key & 0xffffffffff00000full) |
-          (static_cast<uint64_t>(x & 0x3ff) << 14) |
-          (static_cast<uint64_t>(y & 0x3ff) << 4);
+    this->set_point_bits((this->point_bits() & 0x0000000fu) |
+                         ((x & kCoordinateMask) << kXShift) |
+                         ((y & kCoordinateMask) << 4));
   }
 
   __forceinline__ __host__ __device__ uint32_t base_x() const {
-    return ((key >> 14) & 0x3ff);
+    return (this->point_bits() >> kXShift) & kCoordinateMask;
   }
 
   __forceinline__ __host__ __device__ uint32_t base_y() const {
-    return ((key >> 4) & 0x3ff);
+    return (this->point_bits() >> 4) & kCoordinateMask;
   }
 
   __forceinline__ __host__ __device__ void set_dxy(uint64_t dxy) {
-    key = (key & 0xfffffffffffffffcull) | (static_cast<uint64_t>(dxy & 0x3));
+    this->set_point_bits((this->point_bits() & 0xfffffffcu) |
+                         static_cast<uint32_t>(dxy & 0x3));
+  }
+  __forceinline__ __host__ __device__ uint32_t dxy() const {
+    return this->point_bits() & 0x3;
   }
 
   __forceinline__ __host__ __device__ int32_t dx() const {
-    switch (key & 0x3) {
+    switch (dxy()) {
       case 0:
         return 1;
       case 1:
@@ -236,7 +368,7 @@ struct IndexPoint {
   }
 
   __forceinline__ __host__ __device__ int32_t dy() const {
-    switch (key & 0x3) {
+    switch (dxy()) {
       case 0:
         return 0;
       case 1:
@@ -261,40 +393,66 @@ struct IndexPoint {
     return black_to_white() ? dy() : -dy();
   }
 
-  __forceinline__ __host__ __device__ uint32_t point_bits() const {
-    return key & 0xffffff;
-  }
-
   __forceinline__ __host__ __device__ void set_black_to_white(
       bool black_to_white) {
-    key = (key & 0xfffffffffffffff7ull) |
-          (static_cast<uint64_t>(black_to_white) << 3);
+    this->set_point_bits((this->point_bits() & 0xfffffff7u) |
+                         (static_cast<uint32_t>(black_to_white) << 3));
   }
   __forceinline__ __host__ __device__ bool black_to_white() const {
-    return (key & 0x8) != 0;
+    return (this->point_bits() & 0x8) != 0;
   }
 
-  // The key.  This shouldn't be parsed directly.
-  uint64_t key;
-};
-
-std::ostream &operator<<(std::ostream &os, const IndexPoint &point);
-
-// Decomposer for sorting which just returns the key.
-struct QuadBoundaryPointDecomposer {
-  __host__ __device__ ::cuda::std::tuple<uint64_t &> operator()(
-      QuadBoundaryPoint &key) const {
-    return {key.key};
-  }
+ private:
+  static constexpr uint32_t kCoordinateMask =
+      (1u << Storage::kCoordinateBits) - 1;
+  static constexpr uint32_t kXShift = 4 + Storage::kCoordinateBits;
 };
 
-// Decomposer for sorting which just returns the key.
-struct QuadIndexPointDecomposer {
+using IndexPoint = BasicIndexPoint<WidePointStorage>;
+using CompactIndexPoint = BasicIndexPoint<CompactPointStorage>;
+
+static_assert(sizeof(IndexPoint) == 16, "IndexPoint didn't pack right.");
+static_assert(sizeof(CompactIndexPoint) == 8,
+              "CompactIndexPoint didn't pack right.");
+
+template <typename Storage>
+std::ostream &operator<<(std::ostream &os,
+                         const BasicIndexPoint<Storage> &point);
+
+// Returns a copy of point in another layout.  The position has to fit in the
+// new layout, so this is for going from compact to wide points.
+template <typename To, typename From>
+To ConvertPoint(const From &point) {
+  To result;
+  result.set_sort_key(point.sort_key());
+  result.set_base_xy(point.base_x(), point.base_y());
+  result.set_dxy(point.dxy());
+  result.set_black_to_white(point.black_to_white());
+  return result;
+}
+
+// Returns copies of the first size points in another layout, for the debug
+// accessors, which always hand out wide points.
+template <typename To, typename From>
+std::vector<To> ConvertPoints(const From *points, size_t size) {
+  std::vector<To> result(size);
+  for (size_t i = 0; i < size; ++i) {
+    result[i] = ConvertPoint<To>(points[i]);
+  }
+  return result;
+}
+
+#ifdef __CUDACC__
+// Decomposer for sorting which just returns the word holding the key.  Sort
+// from Point::kSortBeginBit.
+template <typename Point>
+struct SortWordDecomposer {
   __host__ __device__ ::cuda::std::tuple<uint64_t &> operator()(
-      IndexPoint &key) const {
-    return {key.key};
+      Point &key) const {
+    return {key.sort_word()};
   }
 };
+#endif  // __CUDACC__
 
 }  // namespace frc971::apriltag
 
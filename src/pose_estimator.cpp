@@ -0,0 +1,674 @@
+#include "pose_estimator.h"
+
+#include <algorithm>
+#include <cmath>
+#include <utility>
+
+#include "common/matd.h"
+#include "common/zarray.h"
+#include "glog/logging.h"
+#include "pose_math.h"
+#include "work_stealing_pool.h"
+
+namespace frc971::apriltag {
+namespace {
+
+// v v' / v'v, which projects onto the line of sight through v.
+Mat3 LineOfSightProjection(const Vec3 &v) {
+  const double inner = Dot(v, v);
+  Mat3 result;
+  for (int i = 0; i < 3; ++i) {
+    for (int j = 0; j < 3; ++j) {
+      result[i * 3 + j] = v[i] * v[j] / inner;
+    }
+  }
+  return result;
+}
+
+// The 4 corners of a tag, both as lines of sight from the camera and in the
+// tag's frame, along with the line of sight projections.
+struct TagCorners {
+  std::array<Vec3, 4> v;
+  std::array<Vec3, 4> p;
+  std::array<Mat3, 4> F;
+};
+
+// Initial pose from the homography, like estimate_pose_for_tag_homography.
+void PoseFromHomography(const matd_t *H, const CameraMatrix &camera_matrix,
+                        double scale, Mat3 *R, Vec3 *t) {
+  // homography_to_pose with a negated fx, because it assumes the camera looks
+  // down -z.
+  const double fx = -camera_matrix.fx;
+  const double fy = camera_matrix.fy;
+  const double cx = camera_matrix.cx;
+  const double cy = camera_matrix.cy;
+
+  double R20 = MATD_EL(H, 2, 0);
+  double R21 = MATD_EL(H, 2, 1);
+  double TZ = MATD_EL(H, 2, 2);
+  double R00 = (MATD_EL(H, 0, 0) - cx * R20) / fx;
+  double R01 = (MATD_EL(H, 0, 1) - cx * R21) / fx;
+  double TX = (MATD_EL(H, 0, 2) - cx * TZ) / fx;
+  double R10 = (MATD_EL(H, 1, 0) - cy * R20) / fy;
+  double R11 = (MATD_EL(H, 1, 1) - cy * R21) / fy;
+  double TY = (MATD_EL(H, 1, 2) - cy * TZ) / fy;
+
+  // Scale so the rotation columns are unit length, using the geometric mean
+  // of their lengths, and put the tag in front of the camera.
+  double length1 = sqrtf(R00 * R00 + R10 * R10 + R20 * R20);
+  double length2 = sqrtf(R01 * R01 + R11 * R11 + R21 * R21);
+  double s = 1.0 / sqrtf(length1 * length2);
+  if (TZ > 0) {
+    s *= -1;
+  }
+
+  R20 *= s;
+  R21 *= s;
+  TZ *= s;
+  R00 *= s;
+  R01 *= s;
+  TX *= s;
+  R10 *= s;
+  R11 *= s;
+  TY *= s;
+
+  // The last column is the cross product of the other two.
+  const double R02 = R10 * R21 - R20 * R11;
+  const double R12 = R20 * R01 - R00 * R21;
+  const double R22 = R00 * R11 - R10 * R01;
+
+  // Polar decomposition to make it a proper rotation.
+  const Mat3 rotation =
+      OrthogonalFactor({R00, R01, R02, R10, R11, R12, R20, R21, R22});
+
+  // Flip y and z back to a camera looking down +z.
+  for (int j = 0; j < 3; ++j) {
+    At(*R, 0, j) = At(rotation, 0, j);
+    At(*R, 1, j) = -At(rotation, 1, j);
+    At(*R, 2, j) = -At(rotation, 2, j);
+  }
+  *t = {TX * scale, -TY * scale, -TZ * scale};
+}
+
+// Refines R and t with n_steps of orthogonal iteration, and returns the object
+// space error.  Follows orthogonal_iteration.
+double OrthogonalIteration(const TagCorners &corners, Mat3 *R, Vec3 *t,
+                           int n_steps) {
+  constexpr int kPoints = 4;
+
+  Vec3 p_mean = {0, 0, 0};
+  for (int i = 0; i < kPoints; ++i) {
+    p_mean = Add(p_mean, corners.p[i]);
+  }
+  p_mean = Scale(p_mean, 1.0 / kPoints);
+
+  std::array<Vec3, kPoints> p_res;
+  for (int i = 0; i < kPoints; ++i) {
+    p_res[i] = Subtract(corners.p[i], p_mean);
+  }
+
+  Mat3 avg_F = {};
+  for (int i = 0; i < kPoints; ++i) {
+    for (int k = 0; k < 9; ++k) {
+      avg_F[k] += corners.F[i][k];
+    }
+  }
+  avg_F = Scale(avg_F, 1.0 / kPoints);
+  const Mat3 M1_inv = Inverse(Subtract(kIdentity, avg_F));
+
+  std::array<Mat3, kPoints> F_minus_I;
+  for (int i = 0; i < kPoints; ++i) {
+    F_minus_I[i] = Subtract(corners.F[i], kIdentity);
+  }
+
+  double prev_error = HUGE_VAL;
+  for (int step = 0; step < n_steps; ++step) {
+    // Translation.
+    Vec3 M2 = {0, 0, 0};
+    for (int j = 0; j < kPoints; ++j) {
+      M2 = Add(M2, Multiply(Multiply(F_minus_I[j], *R), corners.p[j]));
+    }
+    M2 = Scale(M2, 1.0 / kPoints);
+    *t = Multiply(M1_inv, M2);
+
+    // Rotation.
+    std::array<Vec3, kPoints> q;
+    Vec3 q_mean = {0, 0, 0};
+    for (int j = 0; j < kPoints; ++j) {
+      q[j] = Multiply(corners.F[j], Add(Multiply(*R, corners.p[j]), *t));
+      q_mean = Add(q_mean, q[j]);
+    }
+    q_mean = Scale(q_mean, 1.0 / kPoints);
+
+    Mat3 M3 = {};
+    for (int j = 0; j < kPoints; ++j) {
+      const Vec3 d = Subtract(q[j], q_mean);
+      for (int r = 0; r < 3; ++r) {
+        for (int c = 0; c < 3; ++c) {
+          M3[r * 3 + c] += d[r] * p_res[j][c];
+        }
+      }
+    }
+    *R = OrthogonalFactor(M3);
+    if (Determinant(*R) < 0) {
+      At(*R, 0, 2) = -At(*R, 0, 2);
+      At(*R, 1, 2) = -At(*R, 1, 2);
+      At(*R, 2, 2) = -At(*R, 2, 2);
+    }
+
+    double error = 0;
+    for (int j = 0; j < kPoints; ++j) {
+      const Vec3 err_vec = Multiply(Subtract(kIdentity, corners.F[j]),
+                                    Add(Multiply(*R, corners.p[j]), *t));
+      error += Dot(err_vec, err_vec);
+    }
+    prev_error = error;
+  }
+
+  return prev_error;
+}
+
+double PolyVal(const double *p, int degree, double x) {
+  double ret = 0;
+  for (int i = 0; i <= degree; i++) {
+    ret += p[i] * pow(x, i);
+  }
+  return ret;
+}
+
+// Finds the real roots of the polynomial with coefficients p (lowest order
+// first) by bracketing them with the roots of its derivative.  Follows
+// solve_poly_approx, with fixed size scratch since degree is at most 4.
+void SolvePolyApprox(const double *p, int degree, double *roots,
+                     int *n_roots) {
+  static constexpr int kMaxRoot = 1000;
+  CHECK_LE(degree, 4);
+  if (degree == 1) {
+    if (fabs(p[0]) > kMaxRoot * fabs(p[1])) {
+      *n_roots = 0;
+    } else {
+      roots[0] = -p[0] / p[1];
+      *n_roots = 1;
+    }
+    return;
+  }
+
+  // Roots of the derivative.
+  double p_der[4];
+  for (int i = 0; i < degree; i++) {
+    p_der[i] = (i + 1) * p[i + 1];
+  }
+
+  double der_roots[3];
+  int n_der_roots;
+  SolvePolyApprox(p_der, degree - 1, der_roots, &n_der_roots);
+
+  // There is at most one root between each pair of roots of the derivative.
+  *n_roots = 0;
+  for (int i = 0; i <= n_der_roots; i++) {
+    const double min = i == 0 ? -kMaxRoot : der_roots[i - 1];
+    const double max = i == n_der_roots ? kMaxRoot : der_roots[i];
+
+    if (PolyVal(p, degree, min) * PolyVal(p, degree, max) < 0) {
+      // Zero crossing in this interval, use a combination of Newton's and
+      // bisection.
+      double lower;
+      double upper;
+      if (PolyVal(p, degree, min) < PolyVal(p, degree, max)) {
+        lower = min;
+        upper = max;
+      } else {
+        lower = max;
+        upper = min;
+      }
+      double root = 0.5 * (lower + upper);
+      double dx_old = upper - lower;
+      double dx = dx_old;
+      double f = PolyVal(p, degree, root);
+      double df = PolyVal(p_der, degree - 1, root);
+
+      for (int j = 0; j < 100; j++) {
+        if (((root - upper) * df - f) * ((root - lower) * df - f) > 0 ||
+            fabs(2 * f) > fabs(dx_old * df)) {
+          dx_old = dx;
+          dx = 0.5 * (upper - lower);
+          root = lower + dx;
+        } else {
+          dx_old = dx;
+          dx = -f / df;
+          root += dx;
+        }
+
+        if (root == upper || root == lower) {
+          break;
+        }
+
+        f = PolyVal(p, degree, root);
+        df = PolyVal(p_der, degree - 1, root);
+
+        if (f > 0) {
+          upper = root;
+        } else {
+          lower = root;
+        }
+      }
+
+      roots[(*n_roots)++] = root;
+    } else if (PolyVal(p, degree, max) == 0) {
+      // Double or triple root.
+      roots[(*n_roots)++] = max;
+    }
+  }
+}
+
+// Looks for the second local minimum of the object space error, the pose
+// which is ambiguous with R and t.  Returns false if there isn't one.  Follows
+// fix_pose_ambiguities.
+bool FixPoseAmbiguities(const TagCorners &corners, const Vec3 &t,
+                        const Mat3 &R, Mat3 *result) {
+  constexpr int kPoints = 4;
+
+  // 1. Rotation taking t onto the z axis.
+  const Vec3 R_t_3 = Scale(t, 1.0 / std::sqrt(Dot(t, t)));
+  const Vec3 e_x = {1, 0, 0};
+  Vec3 R_t_1 = Subtract(e_x, Scale(R_t_3, Dot(e_x, R_t_3)));
+  R_t_1 = Scale(R_t_1, 1.0 / std::sqrt(Dot(R_t_1, R_t_1)));
+  const Vec3 R_t_2 = Cross(R_t_3, R_t_1);
+  const Mat3 R_t = {R_t_1[0], R_t_1[1], R_t_1[2], R_t_2[0], R_t_2[1],
+                    R_t_2[2], R_t_3[0], R_t_3[1], R_t_3[2]};
+
+  // 2. Rotation about z.
+  const Mat3 R_1_prime = Multiply(R_t, R);
+  double r31 = At(R_1_prime, 2, 0);
+  double r32 = At(R_1_prime, 2, 1);
+  double hypotenuse = sqrt(r31 * r31 + r32 * r32);
+  if (hypotenuse < 1e-100) {
+    r31 = 1;
+    r32 = 0;
+    hypotenuse = 1;
+  }
+  const Mat3 R_z = {r31 / hypotenuse, -r32 / hypotenuse, 0,
+                    r32 / hypotenuse, r31 / hypotenuse,  0,
+                    0,                0,                 1};
+
+  // 3. Parameters of the error as a function of the remaining rotation.
+  const Mat3 R_trans = Multiply(R_1_prime, R_z);
+  const double sin_gamma = -At(R_trans, 0, 1);
+  const double cos_gamma = At(R_trans, 1, 1);
+  const Mat3 R_gamma = {cos_gamma, -sin_gamma, 0, sin_gamma, cos_gamma,
+                        0,         0,          0, 1};
+
+  const double sin_beta = -At(R_trans, 2, 0);
+  const double cos_beta = At(R_trans, 2, 2);
+  const double t_initial = atan2(sin_beta, cos_beta);
+
+  const Mat3 R_z_transpose = Transpose(R_z);
+  std::array<Vec3, kPoints> p_trans;
+  std::array<Mat3, kPoints> F_trans;
+  Mat3 avg_F_trans = {};
+  for (int i = 0; i < kPoints; i++) {
+    p_trans[i] = Multiply(R_z_transpose, corners.p[i]);
+    F_trans[i] = LineOfSightProjection(Multiply(R_t, corners.v[i]));
+    for (int k = 0; k < 9; ++k) {
+      avg_F_trans[k] += F_trans[i][k];
+    }
+  }
+  avg_F_trans = Scale(avg_F_trans, 1.0 / kPoints);
+
+  const Mat3 G =
+      Scale(Inverse(Subtract(kIdentity, avg_F_trans)), 1.0 / kPoints);
+
+  const Mat3 M1 = {0, 0, 2, 0, 0, 0, -2, 0, 0};
+  const Mat3 M2 = {-1, 0, 0, 0, 1, 0, 0, 0, -1};
+  const Mat3 R_gamma_M1 = Multiply(R_gamma, M1);
+  const Mat3 R_gamma_M2 = Multiply(R_gamma, M2);
+
+  Vec3 b0 = {0, 0, 0};
+  Vec3 b1 = {0, 0, 0};
+  Vec3 b2 = {0, 0, 0};
+  for (int i = 0; i < kPoints; i++) {
+    const Mat3 F_minus_I = Subtract(F_trans[i], kIdentity);
+    b0 = Add(b0, Multiply(F_minus_I, Multiply(R_gamma, p_trans[i])));
+    b1 = Add(b1, Multiply(F_minus_I, Multiply(R_gamma_M1, p_trans[i])));
+    b2 = Add(b2, Multiply(F_minus_I, Multiply(R_gamma_M2, p_trans[i])));
+  }
+  const Vec3 b0_ = Multiply(G, b0);
+  const Vec3 b1_ = Multiply(G, b1);
+  const Vec3 b2_ = Multiply(G, b2);
+
+  double a0 = 0;
+  double a1 = 0;
+  double a2 = 0;
+  double a3 = 0;
+  double a4 = 0;
+  for (int i = 0; i < kPoints; i++) {
+    const Mat3 I_minus_F = Subtract(kIdentity, F_trans[i]);
+    const Vec3 c0 =
+        Multiply(I_minus_F, Add(Multiply(R_gamma, p_trans[i]), b0_));
+    const Vec3 c1 =
+        Multiply(I_minus_F, Add(Multiply(R_gamma_M1, p_trans[i]), b1_));
+    const Vec3 c2 =
+        Multiply(I_minus_F, Add(Multiply(R_gamma_M2, p_trans[i]), b2_));
+
+    a0 += Dot(c0, c0);
+    a1 += 2 * Dot(c0, c1);
+    a2 += Dot(c1, c1) + 2 * Dot(c0, c2);
+    a3 += 2 * Dot(c1, c2);
+    a4 += Dot(c2, c2);
+  }
+
+  // 4. Minima of the error.
+  const double p[5] = {a1, 2 * a2 - 4 * a0, 3 * a3 - 3 * a1,
+                       4 * a4 - 2 * a2, -a3};
+  double roots[4];
+  int n_roots;
+  SolvePolyApprox(p, 4, roots, &n_roots);
+
+  double minima[4];
+  int n_minima = 0;
+  for (int i = 0; i < n_roots; i++) {
+    const double t1 = roots[i];
+    const double t2 = t1 * t1;
+    const double t3 = t1 * t2;
+    const double t4 = t1 * t3;
+    const double t5 = t1 * t4;
+    // Check the extremum is a minimum.
+    if (a2 - 2 * a0 + (3 * a3 - 6 * a1) * t1 +
+            (6 * a4 - 8 * a2 + 10 * a0) * t2 + (-8 * a3 + 6 * a1) * t3 +
+            (-6 * a4 + 3 * a2) * t4 + a3 * t5 >=
+        0) {
+      // And that it is qualitatively different from the known minimum.
+      const double angle = 2 * atan(roots[i]);
+      if (fabs(angle - t_initial) > 0.1) {
+        minima[n_minima++] = roots[i];
+      }
+    }
+  }
+
+  // 5. Pose for the minimum.
+  if (n_minima == 1) {
+    const double t = minima[0];
+    Mat3 R_beta;
+    for (int k = 0; k < 9; ++k) {
+      R_beta[k] = ((M2[k] * t + M1[k]) * t + kIdentity[k]) / (1 + t * t);
+    }
+    *result = Multiply(Multiply(Multiply(Transpose(R_t), R_gamma), R_beta),
+                       R_z_transpose);
+    return true;
+  } else if (n_minima > 1) {
+    // This can happen if our prior pose estimate was not very good.
+    LOG(WARNING) << "More than one new minima found.";
+  }
+  return false;
+}
+
+// Errors below this many m^2 are as good as converged.
+constexpr double kNegligibleError = 1e-12;
+
+// Returns the object space error of R and t, the same error
+// OrthogonalIteration minimizes.
+double ObjectSpaceError(const TagCorners &corners, const Mat3 &R,
+                        const Vec3 &t) {
+  double error = 0;
+  for (int j = 0; j < 4; ++j) {
+    const Vec3 err_vec = Multiply(Subtract(kIdentity, corners.F[j]),
+                                  Add(Multiply(R, corners.p[j]), t));
+    error += Dot(err_vec, err_vec);
+  }
+  return error;
+}
+
+// Minimizes the object space error starting from R and t with up to max_steps
+// of damped Gauss-Newton, and returns the error.  Unlike orthogonal iteration,
+// this converges in a handful of steps from a nearby pose, so it stops once a
+// step improves the error by less than convergence times itself.  The number
+// of steps taken is added to *steps.
+double RefinePose(const TagCorners &corners, Mat3 *R, Vec3 *t, int max_steps,
+                  double convergence, int *steps) {
+  double error = ObjectSpaceError(corners, *R, *t);
+  double damping = 1e-6;
+  for (int step = 0; step < max_steps; ++step) {
+    ++*steps;
+
+    // Linearize about R with rotations exp([w]x) R, and accumulate the normal
+    // equations for (w, dt).
+    double JtJ[6][6] = {};
+    double Jtr[6] = {};
+    for (int j = 0; j < 4; ++j) {
+      const Mat3 A = Subtract(kIdentity, corners.F[j]);
+      const Vec3 q = Multiply(*R, corners.p[j]);
+      const Vec3 r = Multiply(A, Add(q, *t));
+      Vec3 columns[6];
+      for (int k = 0; k < 3; ++k) {
+        Vec3 e = {0, 0, 0};
+        e[k] = 1;
+        columns[k] = Multiply(A, Cross(e, q));
+        columns[k + 3] = {At(A, 0, k), At(A, 1, k), At(A, 2, k)};
+      }
+      for (int a = 0; a < 6; ++a) {
+        Jtr[a] += Dot(columns[a], r);
+        for (int b = 0; b <= a; ++b) {
+          JtJ[a][b] += Dot(columns[a], columns[b]);
+        }
+      }
+    }
+    double rhs[6];
+    for (int a = 0; a < 6; ++a) {
+      rhs[a] = -Jtr[a];
+      for (int b = 0; b < a; ++b) {
+        JtJ[b][a] = JtJ[a][b];
+      }
+      JtJ[a][a] *= 1.0 + damping;
+    }
+
+    double delta[6];
+    if (!SolveSymmetric6(JtJ, rhs, delta)) {
+      break;
+    }
+    const Mat3 new_R = Multiply(Rodrigues({delta[0], delta[1], delta[2]}), *R);
+    const Vec3 new_t = Add(*t, {delta[3], delta[4], delta[5]});
+    const double new_error = ObjectSpaceError(corners, new_R, new_t);
+    if (!(new_error <= error)) {
+      // Overshot, so take a shorter step.
+      damping *= 10;
+      continue;
+    }
+    damping = std::max(damping * 0.1, 1e-9);
+    const bool converged = error - new_error <=
+                           convergence * std::max(new_error, kNegligibleError);
+    *R = new_R;
+    *t = new_t;
+    error = new_error;
+    if (converged) {
+      break;
+    }
+  }
+  return error;
+}
+
+// Sets up the corners of a detection of a tag tagsize meters across.
+TagCorners MakeCorners(const apriltag_detection_t *detection, double tagsize,
+                       const CameraMatrix &camera_matrix) {
+  const double scale = tagsize / 2.0;
+
+  TagCorners corners;
+  corners.p = {Vec3{-scale, scale, 0}, Vec3{scale, scale, 0},
+               Vec3{scale, -scale, 0}, Vec3{-scale, -scale, 0}};
+  for (int i = 0; i < 4; i++) {
+    corners.v[i] = {(detection->p[i][0] - camera_matrix.cx) / camera_matrix.fx,
+                    (detection->p[i][1] - camera_matrix.cy) / camera_matrix.fy,
+                    1};
+    corners.F[i] = LineOfSightProjection(corners.v[i]);
+  }
+  return corners;
+}
+
+}  // namespace
+
+TagSizes::TagSizes(double default_size) : default_size_(default_size) {
+  CHECK_GT(default_size, 0.0);
+}
+
+void TagSizes::Set(int id, double size) {
+  CHECK_GE(id, 0);
+  CHECK_GT(size, 0.0);
+  if (static_cast<size_t>(id) >= sizes_.size()) {
+    sizes_.resize(id + 1, 0.0);
+  }
+  sizes_[id] = size;
+}
+
+double TagSizes::Get(int id) const {
+  if (id < 0 || static_cast<size_t>(id) >= sizes_.size() || sizes_[id] == 0) {
+    return default_size_;
+  }
+  return sizes_[id];
+}
+
+PoseEstimator::PoseEstimator(CameraMatrix camera_matrix, TagSizes tag_sizes,
+                             std::shared_ptr<WorkStealingPool> pool)
+    : camera_matrix_(camera_matrix),
+      tag_sizes_(std::move(tag_sizes)),
+      pool_(std::move(pool)) {
+  CHECK(pool_);
+}
+
+TagPose PoseEstimator::EstimateTag(const apriltag_detection_t *detection,
+                                   double tagsize,
+                                   const CameraMatrix &camera_matrix) {
+  const TagCorners corners = MakeCorners(detection, tagsize, camera_matrix);
+
+  TagPose pose{};
+  pose.detection = detection;
+  Mat3 R1;
+  Vec3 t1;
+  PoseFromHomography(detection->H, camera_matrix, tagsize / 2.0, &R1, &t1);
+  const double err1 = OrthogonalIteration(corners, &R1, &t1, kIterations);
+  pose.iterations = kIterations;
+  pose.rotation = R1;
+  pose.translation = t1;
+  pose.error = err1;
+
+  Mat3 R2;
+  if (FixPoseAmbiguities(corners, t1, R1, &R2)) {
+    Vec3 t2 = {0, 0, 0};
+    const double err2 = OrthogonalIteration(corners, &R2, &t2, kIterations);
+    pose.iterations += kIterations;
+    // estimate_tag_pose keeps the first solution on a tie.
+    if (err2 < err1) {
+      pose.rotation = R2;
+      pose.translation = t2;
+      pose.error = err2;
+    }
+  }
+  pose.smoothed_rotation = pose.rotation;
+  pose.smoothed_translation = pose.translation;
+  return pose;
+}
+
+TagPose PoseEstimator::HomographyTag(const apriltag_detection_t *detection,
+                                     double tagsize,
+                                     const CameraMatrix &camera_matrix) {
+  const TagCorners corners = MakeCorners(detection, tagsize, camera_matrix);
+
+  TagPose pose{};
+  pose.detection = detection;
+  PoseFromHomography(detection->H, camera_matrix, tagsize / 2.0,
+                     &pose.rotation, &pose.translation);
+  pose.error = ObjectSpaceError(corners, pose.rotation, pose.translation);
+  pose.smoothed_rotation = pose.rotation;
+  pose.smoothed_translation = pose.translation;
+  return pose;
+}
+
+TagPose PoseEstimator::WarmStartTag(const apriltag_detection_t *detection,
+                                    double tagsize,
+                                    const CameraMatrix &camera_matrix,
+                                    const std::array<double, 9> &rotation,
+                                    const std::array<double, 3> &translation,
+                                    int max_iterations, double convergence) {
+  const TagCorners corners = MakeCorners(detection, tagsize, camera_matrix);
+
+  TagPose pose{};
+  pose.detection = detection;
+  pose.rotation = rotation;
+  pose.translation = translation;
+  pose.warm_started = true;
+  pose.error = RefinePose(corners, &pose.rotation, &pose.translation,
+                          max_iterations, convergence, &pose.iterations);
+  pose.smoothed_rotation = pose.rotation;
+  pose.smoothed_translation = pose.translation;
+  return pose;
+}
+
+double PoseEstimator::PoseError(const apriltag_detection_t *detection,
+                                double tagsize,
+                                const CameraMatrix &camera_matrix,
+                                const std::array<double, 9> &rotation,
+                                const std::array<double, 3> &translation) {
+  return ObjectSpaceError(MakeCorners(detection, tagsize, camera_matrix),
+                          rotation, translation);
+}
+
+void PoseEstimator::EnableTracking(const PoseTracker::Options &options) {
+  tracker_ = std::make_unique<PoseTracker>(options);
+}
+
+void PoseEstimator::DisableTracking() { tracker_.reset(); }
+
+void PoseEstimator::Estimate(const zarray_t *detections,
+                             std::chrono::steady_clock::time_point timestamp) {
+  const size_t n = zarray_size(detections);
+  poses_.resize(n);
+  starts_.resize(n);
+  if (tracker_) {
+    tracker_->StartFrame(timestamp);
+  }
+
+  auto estimate = [&](size_t i, size_t) {
+    apriltag_detection_t *det;
+    zarray_get(const_cast<zarray_t *>(detections), i, &det);
+    const double tagsize = tag_sizes_.Get(det->id);
+    const PoseTracker::Track *track =
+        tracker_ ? tracker_->Lookup(det->id) : nullptr;
+    if (track != nullptr) {
+      const PoseTracker::Options &options = tracker_->options();
+      poses_[i] =
+          WarmStartTag(det, tagsize, camera_matrix_, track->rotation,
+                       track->translation, options.max_iterations,
+                       options.convergence);
+      if (!tracker_->ErrorJumped(*track, poses_[i].error)) {
+        starts_[i] = PoseTracker::Start::kWarm;
+        return;
+      }
+      const int warm_iterations = poses_[i].iterations;
+      poses_[i] = EstimateTag(det, tagsize, camera_matrix_);
+      poses_[i].iterations += warm_iterations;
+      starts_[i] = PoseTracker::Start::kFallback;
+    } else {
+      poses_[i] = EstimateTag(det, tagsize, camera_matrix_);
+      starts_[i] = PoseTracker::Start::kCold;
+    }
+  };
+
+  if (n < kMinParallelPoses) {
+    for (size_t i = 0; i < n; ++i) {
+      estimate(i, 0);
+    }
+  } else {
+    pool_->ForEach(n, estimate);
+  }
+
+  // Tags can show up more than once, so the tracks are updated one at a time.
+  for (size_t i = 0; i < n; ++i) {
+    poses_[i].timestamp = timestamp;
+    if (tracker_) {
+      tracker_->Record(&poses_[i], starts_[i]);
+    }
+  }
+  if (tracker_) {
+    VLOG(1) << "Pose tracker: " << tracker_->stats().ToString();
+  }
+}
+
+}  // namespace frc971::apriltag
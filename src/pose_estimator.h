@@ -0,0 +1,140 @@
+#ifndef FRC971_ORIN_POSE_ESTIMATOR_H_
+#define FRC971_ORIN_POSE_ESTIMATOR_H_
+
+#include <stddef.h>
+
+#include <array>
+#include <chrono>
+#include <memory>
+#include <vector>
+
+#include "apriltag.h"
+#include "detector_backend.h"
+#include "pose_tracker.h"
+
+namespace frc971::apriltag {
+
+class WorkStealingPool;
+
+// Size of each tag in meters, measured the same way as
+// apriltag_detection_info_t::tagsize.  Tags without a size of their own use
+// the default.
+class TagSizes {
+ public:
+  explicit TagSizes(double default_size);
+
+  void Set(int id, double size);
+  double Get(int id) const;
+
+  double default_size() const { return default_size_; }
+
+ private:
+  double default_size_;
+  // Indexed by tag ID, 0 where the tag uses the default.
+  std::vector<double> sizes_;
+};
+
+// Pose of a tag in the camera frame.
+struct TagPose {
+  const apriltag_detection_t *detection;
+  // Row major rotation.
+  std::array<double, 9> rotation;
+  std::array<double, 3> translation;
+  // Object space error of the pose, as returned by estimate_tag_pose.
+  double error;
+
+  // When the frame the tag was found in was captured.
+  std::chrono::steady_clock::time_point timestamp;
+  // The pose low pass filtered across frames by the tracker.  The same as the
+  // pose when tracking is off.
+  std::array<double, 9> smoothed_rotation;
+  std::array<double, 3> smoothed_translation;
+
+  // True if the solve started from the tag's last pose.
+  bool warm_started = false;
+  // Solver steps taken.
+  int iterations = 0;
+};
+
+// Estimates the pose of every detection in a frame.  This is
+// estimate_tag_pose from libapriltag on fixed size matrices, so it never
+// touches the heap once poses() has grown to the largest batch, and batches
+// of more than a few tags are split across a thread pool.
+class PoseEstimator {
+ public:
+  // Number of orthogonal iteration steps, the same as estimate_tag_pose.
+  static constexpr int kIterations = 50;
+
+  // Estimates poses for a camera with the provided intrinsics, running large
+  // batches on pool.
+  PoseEstimator(CameraMatrix camera_matrix, TagSizes tag_sizes,
+                std::shared_ptr<WorkStealingPool> pool);
+
+  // Estimates the pose of every detection in the frame captured at
+  // timestamp.  The results are in poses(), in the same order.
+  void Estimate(const zarray_t *detections,
+                std::chrono::steady_clock::time_point timestamp);
+
+  const std::vector<TagPose> &poses() const { return poses_; }
+
+  const TagSizes &tag_sizes() const { return tag_sizes_; }
+
+  // Starts each tag's solve from its pose in the last frame, with at most
+  // options.max_iterations steps, and smooths the poses.  Tracking is off by
+  // default, so every solve matches estimate_tag_pose.
+  void EnableTracking(const PoseTracker::Options &options);
+  void DisableTracking();
+
+  // Returns the tracker, or nullptr when tracking is off.
+  const PoseTracker *tracker() const { return tracker_.get(); }
+
+  // Estimates the pose of a single detection of a tag tagsize meters across.
+  static TagPose EstimateTag(const apriltag_detection_t *detection,
+                             double tagsize,
+                             const CameraMatrix &camera_matrix);
+
+  // Returns the pose of a single detection from its homography alone, which is
+  // where EstimateTag starts.  Much cheaper, and good to a few degrees.
+  static TagPose HomographyTag(const apriltag_detection_t *detection,
+                               double tagsize,
+                               const CameraMatrix &camera_matrix);
+
+  // Estimates the pose of a single detection by minimizing the same error
+  // starting from rotation and translation instead of the homography.  Uses
+  // Gauss-Newton, which gets there in far fewer steps than orthogonal
+  // iteration from a nearby pose, and stops after max_iterations steps or once
+  // a step improves the error by less than convergence times itself.  Only
+  // looks for the pose nearest the starting one, not the ambiguous one.
+  static TagPose WarmStartTag(const apriltag_detection_t *detection,
+                              double tagsize,
+                              const CameraMatrix &camera_matrix,
+                              const std::array<double, 9> &rotation,
+                              const std::array<double, 3> &translation,
+                              int max_iterations, double convergence);
+
+  // Returns the object space error of a pose of a single detection, the error
+  // the solves above minimize, for poses which come from elsewhere, like a
+  // field solve.
+  static double PoseError(const apriltag_detection_t *detection,
+                          double tagsize, const CameraMatrix &camera_matrix,
+                          const std::array<double, 9> &rotation,
+                          const std::array<double, 3> &translation);
+
+ private:
+  // Batches smaller than this are solved on the calling thread.
+  static constexpr size_t kMinParallelPoses = 4;
+
+  CameraMatrix camera_matrix_;
+  TagSizes tag_sizes_;
+  std::shared_ptr<WorkStealingPool> pool_;
+
+  std::unique_ptr<PoseTracker> tracker_;
+
+  std::vector<TagPose> poses_;
+  // How each of poses_ was solved, for the tracker.
+  std::vector<PoseTracker::Start> starts_;
+};
+
+}  // namespace frc971::apriltag
+
+#endif  // FRC971_ORIN_POSE_ESTIMATOR_H_
@@ -0,0 +1,275 @@
+// pose_estimator_test.cpp
+#include "pose_estimator.h"
+
+#include <glog/logging.h>
+#include <gtest/gtest.h>
+
+#include <array>
+#include <chrono>
+#include <cmath>
+#include <memory>
+#include <utility>
+#include <random>
+#include <vector>
+
+#include "work_stealing_pool.h"
+
+extern "C" {
+#include "apriltag_pose.h"
+#include "common/matd.h"
+#include "common/zarray.h"
+}
+
+namespace frc971::apriltag {
+namespace {
+
+constexpr CameraMatrix kCamera = {
+    .fx = 924.09, .cx = 612.90, .fy = 929.80, .cy = 475.76};
+
+// Makes a detection of a tag tagsize meters across, rotated angle radians
+// about axis and translated by t, with corner_noise pixels of noise on the
+// corners.
+apriltag_detection_t *MakeDetection(std::mt19937 *rng, int id, double tagsize,
+                                    std::array<double, 3> axis, double angle,
+                                    std::array<double, 3> t,
+                                    double corner_noise) {
+  std::normal_distribution<double> noise(0.0, corner_noise);
+
+  const double norm =
+      std::sqrt(axis[0] * axis[0] + axis[1] * axis[1] + axis[2] * axis[2]);
+  for (double &a : axis) {
+    a /= norm;
+  }
+  const double c = std::cos(angle), s = std::sin(angle), C = 1 - c;
+  const double R[3][3] = {
+      {c + axis[0] * axis[0] * C, axis[0] * axis[1] * C - axis[2] * s,
+       axis[0] * axis[2] * C + axis[1] * s},
+      {axis[1] * axis[0] * C + axis[2] * s, c + axis[1] * axis[1] * C,
+       axis[1] * axis[2] * C - axis[0] * s},
+      {axis[2] * axis[0] * C - axis[1] * s, axis[2] * axis[1] * C + axis[0] * s,
+       c + axis[2] * axis[2] * C}};
+
+  // H takes tag coordinates in [-1, 1] to pixels.
+  apriltag_detection_t *det = static_cast<apriltag_detection_t *>(
+      calloc(1, sizeof(apriltag_detection_t)));
+  det->id = id;
+  det->H = matd_create(3, 3);
+  const double K[3][3] = {
+      {kCamera.fx, 0, kCamera.cx}, {0, kCamera.fy, kCamera.cy}, {0, 0, 1}};
+  const double scale = tagsize / 2;
+  const double Rt[3][3] = {{R[0][0] * scale, R[0][1] * scale, t[0]},
+                           {R[1][0] * scale, R[1][1] * scale, t[1]},
+                           {R[2][0] * scale, R[2][1] * scale, t[2]}};
+  for (int i = 0; i < 3; ++i) {
+    for (int j = 0; j < 3; ++j) {
+      MATD_EL(det->H, i, j) =
+          K[i][0] * Rt[0][j] + K[i][1] * Rt[1][j] + K[i][2] * Rt[2][j];
+    }
+  }
+
+  constexpr double kTagCorners[4][2] = {{-1, 1}, {1, 1}, {1, -1}, {-1, -1}};
+  for (int i = 0; i < 4; ++i) {
+    double xyz[3];
+    for (int j = 0; j < 3; ++j) {
+      xyz[j] = MATD_EL(det->H, j, 0) * kTagCorners[i][0] +
+               MATD_EL(det->H, j, 1) * kTagCorners[i][1] +
+               MATD_EL(det->H, j, 2);
+    }
+    det->p[i][0] = xyz[0] / xyz[2] + noise(*rng);
+    det->p[i][1] = xyz[1] / xyz[2] + noise(*rng);
+  }
+  return det;
+}
+
+// Makes a detection of a tag tagsize meters across, rotated up to 1 radian
+// about a random axis and about 2 m in front of the camera.
+apriltag_detection_t *RandomDetection(std::mt19937 *rng, int id,
+                                      double tagsize, double corner_noise) {
+  std::uniform_real_distribution<double> uniform(-1.0, 1.0);
+  const std::array<double, 3> axis = {uniform(*rng), uniform(*rng),
+                                      uniform(*rng)};
+  const double angle = uniform(*rng);
+  const std::array<double, 3> t = {0.8 * uniform(*rng), 0.6 * uniform(*rng),
+                                   2.0 + uniform(*rng)};
+  return MakeDetection(rng, id, tagsize, axis, angle, t, corner_noise);
+}
+
+// Tests that every pose matches estimate_tag_pose, error included.
+TEST(PoseEstimatorTest, MatchesEstimateTagPose) {
+  std::mt19937 rng(971);
+  for (int i = 0; i < 200; ++i) {
+    const double tagsize = 0.1 + 0.001 * i;
+    apriltag_detection_t *det =
+        RandomDetection(&rng, i, tagsize, i % 2 == 0 ? 0.0 : 0.5);
+
+    apriltag_detection_info_t info;
+    info.det = det;
+    info.tagsize = tagsize;
+    info.fx = kCamera.fx;
+    info.fy = kCamera.fy;
+    info.cx = kCamera.cx;
+    info.cy = kCamera.cy;
+    apriltag_pose_t expected;
+    const double expected_error = estimate_tag_pose(&info, &expected);
+
+    const TagPose pose = PoseEstimator::EstimateTag(det, tagsize, kCamera);
+    EXPECT_EQ(pose.detection, det);
+    EXPECT_NEAR(pose.error, expected_error, 1e-9 + 1e-6 * expected_error)
+        << ": tag " << i;
+    // The error of a pose from elsewhere is measured the same way.
+    EXPECT_NEAR(PoseEstimator::PoseError(det, tagsize, kCamera, pose.rotation,
+                                         pose.translation),
+                pose.error, 1e-12 + 1e-9 * pose.error)
+        << ": tag " << i;
+    for (int j = 0; j < 9; ++j) {
+      EXPECT_NEAR(pose.rotation[j], expected.R->data[j], 1e-6) << ": tag " << i;
+    }
+    for (int j = 0; j < 3; ++j) {
+      EXPECT_NEAR(pose.translation[j], expected.t->data[j], 1e-6)
+          << ": tag " << i;
+    }
+
+    matd_destroy(expected.R);
+    matd_destroy(expected.t);
+    apriltag_detection_destroy(det);
+  }
+}
+
+// Tests that batches use each tag's own size, and come out the same on the
+// pool as one at a time.
+TEST(PoseEstimatorTest, BatchUsesPerTagSizes) {
+  TagSizes tag_sizes(0.175);
+  tag_sizes.Set(3, 0.1651);
+  tag_sizes.Set(7, 0.2);
+  EXPECT_EQ(tag_sizes.Get(0), 0.175);
+  EXPECT_EQ(tag_sizes.Get(3), 0.1651);
+  EXPECT_EQ(tag_sizes.Get(5), 0.175);
+  EXPECT_EQ(tag_sizes.Get(7), 0.2);
+  EXPECT_EQ(tag_sizes.Get(100), 0.175);
+
+  std::mt19937 rng(254);
+  zarray_t *detections = zarray_create(sizeof(apriltag_detection_t *));
+  for (int i = 0; i < 10; ++i) {
+    apriltag_detection_t *det =
+        RandomDetection(&rng, i, tag_sizes.Get(i), 0.25);
+    zarray_add(detections, &det);
+  }
+
+  PoseEstimator estimator(kCamera, tag_sizes,
+                          std::make_shared<WorkStealingPool>(4));
+  for (int repeat = 0; repeat < 2; ++repeat) {
+    estimator.Estimate(detections, std::chrono::steady_clock::now());
+    ASSERT_EQ(estimator.poses().size(), 10u);
+    for (int i = 0; i < 10; ++i) {
+      apriltag_detection_t *det;
+      zarray_get(detections, i, &det);
+      const TagPose expected =
+          PoseEstimator::EstimateTag(det, tag_sizes.Get(i), kCamera);
+      const TagPose &pose = estimator.poses()[i];
+      EXPECT_EQ(pose.detection, det);
+      EXPECT_EQ(pose.rotation, expected.rotation);
+      EXPECT_EQ(pose.translation, expected.translation);
+      EXPECT_EQ(pose.error, expected.error);
+      // The tags are about 2 m away, which is only right at the right size.
+      EXPECT_NEAR(pose.translation[2], 2.0, 1.1);
+    }
+  }
+
+  apriltag_detections_destroy(detections);
+}
+
+// Tests that a tag moving slowly is warm started from its last pose, converges
+// in a few steps to at least as good a pose as a cold solve, and goes back to
+// a cold solve when it jumps or goes stale.
+TEST(PoseEstimatorTest, TrackingWarmStartsFromLastPose) {
+  constexpr double kTagSize = 0.1651;
+  TagSizes tag_sizes(kTagSize);
+  PoseEstimator estimator(kCamera, tag_sizes,
+                          std::make_shared<WorkStealingPool>(1));
+  const PoseTracker::Options options;
+  estimator.EnableTracking(options);
+
+  std::mt19937 rng(971);
+  const auto start = std::chrono::steady_clock::now();
+  auto estimate = [&](double angle, std::array<double, 3> t,
+                      std::chrono::nanoseconds time) {
+    apriltag_detection_t *det = MakeDetection(&rng, 5, kTagSize, {0, 1, 0.2},
+                                              angle, t, 0.3);
+    zarray_t *detections = zarray_create(sizeof(apriltag_detection_t *));
+    zarray_add(detections, &det);
+    estimator.Estimate(detections, start + time);
+    CHECK_EQ(estimator.poses().size(), 1u);
+    const TagPose pose = estimator.poses()[0];
+    const TagPose cold = PoseEstimator::EstimateTag(det, kTagSize, kCamera);
+    EXPECT_EQ(pose.timestamp, start + time);
+    apriltag_detections_destroy(detections);
+    return std::make_pair(pose, cold);
+  };
+
+  auto [first, first_cold] = estimate(0.3, {0.2, 0.1, 2.0}, {});
+  EXPECT_FALSE(first.warm_started);
+  EXPECT_EQ(first.error, first_cold.error);
+  EXPECT_EQ(first.smoothed_translation, first.translation);
+  EXPECT_EQ(estimator.tracker()->stats().cold, 1u);
+
+  for (int frame = 1; frame < 50; ++frame) {
+    auto [pose, cold] =
+        estimate(0.3 + 0.002 * frame, {0.2 + 0.001 * frame, 0.1, 2.0},
+                 std::chrono::milliseconds(20 * frame));
+    EXPECT_TRUE(pose.warm_started) << ": frame " << frame;
+    EXPECT_LE(pose.iterations, options.max_iterations);
+    EXPECT_LE(pose.error, cold.error * 1.01 + 1e-12) << ": frame " << frame;
+    for (int i = 0; i < 3; ++i) {
+      EXPECT_NEAR(pose.translation[i], cold.translation[i], 0.01);
+      EXPECT_NEAR(pose.smoothed_translation[i], cold.translation[i], 0.03);
+    }
+    EXPECT_EQ(estimator.tracker()->stats().warm, 1u);
+  }
+
+  // Flipping the tag around is too far to warm start from.
+  auto [flipped, flipped_cold] =
+      estimate(-0.5, {-0.3, 0.1, 1.0}, std::chrono::milliseconds(1000));
+  EXPECT_FALSE(flipped.warm_started);
+  EXPECT_EQ(flipped.translation, flipped_cold.translation);
+  EXPECT_EQ(flipped.smoothed_translation, flipped.translation);
+  EXPECT_EQ(estimator.tracker()->stats().fallbacks, 1u);
+
+  // So is a pose from too long ago.
+  auto [stale, stale_cold] = estimate(
+      -0.5, {-0.3, 0.1, 1.0}, std::chrono::milliseconds(1000) +
+                                  options.max_age + std::chrono::seconds(1));
+  EXPECT_FALSE(stale.warm_started);
+  EXPECT_EQ(stale.error, stale_cold.error);
+  EXPECT_EQ(estimator.tracker()->stats().cold, 1u);
+}
+
+// Tests that a tag ID seen twice in a frame it had no track for is counted as
+// cold both times, even though the first pose recorded makes a track.
+TEST(PoseEstimatorTest, TrackingCountsRepeatedTagsCold) {
+  constexpr double kTagSize = 0.1651;
+  TagSizes tag_sizes(kTagSize);
+  PoseEstimator estimator(kCamera, tag_sizes,
+                          std::make_shared<WorkStealingPool>(1));
+  estimator.EnableTracking(PoseTracker::Options());
+
+  std::mt19937 rng(971);
+  zarray_t *detections = zarray_create(sizeof(apriltag_detection_t *));
+  for (double x : {-0.3, 0.3}) {
+    apriltag_detection_t *det = MakeDetection(&rng, 5, kTagSize, {0, 1, 0.2},
+                                              0.3, {x, 0.1, 2.0}, 0.3);
+    zarray_add(detections, &det);
+  }
+  estimator.Estimate(detections, std::chrono::steady_clock::now());
+  EXPECT_EQ(estimator.tracker()->stats().cold, 2u);
+  EXPECT_EQ(estimator.tracker()->stats().fallbacks, 0u);
+  apriltag_detections_destroy(detections);
+}
+
+}  // namespace
+}  // namespace frc971::apriltag
+
+int main(int argc, char **argv) {
+  ::testing::InitGoogleTest(&argc, argv);
+  google::InitGoogleLogging(argv[0]);
+  return RUN_ALL_TESTS();
+}
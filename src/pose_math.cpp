@@ -0,0 +1,194 @@
+#include "pose_math.h"
+
+#include <algorithm>
+#include <cmath>
+#include <utility>
+
+namespace frc971::apriltag {
+
+Mat3 Inverse(const Mat3 &a) {
+  const double det = Determinant(a);
+  Mat3 result = {
+      a[4] * a[8] - a[5] * a[7], a[2] * a[7] - a[1] * a[8],
+      a[1] * a[5] - a[2] * a[4], a[5] * a[6] - a[3] * a[8],
+      a[0] * a[8] - a[2] * a[6], a[2] * a[3] - a[0] * a[5],
+      a[3] * a[7] - a[4] * a[6], a[1] * a[6] - a[0] * a[7],
+      a[0] * a[4] - a[1] * a[3],
+  };
+  return Scale(result, 1.0 / det);
+}
+
+Mat3 OrthogonalFactor(const Mat3 &a) {
+  // Columns of w converge to U S, and v accumulates the rotations.
+  Mat3 w = a;
+  Mat3 v = kIdentity;
+  for (int sweep = 0; sweep < 30; ++sweep) {
+    bool rotated = false;
+    for (int i = 0; i < 2; ++i) {
+      for (int j = i + 1; j < 3; ++j) {
+        double alpha = 0, beta = 0, gamma = 0;
+        for (int k = 0; k < 3; ++k) {
+          alpha += At(w, k, i) * At(w, k, i);
+          beta += At(w, k, j) * At(w, k, j);
+          gamma += At(w, k, i) * At(w, k, j);
+        }
+        if (std::abs(gamma) <= 1e-15 * std::sqrt(alpha * beta)) {
+          continue;
+        }
+        rotated = true;
+        const double zeta = (beta - alpha) / (2 * gamma);
+        const double t = std::copysign(1.0, zeta) /
+                         (std::abs(zeta) + std::sqrt(1 + zeta * zeta));
+        const double c = 1 / std::sqrt(1 + t * t);
+        const double s = c * t;
+        for (int k = 0; k < 3; ++k) {
+          const double wi = At(w, k, i), wj = At(w, k, j);
+          At(w, k, i) = c * wi - s * wj;
+          At(w, k, j) = s * wi + c * wj;
+          const double vi = At(v, k, i), vj = At(v, k, j);
+          At(v, k, i) = c * vi - s * vj;
+          At(v, k, j) = s * vi + c * vj;
+        }
+      }
+    }
+    if (!rotated) {
+      break;
+    }
+  }
+
+  // Sort the singular vectors by singular value, so any missing ones are last.
+  std::array<Vec3, 3> u_columns, v_columns;
+  std::array<double, 3> sigma;
+  for (int i = 0; i < 3; ++i) {
+    u_columns[i] = {At(w, 0, i), At(w, 1, i), At(w, 2, i)};
+    v_columns[i] = {At(v, 0, i), At(v, 1, i), At(v, 2, i)};
+    sigma[i] = std::sqrt(Dot(u_columns[i], u_columns[i]));
+  }
+  for (int i = 0; i < 2; ++i) {
+    for (int j = 2; j > i; --j) {
+      if (sigma[j] > sigma[j - 1]) {
+        std::swap(sigma[j], sigma[j - 1]);
+        std::swap(u_columns[j], u_columns[j - 1]);
+        std::swap(v_columns[j], v_columns[j - 1]);
+      }
+    }
+  }
+
+  const double tiny = 1e-12 * sigma[0];
+  if (sigma[0] == 0) {
+    u_columns[0] = {1, 0, 0};
+  } else {
+    u_columns[0] = Scale(u_columns[0], 1 / sigma[0]);
+  }
+  if (sigma[1] <= tiny) {
+    // Anything perpendicular to the first column.
+    const Vec3 axis = std::abs(u_columns[0][0]) < 0.9 ? Vec3{1, 0, 0}
+                                                      : Vec3{0, 1, 0};
+    u_columns[1] = Cross(u_columns[0], axis);
+    u_columns[1] =
+        Scale(u_columns[1], 1 / std::sqrt(Dot(u_columns[1], u_columns[1])));
+  } else {
+    u_columns[1] = Scale(u_columns[1], 1 / sigma[1]);
+  }
+  if (sigma[2] <= tiny) {
+    u_columns[2] = Cross(u_columns[0], u_columns[1]);
+  } else {
+    u_columns[2] = Scale(u_columns[2], 1 / sigma[2]);
+  }
+
+  Mat3 result;
+  for (int i = 0; i < 3; ++i) {
+    for (int j = 0; j < 3; ++j) {
+      result[i * 3 + j] = u_columns[0][i] * v_columns[0][j] +
+                          u_columns[1][i] * v_columns[1][j] +
+                          u_columns[2][i] * v_columns[2][j];
+    }
+  }
+  return result;
+}
+
+Mat3 Rodrigues(const Vec3 &w) {
+  const double theta = std::sqrt(Dot(w, w));
+  if (theta < 1e-12) {
+    return OrthogonalFactor({1, -w[2], w[1], w[2], 1, -w[0], -w[1], w[0], 1});
+  }
+  const Vec3 k = Scale(w, 1.0 / theta);
+  const Mat3 K = {0, -k[2], k[1], k[2], 0, -k[0], -k[1], k[0], 0};
+  return Add(Add(kIdentity, Scale(K, std::sin(theta))),
+             Scale(Multiply(K, K), 1.0 - std::cos(theta)));
+}
+
+Mat3 QuaternionToRotation(const std::array<double, 4> &q) {
+  const double norm =
+      std::sqrt(q[0] * q[0] + q[1] * q[1] + q[2] * q[2] + q[3] * q[3]);
+  const double w = q[0] / norm, x = q[1] / norm, y = q[2] / norm,
+               z = q[3] / norm;
+  return {1 - 2 * (y * y + z * z), 2 * (x * y - w * z), 2 * (x * z + w * y),
+          2 * (x * y + w * z), 1 - 2 * (x * x + z * z), 2 * (y * z - w * x),
+          2 * (x * z - w * y), 2 * (y * z + w * x), 1 - 2 * (x * x + y * y)};
+}
+
+std::array<double, 4> RotationToQuaternion(const Mat3 &R) {
+  // Work from the largest of w, x, y and z so nothing divides by a small
+  // number.
+  const double trace = R[0] + R[4] + R[8];
+  std::array<double, 4> q;
+  if (trace > std::max({R[0], R[4], R[8]})) {
+    const double s = 2 * std::sqrt(1 + trace);
+    q = {s / 4, (R[7] - R[5]) / s, (R[2] - R[6]) / s, (R[3] - R[1]) / s};
+  } else if (R[0] >= R[4] && R[0] >= R[8]) {
+    const double s = 2 * std::sqrt(1 + R[0] - R[4] - R[8]);
+    q = {(R[7] - R[5]) / s, s / 4, (R[1] + R[3]) / s, (R[2] + R[6]) / s};
+  } else if (R[4] >= R[8]) {
+    const double s = 2 * std::sqrt(1 + R[4] - R[0] - R[8]);
+    q = {(R[2] - R[6]) / s, (R[1] + R[3]) / s, s / 4, (R[5] + R[7]) / s};
+  } else {
+    const double s = 2 * std::sqrt(1 + R[8] - R[0] - R[4]);
+    q = {(R[3] - R[1]) / s, (R[2] + R[6]) / s, (R[5] + R[7]) / s, s / 4};
+  }
+  // Keep w positive, so the same rotation always comes out the same.
+  if (q[0] < 0) {
+    for (double &v : q) {
+      v = -v;
+    }
+  }
+  return q;
+}
+
+bool SolveSymmetric6(double a[6][6], const double b[6], double x[6]) {
+  for (int j = 0; j < 6; ++j) {
+    double d = a[j][j];
+    for (int k = 0; k < j; ++k) {
+      d -= a[j][k] * a[j][k];
+    }
+    if (!(d > 0)) {
+      return false;
+    }
+    a[j][j] = std::sqrt(d);
+    for (int i = j + 1; i < 6; ++i) {
+      double v = a[i][j];
+      for (int k = 0; k < j; ++k) {
+        v -= a[i][k] * a[j][k];
+      }
+      a[i][j] = v / a[j][j];
+    }
+  }
+  double y[6];
+  for (int i = 0; i < 6; ++i) {
+    double v = b[i];
+    for (int k = 0; k < i; ++k) {
+      v -= a[i][k] * y[k];
+    }
+    y[i] = v / a[i][i];
+  }
+  for (int i = 5; i >= 0; --i) {
+    double v = y[i];
+    for (int k = i + 1; k < 6; ++k) {
+      v -= a[k][i] * x[k];
+    }
+    x[i] = v / a[i][i];
+  }
+  return true;
+}
+
+}  // namespace frc971::apriltag
@@ -0,0 +1,116 @@
+#ifndef FRC971_ORIN_POSE_MATH_H_
+#define FRC971_ORIN_POSE_MATH_H_
+
+#include <array>
+
+namespace frc971::apriltag {
+
+// Fixed size matrix helpers for pose estimation, so nothing has to go through
+// matd and the heap.
+
+// Row major 3x3 matrix and column vector.
+using Mat3 = std::array<double, 9>;
+using Vec3 = std::array<double, 3>;
+
+inline constexpr Mat3 kIdentity = {1, 0, 0, 0, 1, 0, 0, 0, 1};
+
+inline double &At(Mat3 &m, int row, int col) { return m[row * 3 + col]; }
+inline double At(const Mat3 &m, int row, int col) { return m[row * 3 + col]; }
+
+inline Mat3 Multiply(const Mat3 &a, const Mat3 &b) {
+  Mat3 result;
+  for (int i = 0; i < 3; ++i) {
+    for (int j = 0; j < 3; ++j) {
+      result[i * 3 + j] = At(a, i, 0) * At(b, 0, j) +
+                          At(a, i, 1) * At(b, 1, j) + At(a, i, 2) * At(b, 2, j);
+    }
+  }
+  return result;
+}
+
+inline Vec3 Multiply(const Mat3 &a, const Vec3 &v) {
+  Vec3 result;
+  for (int i = 0; i < 3; ++i) {
+    result[i] = At(a, i, 0) * v[0] + At(a, i, 1) * v[1] + At(a, i, 2) * v[2];
+  }
+  return result;
+}
+
+inline Mat3 Transpose(const Mat3 &a) {
+  return {a[0], a[3], a[6], a[1], a[4], a[7], a[2], a[5], a[8]};
+}
+
+inline Mat3 Subtract(const Mat3 &a, const Mat3 &b) {
+  Mat3 result;
+  for (int i = 0; i < 9; ++i) {
+    result[i] = a[i] - b[i];
+  }
+  return result;
+}
+
+inline Mat3 Add(const Mat3 &a, const Mat3 &b) {
+  Mat3 result;
+  for (int i = 0; i < 9; ++i) {
+    result[i] = a[i] + b[i];
+  }
+  return result;
+}
+
+inline Mat3 Scale(const Mat3 &a, double s) {
+  Mat3 result;
+  for (int i = 0; i < 9; ++i) {
+    result[i] = a[i] * s;
+  }
+  return result;
+}
+
+inline Vec3 Add(const Vec3 &a, const Vec3 &b) {
+  return {a[0] + b[0], a[1] + b[1], a[2] + b[2]};
+}
+
+inline Vec3 Subtract(const Vec3 &a, const Vec3 &b) {
+  return {a[0] - b[0], a[1] - b[1], a[2] - b[2]};
+}
+
+inline Vec3 Scale(const Vec3 &a, double s) {
+  return {a[0] * s, a[1] * s, a[2] * s};
+}
+
+inline double Dot(const Vec3 &a, const Vec3 &b) {
+  return a[0] * b[0] + a[1] * b[1] + a[2] * b[2];
+}
+
+inline Vec3 Cross(const Vec3 &a, const Vec3 &b) {
+  return {a[1] * b[2] - a[2] * b[1], a[2] * b[0] - a[0] * b[2],
+          a[0] * b[1] - a[1] * b[0]};
+}
+
+inline double Determinant(const Mat3 &a) {
+  return a[0] * (a[4] * a[8] - a[5] * a[7]) -
+         a[1] * (a[3] * a[8] - a[5] * a[6]) +
+         a[2] * (a[3] * a[7] - a[4] * a[6]);
+}
+
+// Returns the inverse of a, which must not be singular.
+Mat3 Inverse(const Mat3 &a);
+
+// Returns U V' from the singular value decomposition U S V' of a, which is the
+// closest orthogonal matrix to a.  Uses one sided Jacobi rotations, which only
+// needs the 3x3 matrix itself as scratch.  If a is rank deficient, the missing
+// singular vectors of U are filled in to make it a right handed basis.
+Mat3 OrthogonalFactor(const Mat3 &a);
+
+// Returns the rotation of angle |w| about w.
+Mat3 Rodrigues(const Vec3 &w);
+
+// Converts between a rotation and a unit quaternion {w, x, y, z}.
+Mat3 QuaternionToRotation(const std::array<double, 4> &q);
+std::array<double, 4> RotationToQuaternion(const Mat3 &R);
+
+// Solves a x = b for the symmetric positive definite 6x6 a by Cholesky
+// decomposition, overwriting a.  Returns false if a isn't positive definite.
+bool SolveSymmetric6(double a[6][6], const double b[6], double x[6]);
+
+}  // namespace frc971::apriltag
+
+#endif  // FRC971_ORIN_POSE_MATH_H_
@@ -0,0 +1,75 @@
+#include "pose_message.h"
+
+#include <string.h>
+
+#include <algorithm>
+
+#include "glog/logging.h"
+
+namespace frc971::apriltag {
+namespace {
+
+int64_t Nanoseconds(std::chrono::steady_clock::time_point time) {
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(
+             time.time_since_epoch())
+      .count();
+}
+
+}  // namespace
+
+void PoseMessageBuilder::Start(std::string_view camera,
+                               std::chrono::steady_clock::time_point timestamp,
+                               double latency_ms, size_t dropped_frames) {
+  // resize zeroes the header, so every field left alone is 0.
+  buffer_.clear();
+  buffer_.resize(sizeof(PoseMessageHeader));
+  PoseMessageHeader *message = header();
+  memcpy(message->prefix, kPoseMessagePrefix, sizeof(message->prefix));
+  message->version = kPoseMessageVersion;
+  message->header_bytes = sizeof(PoseMessageHeader);
+  message->tag_bytes = sizeof(PoseMessageTag);
+  memcpy(message->camera, camera.data(),
+         std::min(camera.size(), sizeof(message->camera)));
+  message->timestamp_ns = Nanoseconds(timestamp);
+  message->latency_ms = latency_ms;
+  message->dropped_frames = dropped_frames;
+}
+
+void PoseMessageBuilder::SetFieldPose(const FieldPose &field_pose) {
+  CHECK_GE(buffer_.size(), sizeof(PoseMessageHeader)) << ": Start first";
+  PoseMessageHeader *message = header();
+  message->flags |= kPoseMessageFieldPose;
+  message->field_pose_valid = field_pose.valid;
+  message->field_pose_tags = field_pose.tags;
+  if (field_pose.valid) {
+    std::copy(field_pose.rotation.begin(), field_pose.rotation.end(),
+              message->field_rotation);
+    std::copy(field_pose.translation.begin(), field_pose.translation.end(),
+              message->field_translation);
+    std::copy(field_pose.covariance.begin(), field_pose.covariance.end(),
+              message->field_covariance);
+    message->field_rms_error = field_pose.rms_error;
+  }
+}
+
+void PoseMessageBuilder::AddTag(int id, int hamming, const TagPose &pose) {
+  CHECK_GE(buffer_.size(), sizeof(PoseMessageHeader)) << ": Start first";
+  const size_t offset = buffer_.size();
+  buffer_.resize(offset + sizeof(PoseMessageTag));
+  PoseMessageTag *tag =
+      reinterpret_cast<PoseMessageTag *>(buffer_.data() + offset);
+  tag->id = id;
+  tag->hamming = hamming;
+  tag->error = pose.error;
+  tag->timestamp_ns = Nanoseconds(pose.timestamp);
+  std::copy(pose.rotation.begin(), pose.rotation.end(), tag->rotation);
+  std::copy(pose.translation.begin(), pose.translation.end(),
+            tag->translation);
+  std::copy(pose.smoothed_rotation.begin(), pose.smoothed_rotation.end(),
+            tag->smoothed_rotation);
+  std::copy(pose.smoothed_translation.begin(),
+            pose.smoothed_translation.end(), tag->smoothed_translation);
+  ++header()->tags;
+}
+
+}  // namespace frc971::apriltag
@@ -0,0 +1,107 @@
+#ifndef FRC971_ORIN_POSE_MESSAGE_H_
+#define FRC971_ORIN_POSE_MESSAGE_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <bit>
+#include <chrono>
+#include <span>
+#include <string_view>
+#include <vector>
+
+#include "field_localizer.h"
+#include "pose_estimator.h"
+
+namespace frc971::apriltag {
+
+// A binary pose message is a PoseMessageHeader followed by a PoseMessageTag
+// per tag found, all little endian.  It starts with a 5 byte prefix like the
+// gui's other messages, so a client can tell it apart from "POSE:" JSON and
+// "IMG::" images.  A client which knows an older version can still read a
+// newer one by stepping over the header and tags by the sizes they give, since
+// fields are only ever added to the ends.
+inline constexpr char kPoseMessagePrefix[5] = {'P', 'O', 'S', 'B', ':'};
+inline constexpr uint8_t kPoseMessageVersion = 1;
+
+static_assert(std::endian::native == std::endian::little,
+              "Pose messages are sent in host byte order");
+
+// Bits of PoseMessageHeader::flags.
+enum PoseMessageFlag : uint32_t {
+  // The field pose fields are filled in, because the camera is localizing on
+  // the field.
+  kPoseMessageFieldPose = 1 << 0,
+};
+
+struct PoseMessageHeader {
+  char prefix[5];
+  uint8_t version;
+  // sizeof(PoseMessageHeader) and sizeof(PoseMessageTag).
+  uint16_t header_bytes;
+  uint32_t tag_bytes;
+  uint32_t tags;
+  // The camera's ID, NUL padded, and cut short if it doesn't fit.
+  char camera[32];
+  // steady_clock time of capture.
+  int64_t timestamp_ns;
+  // Capture to publish latency.
+  double latency_ms;
+  // Frames skipped so far to keep up.
+  uint64_t dropped_frames;
+  uint32_t flags;
+  uint32_t field_pose_valid;
+  uint32_t field_pose_tags;
+  uint32_t reserved;
+  // Row major.
+  double field_rotation[9];
+  double field_translation[3];
+  double field_covariance[36];
+  double field_rms_error;
+};
+static_assert(sizeof(PoseMessageHeader) == 480);
+
+struct PoseMessageTag {
+  int32_t id;
+  int32_t hamming;
+  double error;
+  // steady_clock time of capture.
+  int64_t timestamp_ns;
+  // Row major.
+  double rotation[9];
+  double translation[3];
+  double smoothed_rotation[9];
+  double smoothed_translation[3];
+};
+static_assert(sizeof(PoseMessageTag) == 216);
+
+// Lays out a binary pose message for the gui.  The buffer is reused from one
+// message to the next, so once it has grown to the most tags seen, building a
+// message never allocates.
+class PoseMessageBuilder {
+ public:
+  // Starts a new message with no tags, in place of the last.
+  void Start(std::string_view camera,
+             std::chrono::steady_clock::time_point timestamp,
+             double latency_ms, size_t dropped_frames);
+
+  // Fills in the field pose.  Messages without one are from cameras which
+  // aren't localizing on the field.
+  void SetFieldPose(const FieldPose &field_pose);
+
+  // Appends a tag.  pose.detection isn't used, so it may be gone already.
+  void AddTag(int id, int hamming, const TagPose &pose);
+
+  std::span<const uint8_t> message() const { return buffer_; }
+
+ private:
+  PoseMessageHeader *header() {
+    return reinterpret_cast<PoseMessageHeader *>(buffer_.data());
+  }
+
+  std::vector<uint8_t> buffer_;
+};
+
+}  // namespace frc971::apriltag
+
+#endif  // FRC971_ORIN_POSE_MESSAGE_H_
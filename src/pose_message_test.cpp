@@ -0,0 +1,144 @@
+// pose_message_test.cpp
+#include "pose_message.h"
+
+#include <glog/logging.h>
+#include <gtest/gtest.h>
+#include <string.h>
+
+#include <chrono>
+#include <string>
+
+namespace frc971::apriltag {
+namespace {
+
+const std::chrono::steady_clock::time_point kCaptured(
+    std::chrono::milliseconds(1500));
+
+TagPose MakePose(double value) {
+  TagPose pose = {};
+  for (size_t i = 0; i < 9; ++i) {
+    pose.rotation[i] = value + i;
+    pose.smoothed_rotation[i] = -value - i;
+  }
+  for (size_t i = 0; i < 3; ++i) {
+    pose.translation[i] = value * 10 + i;
+    pose.smoothed_translation[i] = -value * 10 - i;
+  }
+  pose.error = value / 100;
+  pose.timestamp = kCaptured;
+  return pose;
+}
+
+const PoseMessageHeader &Header(const PoseMessageBuilder &builder) {
+  return *reinterpret_cast<const PoseMessageHeader *>(
+      builder.message().data());
+}
+
+const PoseMessageTag &Tag(const PoseMessageBuilder &builder, size_t i) {
+  return *reinterpret_cast<const PoseMessageTag *>(
+      builder.message().data() + sizeof(PoseMessageHeader) +
+      i * sizeof(PoseMessageTag));
+}
+
+// Tests that a message holds the header and tags it was built from.
+TEST(PoseMessageTest, LaysOutTags) {
+  PoseMessageBuilder builder;
+  builder.Start("front", kCaptured, 12.5, 3);
+  builder.AddTag(7, 1, MakePose(1));
+  builder.AddTag(9, 0, MakePose(2));
+
+  ASSERT_EQ(builder.message().size(),
+            sizeof(PoseMessageHeader) + 2 * sizeof(PoseMessageTag));
+  const PoseMessageHeader &header = Header(builder);
+  EXPECT_EQ(std::string(header.prefix, 5), "POSB:");
+  EXPECT_EQ(header.version, kPoseMessageVersion);
+  EXPECT_EQ(header.header_bytes, sizeof(PoseMessageHeader));
+  EXPECT_EQ(header.tag_bytes, sizeof(PoseMessageTag));
+  EXPECT_EQ(header.tags, 2u);
+  EXPECT_STREQ(header.camera, "front");
+  EXPECT_EQ(header.timestamp_ns, 1500000000);
+  EXPECT_EQ(header.latency_ms, 12.5);
+  EXPECT_EQ(header.dropped_frames, 3u);
+  EXPECT_EQ(header.flags, 0u);
+
+  for (size_t i = 0; i < 2; ++i) {
+    const PoseMessageTag &tag = Tag(builder, i);
+    const TagPose pose = MakePose(i + 1);
+    EXPECT_EQ(tag.id, i == 0 ? 7 : 9);
+    EXPECT_EQ(tag.hamming, i == 0 ? 1 : 0);
+    EXPECT_EQ(tag.error, pose.error);
+    EXPECT_EQ(tag.timestamp_ns, 1500000000);
+    for (size_t j = 0; j < 9; ++j) {
+      EXPECT_EQ(tag.rotation[j], pose.rotation[j]);
+      EXPECT_EQ(tag.smoothed_rotation[j], pose.smoothed_rotation[j]);
+    }
+    for (size_t j = 0; j < 3; ++j) {
+      EXPECT_EQ(tag.translation[j], pose.translation[j]);
+      EXPECT_EQ(tag.smoothed_translation[j], pose.smoothed_translation[j]);
+    }
+  }
+}
+
+// Tests that the field pose is only filled in when set, and the camera ID is
+// cut short to fit.
+TEST(PoseMessageTest, LaysOutFieldPose) {
+  PoseMessageBuilder builder;
+  const std::string camera(40, 'c');
+  builder.Start(camera, kCaptured, 1, 0);
+  FieldPose field_pose = {};
+  builder.SetFieldPose(field_pose);
+  EXPECT_EQ(Header(builder).flags, kPoseMessageFieldPose);
+  EXPECT_EQ(Header(builder).field_pose_valid, 0u);
+  EXPECT_EQ(std::string(Header(builder).camera, 32), camera.substr(0, 32));
+
+  field_pose.valid = true;
+  field_pose.tags = 3;
+  field_pose.rms_error = 0.25;
+  for (size_t i = 0; i < 9; ++i) {
+    field_pose.rotation[i] = i;
+  }
+  field_pose.translation = {1, 2, 3};
+  for (size_t i = 0; i < 36; ++i) {
+    field_pose.covariance[i] = i * 0.5;
+  }
+  builder.Start("", kCaptured, 1, 0);
+  builder.SetFieldPose(field_pose);
+  const PoseMessageHeader &header = Header(builder);
+  EXPECT_EQ(header.camera[0], '\0');
+  EXPECT_EQ(header.field_pose_valid, 1u);
+  EXPECT_EQ(header.field_pose_tags, 3u);
+  EXPECT_EQ(header.field_rms_error, 0.25);
+  EXPECT_EQ(header.field_rotation[8], 8);
+  EXPECT_EQ(header.field_translation[2], 3);
+  EXPECT_EQ(header.field_covariance[35], 17.5);
+}
+
+// Tests that the buffer is reused rather than reallocated once it is big
+// enough, and that each message starts over.
+TEST(PoseMessageTest, ReusesBuffer) {
+  PoseMessageBuilder builder;
+  builder.Start("front", kCaptured, 1, 0);
+  for (int i = 0; i < 16; ++i) {
+    builder.AddTag(i, 0, MakePose(i));
+  }
+  const uint8_t *data = builder.message().data();
+
+  builder.Start("front", kCaptured, 2, 0);
+  EXPECT_EQ(Header(builder).tags, 0u);
+  EXPECT_EQ(builder.message().size(), sizeof(PoseMessageHeader));
+  for (int i = 0; i < 16; ++i) {
+    builder.AddTag(i, 0, MakePose(i));
+  }
+  EXPECT_EQ(builder.message().data(), data);
+  EXPECT_EQ(Header(builder).tags, 16u);
+  EXPECT_EQ(Tag(builder, 15).id, 15);
+}
+
+}  // namespace
+}  // namespace frc971::apriltag
+
+int main(int argc, char **argv) {
+  ::testing::InitGoogleTest(&argc, argv);
+  google::InitGoogleLogging(argv[0]);
+  return RUN_ALL_TESTS();
+}
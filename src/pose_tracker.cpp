@@ -0,0 +1,104 @@
+#include "pose_tracker.h"
+
+#include <algorithm>
+#include <cmath>
+#include <sstream>
+
+#include "apriltag.h"
+#include "glog/logging.h"
+#include "pose_estimator.h"
+
+namespace frc971::apriltag {
+
+PoseTracker::PoseTracker(const Options &options) : options_(options) {
+  CHECK_GT(options_.max_iterations, 0);
+  CHECK_GE(options_.smoothing.count(), 0);
+}
+
+void PoseTracker::StartFrame(std::chrono::steady_clock::time_point timestamp) {
+  timestamp_ = timestamp;
+  stats_ = Stats();
+}
+
+const PoseTracker::Track *PoseTracker::Lookup(int id) const {
+  if (id < 0 || static_cast<size_t>(id) >= tracks_.size()) {
+    return nullptr;
+  }
+  const Track &track = tracks_[id];
+  if (track.timestamp == std::chrono::steady_clock::time_point() ||
+      timestamp_ - track.timestamp > options_.max_age) {
+    return nullptr;
+  }
+  return &track;
+}
+
+bool PoseTracker::ErrorJumped(const Track &track, double error) const {
+  return error >
+         std::max(options_.error_jump * track.mean_error, options_.min_error);
+}
+
+void PoseTracker::Record(TagPose *pose, Start start) {
+  const int id = pose->detection->id;
+  CHECK_GE(id, 0);
+  CHECK_EQ(pose->warm_started, start == Start::kWarm);
+
+  switch (start) {
+    case Start::kWarm:
+      ++stats_.warm;
+      break;
+    case Start::kCold:
+      ++stats_.cold;
+      break;
+    case Start::kFallback:
+      ++stats_.fallbacks;
+      break;
+  }
+  stats_.iterations += pose->iterations;
+
+  if (static_cast<size_t>(id) >= tracks_.size()) {
+    tracks_.resize(id + 1, Track{});
+  }
+  Track &track = tracks_[id];
+
+  pose->timestamp = timestamp_;
+  if (pose->warm_started && options_.smoothing.count() > 0) {
+    // Exponential filter, weighted by how long it has been since the last
+    // update so dropped frames don't slow it down.
+    const double dt =
+        std::chrono::duration<double>(timestamp_ - track.timestamp).count();
+    const double tau =
+        std::chrono::duration<double>(options_.smoothing).count();
+    const double alpha = 1.0 - std::exp(-std::max(dt, 0.0) / tau);
+    pose->smoothed_translation =
+        Add(track.smoothed_translation,
+            Scale(Subtract(pose->translation, track.smoothed_translation),
+                  alpha));
+    pose->smoothed_rotation =
+        OrthogonalFactor(Add(Scale(track.smoothed_rotation, 1.0 - alpha),
+                             Scale(pose->rotation, alpha)));
+  } else {
+    pose->smoothed_rotation = pose->rotation;
+    pose->smoothed_translation = pose->translation;
+  }
+
+  track.timestamp = timestamp_;
+  track.rotation = pose->rotation;
+  track.translation = pose->translation;
+  // Averages over about 8 frames.
+  if (pose->warm_started) {
+    track.mean_error += (pose->error - track.mean_error) / 8;
+  } else {
+    track.mean_error = pose->error;
+  }
+  track.smoothed_rotation = pose->smoothed_rotation;
+  track.smoothed_translation = pose->smoothed_translation;
+}
+
+std::string PoseTracker::Stats::ToString() const {
+  std::ostringstream os;
+  os << warm << " warm, " << cold << " cold, " << fallbacks << " fallbacks, "
+     << iterations << " iterations";
+  return os.str();
+}
+
+}  // namespace frc971::apriltag
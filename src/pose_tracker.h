@@ -0,0 +1,111 @@
+#ifndef FRC971_ORIN_POSE_TRACKER_H_
+#define FRC971_ORIN_POSE_TRACKER_H_
+
+#include <stddef.h>
+
+#include <chrono>
+#include <string>
+#include <vector>
+
+#include "pose_math.h"
+
+namespace frc971::apriltag {
+
+struct TagPose;
+
+// Remembers the last pose of each tag ID, so the next frame's solve can start
+// from it instead of from the homography, and low pass filters the poses for
+// consumers which would rather have less jitter than less lag.
+class PoseTracker {
+ public:
+  struct Options {
+    // Steps a warm started solve can take.
+    int max_iterations = 5;
+    // A warm started solve stops once its error changes by less than this
+    // fraction in a step.
+    double convergence = 1e-3;
+    // A warm started solve is thrown away for a cold one if its error is more
+    // than error_jump times the tag's typical error, or min_error m^2,
+    // whichever is larger.  The error is the sum of squares of the 2 degrees of
+    // freedom the pose can't fit, so noise alone only gets over 10 times its
+    // mean about once in 20000 frames.
+    double error_jump = 10.0;
+    double min_error = 1e-6;
+    // Tags which haven't been seen for longer than this start cold.
+    std::chrono::nanoseconds max_age = std::chrono::milliseconds(250);
+    // Time constant of the filter on the smoothed pose.  0 turns it off.
+    std::chrono::nanoseconds smoothing = std::chrono::milliseconds(50);
+  };
+
+  explicit PoseTracker(const Options &options);
+
+  // What is remembered about a tag.
+  struct Track {
+    std::chrono::steady_clock::time_point timestamp;
+    Mat3 rotation;
+    Vec3 translation;
+    // Running average of the error.
+    double mean_error;
+    Mat3 smoothed_rotation;
+    Vec3 smoothed_translation;
+  };
+
+  // Starts tracking the frame captured at timestamp.
+  void StartFrame(std::chrono::steady_clock::time_point timestamp);
+
+  // Returns the track to warm start id from, or nullptr if it hasn't been seen
+  // recently.  Can be called from several threads at once.
+  const Track *Lookup(int id) const;
+
+  // Returns true if a warm started solve with error should be thrown away.
+  bool ErrorJumped(const Track &track, double error) const;
+
+  // How a tag's pose was solved.
+  enum class Start {
+    // From the tag's track.
+    kWarm,
+    // From scratch, because Lookup found no track.
+    kCold,
+    // From scratch, because the warm started error jumped.
+    kFallback,
+  };
+
+  // Remembers the pose solved for a tag this frame, and fills out its
+  // timestamp and smoothed pose.  Smoothing starts over unless the pose was
+  // warm started.  start is decided when the pose is solved, since recording
+  // an earlier pose of the same ID this frame changes what Lookup returns.
+  void Record(TagPose *pose, Start start);
+
+  struct Stats {
+    // Tags solved from last frame's pose.
+    size_t warm = 0;
+    // Tags solved from scratch because there was nothing to start from.
+    size_t cold = 0;
+    // Tags solved from scratch because the warm started error jumped.
+    size_t fallbacks = 0;
+    // Solver steps taken.
+    size_t iterations = 0;
+
+    std::string ToString() const;
+  };
+
+  // Returns the stats for the current frame.
+  const Stats &stats() const { return stats_; }
+
+  const Options &options() const { return options_; }
+
+ private:
+  Options options_;
+
+  std::chrono::steady_clock::time_point timestamp_;
+
+  // Indexed by tag ID.  Tracks which have never been recorded have a
+  // timestamp at the epoch.
+  std::vector<Track> tracks_;
+
+  Stats stats_;
+};
+
+}  // namespace frc971::apriltag
+
+#endif  // FRC971_ORIN_POSE_TRACKER_H_
@@ -0,0 +1,306 @@
+#include "recorder.h"
+
+#include <string.h>
+
+#include <algorithm>
+#include <utility>
+
+#include "glog/logging.h"
+
+extern "C" {
+#include "common/zarray.h"
+}
+
+namespace frc971::apriltag {
+namespace {
+
+int64_t Nanoseconds(std::chrono::steady_clock::duration duration) {
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(duration)
+      .count();
+}
+
+// Returns the bytes of an image as captured.
+size_t FrameBytes(ImageFormat format, size_t width, size_t height) {
+  const size_t bytes = RowStride(format, width) * height;
+  return format.pixel_format == PixelFormat::kNv12 ? bytes * 3 / 2 : bytes;
+}
+
+}  // namespace
+
+std::unique_ptr<Recorder> Recorder::Create(const std::string &path,
+                                           size_t width, size_t height,
+                                           ImageFormat format,
+                                           const Options &options) {
+  std::unique_ptr<FrameLogWriter> writer = FrameLogWriter::Create(path);
+  if (writer == nullptr) {
+    return nullptr;
+  }
+  LOG(INFO) << "Recording " << width << "x" << height << " frames to "
+            << path;
+  return std::unique_ptr<Recorder>(
+      new Recorder(std::move(writer), width, height, format, options));
+}
+
+Recorder::Recorder(std::unique_ptr<FrameLogWriter> writer, size_t width,
+                   size_t height, ImageFormat format, const Options &options)
+    : writer_(std::move(writer)),
+      width_(width),
+      height_(height),
+      format_(format),
+      options_(options),
+      queue_(options.queue_depth, DropPolicy::kBlock),
+      buffer_(options.chunk_bytes +
+              PadRecord(sizeof(RecordHeader) + sizeof(FrameRecord) +
+                        FrameBytes(format, width, height))) {
+  // Go once around the queue to size every slot before the first frame.
+  const size_t image_bytes = options_.luma_only
+                                 ? LumaBytes(format_, width_, height_)
+                                 : FrameBytes(format_, width_, height_);
+  for (size_t i = 0; i < options_.queue_depth; ++i) {
+    Entry *entry = queue_.BeginPush();
+    entry->image.resize(image_bytes);
+    entry->detections.reserve(16);
+    entry->poses.reserve(16);
+    queue_.EndPush();
+  }
+  for (size_t i = 0; i < options_.queue_depth; ++i) {
+    queue_.Pop();
+  }
+  last_ids_.reserve(16);
+  ids_.reserve(16);
+
+  thread_ = std::thread(&Recorder::Write, this);
+}
+
+Recorder::~Recorder() {
+  // Waits for room, so the last entry always gets through.
+  Entry *entry = queue_.BeginPush();
+  entry->last = true;
+  queue_.EndPush();
+  thread_.join();
+}
+
+uint32_t Recorder::Triggers(const CapturedFrame &frame,
+                            const zarray_t *detections,
+                            const StageTimes &times) {
+  uint32_t triggers = 0;
+  if (options_.sample_period > std::chrono::steady_clock::duration::zero() &&
+      (!sampled_ || frame.timestamp - last_sample_ >= options_.sample_period)) {
+    triggers |= kTriggerSampled;
+    sampled_ = true;
+    last_sample_ = frame.timestamp;
+  }
+
+  ids_.clear();
+  for (int i = 0; i < zarray_size(detections); ++i) {
+    apriltag_detection_t *det;
+    zarray_get(const_cast<zarray_t *>(detections), i, &det);
+    ids_.push_back(det->id);
+    if (options_.trigger_on_bit_errors && det->hamming > 0) {
+      triggers |= kTriggerBitErrors;
+    }
+  }
+  std::sort(ids_.begin(), ids_.end());
+  if (options_.trigger_on_tag_loss &&
+      !std::includes(ids_.begin(), ids_.end(), last_ids_.begin(),
+                     last_ids_.end())) {
+    triggers |= kTriggerTagLost;
+  }
+  std::swap(ids_, last_ids_);
+
+  if (options_.latency_limit > std::chrono::steady_clock::duration::zero() &&
+      times.pose_end - frame.timestamp > options_.latency_limit) {
+    triggers |= kTriggerLatency;
+  }
+  return triggers;
+}
+
+bool Recorder::Record(const CapturedFrame &frame, const zarray_t *detections,
+                      std::span<const TagPose> poses,
+                      const FieldPose &field_pose, const StageTimes &times) {
+  CHECK_EQ(frame.width, width_);
+  CHECK_EQ(frame.height, height_);
+  CHECK(frame.format.pixel_format == format_.pixel_format);
+  CHECK_EQ(RowStride(frame.format, width_), RowStride(format_, width_));
+
+  // Triggers look at every frame, even ones which are dropped.
+  const uint32_t triggers = Triggers(frame, detections, times);
+  Entry *entry = queue_.TryBeginPush();
+  if (entry == nullptr) {
+    return false;
+  }
+
+  entry->result = ResultRecord{
+      .timestamp_ns = Nanoseconds(frame.timestamp.time_since_epoch()),
+      .sequence = frame.sequence,
+      .triggers = triggers,
+      .queued_ns = Nanoseconds(times.detect_start - frame.timestamp),
+      .detect_ns = Nanoseconds(times.detect_end - times.detect_start),
+      .pose_ns = Nanoseconds(times.pose_end - times.detect_end),
+      .detections = static_cast<uint32_t>(zarray_size(detections)),
+      .poses = static_cast<uint32_t>(poses.size()),
+      .field_pose_valid = field_pose.valid,
+      .field_pose_tags = static_cast<uint32_t>(field_pose.tags),
+      .field_rotation = {},
+      .field_translation = {},
+      .field_covariance = {},
+      .field_rms_error = field_pose.rms_error,
+  };
+  if (field_pose.valid) {
+    std::copy(field_pose.rotation.begin(), field_pose.rotation.end(),
+              entry->result.field_rotation);
+    std::copy(field_pose.translation.begin(), field_pose.translation.end(),
+              entry->result.field_translation);
+    std::copy(field_pose.covariance.begin(), field_pose.covariance.end(),
+              entry->result.field_covariance);
+  }
+
+  entry->detections.clear();
+  for (int i = 0; i < zarray_size(detections); ++i) {
+    apriltag_detection_t *det;
+    zarray_get(const_cast<zarray_t *>(detections), i, &det);
+    DetectionRecord record{};
+    record.id = det->id;
+    record.hamming = det->hamming;
+    record.decision_margin = det->decision_margin;
+    record.center[0] = det->c[0];
+    record.center[1] = det->c[1];
+    memcpy(record.corners, det->p, sizeof(record.corners));
+    entry->detections.push_back(record);
+  }
+
+  entry->poses.clear();
+  for (const TagPose &pose : poses) {
+    PoseRecord record{};
+    record.id = pose.detection != nullptr ? pose.detection->id : -1;
+    record.error = pose.error;
+    std::copy(pose.rotation.begin(), pose.rotation.end(), record.rotation);
+    std::copy(pose.translation.begin(), pose.translation.end(),
+              record.translation);
+    entry->poses.push_back(record);
+  }
+
+  entry->image_bytes = 0;
+  if (triggers != 0) {
+    // Only the luma is copied when that's all that will be kept.
+    entry->image_bytes =
+        options_.luma_only ? LumaBytes(frame.format, width_, height_)
+                           : frame.bytes;
+    CHECK_LE(entry->image_bytes, entry->image.size());
+    CHECK_LE(entry->image_bytes, frame.bytes);
+    memcpy(entry->image.data(), frame.data, entry->image_bytes);
+    images_.fetch_add(1, std::memory_order_relaxed);
+  }
+  queue_.EndPush();
+  return true;
+}
+
+void Recorder::Write() {
+  while (Entry *entry = queue_.Front()) {
+    if (entry->last) {
+      queue_.Pop();
+      break;
+    }
+    Append(*entry);
+    queue_.Pop();
+    if (std::chrono::steady_clock::now() - chunk_start_ >=
+        options_.flush_period) {
+      Flush();
+    }
+  }
+  Flush();
+}
+
+void Recorder::Append(const Entry &entry) {
+  const size_t result_bytes =
+      sizeof(ResultRecord) +
+      entry.detections.size() * sizeof(DetectionRecord) +
+      entry.poses.size() * sizeof(PoseRecord);
+  const size_t image_bytes =
+      options_.luma_only ? width_ * height_ : entry.image_bytes;
+  const size_t bytes =
+      PadRecord(sizeof(RecordHeader) + result_bytes) +
+      (entry.image_bytes > 0
+           ? PadRecord(sizeof(RecordHeader) + sizeof(FrameRecord) +
+                       image_bytes)
+           : 0);
+
+  if (buffer_.size() > 0 &&
+      (buffer_.size() + bytes > options_.chunk_bytes ||
+       bytes > buffer_.remaining())) {
+    Flush();
+  }
+  if (buffer_.size() == 0) {
+    buffer_.Reserve(PadRecord(sizeof(RecordHeader) + sizeof(ChunkRecord)) +
+                    bytes);
+    ChunkRecord *chunk = reinterpret_cast<ChunkRecord *>(
+        buffer_.Append(RecordType::kChunk, sizeof(ChunkRecord)));
+    *chunk = ChunkRecord{};
+    chunk->first_timestamp_ns = entry.result.timestamp_ns;
+    chunk_start_ = std::chrono::steady_clock::now();
+  }
+
+  uint8_t *result = buffer_.Append(RecordType::kResult, result_bytes);
+  memcpy(result, &entry.result, sizeof(ResultRecord));
+  result += sizeof(ResultRecord);
+  memcpy(result, entry.detections.data(),
+         entry.detections.size() * sizeof(DetectionRecord));
+  result += entry.detections.size() * sizeof(DetectionRecord);
+  memcpy(result, entry.poses.data(), entry.poses.size() * sizeof(PoseRecord));
+
+  if (entry.image_bytes > 0) {
+    FrameRecord *frame = reinterpret_cast<FrameRecord *>(buffer_.Append(
+        RecordType::kFrame, sizeof(FrameRecord) + image_bytes));
+    *frame = FrameRecord{
+        .timestamp_ns = entry.result.timestamp_ns,
+        .sequence = entry.result.sequence,
+        .pixel_format = static_cast<uint32_t>(options_.luma_only
+                                                  ? PixelFormat::kGray8
+                                                  : format_.pixel_format),
+        .width = static_cast<uint32_t>(width_),
+        .height = static_cast<uint32_t>(height_),
+        .stride = options_.luma_only ? width_ : RowStride(format_, width_),
+        .bytes = image_bytes,
+        .reserved = 0,
+    };
+    uint8_t *image = reinterpret_cast<uint8_t *>(frame + 1);
+    if (!options_.luma_only) {
+      memcpy(image, entry.image.data(), image_bytes);
+    } else {
+      const size_t stride = RowStride(format_, width_);
+      for (size_t row = 0; row < height_; ++row) {
+        const uint8_t *in = entry.image.data() + row * stride;
+        uint8_t *out = image + row * width_;
+        if (BytesPerPixel(format_.pixel_format) == 1) {
+          memcpy(out, in, width_);
+          continue;
+        }
+        for (size_t col = 0; col < width_; ++col) {
+          out[col] = ReadLuma(in, col, format_.pixel_format);
+        }
+      }
+    }
+  }
+
+  ChunkRecord *chunk =
+      reinterpret_cast<ChunkRecord *>(buffer_.data() + sizeof(RecordHeader));
+  chunk->records += entry.image_bytes > 0 ? 2 : 1;
+  chunk->last_timestamp_ns = entry.result.timestamp_ns;
+}
+
+void Recorder::Flush() {
+  if (buffer_.size() == 0) {
+    return;
+  }
+  const size_t chunk_bytes =
+      PadRecord(sizeof(RecordHeader) + sizeof(ChunkRecord));
+  reinterpret_cast<ChunkRecord *>(buffer_.data() + sizeof(RecordHeader))
+      ->size = buffer_.size() - chunk_bytes;
+  if (!writer_->WriteRecords(buffer_.records())) {
+    LOG(ERROR) << "Dropped " << buffer_.size() << " bytes of recording";
+  }
+  bytes_written_.store(writer_->bytes_written(), std::memory_order_relaxed);
+  buffer_.Clear();
+}
+
+}  // namespace frc971::apriltag
@@ -0,0 +1,143 @@
+#ifndef FRC971_ORIN_RECORDER_H_
+#define FRC971_ORIN_RECORDER_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <span>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "apriltag.h"
+#include "field_localizer.h"
+#include "frame_log.h"
+#include "frame_source.h"
+#include "pose_estimator.h"
+#include "spsc_queue.h"
+
+namespace frc971::apriltag {
+
+// When each stage of detecting a frame finished.
+struct StageTimes {
+  std::chrono::steady_clock::time_point detect_start;
+  std::chrono::steady_clock::time_point detect_end;
+  std::chrono::steady_clock::time_point pose_end;
+};
+
+// Records what the detector made of each frame to a frame log: its
+// detections, poses and stage timings, and its image when sampled or when
+// something looks wrong.  The log can be read back with FrameLogReader, and
+// its images replayed with ReplaySource.
+//
+// Record only copies into a preallocated slot of a queue, so the detect loop
+// never waits on the disk.  A background thread lays the records out in
+// chunks in a preallocated buffer and writes each chunk in one go.  If the
+// disk falls behind, frames are dropped from the log rather than held up.
+class Recorder {
+ public:
+  struct Options {
+    // Keep only the luma of images, as 8 bit gray, which is all the detector
+    // reads.  The conversion happens on the writer thread.
+    bool luma_only = true;
+    // Keep an image this often, whether or not anything triggered.  Anything
+    // shorter than a frame keeps every image, and zero turns sampling off.
+    std::chrono::steady_clock::duration sample_period = std::chrono::seconds(1);
+    // Keep the image when a tag seen in the last frame is lost.
+    bool trigger_on_tag_loss = true;
+    // Keep the image when a tag only decoded after correcting bit errors.
+    bool trigger_on_bit_errors = true;
+    // Keep the image when capture to pose latency is over this.  Zero turns
+    // it off.
+    std::chrono::steady_clock::duration latency_limit{0};
+    // Frames which can wait to be written.
+    size_t queue_depth = 8;
+    // Write out a chunk once it is this big or this old.
+    size_t chunk_bytes = 8 << 20;
+    std::chrono::steady_clock::duration flush_period = std::chrono::seconds(1);
+  };
+
+  // Starts recording frames like the one described to path, replacing any
+  // file there.  Returns nullptr if the log can't be created.
+  static std::unique_ptr<Recorder> Create(const std::string &path,
+                                          size_t width, size_t height,
+                                          ImageFormat format,
+                                          const Options &options);
+
+  // Writes out everything recorded so far.
+  ~Recorder();
+
+  Recorder(const Recorder &) = delete;
+  Recorder &operator=(const Recorder &) = delete;
+
+  // Queues a frame's results, and its image if kept, to be written.  Poses
+  // are told apart by their detections' IDs, so the detections have to still
+  // be valid.  Never waits.  Returns false if the frame was dropped because
+  // the writer is behind.  Call from one thread only.
+  bool Record(const CapturedFrame &frame, const zarray_t *detections,
+              std::span<const TagPose> poses, const FieldPose &field_pose,
+              const StageTimes &times);
+
+  // Frames dropped from the log so far.
+  size_t dropped() const { return queue_.dropped(); }
+  // Images kept so far.
+  size_t images() const { return images_.load(std::memory_order_relaxed); }
+  size_t bytes_written() const {
+    return bytes_written_.load(std::memory_order_relaxed);
+  }
+
+ private:
+  // A frame waiting to be written.
+  struct Entry {
+    // Tells the writer to finish up.
+    bool last = false;
+    ResultRecord result;
+    std::vector<DetectionRecord> detections;
+    std::vector<PoseRecord> poses;
+    // The image as captured, if any triggers are set.  Sized up front.
+    std::vector<uint8_t> image;
+    size_t image_bytes = 0;
+  };
+
+  Recorder(std::unique_ptr<FrameLogWriter> writer, size_t width,
+           size_t height, ImageFormat format, const Options &options);
+
+  // Returns the triggers set off by a frame.
+  uint32_t Triggers(const CapturedFrame &frame, const zarray_t *detections,
+                    const StageTimes &times);
+
+  // Writer thread side.
+  void Write();
+  void Append(const Entry &entry);
+  void Flush();
+
+  const std::unique_ptr<FrameLogWriter> writer_;
+  const size_t width_;
+  const size_t height_;
+  const ImageFormat format_;
+  const Options options_;
+
+  SpscQueue<Entry> queue_;
+
+  // Detect thread state.
+  bool sampled_ = false;
+  std::chrono::steady_clock::time_point last_sample_;
+  // Sorted IDs of the tags in the last frame and this one.
+  std::vector<int> last_ids_;
+  std::vector<int> ids_;
+  std::atomic<size_t> images_{0};
+
+  // Writer thread state.
+  RecordBuffer buffer_;
+  std::chrono::steady_clock::time_point chunk_start_;
+  std::atomic<size_t> bytes_written_{0};
+
+  std::thread thread_;
+};
+
+}  // namespace frc971::apriltag
+
+#endif  // FRC971_ORIN_RECORDER_H_
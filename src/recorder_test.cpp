@@ -0,0 +1,302 @@
+// recorder_test.cpp
+#include "recorder.h"
+
+#include <glog/logging.h>
+#include <gtest/gtest.h>
+
+#include <chrono>
+#include <cstdio>
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "frame_log.h"
+#include "replay_source.h"
+
+extern "C" {
+#include "common/zarray.h"
+}
+
+namespace frc971::apriltag {
+namespace {
+
+constexpr size_t kWidth = 32;
+constexpr size_t kHeight = 24;
+constexpr size_t kStride = kWidth * 2 + 8;
+constexpr ImageFormat kFormat = {.pixel_format = PixelFormat::kYuyv,
+                                 .stride = kStride};
+constexpr std::chrono::milliseconds kPeriod(10);
+
+const std::chrono::steady_clock::time_point kStart(std::chrono::seconds(500));
+
+// Makes YUYV frames with a luma of row + col + i and a chroma of 128, and the
+// detections to record with them.
+class RecorderTest : public ::testing::Test {
+ protected:
+  RecorderTest()
+      : image_(kStride * kHeight),
+        detections_(zarray_create(sizeof(apriltag_detection_t *))) {}
+
+  ~RecorderTest() override {
+    zarray_destroy(detections_);
+    for (apriltag_detection_t *det : dets_) {
+      delete det;
+    }
+  }
+
+  CapturedFrame MakeFrame(int i) {
+    for (size_t row = 0; row < kHeight; ++row) {
+      for (size_t col = 0; col < kWidth; ++col) {
+        image_[row * kStride + col * 2] = row + col + i;
+        image_[row * kStride + col * 2 + 1] = 128;
+      }
+    }
+    return CapturedFrame{
+        .data = image_.data(),
+        .bytes = image_.size(),
+        .width = kWidth,
+        .height = kHeight,
+        .format = kFormat,
+        .timestamp = kStart + i * kPeriod,
+        .sequence = static_cast<uint32_t>(i),
+    };
+  }
+
+  // Replaces the detections with tags of the provided IDs and hamming
+  // distances, and makes up a pose for each.
+  void SetDetections(const std::vector<std::pair<int, int>> &tags) {
+    zarray_clear(detections_);
+    poses_.clear();
+    for (const auto &[id, hamming] : tags) {
+      apriltag_detection_t *det = new apriltag_detection_t{};
+      det->id = id;
+      det->hamming = hamming;
+      det->decision_margin = 50.0f + id;
+      det->c[0] = 10.0 * id;
+      det->c[1] = 20.0 * id;
+      det->p[2][1] = id + 0.5;
+      dets_.push_back(det);
+      zarray_add(detections_, &det);
+      TagPose pose{};
+      pose.detection = det;
+      pose.rotation = {1, 0, 0, 0, 1, 0, 0, 0, 1};
+      pose.translation = {0.0, 0.0, 1.0 * id};
+      pose.error = 0.01 * id;
+      poses_.push_back(pose);
+    }
+  }
+
+  // Times for a frame which waited 1 ms and then took latency in all.
+  StageTimes Times(const CapturedFrame &frame,
+                   std::chrono::milliseconds latency) {
+    return StageTimes{
+        .detect_start = frame.timestamp + std::chrono::milliseconds(1),
+        .detect_end = frame.timestamp + std::chrono::milliseconds(2),
+        .pose_end = frame.timestamp + latency,
+    };
+  }
+
+  std::vector<uint8_t> image_;
+  zarray_t *detections_;
+  std::vector<apriltag_detection_t *> dets_;
+  std::vector<TagPose> poses_;
+};
+
+// Tests that results come back as recorded, and that images are only kept,
+// as gray, when something triggers.
+TEST_F(RecorderTest, KeepsTriggeredImages) {
+  const std::string path = ::testing::TempDir() + "triggers.log";
+  {
+    std::unique_ptr<Recorder> recorder =
+        Recorder::Create(path, kWidth, kHeight, kFormat,
+                         {.sample_period = std::chrono::seconds(0),
+                          .latency_limit = std::chrono::milliseconds(20)});
+    ASSERT_NE(recorder, nullptr);
+
+    FieldPose field_pose;
+    field_pose.valid = true;
+    field_pose.tags = 2;
+    field_pose.translation = {1.0, 2.0, 3.0};
+    field_pose.covariance.fill(0.5);
+    field_pose.rms_error = 0.25;
+
+    // Nothing happens, then tag 2 is lost, tag 1 needs a bit corrected, the
+    // frame is late, and nothing happens again.
+    const std::vector<std::vector<std::pair<int, int>>> tags = {
+        {{1, 0}, {2, 0}}, {{1, 0}, {2, 0}}, {{1, 0}},
+        {{1, 1}},         {{1, 0}},         {{1, 0}}};
+    for (size_t i = 0; i < tags.size(); ++i) {
+      SetDetections(tags[i]);
+      const CapturedFrame frame = MakeFrame(i);
+      EXPECT_TRUE(recorder->Record(
+          frame, detections_, poses_, field_pose,
+          Times(frame, std::chrono::milliseconds(i == 4 ? 30 : 5))));
+    }
+    EXPECT_EQ(recorder->images(), 3u);
+  }
+
+  std::unique_ptr<FrameLogReader> reader = FrameLogReader::Open(path);
+  ASSERT_NE(reader, nullptr);
+  ASSERT_EQ(reader->results(), 6u);
+  ASSERT_EQ(reader->frames(), 3u);
+  ASSERT_EQ(reader->chunks(), 1u);
+  EXPECT_EQ(reader->chunk(0).records, 9u);
+  EXPECT_EQ(reader->chunk(0).first_timestamp_ns,
+            reader->result(0).record->timestamp_ns);
+  EXPECT_EQ(reader->chunk(0).last_timestamp_ns,
+            reader->result(5).record->timestamp_ns);
+
+  const std::vector<uint32_t> triggers = {
+      0, 0, kTriggerTagLost, kTriggerBitErrors, kTriggerLatency, 0};
+  int frames = 0;
+  for (size_t i = 0; i < reader->results(); ++i) {
+    const RecordedResult &result = reader->result(i);
+    EXPECT_EQ(result.record->sequence, i);
+    EXPECT_EQ(result.timestamp(), kStart + static_cast<int>(i) * kPeriod);
+    EXPECT_EQ(result.record->triggers, triggers[i]) << i;
+    EXPECT_EQ(result.record->queued_ns, 1000000);
+    EXPECT_EQ(result.record->detect_ns, 1000000);
+    EXPECT_EQ(result.record->pose_ns, i == 4 ? 28000000 : 3000000);
+    EXPECT_EQ(result.record->field_pose_valid, 1u);
+    EXPECT_EQ(result.record->field_pose_tags, 2u);
+    EXPECT_EQ(result.record->field_translation[2], 3.0);
+    EXPECT_EQ(result.record->field_covariance[35], 0.5);
+    EXPECT_EQ(result.record->field_rms_error, 0.25);
+
+    ASSERT_EQ(result.detections.size(), i < 2 ? 2u : 1u);
+    ASSERT_EQ(result.poses.size(), result.detections.size());
+    for (size_t j = 0; j < result.detections.size(); ++j) {
+      const int id = j + 1;
+      EXPECT_EQ(result.detections[j].id, id);
+      EXPECT_EQ(result.detections[j].hamming, i == 3 ? 1 : 0);
+      EXPECT_EQ(result.detections[j].decision_margin, 50.0f + id);
+      EXPECT_EQ(result.detections[j].center[1], 20.0 * id);
+      EXPECT_EQ(result.detections[j].corners[2][1], id + 0.5);
+      EXPECT_EQ(result.poses[j].id, id);
+      EXPECT_EQ(result.poses[j].rotation[8], 1.0);
+      EXPECT_EQ(result.poses[j].translation[2], 1.0 * id);
+      EXPECT_EQ(result.poses[j].error, 0.01 * id);
+    }
+
+    if (triggers[i] == 0) {
+      EXPECT_EQ(result.frame, -1);
+      continue;
+    }
+    ASSERT_EQ(result.frame, frames++);
+    const CapturedFrame frame = reader->frame(result.frame);
+    EXPECT_EQ(frame.format.pixel_format, PixelFormat::kGray8);
+    EXPECT_EQ(frame.format.stride, kWidth);
+    EXPECT_EQ(frame.bytes, kWidth * kHeight);
+    EXPECT_EQ(frame.sequence, i);
+    for (size_t row = 0; row < kHeight; ++row) {
+      for (size_t col = 0; col < kWidth; ++col) {
+        ASSERT_EQ(frame.data[row * kWidth + col],
+                  static_cast<uint8_t>(row + col + i));
+      }
+    }
+  }
+
+  EXPECT_EQ(reader->FindResult(kStart), 0u);
+  EXPECT_EQ(reader->FindResult(kStart + 3 * kPeriod - kPeriod / 2), 3u);
+  EXPECT_EQ(reader->FindResult(kStart + 10 * kPeriod), 6u);
+  std::remove(path.c_str());
+}
+
+// Tests that sampling keeps whole images at the rate asked for, split across
+// chunks, and that they can be replayed.
+TEST_F(RecorderTest, SamplesAcrossChunks) {
+  const std::string path = ::testing::TempDir() + "sampled.log";
+  constexpr int kFrames = 40;
+  {
+    std::unique_ptr<Recorder> recorder =
+        Recorder::Create(path, kWidth, kHeight, kFormat,
+                         {.luma_only = false,
+                          .sample_period = 4 * kPeriod,
+                          .trigger_on_tag_loss = false,
+                          .queue_depth = kFrames,
+                          .chunk_bytes = 4096});
+    ASSERT_NE(recorder, nullptr);
+    for (int i = 0; i < kFrames; ++i) {
+      SetDetections({{i % 3, 0}});
+      const CapturedFrame frame = MakeFrame(i);
+      ASSERT_TRUE(recorder->Record(frame, detections_, poses_, FieldPose{},
+                                   Times(frame, kPeriod)));
+    }
+  }
+
+  std::unique_ptr<FrameLogReader> reader = FrameLogReader::Open(path);
+  ASSERT_NE(reader, nullptr);
+  ASSERT_EQ(reader->results(), static_cast<size_t>(kFrames));
+  ASSERT_EQ(reader->frames(), static_cast<size_t>(kFrames / 4));
+  EXPECT_GT(reader->chunks(), 1u);
+  uint32_t records = 0;
+  for (size_t i = 0; i < reader->chunks(); ++i) {
+    records += reader->chunk(i).records;
+  }
+  EXPECT_EQ(records, kFrames + kFrames / 4);
+
+  for (int i = 0; i < kFrames; ++i) {
+    const RecordedResult &result = reader->result(i);
+    EXPECT_EQ(result.record->field_pose_valid, 0u);
+    EXPECT_EQ(result.detections[0].id, i % 3);
+    if (i % 4 != 0) {
+      EXPECT_EQ(result.record->triggers, 0u);
+      continue;
+    }
+    EXPECT_EQ(result.record->triggers, kTriggerSampled);
+    const CapturedFrame frame = reader->frame(result.frame);
+    EXPECT_EQ(frame.format.pixel_format, PixelFormat::kYuyv);
+    EXPECT_EQ(frame.format.stride, kStride);
+    ASSERT_EQ(frame.bytes, image_.size());
+    EXPECT_EQ(frame.data[kStride + 4], static_cast<uint8_t>(1 + 2 + i));
+    EXPECT_EQ(frame.data[kStride + 5], 128);
+  }
+  reader.reset();
+
+  std::unique_ptr<ReplaySource> source =
+      ReplaySource::Open(path, {.mode = ReplaySource::Mode::kFast});
+  ASSERT_NE(source, nullptr);
+  EXPECT_EQ(source->frames(), static_cast<size_t>(kFrames / 4));
+  std::remove(path.c_str());
+}
+
+// Tests that a recorder which can't keep up drops frames instead of holding
+// up the caller, and that every frame it took makes it to the log.
+TEST_F(RecorderTest, DropsWhenBehind) {
+  const std::string path = ::testing::TempDir() + "dropped.log";
+  constexpr int kFrames = 500;
+  size_t recorded = 0;
+  size_t dropped = 0;
+  {
+    std::unique_ptr<Recorder> recorder = Recorder::Create(
+        path, kWidth, kHeight, kFormat,
+        {.luma_only = false, .sample_period = kPeriod / 2, .queue_depth = 1});
+    ASSERT_NE(recorder, nullptr);
+    SetDetections({{7, 0}});
+    for (int i = 0; i < kFrames; ++i) {
+      const CapturedFrame frame = MakeFrame(i);
+      if (recorder->Record(frame, detections_, poses_, FieldPose{},
+                           Times(frame, kPeriod))) {
+        ++recorded;
+      }
+    }
+    dropped = recorder->dropped();
+  }
+  EXPECT_EQ(recorded + dropped, static_cast<size_t>(kFrames));
+
+  std::unique_ptr<FrameLogReader> reader = FrameLogReader::Open(path);
+  ASSERT_NE(reader, nullptr);
+  EXPECT_EQ(reader->results(), recorded);
+  EXPECT_EQ(reader->frames(), recorded);
+  std::remove(path.c_str());
+}
+
+}  // namespace
+}  // namespace frc971::apriltag
+
+int main(int argc, char **argv) {
+  ::testing::InitGoogleTest(&argc, argv);
+  google::InitGoogleLogging(argv[0]);
+  return RUN_ALL_TESTS();
+}
@@ -0,0 +1,122 @@
+#include "replay_source.h"
+
+#include <utility>
+
+#include "glog/logging.h"
+
+namespace frc971::apriltag {
+
+std::unique_ptr<ReplaySource> ReplaySource::Open(const std::string &path,
+                                                 const Options &options) {
+  std::unique_ptr<FrameLogReader> reader =
+      FrameLogReader::Open(path, options.preload);
+  if (reader == nullptr) {
+    return nullptr;
+  }
+  if (reader->frames() == 0) {
+    LOG(ERROR) << "No frames in " << path;
+    return nullptr;
+  }
+  // The detector is sized for one resolution, and the frames have to be laid
+  // out the same for the stride.
+  const CapturedFrame first = reader->frame(0);
+  for (size_t i = 1; i < reader->frames(); ++i) {
+    const CapturedFrame frame = reader->frame(i);
+    if (frame.width != first.width || frame.height != first.height ||
+        frame.format.pixel_format != first.format.pixel_format ||
+        frame.format.stride != first.format.stride) {
+      LOG(ERROR) << "Frame " << i << " of " << path
+                 << " doesn't match the first frame's resolution and layout";
+      return nullptr;
+    }
+  }
+  LOG(INFO) << "Replaying " << reader->frames() << " " << first.width << "x"
+            << first.height << " frames from " << path;
+  return std::unique_ptr<ReplaySource>(
+      new ReplaySource(std::move(reader), options));
+}
+
+ReplaySource::ReplaySource(std::unique_ptr<FrameLogReader> reader,
+                           const Options &options)
+    : reader_(std::move(reader)), options_(options), first_(reader_->frame(0)) {
+  // Go around again one average frame period after the last frame.
+  const size_t frames = reader_->frames();
+  const CapturedFrame last = reader_->frame(frames - 1);
+  const std::chrono::steady_clock::duration span =
+      last.timestamp - first_.timestamp;
+  loop_duration_ = std::chrono::milliseconds(33);
+  if (frames > 1) {
+    loop_duration_ = span + span / static_cast<int64_t>(frames - 1);
+  }
+  loop_sequence_ = last.sequence - first_.sequence + 1;
+}
+
+bool ReplaySource::Next(CapturedFrame *frame) {
+  const size_t frames = reader_->frames();
+  const size_t pass = played_ / frames;
+  if (pass > 0 && !options_.loop) {
+    return false;
+  }
+
+  *frame = reader_->frame(played_ % frames);
+  frame->timestamp += static_cast<int64_t>(pass) * loop_duration_;
+  frame->sequence += static_cast<uint32_t>(pass) * loop_sequence_;
+
+  std::unique_lock<std::mutex> lock(mutex_);
+  switch (options_.mode) {
+    case Mode::kRealTime: {
+      if (played_ == 0) {
+        start_ = std::chrono::steady_clock::now();
+      }
+      frame->timestamp = start_ + (frame->timestamp - first_.timestamp);
+      condition_.wait_until(lock, frame->timestamp,
+                            [this]() { return stopped_; });
+      break;
+    }
+    case Mode::kFast:
+      break;
+    case Mode::kStep:
+      condition_.wait(lock, [this]() { return stopped_ || steps_ > 0; });
+      if (steps_ > 0) {
+        --steps_;
+      }
+      break;
+  }
+  if (stopped_) {
+    return false;
+  }
+  ++played_;
+  return true;
+}
+
+bool ReplaySource::finished() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return stopped_ || (!options_.loop && played_ >= reader_->frames());
+}
+
+void ReplaySource::Step() {
+  std::lock_guard<std::mutex> lock(mutex_);
+  ++steps_;
+  condition_.notify_all();
+}
+
+void ReplaySource::Stop() {
+  std::lock_guard<std::mutex> lock(mutex_);
+  stopped_ = true;
+  condition_.notify_all();
+}
+
+bool ParseReplayMode(std::string_view name, ReplaySource::Mode *mode) {
+  if (name == "realtime") {
+    *mode = ReplaySource::Mode::kRealTime;
+  } else if (name == "fast") {
+    *mode = ReplaySource::Mode::kFast;
+  } else if (name == "step") {
+    *mode = ReplaySource::Mode::kStep;
+  } else {
+    return false;
+  }
+  return true;
+}
+
+}  // namespace frc971::apriltag
@@ -0,0 +1,94 @@
+#ifndef FRC971_ORIN_REPLAY_SOURCE_H_
+#define FRC971_ORIN_REPLAY_SOURCE_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <chrono>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+
+#include "frame_log.h"
+#include "frame_source.h"
+
+namespace frc971::apriltag {
+
+// Plays back a recorded frame log, so the pipeline can be run and profiled
+// offline on the same frames every time.  Frames are read in place from the
+// mapped log, like a camera's driver buffers.
+class ReplaySource : public FrameSource {
+ public:
+  enum class Mode {
+    // Frames come out as far apart as they were recorded, with timestamps
+    // moved up to when the replay started so latencies still make sense.
+    kRealTime,
+    // Frames come out as fast as they are asked for, with their recorded
+    // timestamps.
+    kFast,
+    // Like kFast, but each frame waits for a call to Step.
+    kStep,
+  };
+
+  struct Options {
+    Mode mode = Mode::kRealTime;
+    // Start over at the end of the log instead of finishing.  Timestamps and
+    // sequence numbers keep counting up.
+    bool loop = false;
+    // Read the whole log in before the first frame.
+    bool preload = false;
+  };
+
+  // Returns nullptr if the log can't be read, is empty, or changes resolution
+  // or pixel format part way through.
+  static std::unique_ptr<ReplaySource> Open(const std::string &path,
+                                            const Options &options);
+
+  bool Next(CapturedFrame *frame) override;
+  // The log stays mapped, so there is nothing to give back.
+  void Release(const CapturedFrame &) override {}
+  bool finished() const override;
+
+  size_t width() const override { return first_.width; }
+  size_t height() const override { return first_.height; }
+  ImageFormat format() const override { return first_.format; }
+
+  // Lets Next hand out one more frame in Mode::kStep.  Can be called from any
+  // thread.
+  void Step();
+
+  // Wakes up Next and finishes the replay.  Can be called from any thread.
+  void Stop();
+
+  size_t frames() const { return reader_->frames(); }
+
+ private:
+  ReplaySource(std::unique_ptr<FrameLogReader> reader, const Options &options);
+
+  const std::unique_ptr<FrameLogReader> reader_;
+  const Options options_;
+  const CapturedFrame first_;
+
+  // How far timestamps and sequence numbers move on each time around the log.
+  std::chrono::steady_clock::duration loop_duration_;
+  uint32_t loop_sequence_;
+
+  // Frames handed out so far, and when the first one was.
+  size_t played_ = 0;
+  std::chrono::steady_clock::time_point start_;
+
+  mutable std::mutex mutex_;
+  std::condition_variable condition_;
+  size_t steps_ = 0;
+  bool stopped_ = false;
+};
+
+// Parses "realtime", "fast" or "step" into a replay mode.  Returns false if
+// the name is unknown.
+bool ParseReplayMode(std::string_view name, ReplaySource::Mode *mode);
+
+}  // namespace frc971::apriltag
+
+#endif  // FRC971_ORIN_REPLAY_SOURCE_H_
@@ -0,0 +1,199 @@
+// replay_source_test.cpp
+#include "replay_source.h"
+
+#include <glog/logging.h>
+#include <gtest/gtest.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <fstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "frame_log.h"
+
+namespace frc971::apriltag {
+namespace {
+
+constexpr size_t kWidth = 64;
+constexpr size_t kHeight = 48;
+constexpr size_t kStride = kWidth * 2 + 16;
+constexpr int kFrames = 5;
+constexpr std::chrono::milliseconds kPeriod(10);
+
+const std::chrono::steady_clock::time_point kStart(std::chrono::seconds(500));
+
+// Writes a log of kFrames YUYV frames, kPeriod apart, with every byte of
+// frame i set to i.  Sequence number 2 is skipped, like a dropped frame.
+std::string WriteLog(const std::string &name) {
+  const std::string path = ::testing::TempDir() + name;
+  std::unique_ptr<FrameLogWriter> writer = FrameLogWriter::Create(path);
+  CHECK(writer != nullptr);
+  std::vector<uint8_t> image(kStride * kHeight);
+  for (int i = 0; i < kFrames; ++i) {
+    std::fill(image.begin(), image.end(), i);
+    CHECK(writer->WriteFrame(CapturedFrame{
+        .data = image.data(),
+        .bytes = image.size(),
+        .width = kWidth,
+        .height = kHeight,
+        .format = {.pixel_format = PixelFormat::kYuyv, .stride = kStride},
+        .timestamp = kStart + i * kPeriod,
+        .sequence = static_cast<uint32_t>(i < 2 ? i : i + 1),
+    }));
+  }
+  return path;
+}
+
+// Tests that frames come back as written, aligned, and that a log cut short
+// keeps its whole frames.
+TEST(FrameLogTest, ReadsBackFrames) {
+  const std::string path = WriteLog("frames.log");
+  {
+    std::unique_ptr<FrameLogReader> reader = FrameLogReader::Open(path);
+    ASSERT_NE(reader, nullptr);
+    ASSERT_EQ(reader->frames(), static_cast<size_t>(kFrames));
+    for (int i = 0; i < kFrames; ++i) {
+      const CapturedFrame frame = reader->frame(i);
+      EXPECT_EQ(reinterpret_cast<uintptr_t>(frame.data) % kRecordAlignment,
+                0u);
+      EXPECT_EQ(frame.width, kWidth);
+      EXPECT_EQ(frame.height, kHeight);
+      EXPECT_EQ(frame.format.pixel_format, PixelFormat::kYuyv);
+      EXPECT_EQ(frame.format.stride, kStride);
+      EXPECT_EQ(frame.bytes, kStride * kHeight);
+      EXPECT_EQ(frame.timestamp, kStart + i * kPeriod);
+      EXPECT_EQ(frame.data[0], i);
+      EXPECT_EQ(frame.data[frame.bytes - 1], i);
+    }
+  }
+
+  ASSERT_EQ(truncate(path.c_str(), sizeof(FrameLogHeader) +
+                                       3 * PadRecord(kRecordAlignment +
+                                                     kStride * kHeight) +
+                                       100),
+            0);
+  std::unique_ptr<FrameLogReader> reader = FrameLogReader::Open(path);
+  ASSERT_NE(reader, nullptr);
+  EXPECT_EQ(reader->frames(), 3u);
+  reader.reset();
+
+  {
+    std::ofstream f(path);
+    f << "not a frame log, but long enough to have a header in it............";
+  }
+  EXPECT_EQ(FrameLogReader::Open(path), nullptr);
+  std::remove(path.c_str());
+}
+
+// Tests that fast replay hands out every frame, in order and with the
+// recorded timestamps, and keeps counting up when it loops.
+TEST(ReplaySourceTest, FastLoops) {
+  const std::string path = WriteLog("fast.log");
+  std::unique_ptr<ReplaySource> source =
+      ReplaySource::Open(path, {.mode = ReplaySource::Mode::kFast,
+                                .loop = true});
+  ASSERT_NE(source, nullptr);
+  EXPECT_EQ(source->width(), kWidth);
+  EXPECT_EQ(source->height(), kHeight);
+  EXPECT_EQ(source->format().stride, kStride);
+
+  CapturedFrame frame;
+  std::chrono::steady_clock::time_point last_timestamp;
+  uint32_t last_sequence = 0;
+  for (int i = 0; i < 3 * kFrames; ++i) {
+    ASSERT_TRUE(source->Next(&frame));
+    EXPECT_EQ(frame.data[0], i % kFrames);
+    if (i > 0) {
+      EXPECT_EQ(frame.timestamp - last_timestamp, kPeriod);
+      EXPECT_EQ(frame.sequence, last_sequence + (i % kFrames == 2 ? 2 : 1));
+    }
+    last_timestamp = frame.timestamp;
+    last_sequence = frame.sequence;
+    source->Release(frame);
+  }
+  EXPECT_FALSE(source->finished());
+  source->Stop();
+  EXPECT_TRUE(source->finished());
+  EXPECT_FALSE(source->Next(&frame));
+
+  // Without loop, the replay finishes at the end of the log.
+  source = ReplaySource::Open(path, {.mode = ReplaySource::Mode::kFast});
+  for (int i = 0; i < kFrames; ++i) {
+    EXPECT_FALSE(source->finished());
+    ASSERT_TRUE(source->Next(&frame));
+  }
+  EXPECT_TRUE(source->finished());
+  EXPECT_FALSE(source->Next(&frame));
+  std::remove(path.c_str());
+}
+
+// Tests that real time replay spaces frames out as recorded, with timestamps
+// from when it started.  Only lower bounds are checked, since a loaded machine
+// can deliver any frame late.
+TEST(ReplaySourceTest, RealTime) {
+  const std::string path = WriteLog("realtime.log");
+  std::unique_ptr<ReplaySource> source = ReplaySource::Open(path, {});
+  ASSERT_NE(source, nullptr);
+
+  const auto start = std::chrono::steady_clock::now();
+  CapturedFrame frame;
+  std::chrono::steady_clock::time_point last_timestamp;
+  for (int i = 0; i < kFrames; ++i) {
+    ASSERT_TRUE(source->Next(&frame));
+    EXPECT_LE(frame.timestamp, std::chrono::steady_clock::now());
+    EXPECT_GE(frame.timestamp, start + i * kPeriod);
+    if (i > 0) {
+      EXPECT_GE(frame.timestamp - last_timestamp, kPeriod);
+    }
+    last_timestamp = frame.timestamp;
+  }
+  EXPECT_GE(std::chrono::steady_clock::now() - start,
+            (kFrames - 1) * kPeriod);
+  std::remove(path.c_str());
+}
+
+// Tests that step replay waits for each Step, and that Stop wakes it up.
+TEST(ReplaySourceTest, Step) {
+  const std::string path = WriteLog("step.log");
+  std::unique_ptr<ReplaySource> source =
+      ReplaySource::Open(path, {.mode = ReplaySource::Mode::kStep});
+  ASSERT_NE(source, nullptr);
+
+  source->Step();
+  CapturedFrame frame;
+  ASSERT_TRUE(source->Next(&frame));
+  EXPECT_EQ(frame.data[0], 0);
+
+  std::atomic<bool> done{false};
+  std::thread consumer([&]() {
+    CapturedFrame frame;
+    EXPECT_TRUE(source->Next(&frame));
+    EXPECT_EQ(frame.data[0], 1);
+    done = true;
+    EXPECT_FALSE(source->Next(&frame));
+  });
+  std::this_thread::sleep_for(std::chrono::milliseconds(20));
+  EXPECT_FALSE(done);
+  source->Step();
+  while (!done) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+  }
+  std::this_thread::sleep_for(std::chrono::milliseconds(20));
+  source->Stop();
+  consumer.join();
+  std::remove(path.c_str());
+}
+
+}  // namespace
+}  // namespace frc971::apriltag
+
+int main(int argc, char **argv) {
+  ::testing::InitGoogleTest(&argc, argv);
+  google::InitGoogleLogging(argv[0]);
+  return RUN_ALL_TESTS();
+}
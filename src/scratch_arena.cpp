@@ -0,0 +1,121 @@
+#include "scratch_arena.h"
+
+#include <algorithm>
+#include <iomanip>
+#include <numeric>
+#include <sstream>
+
+namespace frc971::apriltag {
+namespace {
+
+size_t AlignUp(size_t bytes) {
+  return (bytes + ScratchLayout::kAlignment - 1) / ScratchLayout::kAlignment *
+         ScratchLayout::kAlignment;
+}
+
+double Megabytes(size_t bytes) { return bytes / (1024.0 * 1024.0); }
+
+}  // namespace
+
+ScratchLayout::Buffer ScratchLayout::Add(std::string_view name, size_t bytes,
+                                         size_t first, size_t last) {
+  CHECK(!planned_) << ": Can't add " << name << " to a planned layout";
+  CHECK_LE(first, last) << ": " << name;
+  buffers_.push_back(Entry{
+      .name = std::string(name),
+      .bytes = bytes,
+      .first = first,
+      .last = last,
+      .offset = 0,
+  });
+  return Buffer{.index = buffers_.size() - 1};
+}
+
+void ScratchLayout::Plan() {
+  // Place the biggest buffers first, each at the lowest offset which doesn't
+  // overlap anything already placed and live at the same time.  This is the
+  // usual greedy by size heuristic.  It isn't optimal, but it is deterministic
+  // and close to the peak live size when the big buffers dominate.
+  std::vector<size_t> order(buffers_.size());
+  std::iota(order.begin(), order.end(), 0);
+  std::stable_sort(order.begin(), order.end(), [this](size_t a, size_t b) {
+    return buffers_[a].bytes > buffers_[b].bytes;
+  });
+
+  std::vector<size_t> placed;
+  placed.reserve(buffers_.size());
+  size_ = 0;
+  for (size_t index : order) {
+    Entry &entry = buffers_[index];
+
+    // Everything already placed which is live at the same time, in order of
+    // offset.
+    std::vector<const Entry *> conflicts;
+    for (size_t other_index : placed) {
+      const Entry &other = buffers_[other_index];
+      if (other.first <= entry.last && entry.first <= other.last) {
+        conflicts.push_back(&other);
+      }
+    }
+    std::sort(conflicts.begin(), conflicts.end(),
+              [](const Entry *a, const Entry *b) {
+                return a->offset < b->offset;
+              });
+
+    // Find the first gap big enough.
+    size_t offset = 0;
+    for (const Entry *other : conflicts) {
+      if (offset + entry.bytes <= other->offset) {
+        break;
+      }
+      offset = std::max(offset, AlignUp(other->offset + other->bytes));
+    }
+
+    entry.offset = offset;
+    size_ = std::max(size_, AlignUp(offset + entry.bytes));
+    placed.push_back(index);
+  }
+  planned_ = true;
+}
+
+size_t ScratchLayout::unshared_size() const {
+  size_t result = 0;
+  for (const Entry &entry : buffers_) {
+    result += AlignUp(entry.bytes);
+  }
+  return result;
+}
+
+size_t ScratchLayout::peak_live_size() const {
+  size_t stages = 0;
+  for (const Entry &entry : buffers_) {
+    stages = std::max(stages, entry.last + 1);
+  }
+  size_t result = 0;
+  for (size_t stage = 0; stage < stages; ++stage) {
+    size_t live = 0;
+    for (const Entry &entry : buffers_) {
+      if (entry.first <= stage && stage <= entry.last) {
+        live += AlignUp(entry.bytes);
+      }
+    }
+    result = std::max(result, live);
+  }
+  return result;
+}
+
+std::string ScratchLayout::ToString() const {
+  std::ostringstream os;
+  os << std::fixed << std::setprecision(2);
+  for (const Entry &entry : buffers_) {
+    os << "  " << std::left << std::setw(40) << entry.name << std::right
+       << std::setw(10) << Megabytes(entry.bytes) << " MB at "
+       << std::setw(10) << Megabytes(entry.offset) << " MB, stages "
+       << entry.first << "-" << entry.last << "\n";
+  }
+  os << "  " << Megabytes(size_) << " MB total, " << Megabytes(unshared_size())
+     << " MB unshared, " << Megabytes(peak_live_size()) << " MB peak live";
+  return os.str();
+}
+
+}  // namespace frc971::apriltag
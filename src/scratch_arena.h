@@ -0,0 +1,158 @@
+#ifndef FRC971_ORIN_SCRATCH_ARENA_H_
+#define FRC971_ORIN_SCRATCH_ARENA_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <memory>
+#include <new>
+#include <span>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "glog/logging.h"
+
+namespace frc971::apriltag {
+
+// Plans how to pack a set of buffers into a single allocation.  The detector
+// runs as a fixed sequence of stages, and each buffer is only live from the
+// stage which writes it through the last stage which reads it.  Buffers which
+// are never live during the same stage share memory.
+class ScratchLayout {
+ public:
+  // Handle to a buffer in the layout.
+  struct Buffer {
+    size_t index;
+  };
+
+  // Every buffer starts on a multiple of this.  cudaMalloc returns 256 byte
+  // aligned memory, and cub wants its temporary storage at least that
+  // aligned.
+  static constexpr size_t kAlignment = 256;
+
+  // Adds a buffer of the provided number of bytes which is live from stage
+  // first through stage last inclusive.
+  Buffer Add(std::string_view name, size_t bytes, size_t first, size_t last);
+
+  // Adds a buffer holding size objects of type T.
+  template <typename T>
+  Buffer Add(std::string_view name, size_t size, size_t first, size_t last) {
+    return Add(name, size * sizeof(T), first, last);
+  }
+
+  // Assigns an offset to every buffer.  Must be called after the last Add and
+  // before offset or size.
+  void Plan();
+
+  // Returns the offset of the buffer from the start of the allocation.
+  size_t offset(Buffer buffer) const {
+    CHECK(planned_);
+    return buffers_[buffer.index].offset;
+  }
+  // Returns the number of bytes requested for the buffer.
+  size_t bytes(Buffer buffer) const { return buffers_[buffer.index].bytes; }
+  // Returns the stages the buffer is live for.
+  size_t first(Buffer buffer) const { return buffers_[buffer.index].first; }
+  size_t last(Buffer buffer) const { return buffers_[buffer.index].last; }
+
+  // Returns the number of buffers added.
+  size_t buffer_count() const { return buffers_.size(); }
+
+  // Returns the size of the single allocation holding every buffer.
+  size_t size() const {
+    CHECK(planned_);
+    return size_;
+  }
+
+  // Returns the size it would take to give every buffer its own allocation.
+  size_t unshared_size() const;
+
+  // Returns the most memory live during any one stage.  No layout can be
+  // smaller than this.
+  size_t peak_live_size() const;
+
+  // Returns a table of the buffers and the footprint for logging.
+  std::string ToString() const;
+
+ private:
+  struct Entry {
+    std::string name;
+    size_t bytes;
+    size_t first;
+    size_t last;
+    size_t offset;
+  };
+
+  std::vector<Entry> buffers_;
+  size_t size_ = 0;
+  bool planned_ = false;
+};
+
+// Host memory for a ScratchArena.  This lets the layout be exercised without a
+// GPU.
+class HostScratchMemory {
+ public:
+  explicit HostScratchMemory(size_t size)
+      : memory_(new (std::align_val_t(ScratchLayout::kAlignment))
+                    uint8_t[size]),
+        size_(size) {}
+
+  uint8_t *get() { return memory_.get(); }
+  const uint8_t *get() const { return memory_.get(); }
+
+  size_t size() const { return size_; }
+
+ private:
+  struct Free {
+    void operator()(uint8_t *memory) const {
+      ::operator delete[](memory, std::align_val_t(ScratchLayout::kAlignment));
+    }
+  };
+
+  std::unique_ptr<uint8_t[], Free> memory_;
+  size_t size_;
+};
+
+// A ScratchLayout along with the single allocation backing it.  Memory is the
+// allocation type, GpuMemory<uint8_t> for the GPU or HostScratchMemory.
+//
+// Add all the buffers, call Allocate, and then Get each buffer.
+template <typename Memory>
+class ScratchArena {
+ public:
+  template <typename T>
+  ScratchLayout::Buffer Add(std::string_view name, size_t size, size_t first,
+                            size_t last) {
+    CHECK(!memory_) << ": Can't add to an allocated arena";
+    return layout_.Add<T>(name, size, first, last);
+  }
+
+  // Plans the layout and allocates the memory for it.
+  void Allocate() {
+    layout_.Plan();
+    memory_ = std::make_unique<Memory>(layout_.size());
+  }
+
+  // Returns the memory for a buffer.  The contents are only valid during the
+  // stages the buffer was added for.
+  template <typename T>
+  std::span<T> Get(ScratchLayout::Buffer buffer) {
+    CHECK(memory_);
+    return std::span<T>(
+        reinterpret_cast<T *>(memory_->get() + layout_.offset(buffer)),
+        layout_.bytes(buffer) / sizeof(T));
+  }
+
+  const ScratchLayout &layout() const { return layout_; }
+
+ private:
+  ScratchLayout layout_;
+  std::unique_ptr<Memory> memory_;
+};
+
+using HostScratchArena = ScratchArena<HostScratchMemory>;
+
+}  // namespace frc971::apriltag
+
+#endif  // FRC971_ORIN_SCRATCH_ARENA_H_
@@ -0,0 +1,117 @@
+// scratch_arena_test.cpp
+#include "scratch_arena.h"
+
+#include <glog/logging.h>
+#include <gtest/gtest.h>
+
+#include <algorithm>
+#include <random>
+#include <vector>
+
+namespace frc971::apriltag {
+namespace {
+
+// Returns true if the bytes of a and b overlap.
+bool Overlaps(const ScratchLayout &layout, ScratchLayout::Buffer a,
+              ScratchLayout::Buffer b) {
+  return layout.offset(a) < layout.offset(b) + layout.bytes(b) &&
+         layout.offset(b) < layout.offset(a) + layout.bytes(a);
+}
+
+// Returns true if a and b are live during the same stage.
+bool LiveTogether(const ScratchLayout &layout, ScratchLayout::Buffer a,
+                  ScratchLayout::Buffer b) {
+  return layout.first(a) <= layout.last(b) && layout.first(b) <= layout.last(a);
+}
+
+TEST(ScratchLayoutTest, DisjointLifetimesShareMemory) {
+  ScratchLayout layout;
+  const ScratchLayout::Buffer a = layout.Add<uint32_t>("a", 1000, 0, 1);
+  const ScratchLayout::Buffer b = layout.Add<uint32_t>("b", 2000, 2, 3);
+  const ScratchLayout::Buffer c = layout.Add<uint8_t>("c", 100, 1, 2);
+  layout.Plan();
+
+  EXPECT_EQ(layout.offset(a), layout.offset(b));
+  EXPECT_FALSE(Overlaps(layout, a, c));
+  EXPECT_FALSE(Overlaps(layout, b, c));
+  EXPECT_EQ(layout.size(), 8192u + 256u);
+  EXPECT_EQ(layout.peak_live_size(), 8192u + 256u);
+  EXPECT_EQ(layout.unshared_size(), 4096u + 8192u + 256u);
+}
+
+TEST(ScratchLayoutTest, LiveBuffersNeverAlias) {
+  std::mt19937 rng(971);
+  for (int trial = 0; trial < 50; ++trial) {
+    constexpr size_t kStages = 15;
+    ScratchLayout layout;
+    std::vector<ScratchLayout::Buffer> buffers;
+    for (int i = 0; i < 30; ++i) {
+      const size_t first = rng() % kStages;
+      const size_t last = first + rng() % (kStages - first);
+      buffers.push_back(
+          layout.Add("buffer", 1 + rng() % 100000, first, last));
+    }
+    layout.Plan();
+
+    EXPECT_GE(layout.size(), layout.peak_live_size());
+    EXPECT_LE(layout.size(), layout.unshared_size());
+    for (size_t i = 0; i < buffers.size(); ++i) {
+      EXPECT_EQ(layout.offset(buffers[i]) % ScratchLayout::kAlignment, 0u);
+      EXPECT_LE(layout.offset(buffers[i]) + layout.bytes(buffers[i]),
+                layout.size());
+      for (size_t j = i + 1; j < buffers.size(); ++j) {
+        if (LiveTogether(layout, buffers[i], buffers[j])) {
+          EXPECT_FALSE(Overlaps(layout, buffers[i], buffers[j]));
+        }
+      }
+    }
+  }
+}
+
+// Runs a fake pipeline through a host arena.  Each stage fills the buffers it
+// produces, and every buffer must still hold its contents at each stage it is
+// live for.
+TEST(ScratchArenaTest, BuffersSurviveTheirLifetimes) {
+  constexpr size_t kStages = 6;
+  HostScratchArena arena;
+  const std::vector<ScratchLayout::Buffer> buffers = {
+      arena.Add<uint32_t>("image", 4096, 0, 2),
+      arena.Add<uint8_t>("temp 0", 10000, 1, 1),
+      arena.Add<uint64_t>("points", 3000, 2, 4),
+      arena.Add<uint8_t>("temp 1", 20000, 3, 3),
+      arena.Add<uint32_t>("sorted", 3000, 3, 5),
+      arena.Add<uint8_t>("temp 2", 5000, 5, 5),
+  };
+  arena.Allocate();
+  EXPECT_LT(arena.layout().size(), arena.layout().unshared_size());
+
+  for (size_t stage = 0; stage < kStages; ++stage) {
+    for (size_t i = 0; i < buffers.size(); ++i) {
+      if (arena.layout().first(buffers[i]) == stage) {
+        std::span<uint8_t> memory = arena.Get<uint8_t>(buffers[i]);
+        std::fill(memory.begin(), memory.end(), i + 1);
+      }
+    }
+    for (size_t i = 0; i < buffers.size(); ++i) {
+      if (arena.layout().first(buffers[i]) <= stage &&
+          stage <= arena.layout().last(buffers[i])) {
+        std::span<uint8_t> memory = arena.Get<uint8_t>(buffers[i]);
+        ASSERT_EQ(std::count(memory.begin(), memory.end(), i + 1),
+                  static_cast<ptrdiff_t>(memory.size()))
+            << "Buffer " << i << " clobbered by stage " << stage;
+      }
+    }
+  }
+
+  EXPECT_EQ(arena.Get<uint32_t>(buffers[0]).size(), 4096u);
+  EXPECT_EQ(arena.Get<uint64_t>(buffers[2]).size(), 3000u);
+}
+
+}  // namespace
+}  // namespace frc971::apriltag
+
+int main(int argc, char **argv) {
+  ::testing::InitGoogleTest(&argc, argv);
+  google::InitGoogleLogging(argv[0]);
+  return RUN_ALL_TESTS();
+}
@@ -0,0 +1,144 @@
+#ifndef FRC971_ORIN_SPSC_QUEUE_H_
+#define FRC971_ORIN_SPSC_QUEUE_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <atomic>
+#include <vector>
+
+#include "glog/logging.h"
+
+namespace frc971::apriltag {
+
+// What a full queue does with the next item.
+enum class DropPolicy {
+  // The producer waits for the consumer to make room.
+  kBlock,
+  // The new item is dropped, so the producer never waits.  Dropping the oldest
+  // item instead would mean taking a slot back from under the consumer, which
+  // a single producer, single consumer ring can't do without a lock.  A depth
+  // of 1 or 2 keeps the items which do get through fresh.
+  kDropNewest,
+};
+
+// Bounded single producer, single consumer ring of preallocated items, for
+// handing frames between pipeline stages on different threads.  Items are
+// filled in and read in place, so anything they own, like image buffers, is
+// reused from one trip around the ring to the next instead of reallocated.
+//
+// Pushing and popping are lock free.  Waiting for room or for an item sleeps
+// on the indices with std::atomic::wait instead of spinning.
+template <typename T>
+class SpscQueue {
+ public:
+  SpscQueue(size_t depth, DropPolicy policy)
+      : items_(depth), policy_(policy) {
+    CHECK_GT(depth, 0u);
+  }
+
+  SpscQueue(const SpscQueue &) = delete;
+  SpscQueue &operator=(const SpscQueue &) = delete;
+
+  // Producer side.  Returns the slot to fill in next, or nullptr if the item
+  // should be dropped, because the queue is full and drops new items or
+  // because it is closed.  Waits for room under DropPolicy::kBlock.  The slot
+  // still holds whatever was last in it.
+  T *BeginPush() {
+    const uint64_t tail = tail_.load(std::memory_order_relaxed);
+    while (true) {
+      const uint64_t head = head_.load(std::memory_order_acquire);
+      if ((head | tail) & kClosed) {
+        return nullptr;
+      }
+      if (tail - head < items_.size()) {
+        return &items_[tail % items_.size()];
+      }
+      if (policy_ == DropPolicy::kDropNewest) {
+        dropped_.fetch_add(1, std::memory_order_relaxed);
+        return nullptr;
+      }
+      head_.wait(head, std::memory_order_acquire);
+    }
+  }
+
+  // Like BeginPush, but returns nullptr and counts the item as dropped
+  // instead of waiting when the queue is full, whatever the policy.  Lets a
+  // producer which mustn't wait share a queue with one which may, like a
+  // final item which has to get through.
+  T *TryBeginPush() {
+    const uint64_t tail = tail_.load(std::memory_order_relaxed);
+    const uint64_t head = head_.load(std::memory_order_acquire);
+    if ((head | tail) & kClosed) {
+      return nullptr;
+    }
+    if (tail - head >= items_.size()) {
+      dropped_.fetch_add(1, std::memory_order_relaxed);
+      return nullptr;
+    }
+    return &items_[tail % items_.size()];
+  }
+
+  // Hands the slot from BeginPush to the consumer.
+  void EndPush() {
+    // fetch_add rather than store, so a Close on another thread isn't lost.
+    tail_.fetch_add(1, std::memory_order_release);
+    tail_.notify_one();
+  }
+
+  // Consumer side.  Waits for an item and returns it, or returns nullptr once
+  // the queue is closed and everything pushed before then has been popped.
+  T *Front() {
+    const uint64_t head = head_.load(std::memory_order_relaxed) & ~kClosed;
+    while (true) {
+      const uint64_t tail = tail_.load(std::memory_order_acquire);
+      if ((tail & ~kClosed) != head) {
+        return &items_[head % items_.size()];
+      }
+      if (tail & kClosed) {
+        return nullptr;
+      }
+      tail_.wait(tail, std::memory_order_acquire);
+    }
+  }
+
+  // Hands the item from Front back to the producer.
+  void Pop() {
+    head_.fetch_add(1, std::memory_order_release);
+    head_.notify_one();
+  }
+
+  // Wakes up both sides.  Every later push returns nullptr, and Front returns
+  // nullptr once the items already pushed have been drained.  Can be called
+  // from any thread.
+  void Close() {
+    head_.fetch_or(kClosed, std::memory_order_acq_rel);
+    tail_.fetch_or(kClosed, std::memory_order_acq_rel);
+    head_.notify_all();
+    tail_.notify_all();
+  }
+
+  // Items dropped because the queue was full.
+  size_t dropped() const { return dropped_.load(std::memory_order_relaxed); }
+
+  size_t depth() const { return items_.size(); }
+  DropPolicy policy() const { return policy_; }
+
+ private:
+  // Set in both indices by Close.  The indices count up from 0 and would take
+  // centuries to get here.
+  static constexpr uint64_t kClosed = uint64_t{1} << 63;
+
+  std::vector<T> items_;
+  const DropPolicy policy_;
+
+  // Count of items popped, written by the consumer, and pushed, written by the
+  // producer.  On separate cache lines so the two sides don't contend.
+  alignas(64) std::atomic<uint64_t> head_{0};
+  alignas(64) std::atomic<uint64_t> tail_{0};
+  alignas(64) std::atomic<size_t> dropped_{0};
+};
+
+}  // namespace frc971::apriltag
+
+#endif  // FRC971_ORIN_SPSC_QUEUE_H_
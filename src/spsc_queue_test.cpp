@@ -0,0 +1,150 @@
+// spsc_queue_test.cpp
+#include "spsc_queue.h"
+
+#include <glog/logging.h>
+#include <gtest/gtest.h>
+
+#include <chrono>
+#include <thread>
+#include <vector>
+
+namespace frc971::apriltag {
+namespace {
+
+// Tests that items come out in order across threads, with the producer waiting
+// for room instead of dropping anything.
+TEST(SpscQueueTest, BlockingPassesEverythingInOrder) {
+  constexpr int kItems = 200000;
+  SpscQueue<std::vector<int>> queue(3, DropPolicy::kBlock);
+
+  std::thread producer([&]() {
+    for (int i = 0; i < kItems; ++i) {
+      std::vector<int> *item = queue.BeginPush();
+      ASSERT_NE(item, nullptr);
+      item->assign({i, i + 1});
+      queue.EndPush();
+    }
+  });
+
+  for (int i = 0; i < kItems; ++i) {
+    std::vector<int> *item = queue.Front();
+    ASSERT_NE(item, nullptr);
+    ASSERT_EQ(item->size(), 2u);
+    ASSERT_EQ((*item)[0], i);
+    ASSERT_EQ((*item)[1], i + 1);
+    queue.Pop();
+  }
+  producer.join();
+  EXPECT_EQ(queue.dropped(), 0u);
+}
+
+// Tests that a full queue drops new items, and that slots keep what was last
+// in them so their buffers get reused.
+TEST(SpscQueueTest, DropNewestWhenFull) {
+  SpscQueue<std::vector<int>> queue(2, DropPolicy::kDropNewest);
+  for (int i = 0; i < 2; ++i) {
+    std::vector<int> *item = queue.BeginPush();
+    ASSERT_NE(item, nullptr);
+    item->assign(100, i);
+    queue.EndPush();
+  }
+  EXPECT_EQ(queue.BeginPush(), nullptr);
+  EXPECT_EQ(queue.BeginPush(), nullptr);
+  EXPECT_EQ(queue.dropped(), 2u);
+
+  const std::vector<int> *first = queue.Front();
+  EXPECT_EQ((*first)[0], 0);
+  queue.Pop();
+
+  std::vector<int> *reused = queue.BeginPush();
+  ASSERT_EQ(reused, first);
+  EXPECT_EQ(reused->size(), 100u);
+  reused->assign(50, 2);
+  queue.EndPush();
+
+  EXPECT_EQ((*queue.Front())[0], 1);
+  queue.Pop();
+  EXPECT_EQ((*queue.Front())[0], 2);
+  queue.Pop();
+  EXPECT_EQ(queue.dropped(), 2u);
+}
+
+// Tests that TryBeginPush drops instead of waiting on a blocking queue, while
+// BeginPush still waits.
+TEST(SpscQueueTest, TryBeginPushNeverWaits) {
+  SpscQueue<int> queue(1, DropPolicy::kBlock);
+  int *item = queue.TryBeginPush();
+  ASSERT_NE(item, nullptr);
+  *item = 1;
+  queue.EndPush();
+  EXPECT_EQ(queue.TryBeginPush(), nullptr);
+  EXPECT_EQ(queue.dropped(), 1u);
+
+  std::thread producer([&]() {
+    int *item = queue.BeginPush();
+    ASSERT_NE(item, nullptr);
+    *item = 2;
+    queue.EndPush();
+  });
+  std::this_thread::sleep_for(std::chrono::milliseconds(20));
+  EXPECT_EQ(*queue.Front(), 1);
+  queue.Pop();
+  producer.join();
+  EXPECT_EQ(*queue.Front(), 2);
+  queue.Pop();
+  EXPECT_EQ(queue.dropped(), 1u);
+}
+
+// Tests that closing wakes up a consumer waiting on an empty queue and a
+// producer waiting on a full one.
+TEST(SpscQueueTest, CloseWakesWaiters) {
+  SpscQueue<int> empty(1, DropPolicy::kBlock);
+  std::thread consumer([&]() { EXPECT_EQ(empty.Front(), nullptr); });
+
+  SpscQueue<int> full(1, DropPolicy::kBlock);
+  *full.BeginPush() = 1;
+  full.EndPush();
+  std::thread producer([&]() { EXPECT_EQ(full.BeginPush(), nullptr); });
+
+  std::this_thread::sleep_for(std::chrono::milliseconds(20));
+  empty.Close();
+  full.Close();
+  consumer.join();
+  producer.join();
+  // The item pushed before closing still gets through.
+  ASSERT_NE(full.Front(), nullptr);
+  EXPECT_EQ(*full.Front(), 1);
+  full.Pop();
+  EXPECT_EQ(full.Front(), nullptr);
+}
+
+// Tests that items pushed before the queue is closed are still popped, so a
+// producer can close the queue as soon as it is done without losing its last
+// items.
+TEST(SpscQueueTest, DrainsAfterClose) {
+  SpscQueue<int> queue(3, DropPolicy::kBlock);
+  for (int i = 0; i < 3; ++i) {
+    *queue.BeginPush() = i;
+    queue.EndPush();
+  }
+  queue.Close();
+  EXPECT_EQ(queue.BeginPush(), nullptr);
+  EXPECT_EQ(queue.TryBeginPush(), nullptr);
+
+  for (int i = 0; i < 3; ++i) {
+    int *item = queue.Front();
+    ASSERT_NE(item, nullptr);
+    EXPECT_EQ(*item, i);
+    queue.Pop();
+  }
+  EXPECT_EQ(queue.Front(), nullptr);
+}
+
+}  // namespace
+}  // namespace frc971::apriltag
+
+int main(int argc, char **argv) {
+  ::testing::InitGoogleTest(&argc, argv);
+  google::InitGoogleLogging(argv[0]);
+  return RUN_ALL_TESTS();
+}
@@ -1,5 +1,7 @@
 #include <stdint.h>
 
+#include <algorithm>
+
 #include "cuda_frc971.h"
 #include "threshold.h"
 
@@ -15,19 +17,24 @@ namespace {
 // Writes out the grayscale image and decimated image.
 __global__ void InternalCudaToGreyscaleAndDecimateHalide(
     const uint8_t *color_image, uint8_t *gray_image, uint8_t *decimated_image,
-    size_t width, size_t height) {
+    size_t width, size_t height, size_t decimation, size_t decimated_width,
+    size_t decimated_height, PixelFormat pixel_format, size_t stride) {
   size_t i = blockIdx.x * blockDim.x + threadIdx.x;
   while (i < width * height) {
-    uint8_t pixel = gray_image[i] = color_image[i * 2];
-
     const size_t row = i / width;
     const size_t col = i - width * row;
 
-    // Copy over every other pixel.
-    if (row % 2 == 0 && col % 2 == 0) {
-      size_t decimated_row = row / 2;
-      size_t decimated_col = col / 2;
-      decimated_image[decimated_row * width / 2 + decimated_col] = pixel;
+    uint8_t pixel = gray_image[i] =
+        ReadLuma(color_image + row * stride, col, pixel_format);
+
+    // Copy over every decimation'th pixel.
+    if (row % decimation == 0 && col % decimation == 0) {
+      size_t decimated_row = row / decimation;
+      size_t decimated_col = col / decimation;
+      if (decimated_row < decimated_height && decimated_col < decimated_width) {
+        decimated_image[decimated_row * decimated_width + decimated_col] =
+            pixel;
+      }
     }
     i += blockDim.x * gridDim.x;
   }
@@ -151,23 +158,29 @@ __global__ void InternalThreshold(const uint8_t *decimated_image,
 void CudaToGreyscaleAndDecimateHalide(
     const uint8_t *color_image, uint8_t *gray_image, uint8_t *decimated_image,
     uint8_t *unfiltered_minmax_image, uint8_t *minmax_image,
-    uint8_t *thresholded_image, size_t width, size_t height,
-    size_t min_white_black_diff, CudaStream *stream) {
-  CHECK((width % 8) == 0);
-  CHECK((height % 8) == 0);
+    uint8_t *thresholded_image, size_t width, size_t height, size_t decimation,
+    ImageFormat format, size_t min_white_black_diff, CudaStream *stream) {
+  CHECK_GE(decimation, 1u);
+  CHECK_LE(decimation, kMaxDecimation);
+  size_t decimated_width = DecimatedSize(width, decimation);
+  size_t decimated_height = DecimatedSize(height, decimation);
+  CHECK_GT(decimated_width, 0u);
+  CHECK_GT(decimated_height, 0u);
+
   constexpr size_t kThreads = 256;
   {
-    // Step one, convert to gray and decimate.
-    size_t kBlocks = (width * height + kThreads - 1) / kThreads / 4;
+    // Step one, convert to gray and decimate.  The kernels loop over the image,
+    // so a quarter of a thread per pixel is enough, but never 0 blocks.
+    size_t kBlocks =
+        std::max<size_t>(1, (width * height + kThreads - 1) / kThreads / 4);
     InternalCudaToGreyscaleAndDecimateHalide<<<kBlocks, kThreads, 0,
                                                stream->get()>>>(
-        color_image, gray_image, decimated_image, width, height);
+        color_image, gray_image, decimated_image, width, height, decimation,
+        decimated_width, decimated_height, format.pixel_format,
+        RowStride(format, width));
     MaybeCheckAndSynchronize();
   }
 
-  size_t decimated_width = width / 2;
-  size_t decimated_height = height / 2;
-
   {
     // Step 2, compute a min/max for each block of 4x4 (16) pixels.
     dim3 threads(16, 16, 1);
@@ -191,7 +204,8 @@ void CudaToGreyscaleAndDecimateHalide(
   {
     // Now, write out 127 if the min/max are too close to each other, or 0/255
     // if the pixels are above or below the average of the min/max.
-    size_t kBlocks = (width * height / 4 + kThreads - 1) / kThreads / 4;
+    size_t kBlocks = std::max<size_t>(
+        1, (decimated_width * decimated_height + kThreads - 1) / kThreads / 4);
     InternalThreshold<<<kBlocks, kThreads, 0, stream->get()>>>(
         decimated_image, reinterpret_cast<uchar2 *>(minmax_image),
         thresholded_image, decimated_width, decimated_height,
@@ -4,16 +4,20 @@
 #include <stdint.h>
 
 #include "cuda_frc971.h"
+#include "decimation.h"
+#include "pixel_format.h"
 
 namespace frc971::apriltag {
 
 // Converts to grayscale, decimates, and thresholds an image on the provided
-// stream.
+// stream.  color_image is laid out as described by format.  The decimated
+// images are DecimatedSize(width, decimation) x
+// DecimatedSize(height, decimation).
 void CudaToGreyscaleAndDecimateHalide(
     const uint8_t *color_image, uint8_t *gray_image, uint8_t *decimated_image,
     uint8_t *unfiltered_minmax_image, uint8_t *minmax_image,
-    uint8_t *thresholded_image, size_t width, size_t height,
-    size_t min_white_black_diff, CudaStream *stream);
+    uint8_t *thresholded_image, size_t width, size_t height, size_t decimation,
+    ImageFormat format, size_t min_white_black_diff, CudaStream *stream);
 
 }  // namespace frc971::apriltag
 
@@ -0,0 +1,658 @@
+#include "threshold_cpu.h"
+
+#include <algorithm>
+#include <array>
+#include <cstring>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define FRC971_THRESHOLD_AVX2
+#elif defined(__aarch64__)
+#include <arm_neon.h>
+#define FRC971_THRESHOLD_NEON
+#endif
+
+#include "glog/logging.h"
+#include "parallel_for.h"
+
+namespace frc971::apriltag {
+namespace {
+
+// The whole stage is done in one pass over the image.  Each worker takes a
+// strip of tile rows (a tile is 4x4 decimated pixels, so 4 * decimation rows
+// of the full image) and walks down it, keeping the block min/max of the
+// previous, current and next tile rows in a ring.  Everything a tile row
+// touches is still in cache by the time it is thresholded.  The tile row just
+// past each end of the strip gets its min/max computed by both neighboring
+// workers so strips don't have to wait on each other.
+
+// Minimum number of tile rows to hand to a worker at a time.
+constexpr size_t kMinTileRowsPerTask = 4;
+
+// Returns the number of strips the tile rows are split into.
+size_t StripCount(size_t tile_height, workerpool_t *wp) {
+  return std::max<size_t>(
+      1, std::min({WorkerCount(wp), tile_height / kMinTileRowsPerTask,
+                   kMaxParallelChunks}));
+}
+
+// Returns the bytes of scratch a strip needs for its halo: 4 decimated rows,
+// and the unfiltered min/max rows above and below it.
+size_t HaloSize(size_t decimated_width) {
+  return decimated_width * 4 + decimated_width / 4 * 2 * 2;
+}
+
+// Row kernels.  Each has a scalar, AVX2 and NEON version, all of which produce
+// identical results.
+struct RowKernels {
+  // Extracts the luma of a row of color pixels into gray.
+  void (*gray)(const uint8_t *color_row, uint8_t *gray_row, size_t width);
+  // Extracts the luma of every decimation'th pixel of a row of color pixels
+  // into decimated.
+  void (*decimate)(const uint8_t *color_row, uint8_t *decimated_row,
+                   size_t decimated_width);
+  // Computes the min and max of each 4x4 block of the 4 provided decimated
+  // rows, and writes out interleaved (min, max) pairs.
+  void (*block_minmax)(const uint8_t *const rows[4], uint8_t *minmax_row,
+                       size_t tile_width);
+  // Thresholds a row of decimated pixels against the per tile min/max.
+  void (*threshold)(const uint8_t *decimated_row, const uint8_t *minmax_row,
+                    uint8_t *thresholded_row, size_t decimated_width,
+                    size_t min_white_black_diff);
+};
+
+// Extracts the luma of a row of pixels in kPixelFormat.
+template <PixelFormat kPixelFormat>
+void ScalarGray(const uint8_t *color_row, uint8_t *gray_row, size_t width) {
+  if constexpr (BytesPerPixel(kPixelFormat) == 1) {
+    memcpy(gray_row, color_row, width);
+  } else {
+    for (size_t col = 0; col < width; ++col) {
+      gray_row[col] = ReadLuma(color_row, col, kPixelFormat);
+    }
+  }
+}
+
+// Extracts the luma of every kDecimation'th pixel of a row in kPixelFormat.
+template <PixelFormat kPixelFormat, size_t kDecimation>
+void ScalarDecimate(const uint8_t *color_row, uint8_t *decimated_row,
+                    size_t decimated_width) {
+  for (size_t col = 0; col < decimated_width; ++col) {
+    decimated_row[col] = ReadLuma(color_row, col * kDecimation, kPixelFormat);
+  }
+}
+
+// The packed 4:2:2 format with the luma in byte kLumaOffset of each pixel.
+template <size_t kLumaOffset>
+constexpr PixelFormat k422Format =
+    kLumaOffset == 0 ? PixelFormat::kYuyv : PixelFormat::kUyvy;
+
+void ScalarBlockMinMax(const uint8_t *const rows[4], uint8_t *minmax_row,
+                       size_t tile_width) {
+  for (size_t x = 0; x < tile_width; ++x) {
+    uint8_t min_val = 255;
+    uint8_t max_val = 0;
+    for (size_t i = 0; i < 4; ++i) {
+      for (size_t j = 0; j < 4; ++j) {
+        min_val = std::min(min_val, rows[i][x * 4 + j]);
+        max_val = std::max(max_val, rows[i][x * 4 + j]);
+      }
+    }
+    minmax_row[x * 2] = min_val;
+    minmax_row[x * 2 + 1] = max_val;
+  }
+}
+
+// Thresholds a single pixel.  Matches InternalThreshold.
+inline uint8_t ThresholdPixel(uint8_t pixel, uint8_t min_val, uint8_t max_val,
+                              size_t min_white_black_diff) {
+  if (static_cast<size_t>(max_val - min_val) < min_white_black_diff) {
+    return 127;
+  }
+  const uint8_t thresh = min_val + (max_val - min_val) / 2;
+  return pixel > thresh ? 255 : 0;
+}
+
+void ScalarThreshold(const uint8_t *decimated_row, const uint8_t *minmax_row,
+                     uint8_t *thresholded_row, size_t decimated_width,
+                     size_t min_white_black_diff) {
+  for (size_t x = 0; x < decimated_width; ++x) {
+    thresholded_row[x] =
+        ThresholdPixel(decimated_row[x], minmax_row[(x / 4) * 2],
+                       minmax_row[(x / 4) * 2 + 1], min_white_black_diff);
+  }
+}
+
+#ifdef FRC971_THRESHOLD_AVX2
+
+#define FRC971_AVX2_TARGET __attribute__((target("avx2")))
+
+// Extracts byte kLumaOffset of each 16 bit pixel.  Also decimates GRAY8.
+template <size_t kLumaOffset>
+FRC971_AVX2_TARGET void Avx2Gray422(const uint8_t *color_row,
+                                    uint8_t *gray_row, size_t width) {
+  const __m256i low_byte = _mm256_set1_epi16(0x00ff);
+  size_t col = 0;
+  for (; col + 32 <= width; col += 32) {
+    __m256i a = _mm256_loadu_si256(
+        reinterpret_cast<const __m256i *>(color_row + col * 2));
+    __m256i b = _mm256_loadu_si256(
+        reinterpret_cast<const __m256i *>(color_row + col * 2 + 32));
+    // Move the luma into the low byte of each 16 bit word.
+    if constexpr (kLumaOffset == 0) {
+      a = _mm256_and_si256(a, low_byte);
+      b = _mm256_and_si256(b, low_byte);
+    } else {
+      a = _mm256_srli_epi16(a, 8);
+      b = _mm256_srli_epi16(b, 8);
+    }
+    // packus interleaves the 128 bit lanes, permute puts them back in order.
+    const __m256i packed = _mm256_packus_epi16(a, b);
+    _mm256_storeu_si256(reinterpret_cast<__m256i *>(gray_row + col),
+                        _mm256_permute4x64_epi64(packed, 0xd8));
+  }
+  ScalarGray<k422Format<kLumaOffset>>(color_row + col * 2, gray_row + col,
+                                      width - col);
+}
+
+// Extracts byte kLumaOffset of every other 16 bit pixel.
+template <size_t kLumaOffset>
+FRC971_AVX2_TARGET void Avx2Decimate422(const uint8_t *color_row,
+                                        uint8_t *decimated_row,
+                                        size_t decimated_width) {
+  const __m256i low_byte = _mm256_set1_epi32(0x000000ff);
+  const __m256i lane_order = _mm256_setr_epi32(0, 4, 1, 5, 2, 6, 3, 7);
+  size_t col = 0;
+  for (; col + 32 <= decimated_width; col += 32) {
+    const __m256i *src =
+        reinterpret_cast<const __m256i *>(color_row + col * 4);
+    __m256i v[4];
+    for (int i = 0; i < 4; ++i) {
+      // Move the luma into the low byte of each 32 bit word.
+      v[i] = _mm256_and_si256(
+          _mm256_srli_epi32(_mm256_loadu_si256(src + i), 8 * kLumaOffset),
+          low_byte);
+    }
+    // Two rounds of in lane packing leave each 32 bit word holding 4
+    // consecutive pixels, but with the words out of order.
+    const __m256i packed =
+        _mm256_packus_epi16(_mm256_packus_epi32(v[0], v[1]),
+                            _mm256_packus_epi32(v[2], v[3]));
+    _mm256_storeu_si256(reinterpret_cast<__m256i *>(decimated_row + col),
+                        _mm256_permutevar8x32_epi32(packed, lane_order));
+  }
+  ScalarDecimate<k422Format<kLumaOffset>, 2>(
+      color_row + col * 4, decimated_row + col, decimated_width - col);
+}
+
+FRC971_AVX2_TARGET void Avx2BlockMinMax(const uint8_t *const rows[4],
+                                        uint8_t *minmax_row,
+                                        size_t tile_width) {
+  const __m256i low_byte = _mm256_set1_epi32(0x000000ff);
+  const __m256i lane_order = _mm256_setr_epi32(0, 1, 4, 5, 2, 3, 6, 7);
+  size_t x = 0;
+  for (; x + 8 <= tile_width; x += 8) {
+    __m256i min_val = _mm256_loadu_si256(
+        reinterpret_cast<const __m256i *>(rows[0] + x * 4));
+    __m256i max_val = min_val;
+    for (size_t i = 1; i < 4; ++i) {
+      const __m256i row = _mm256_loadu_si256(
+          reinterpret_cast<const __m256i *>(rows[i] + x * 4));
+      min_val = _mm256_min_epu8(min_val, row);
+      max_val = _mm256_max_epu8(max_val, row);
+    }
+    // Reduce the 4 bytes of each 32 bit word into its low byte.
+    min_val = _mm256_min_epu8(min_val, _mm256_srli_epi32(min_val, 8));
+    min_val = _mm256_min_epu8(min_val, _mm256_srli_epi32(min_val, 16));
+    max_val = _mm256_max_epu8(max_val, _mm256_srli_epi32(max_val, 8));
+    max_val = _mm256_max_epu8(max_val, _mm256_srli_epi32(max_val, 16));
+    // Interleave min and max into the low 16 bits of each word, and pack down.
+    const __m256i pairs =
+        _mm256_or_si256(_mm256_and_si256(min_val, low_byte),
+                        _mm256_slli_epi32(_mm256_and_si256(max_val, low_byte),
+                                          8));
+    const __m256i packed = _mm256_permutevar8x32_epi32(
+        _mm256_packus_epi32(pairs, pairs), lane_order);
+    _mm_storeu_si128(reinterpret_cast<__m128i *>(minmax_row + x * 2),
+                     _mm256_castsi256_si128(packed));
+  }
+  const uint8_t *const tail_rows[4] = {rows[0] + x * 4, rows[1] + x * 4,
+                                       rows[2] + x * 4, rows[3] + x * 4};
+  ScalarBlockMinMax(tail_rows, minmax_row + x * 2, tile_width - x);
+}
+
+FRC971_AVX2_TARGET void Avx2Threshold(const uint8_t *decimated_row,
+                                      const uint8_t *minmax_row,
+                                      uint8_t *thresholded_row,
+                                      size_t decimated_width,
+                                      size_t min_white_black_diff) {
+  if (min_white_black_diff > 255) {
+    // Nothing has enough contrast, let the scalar path fill in 127's.
+    ScalarThreshold(decimated_row, minmax_row, thresholded_row,
+                    decimated_width, min_white_black_diff);
+    return;
+  }
+  // Broadcasts the min (or max) of each of the 8 tiles to its 4 pixels.
+  const __m256i spread_min = _mm256_setr_epi8(
+      0, 0, 0, 0, 2, 2, 2, 2, 4, 4, 4, 4, 6, 6, 6, 6, 0, 0, 0, 0, 2, 2, 2, 2,
+      4, 4, 4, 4, 6, 6, 6, 6);
+  const __m256i spread_max = _mm256_add_epi8(spread_min, _mm256_set1_epi8(1));
+  const __m256i low_bits = _mm256_set1_epi8(0x7f);
+  const __m256i white = _mm256_set1_epi8(static_cast<char>(255));
+  const __m256i gray = _mm256_set1_epi8(127);
+  const bool check_contrast = min_white_black_diff > 0;
+  const __m256i max_low_contrast = _mm256_set1_epi8(
+      static_cast<char>(check_contrast ? min_white_black_diff - 1 : 0));
+
+  size_t x = 0;
+  for (; x + 32 <= decimated_width; x += 32) {
+    // 8 tiles of (min, max), 4 in each 128 bit lane.
+    const __m128i tiles_low = _mm_loadl_epi64(
+        reinterpret_cast<const __m128i *>(minmax_row + (x / 4) * 2));
+    const __m128i tiles_high = _mm_loadl_epi64(
+        reinterpret_cast<const __m128i *>(minmax_row + (x / 4) * 2 + 8));
+    const __m256i tiles = _mm256_set_m128i(tiles_high, tiles_low);
+    const __m256i min_val = _mm256_shuffle_epi8(tiles, spread_min);
+    const __m256i max_val = _mm256_shuffle_epi8(tiles, spread_max);
+
+    const __m256i diff = _mm256_sub_epi8(max_val, min_val);
+    const __m256i thresh = _mm256_add_epi8(
+        min_val, _mm256_and_si256(_mm256_srli_epi16(diff, 1), low_bits));
+
+    const __m256i pixels = _mm256_loadu_si256(
+        reinterpret_cast<const __m256i *>(decimated_row + x));
+    // pixel > thresh is the same as max(pixel, thresh) != thresh.
+    const __m256i not_above = _mm256_cmpeq_epi8(
+        _mm256_max_epu8(pixels, thresh), thresh);
+    __m256i result = _mm256_andnot_si256(not_above, white);
+    if (check_contrast) {
+      // diff < min_white_black_diff is the same as
+      // min(diff, min_white_black_diff - 1) == diff.
+      const __m256i low_contrast = _mm256_cmpeq_epi8(
+          _mm256_min_epu8(diff, max_low_contrast), diff);
+      result = _mm256_blendv_epi8(result, gray, low_contrast);
+    }
+    _mm256_storeu_si256(reinterpret_cast<__m256i *>(thresholded_row + x),
+                        result);
+  }
+  ScalarThreshold(decimated_row + x, minmax_row + (x / 4) * 2,
+                  thresholded_row + x, decimated_width - x,
+                  min_white_black_diff);
+}
+
+#undef FRC971_AVX2_TARGET
+
+#endif  // FRC971_THRESHOLD_AVX2
+
+#ifdef FRC971_THRESHOLD_NEON
+
+// Extracts byte kLumaOffset of each 16 bit pixel.  Also decimates GRAY8.
+template <size_t kLumaOffset>
+void NeonGray422(const uint8_t *color_row, uint8_t *gray_row, size_t width) {
+  size_t col = 0;
+  for (; col + 16 <= width; col += 16) {
+    vst1q_u8(gray_row + col, vld2q_u8(color_row + col * 2).val[kLumaOffset]);
+  }
+  ScalarGray<k422Format<kLumaOffset>>(color_row + col * 2, gray_row + col,
+                                      width - col);
+}
+
+// Extracts byte kLumaOffset of every other 16 bit pixel.
+template <size_t kLumaOffset>
+void NeonDecimate422(const uint8_t *color_row, uint8_t *decimated_row,
+                     size_t decimated_width) {
+  size_t col = 0;
+  for (; col + 16 <= decimated_width; col += 16) {
+    vst1q_u8(decimated_row + col,
+             vld4q_u8(color_row + col * 4).val[kLumaOffset]);
+  }
+  ScalarDecimate<k422Format<kLumaOffset>, 2>(
+      color_row + col * 4, decimated_row + col, decimated_width - col);
+}
+
+void NeonBlockMinMax(const uint8_t *const rows[4], uint8_t *minmax_row,
+                     size_t tile_width) {
+  // vld4q_u8 deinterleaves 64 bytes, so each vector holds one column of 16
+  // tiles.
+  size_t x = 0;
+  for (; x + 16 <= tile_width; x += 16) {
+    uint8x16_t min_val = vdupq_n_u8(255);
+    uint8x16_t max_val = vdupq_n_u8(0);
+    for (size_t i = 0; i < 4; ++i) {
+      const uint8x16x4_t row = vld4q_u8(rows[i] + x * 4);
+      min_val = vminq_u8(min_val, vminq_u8(vminq_u8(row.val[0], row.val[1]),
+                                           vminq_u8(row.val[2], row.val[3])));
+      max_val = vmaxq_u8(max_val, vmaxq_u8(vmaxq_u8(row.val[0], row.val[1]),
+                                           vmaxq_u8(row.val[2], row.val[3])));
+    }
+    uint8x16x2_t pairs;
+    pairs.val[0] = min_val;
+    pairs.val[1] = max_val;
+    vst2q_u8(minmax_row + x * 2, pairs);
+  }
+  const uint8_t *const tail_rows[4] = {rows[0] + x * 4, rows[1] + x * 4,
+                                       rows[2] + x * 4, rows[3] + x * 4};
+  ScalarBlockMinMax(tail_rows, minmax_row + x * 2, tile_width - x);
+}
+
+void NeonThreshold(const uint8_t *decimated_row, const uint8_t *minmax_row,
+                   uint8_t *thresholded_row, size_t decimated_width,
+                   size_t min_white_black_diff) {
+  if (min_white_black_diff > 255) {
+    ScalarThreshold(decimated_row, minmax_row, thresholded_row,
+                    decimated_width, min_white_black_diff);
+    return;
+  }
+  // Broadcasts the min (or max) of each of the 4 tiles to its 4 pixels.
+  static const uint8_t kSpreadMin[16] = {0, 0, 0, 0, 2, 2, 2, 2,
+                                         4, 4, 4, 4, 6, 6, 6, 6};
+  const uint8x16_t spread_min = vld1q_u8(kSpreadMin);
+  const uint8x16_t spread_max = vaddq_u8(spread_min, vdupq_n_u8(1));
+  const bool check_contrast = min_white_black_diff > 0;
+  const uint8x16_t contrast = vdupq_n_u8(min_white_black_diff);
+
+  size_t x = 0;
+  for (; x + 16 <= decimated_width; x += 16) {
+    const uint8x16_t tiles =
+        vcombine_u8(vld1_u8(minmax_row + (x / 4) * 2), vdup_n_u8(0));
+    const uint8x16_t min_val = vqtbl1q_u8(tiles, spread_min);
+    const uint8x16_t max_val = vqtbl1q_u8(tiles, spread_max);
+    const uint8x16_t diff = vsubq_u8(max_val, min_val);
+    const uint8x16_t thresh = vaddq_u8(min_val, vshrq_n_u8(diff, 1));
+
+    const uint8x16_t pixels = vld1q_u8(decimated_row + x);
+    uint8x16_t result = vcgtq_u8(pixels, thresh);
+    if (check_contrast) {
+      result = vbslq_u8(vcltq_u8(diff, contrast), vdupq_n_u8(127), result);
+    }
+    vst1q_u8(thresholded_row + x, result);
+  }
+  ScalarThreshold(decimated_row + x, minmax_row + (x / 4) * 2,
+                  thresholded_row + x, decimated_width - x,
+                  min_white_black_diff);
+}
+
+#endif  // FRC971_THRESHOLD_NEON
+
+// Returns the scalar kernels for kPixelFormat.
+template <PixelFormat kPixelFormat>
+RowKernels ScalarKernels(size_t decimation) {
+  RowKernels kernels{
+      .gray = ScalarGray<kPixelFormat>,
+      .decimate = nullptr,
+      .block_minmax = ScalarBlockMinMax,
+      .threshold = ScalarThreshold,
+  };
+  switch (decimation) {
+    case 1:
+      kernels.decimate = ScalarDecimate<kPixelFormat, 1>;
+      break;
+    case 2:
+      kernels.decimate = ScalarDecimate<kPixelFormat, 2>;
+      break;
+    case 3:
+      kernels.decimate = ScalarDecimate<kPixelFormat, 3>;
+      break;
+    case 4:
+      kernels.decimate = ScalarDecimate<kPixelFormat, 4>;
+      break;
+  }
+  static_assert(kMaxDecimation == 4);
+  return kernels;
+}
+
+// Picks the fastest kernels this machine supports for the provided format and
+// decimation, or the scalar ones if vector is false.
+RowKernels SelectKernels(PixelFormat pixel_format, size_t decimation,
+                         bool vector) {
+  RowKernels kernels;
+  switch (pixel_format) {
+    case PixelFormat::kGray8:
+      kernels = ScalarKernels<PixelFormat::kGray8>(decimation);
+      break;
+    case PixelFormat::kYuyv:
+      kernels = ScalarKernels<PixelFormat::kYuyv>(decimation);
+      break;
+    case PixelFormat::kUyvy:
+      kernels = ScalarKernels<PixelFormat::kUyvy>(decimation);
+      break;
+    case PixelFormat::kNv12:
+      kernels = ScalarKernels<PixelFormat::kNv12>(decimation);
+      break;
+    case PixelFormat::kBgr24:
+      // BGR needs a weighted sum per pixel and only shows up when the camera
+      // hands us decoded frames, so it stays scalar.
+      kernels = ScalarKernels<PixelFormat::kBgr24>(decimation);
+      break;
+  }
+
+#if defined(FRC971_THRESHOLD_AVX2) || defined(FRC971_THRESHOLD_NEON)
+  if (!vector) {
+    return kernels;
+  }
+#ifdef FRC971_THRESHOLD_AVX2
+  if (!__builtin_cpu_supports("avx2")) {
+    return kernels;
+  }
+#define FRC971_SIMD(name) Avx2##name
+#else
+#define FRC971_SIMD(name) Neon##name
+#endif
+  kernels.block_minmax = FRC971_SIMD(BlockMinMax);
+  kernels.threshold = FRC971_SIMD(Threshold);
+  // Only 2x decimation has vector kernels.  3x and 4x decimation touch few
+  // enough pixels that the gray conversion dominates.
+  switch (pixel_format) {
+    case PixelFormat::kGray8:
+    case PixelFormat::kNv12:
+      if (decimation == 2) {
+        // Decimating gray is the same as pulling the even bytes out of YUYV.
+        kernels.decimate = FRC971_SIMD(Gray422)<0>;
+      }
+      break;
+    case PixelFormat::kYuyv:
+      kernels.gray = FRC971_SIMD(Gray422)<0>;
+      if (decimation == 2) {
+        kernels.decimate = FRC971_SIMD(Decimate422)<0>;
+      }
+      break;
+    case PixelFormat::kUyvy:
+      kernels.gray = FRC971_SIMD(Gray422)<1>;
+      if (decimation == 2) {
+        kernels.decimate = FRC971_SIMD(Decimate422)<1>;
+      }
+      break;
+    case PixelFormat::kBgr24:
+      break;
+  }
+#undef FRC971_SIMD
+#endif
+  if (decimation == 1) {
+    // Decimating by 1 is just the gray conversion.
+    kernels.decimate = kernels.gray;
+  }
+  return kernels;
+}
+
+const RowKernels &Kernels(PixelFormat pixel_format, size_t decimation,
+                          bool vector) {
+  static const auto kernels = [] {
+    std::array<std::array<std::array<RowKernels, kMaxDecimation>, 5>, 2>
+        result;
+    for (size_t v = 0; v < result.size(); ++v) {
+      for (size_t format = 0; format < result[v].size(); ++format) {
+        for (size_t i = 0; i < kMaxDecimation; ++i) {
+          result[v][format][i] = SelectKernels(
+              static_cast<PixelFormat>(format), i + 1, v == 1);
+        }
+      }
+    }
+    return result;
+  }();
+  return kernels[vector][static_cast<size_t>(pixel_format)][decimation - 1];
+}
+
+// Filters the min/max for the 3x3 set of tiles centered on each tile of the
+// current row.  previous and next are nullptr at the edges of the image.
+// Matches InternalBlockFilter.
+void FilterRow(const uint8_t *previous, const uint8_t *current,
+               const uint8_t *next, uint8_t *minmax_row, size_t tile_width) {
+  const uint8_t *rows[3] = {previous, current, next};
+  for (size_t x = 0; x < tile_width; ++x) {
+    const size_t begin = x == 0 ? 0 : x - 1;
+    const size_t end = std::min(x + 2, tile_width);
+    uint8_t min_val = 255;
+    uint8_t max_val = 0;
+    for (const uint8_t *row : rows) {
+      if (row == nullptr) {
+        continue;
+      }
+      for (size_t read_x = begin; read_x < end; ++read_x) {
+        min_val = std::min(min_val, row[read_x * 2]);
+        max_val = std::max(max_val, row[read_x * 2 + 1]);
+      }
+    }
+    minmax_row[x * 2] = min_val;
+    minmax_row[x * 2 + 1] = max_val;
+  }
+}
+
+// Runs the whole stage with the provided kernels.
+void ToGreyscaleAndDecimate(const RowKernels &kernels,
+                            const uint8_t *color_image, uint8_t *gray_image,
+                            uint8_t *decimated_image,
+                            uint8_t *unfiltered_minmax_image,
+                            uint8_t *minmax_image, uint8_t *thresholded_image,
+                            uint8_t *scratch, size_t width, size_t height,
+                            size_t decimation, ImageFormat format,
+                            size_t min_white_black_diff, workerpool_t *wp) {
+  const size_t decimated_width = DecimatedSize(width, decimation);
+  const size_t decimated_height = DecimatedSize(height, decimation);
+  CHECK_GT(decimated_width, 0u);
+  CHECK_GT(decimated_height, 0u);
+  const size_t tile_width = decimated_width / 4;
+  const size_t tile_height = decimated_height / 4;
+  const size_t tile_rows = 4 * decimation;
+  const size_t color_step = RowStride(format, width);
+
+  // Thresholds tile rows [begin, end).  halo is scratch for the tile rows
+  // just outside the strip, which belong to the neighboring workers.  We
+  // compute their min/max without writing out any pixels.
+  auto threshold_strip = [&](size_t begin, size_t end, uint8_t *halo) {
+    uint8_t *const halo_decimated = halo;
+    uint8_t *const halo_minmax = halo + decimated_width * 4;
+
+    // Converts, decimates and computes the block min/max of tile row y,
+    // returning the unfiltered min/max row.
+    auto block_minmax_row = [&](size_t y) -> const uint8_t * {
+      const bool owned = y >= begin && y < end;
+      uint8_t *decimated_rows =
+          owned ? decimated_image + y * 4 * decimated_width : halo_decimated;
+      uint8_t *minmax_row =
+          owned ? unfiltered_minmax_image + y * tile_width * 2
+                : halo_minmax + (y < begin ? 0 : tile_width * 2);
+      for (size_t i = 0; i < tile_rows; ++i) {
+        const size_t row = y * tile_rows + i;
+        const uint8_t *color_row = color_image + row * color_step;
+        if (owned) {
+          kernels.gray(color_row, gray_image + row * width, width);
+        }
+        if (i % decimation == 0) {
+          kernels.decimate(color_row,
+                           decimated_rows + i / decimation * decimated_width,
+                           decimated_width);
+        }
+      }
+      const uint8_t *const rows[4] = {
+          decimated_rows, decimated_rows + decimated_width,
+          decimated_rows + 2 * decimated_width,
+          decimated_rows + 3 * decimated_width};
+      kernels.block_minmax(rows, minmax_row, tile_width);
+      return minmax_row;
+    };
+
+    const uint8_t *previous = begin > 0 ? block_minmax_row(begin - 1) : nullptr;
+    const uint8_t *current = block_minmax_row(begin);
+    for (size_t y = begin; y < end; ++y) {
+      const uint8_t *next =
+          y + 1 < tile_height ? block_minmax_row(y + 1) : nullptr;
+
+      uint8_t *filtered_row = minmax_image + y * tile_width * 2;
+      FilterRow(previous, current, next, filtered_row, tile_width);
+
+      for (size_t i = 0; i < 4; ++i) {
+        const size_t row = y * 4 + i;
+        kernels.threshold(decimated_image + row * decimated_width,
+                          filtered_row,
+                          thresholded_image + row * decimated_width,
+                          decimated_width, min_white_black_diff);
+      }
+
+      previous = current;
+      current = next;
+    }
+  };
+
+  // Strips are numbered so each has its own halo.
+  const size_t strips = StripCount(tile_height, wp);
+  const size_t halo_size = HaloSize(decimated_width);
+  ParallelFor(wp, 0, strips, 1, [&](size_t first, size_t last) {
+    for (size_t strip = first; strip < last; ++strip) {
+      const size_t begin = tile_height * strip / strips;
+      const size_t end = tile_height * (strip + 1) / strips;
+      if (begin < end) {
+        threshold_strip(begin, end, scratch + strip * halo_size);
+      }
+    }
+  });
+
+  // The rows trimmed off the bottom of the decimated image still belong in
+  // the full resolution gray image.
+  for (size_t row = tile_height * tile_rows; row < height; ++row) {
+    kernels.gray(color_image + row * color_step, gray_image + row * width,
+                 width);
+  }
+}
+
+
+}  // namespace
+
+size_t CpuThresholdScratchSize(size_t width, size_t height, size_t decimation,
+                               workerpool_t *wp) {
+  return StripCount(DecimatedSize(height, decimation) / 4, wp) *
+         HaloSize(DecimatedSize(width, decimation));
+}
+
+void CpuToGreyscaleAndDecimate(const uint8_t *color_image, uint8_t *gray_image,
+                               uint8_t *decimated_image,
+                               uint8_t *unfiltered_minmax_image,
+                               uint8_t *minmax_image,
+                               uint8_t *thresholded_image, uint8_t *scratch,
+                               size_t width, size_t height, size_t decimation,
+                               ImageFormat format, size_t min_white_black_diff,
+                               workerpool_t *wp) {
+  CHECK_GE(decimation, 1u);
+  CHECK_LE(decimation, kMaxDecimation);
+  ToGreyscaleAndDecimate(Kernels(format.pixel_format, decimation, true),
+                         color_image, gray_image, decimated_image,
+                         unfiltered_minmax_image, minmax_image,
+                         thresholded_image, scratch, width, height, decimation,
+                         format, min_white_black_diff, wp);
+}
+
+void CpuToGreyscaleAndDecimateScalar(
+    const uint8_t *color_image, uint8_t *gray_image, uint8_t *decimated_image,
+    uint8_t *unfiltered_minmax_image, uint8_t *minmax_image,
+    uint8_t *thresholded_image, uint8_t *scratch, size_t width, size_t height,
+    size_t decimation, ImageFormat format, size_t min_white_black_diff,
+    workerpool_t *wp) {
+  CHECK_GE(decimation, 1u);
+  CHECK_LE(decimation, kMaxDecimation);
+  ToGreyscaleAndDecimate(Kernels(format.pixel_format, decimation, false),
+                         color_image, gray_image, decimated_image,
+                         unfiltered_minmax_image, minmax_image,
+                         thresholded_image, scratch, width, height, decimation,
+                         format, min_white_black_diff, wp);
+}
+
+}  // namespace frc971::apriltag
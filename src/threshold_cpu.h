@@ -0,0 +1,44 @@
+#ifndef FRC971_ORIN_THRESHOLD_CPU_H_
+#define FRC971_ORIN_THRESHOLD_CPU_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "apriltag.h"
+#include "decimation.h"
+#include "pixel_format.h"
+
+namespace frc971::apriltag {
+
+// Host version of CudaToGreyscaleAndDecimateHalide.  Converts to grayscale,
+// decimates, and thresholds an image in a single pass, split into row strips on
+// the worker pool.  Uses AVX2 or NEON when available.  Every output buffer
+// matches the CUDA version byte for byte.  The decimated images are
+// DecimatedSize(width, decimation) x DecimatedSize(height, decimation).
+// scratch holds CpuThresholdScratchSize bytes, so nothing is allocated.
+void CpuToGreyscaleAndDecimate(const uint8_t *color_image, uint8_t *gray_image,
+                               uint8_t *decimated_image,
+                               uint8_t *unfiltered_minmax_image,
+                               uint8_t *minmax_image,
+                               uint8_t *thresholded_image, uint8_t *scratch,
+                               size_t width, size_t height, size_t decimation,
+                               ImageFormat format, size_t min_white_black_diff,
+                               workerpool_t *wp);
+
+// Same as CpuToGreyscaleAndDecimate, but only uses the scalar kernels, so the
+// vector ones can be checked against it.
+void CpuToGreyscaleAndDecimateScalar(
+    const uint8_t *color_image, uint8_t *gray_image, uint8_t *decimated_image,
+    uint8_t *unfiltered_minmax_image, uint8_t *minmax_image,
+    uint8_t *thresholded_image, uint8_t *scratch, size_t width, size_t height,
+    size_t decimation, ImageFormat format, size_t min_white_black_diff,
+    workerpool_t *wp);
+
+// Returns the bytes of scratch CpuToGreyscaleAndDecimate needs for an image
+// of the provided size on wp.
+size_t CpuThresholdScratchSize(size_t width, size_t height, size_t decimation,
+                               workerpool_t *wp);
+
+}  // namespace frc971::apriltag
+
+#endif  // FRC971_ORIN_THRESHOLD_CPU_H_
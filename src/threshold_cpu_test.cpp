@@ -0,0 +1,150 @@
+// threshold_cpu_test.cpp
+#include "threshold_cpu.h"
+
+#include <glog/logging.h>
+#include <gtest/gtest.h>
+
+#include <chrono>
+#include <random>
+#include <vector>
+
+#include "common/workerpool.h"
+
+namespace frc971::apriltag {
+namespace {
+
+constexpr PixelFormat kPixelFormats[] = {
+    PixelFormat::kGray8, PixelFormat::kYuyv, PixelFormat::kUyvy,
+    PixelFormat::kNv12, PixelFormat::kBgr24};
+
+// Every buffer CpuToGreyscaleAndDecimate writes.
+struct ThresholdOutput {
+  ThresholdOutput(size_t width, size_t height, size_t decimation)
+      : gray(width * height),
+        decimated(DecimatedSize(width, decimation) *
+                  DecimatedSize(height, decimation)),
+        unfiltered_minmax(DecimatedSize(width, decimation) / 4 *
+                          (DecimatedSize(height, decimation) / 4) * 2),
+        minmax(unfiltered_minmax.size()),
+        thresholded(decimated.size()) {}
+
+  std::vector<uint8_t> gray;
+  std::vector<uint8_t> decimated;
+  std::vector<uint8_t> unfiltered_minmax;
+  std::vector<uint8_t> minmax;
+  std::vector<uint8_t> thresholded;
+};
+
+constexpr size_t kMinWhiteBlackDiff = 20;
+
+// Fills an image with blocks of noise, some flat and some busy, so tiles land
+// on both sides of kMinWhiteBlackDiff.
+std::vector<uint8_t> MakeImage(size_t stride, size_t height,
+                               std::mt19937 *rng) {
+  constexpr uint32_t kNoise[] = {4, 16, 24, 200};
+  std::vector<uint8_t> image(stride * height);
+  for (size_t y = 0; y < height; ++y) {
+    for (size_t x = 0; x < stride; ++x) {
+      const uint32_t noise = kNoise[(x / 53 + y / 29) % 4];
+      image[y * stride + x] = 40 + (*rng)() % noise;
+    }
+  }
+  return image;
+}
+
+// Tests that the AVX2 or NEON kernels match the scalar ones bit for bit, for
+// every pixel format and decimation, on widths which leave a partial vector at
+// the end of each row.
+TEST(ThresholdCpuTest, VectorKernelsMatchScalar) {
+  std::mt19937 rng(971);
+  workerpool_t *wp = workerpool_create(3);
+  for (PixelFormat pixel_format : kPixelFormats) {
+    for (size_t width : {97u, 250u, 333u, 1283u}) {
+      constexpr size_t kHeight = 67;
+      // Pad the rows too, so the stride isn't a multiple of the vector width.
+      const ImageFormat format = {
+          .pixel_format = pixel_format,
+          .stride = width * BytesPerPixel(pixel_format) + 5};
+      const std::vector<uint8_t> image =
+          MakeImage(RowStride(format, width), kHeight, &rng);
+
+      for (size_t decimation = 1; decimation <= kMaxDecimation;
+           ++decimation) {
+        SCOPED_TRACE(static_cast<int>(pixel_format));
+        SCOPED_TRACE(width);
+        SCOPED_TRACE(decimation);
+        std::vector<uint8_t> scratch(
+            CpuThresholdScratchSize(width, kHeight, decimation, wp));
+
+        ThresholdOutput vector(width, kHeight, decimation);
+        CpuToGreyscaleAndDecimate(
+            image.data(), vector.gray.data(), vector.decimated.data(),
+            vector.unfiltered_minmax.data(), vector.minmax.data(),
+            vector.thresholded.data(), scratch.data(), width, kHeight,
+            decimation, format, kMinWhiteBlackDiff, wp);
+
+        ThresholdOutput scalar(width, kHeight, decimation);
+        CpuToGreyscaleAndDecimateScalar(
+            image.data(), scalar.gray.data(), scalar.decimated.data(),
+            scalar.unfiltered_minmax.data(), scalar.minmax.data(),
+            scalar.thresholded.data(), scratch.data(), width, kHeight,
+            decimation, format, kMinWhiteBlackDiff, wp);
+
+        EXPECT_EQ(vector.gray, scalar.gray);
+        EXPECT_EQ(vector.decimated, scalar.decimated);
+        EXPECT_EQ(vector.unfiltered_minmax, scalar.unfiltered_minmax);
+        EXPECT_EQ(vector.minmax, scalar.minmax);
+        EXPECT_EQ(vector.thresholded, scalar.thresholded);
+      }
+    }
+  }
+  workerpool_destroy(wp);
+}
+
+// Times a 1280x800 YUYV frame at decimation 2 on 3 threads, the camera's usual
+// configuration.  It should take well under a millisecond.  The time is only
+// reported, since it depends on the machine.
+TEST(ThresholdCpuTest, Time1280x800) {
+  constexpr size_t kWidth = 1280;
+  constexpr size_t kHeight = 800;
+  constexpr size_t kDecimation = 2;
+  constexpr int kIterations = 100;
+  std::mt19937 rng(971);
+  workerpool_t *wp = workerpool_create(3);
+  const ImageFormat format = {.pixel_format = PixelFormat::kYuyv};
+  const std::vector<uint8_t> image =
+      MakeImage(RowStride(format, kWidth), kHeight, &rng);
+  std::vector<uint8_t> scratch(
+      CpuThresholdScratchSize(kWidth, kHeight, kDecimation, wp));
+  ThresholdOutput output(kWidth, kHeight, kDecimation);
+
+  auto run = [&]() {
+    CpuToGreyscaleAndDecimate(
+        image.data(), output.gray.data(), output.decimated.data(),
+        output.unfiltered_minmax.data(), output.minmax.data(),
+        output.thresholded.data(), scratch.data(), kWidth, kHeight,
+        kDecimation, format, kMinWhiteBlackDiff, wp);
+  };
+  // Warms up the caches and the pool's threads.
+  run();
+  const auto start = std::chrono::steady_clock::now();
+  for (int i = 0; i < kIterations; ++i) {
+    run();
+  }
+  const double ms = std::chrono::duration<double, std::milli>(
+                        std::chrono::steady_clock::now() - start)
+                        .count() /
+                    kIterations;
+  LOG(INFO) << "1280x800 YUYV threshold: " << ms << " ms";
+  RecordProperty("threshold_1280x800_us", static_cast<int>(ms * 1000));
+  workerpool_destroy(wp);
+}
+
+}  // namespace
+}  // namespace frc971::apriltag
+
+int main(int argc, char **argv) {
+  ::testing::InitGoogleTest(&argc, argv);
+  google::InitGoogleLogging(argv[0]);
+  return RUN_ALL_TESTS();
+}
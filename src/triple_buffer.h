@@ -0,0 +1,102 @@
+#ifndef FRC971_ORIN_TRIPLE_BUFFER_H_
+#define FRC971_ORIN_TRIPLE_BUFFER_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <array>
+#include <atomic>
+
+namespace frc971::apriltag {
+
+// Hands the newest item from a single producer to a single consumer, dropping
+// whatever the consumer didn't get to in time.  Unlike SpscQueue, the consumer
+// only ever sees the latest item and the producer never waits, which is what a
+// camera feeding a slower detector wants: a skipped frame is better than a
+// stale one.
+//
+// There are three preallocated items.  The producer fills in one, the
+// consumer reads another, and the third holds the newest finished item.
+// Publishing and taking swap a slot with that middle one, so neither side ever
+// waits on the other.  Items are reused, so anything they own, like image
+// buffers, isn't reallocated.
+template <typename T>
+class TripleBuffer {
+ public:
+  TripleBuffer() = default;
+
+  TripleBuffer(const TripleBuffer &) = delete;
+  TripleBuffer &operator=(const TripleBuffer &) = delete;
+
+  // Producer side.  Returns the slot to fill in next.  It still holds
+  // whatever was last in it.
+  T *BeginWrite() { return &items_[back_]; }
+
+  // Makes the slot from BeginWrite the newest item.  If the consumer hasn't
+  // taken the one before it, that one is dropped.
+  void EndWrite() {
+    uint32_t state = state_.load(std::memory_order_relaxed);
+    while (!state_.compare_exchange_weak(
+        state, back_ | kFresh | (state & kClosed), std::memory_order_acq_rel,
+        std::memory_order_relaxed)) {
+    }
+    if (state & kFresh) {
+      dropped_.fetch_add(1, std::memory_order_relaxed);
+    }
+    back_ = state & kIndexMask;
+    state_.notify_one();
+  }
+
+  // Consumer side.  Waits for an item newer than the last one taken and
+  // returns it, or returns nullptr once closed.  The item is the consumer's
+  // until the next call.
+  T *Take() {
+    uint32_t state = state_.load(std::memory_order_acquire);
+    while (true) {
+      if (state & kClosed) {
+        return nullptr;
+      }
+      if (!(state & kFresh)) {
+        state_.wait(state, std::memory_order_acquire);
+        state = state_.load(std::memory_order_acquire);
+        continue;
+      }
+      if (state_.compare_exchange_weak(state, front_,
+                                       std::memory_order_acq_rel,
+                                       std::memory_order_acquire)) {
+        front_ = state & kIndexMask;
+        return &items_[front_];
+      }
+    }
+  }
+
+  // Wakes up the consumer and makes every later Take return nullptr.  Can be
+  // called from any thread.
+  void Close() {
+    state_.fetch_or(kClosed, std::memory_order_acq_rel);
+    state_.notify_all();
+  }
+
+  // Items replaced before the consumer took them.
+  size_t dropped() const { return dropped_.load(std::memory_order_relaxed); }
+
+ private:
+  // state_ holds the index of the middle item, whether it is newer than the
+  // consumer's, and whether the buffer is closed.
+  static constexpr uint32_t kIndexMask = 3;
+  static constexpr uint32_t kFresh = 4;
+  static constexpr uint32_t kClosed = 8;
+
+  std::array<T, 3> items_;
+
+  // Owned by the producer and consumer respectively.
+  uint32_t back_ = 0;
+  uint32_t front_ = 1;
+
+  alignas(64) std::atomic<uint32_t> state_{2};
+  alignas(64) std::atomic<size_t> dropped_{0};
+};
+
+}  // namespace frc971::apriltag
+
+#endif  // FRC971_ORIN_TRIPLE_BUFFER_H_
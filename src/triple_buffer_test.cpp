@@ -0,0 +1,83 @@
+// triple_buffer_test.cpp
+#include "triple_buffer.h"
+
+#include <glog/logging.h>
+#include <gtest/gtest.h>
+
+#include <chrono>
+#include <thread>
+#include <vector>
+
+namespace frc971::apriltag {
+namespace {
+
+// Tests that only the newest item is taken, and that the ones it replaced are
+// counted as dropped.
+TEST(TripleBufferTest, TakesNewest) {
+  TripleBuffer<std::vector<int>> buffer;
+  for (int i = 0; i < 3; ++i) {
+    buffer.BeginWrite()->assign(10, i);
+    buffer.EndWrite();
+  }
+  EXPECT_EQ(buffer.dropped(), 2u);
+
+  std::vector<int> *item = buffer.Take();
+  ASSERT_NE(item, nullptr);
+  EXPECT_EQ((*item)[0], 2);
+
+  // The consumer's item stays put while the producer keeps going.
+  for (int i = 3; i < 6; ++i) {
+    std::vector<int> *slot = buffer.BeginWrite();
+    EXPECT_NE(slot, item);
+    slot->assign(10, i);
+    buffer.EndWrite();
+  }
+  EXPECT_EQ((*item)[0], 2);
+  EXPECT_EQ((*buffer.Take())[0], 5);
+  EXPECT_EQ(buffer.dropped(), 4u);
+}
+
+// Tests that the consumer never sees an item twice or goes backwards, with the
+// producer running flat out on another thread.
+TEST(TripleBufferTest, NewerAcrossThreads) {
+  constexpr int kItems = 200000;
+  TripleBuffer<std::vector<int>> buffer;
+
+  std::thread producer([&]() {
+    for (int i = 0; i < kItems; ++i) {
+      buffer.BeginWrite()->assign({i, i + 1});
+      buffer.EndWrite();
+    }
+    buffer.Close();
+  });
+
+  int last = -1;
+  int taken = 0;
+  while (std::vector<int> *item = buffer.Take()) {
+    ASSERT_EQ(item->size(), 2u);
+    ASSERT_GT((*item)[0], last);
+    ASSERT_EQ((*item)[1], (*item)[0] + 1);
+    last = (*item)[0];
+    ++taken;
+  }
+  producer.join();
+  EXPECT_LE(taken + buffer.dropped(), static_cast<size_t>(kItems));
+}
+
+// Tests that closing wakes up a consumer waiting for an item.
+TEST(TripleBufferTest, CloseWakesConsumer) {
+  TripleBuffer<int> buffer;
+  std::thread consumer([&]() { EXPECT_EQ(buffer.Take(), nullptr); });
+  std::this_thread::sleep_for(std::chrono::milliseconds(20));
+  buffer.Close();
+  consumer.join();
+}
+
+}  // namespace
+}  // namespace frc971::apriltag
+
+int main(int argc, char **argv) {
+  ::testing::InitGoogleTest(&argc, argv);
+  google::InitGoogleLogging(argv[0]);
+  return RUN_ALL_TESTS();
+}
@@ -0,0 +1,211 @@
+#include "undistort_map.h"
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include <sstream>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define FRC971_UNDISTORT_AVX2
+#endif
+
+#include "glog/logging.h"
+
+namespace frc971::apriltag {
+namespace {
+
+// Bilinearly interpolates between the 4 nodes of table starting at index, with
+// stride nodes per row.
+double Bilinear(const float *table, size_t index, size_t stride, double fx,
+                double fy) {
+  const double d00 = table[index];
+  const double d01 = table[index + 1];
+  const double d10 = table[index + stride];
+  const double d11 = table[index + stride + 1];
+  const double top = d00 + fx * (d01 - d00);
+  const double bottom = d10 + fx * (d11 - d10);
+  return top + fy * (bottom - top);
+}
+
+#ifdef FRC971_UNDISTORT_AVX2
+
+#define FRC971_AVX2_TARGET __attribute__((target("avx2")))
+
+// Same as Bilinear, for 4 points at a time.
+FRC971_AVX2_TARGET __m256d Avx2Bilinear(const float *table, __m128i index,
+                                        int32_t stride, __m256d fx,
+                                        __m256d fy) {
+  const __m256d d00 = _mm256_cvtps_pd(_mm_i32gather_ps(table, index, 4));
+  const __m256d d01 = _mm256_cvtps_pd(_mm_i32gather_ps(table + 1, index, 4));
+  const __m256d d10 =
+      _mm256_cvtps_pd(_mm_i32gather_ps(table + stride, index, 4));
+  const __m256d d11 =
+      _mm256_cvtps_pd(_mm_i32gather_ps(table + stride + 1, index, 4));
+  const __m256d top =
+      _mm256_add_pd(d00, _mm256_mul_pd(fx, _mm256_sub_pd(d01, d00)));
+  const __m256d bottom =
+      _mm256_add_pd(d10, _mm256_mul_pd(fx, _mm256_sub_pd(d11, d10)));
+  return _mm256_add_pd(top, _mm256_mul_pd(fy, _mm256_sub_pd(bottom, top)));
+}
+
+#endif  // FRC971_UNDISTORT_AVX2
+
+}  // namespace
+
+UndistortMap::UndistortMap(size_t width, size_t height,
+                           const CameraMatrix &camera_matrix,
+                           const DistCoeffs &distortion_coefficients,
+                           size_t step)
+    : camera_matrix_(camera_matrix),
+      distortion_coefficients_(distortion_coefficients),
+      step_(step),
+      inverse_step_(1.0 / step),
+      node_cols_((width + step - 1) / step + 1),
+      node_rows_((height + step - 1) / step + 1) {
+  CHECK_GE(step, 1u);
+  // The AVX2 path gathers with 32 bit indices.
+  CHECK_LT(node_cols_ * node_rows_,
+           static_cast<size_t>(std::numeric_limits<int32_t>::max()));
+
+  dx_.resize(node_cols_ * node_rows_);
+  dy_.resize(node_cols_ * node_rows_);
+  for (size_t row = 0; row < node_rows_; ++row) {
+    for (size_t col = 0; col < node_cols_; ++col) {
+      const double x = static_cast<double>(col * step_);
+      const double y = static_cast<double>(row * step_);
+      double u = x;
+      double v = y;
+      if (!DetectorBackend::UnDistort(&u, &v, &camera_matrix_,
+                                      &distortion_coefficients_)) {
+        ++unconverged_nodes_;
+      }
+      dx_[row * node_cols_ + col] = u - x;
+      dy_[row * node_cols_ + col] = v - y;
+    }
+  }
+
+#ifdef FRC971_UNDISTORT_AVX2
+  use_avx2_ = __builtin_cpu_supports("avx2");
+#endif
+}
+
+void UndistortMap::Undistort(double *u, double *v, size_t n) const {
+#ifdef FRC971_UNDISTORT_AVX2
+  if (use_avx2_) {
+    Avx2Undistort(u, v, n);
+    return;
+  }
+#endif
+  UndistortScalar(u, v, 0, n);
+}
+
+void UndistortMap::UndistortScalar(double *u, double *v, size_t begin,
+                                   size_t end) const {
+  const double max_gx = node_cols_ - 1;
+  const double max_gy = node_rows_ - 1;
+  for (size_t i = begin; i < end; ++i) {
+    const double gx = u[i] * inverse_step_;
+    const double gy = v[i] * inverse_step_;
+    // Written so NaN falls back too.
+    if (!(gx >= 0.0 && gx < max_gx && gy >= 0.0 && gy < max_gy)) {
+      DetectorBackend::UnDistort(u + i, v + i, &camera_matrix_,
+                                 &distortion_coefficients_);
+      continue;
+    }
+
+    const size_t col = static_cast<size_t>(gx);
+    const size_t row = static_cast<size_t>(gy);
+    const double fx = gx - col;
+    const double fy = gy - row;
+    const size_t index = row * node_cols_ + col;
+    u[i] += Bilinear(dx_.data(), index, node_cols_, fx, fy);
+    v[i] += Bilinear(dy_.data(), index, node_cols_, fx, fy);
+  }
+}
+
+#ifdef FRC971_UNDISTORT_AVX2
+
+FRC971_AVX2_TARGET void UndistortMap::Avx2Undistort(double *u, double *v,
+                                                    size_t n) const {
+  const __m256d inverse_step = _mm256_set1_pd(inverse_step_);
+  const __m256d zero = _mm256_setzero_pd();
+  const __m256d max_gx = _mm256_set1_pd(node_cols_ - 1);
+  const __m256d max_gy = _mm256_set1_pd(node_rows_ - 1);
+  const int32_t stride = node_cols_;
+  const __m128i stride4 = _mm_set1_epi32(stride);
+
+  size_t i = 0;
+  for (; i + 4 <= n; i += 4) {
+    const __m256d u4 = _mm256_loadu_pd(u + i);
+    const __m256d v4 = _mm256_loadu_pd(v + i);
+    const __m256d gx = _mm256_mul_pd(u4, inverse_step);
+    const __m256d gy = _mm256_mul_pd(v4, inverse_step);
+
+    // Ordered compares are false for NaN, so those fall back too.
+    const __m256d on_grid = _mm256_and_pd(
+        _mm256_and_pd(_mm256_cmp_pd(gx, zero, _CMP_GE_OQ),
+                      _mm256_cmp_pd(gx, max_gx, _CMP_LT_OQ)),
+        _mm256_and_pd(_mm256_cmp_pd(gy, zero, _CMP_GE_OQ),
+                      _mm256_cmp_pd(gy, max_gy, _CMP_LT_OQ)));
+    if (_mm256_movemask_pd(on_grid) != 0xf) {
+      UndistortScalar(u, v, i, i + 4);
+      continue;
+    }
+
+    // Everything is positive, so truncating is the floor.
+    const __m128i col = _mm256_cvttpd_epi32(gx);
+    const __m128i row = _mm256_cvttpd_epi32(gy);
+    const __m256d fx = _mm256_sub_pd(gx, _mm256_cvtepi32_pd(col));
+    const __m256d fy = _mm256_sub_pd(gy, _mm256_cvtepi32_pd(row));
+    const __m128i index = _mm_add_epi32(_mm_mullo_epi32(row, stride4), col);
+
+    _mm256_storeu_pd(
+        u + i,
+        _mm256_add_pd(u4, Avx2Bilinear(dx_.data(), index, stride, fx, fy)));
+    _mm256_storeu_pd(
+        v + i,
+        _mm256_add_pd(v4, Avx2Bilinear(dy_.data(), index, stride, fx, fy)));
+  }
+  UndistortScalar(u, v, i, n);
+}
+
+#undef FRC971_AVX2_TARGET
+
+#endif  // FRC971_UNDISTORT_AVX2
+
+UndistortMap::Accuracy UndistortMap::MeasureAccuracy() const {
+  Accuracy accuracy;
+  accuracy.unconverged_nodes = unconverged_nodes_;
+  double total_error = 0.0;
+  for (size_t row = 0; row + 1 < node_rows_; ++row) {
+    for (size_t col = 0; col + 1 < node_cols_; ++col) {
+      double map_u = (col + 0.5) * step_;
+      double map_v = (row + 0.5) * step_;
+      double solver_u = map_u;
+      double solver_v = map_v;
+      UndistortScalar(&map_u, &map_v, 0, 1);
+      DetectorBackend::UnDistort(&solver_u, &solver_v, &camera_matrix_,
+                                 &distortion_coefficients_);
+
+      const double error = std::hypot(map_u - solver_u, map_v - solver_v);
+      accuracy.max_error = std::max(accuracy.max_error, error);
+      total_error += error;
+      ++accuracy.samples;
+    }
+  }
+  if (accuracy.samples > 0) {
+    accuracy.mean_error = total_error / accuracy.samples;
+  }
+  return accuracy;
+}
+
+std::string UndistortMap::Accuracy::ToString() const {
+  std::ostringstream os;
+  os << "max error " << max_error << " px, mean error " << mean_error
+     << " px over " << samples << " points, " << unconverged_nodes
+     << " unconverged nodes";
+  return os.str();
+}
+
+}  // namespace frc971::apriltag
@@ -0,0 +1,80 @@
+#ifndef FRC971_ORIN_UNDISTORT_MAP_H_
+#define FRC971_ORIN_UNDISTORT_MAP_H_
+
+#include <stddef.h>
+
+#include <string>
+#include <vector>
+
+#include "detector_backend.h"
+
+namespace frc971::apriltag {
+
+// Lookup table standing in for DetectorBackend::UnDistort.  The iterative
+// solver is run once for each node of a grid spaced step pixels apart over the
+// image, and points are undistorted by bilinearly interpolating the correction
+// at the 4 surrounding nodes.  Points off the grid fall back to the solver.
+class UndistortMap {
+ public:
+  // Default spacing between nodes in pixels.
+  static constexpr size_t kDefaultStep = 4;
+
+  UndistortMap(size_t width, size_t height, const CameraMatrix &camera_matrix,
+               const DistCoeffs &distortion_coefficients,
+               size_t step = kDefaultStep);
+
+  // Undistorts the n points (u[i], v[i]) in place.
+  void Undistort(double *u, double *v, size_t n) const;
+
+  // How far the map is from the iterative solver.
+  struct Accuracy {
+    // Distance between the two in pixels.
+    double max_error = 0.0;
+    double mean_error = 0.0;
+    // Number of points compared.
+    size_t samples = 0;
+    // Number of nodes the solver didn't converge for.
+    size_t unconverged_nodes = 0;
+
+    std::string ToString() const;
+  };
+
+  // Compares the map to the solver at the center of every cell, which is
+  // where the interpolation is furthest from the nodes.
+  Accuracy MeasureAccuracy() const;
+
+  size_t step() const { return step_; }
+
+ private:
+  // Undistorts points [begin, end) one at a time.
+  void UndistortScalar(double *u, double *v, size_t begin, size_t end) const;
+
+#if defined(__x86_64__) || defined(__i386__)
+  // Undistorts 4 points at a time with AVX2 gathers.
+  void Avx2Undistort(double *u, double *v, size_t n) const;
+#endif
+
+  CameraMatrix camera_matrix_;
+  DistCoeffs distortion_coefficients_;
+
+  size_t step_;
+  double inverse_step_;
+
+  // Number of nodes along each axis.  Points are on the grid if their
+  // coordinates divided by step are in [0, node_cols_ - 1) and
+  // [0, node_rows_ - 1).
+  size_t node_cols_;
+  size_t node_rows_;
+
+  // Undistorted minus distorted coordinates at each node, row major.
+  std::vector<float> dx_;
+  std::vector<float> dy_;
+
+  size_t unconverged_nodes_ = 0;
+
+  bool use_avx2_ = false;
+};
+
+}  // namespace frc971::apriltag
+
+#endif  // FRC971_ORIN_UNDISTORT_MAP_H_
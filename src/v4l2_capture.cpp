@@ -0,0 +1,297 @@
+#include "v4l2_capture.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/videodev2.h>
+#include <poll.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <utility>
+
+#include "glog/logging.h"
+
+namespace frc971::apriltag {
+namespace {
+
+// A device node opened non-blocking, so VIDIOC_DQBUF never waits and
+// WaitReadable can time out.
+class FileV4l2Device : public V4l2Device {
+ public:
+  explicit FileV4l2Device(int fd) : fd_(fd) {}
+  ~FileV4l2Device() override { close(fd_); }
+
+  int Ioctl(unsigned long request, void *arg) override {
+    int result;
+    do {
+      result = ioctl(fd_, request, arg);
+    } while (result == -1 && errno == EINTR);
+    return result;
+  }
+
+  void *Mmap(size_t length, off_t offset) override {
+    return mmap(nullptr, length, PROT_READ | PROT_WRITE, MAP_SHARED, fd_,
+                offset);
+  }
+
+  void Munmap(void *address, size_t length) override {
+    munmap(address, length);
+  }
+
+  bool WaitReadable(std::chrono::milliseconds timeout) override {
+    pollfd p = {.fd = fd_, .events = POLLIN, .revents = 0};
+    int result;
+    do {
+      result = poll(&p, 1, timeout.count());
+    } while (result == -1 && errno == EINTR);
+    return result > 0;
+  }
+
+ private:
+  const int fd_;
+};
+
+uint32_t FourCc(PixelFormat pixel_format) {
+  switch (pixel_format) {
+    case PixelFormat::kGray8:
+      return V4L2_PIX_FMT_GREY;
+    case PixelFormat::kYuyv:
+      return V4L2_PIX_FMT_YUYV;
+    case PixelFormat::kUyvy:
+      return V4L2_PIX_FMT_UYVY;
+    case PixelFormat::kNv12:
+      return V4L2_PIX_FMT_NV12;
+    case PixelFormat::kBgr24:
+      return V4L2_PIX_FMT_BGR24;
+  }
+  return 0;
+}
+
+std::string FourCcName(uint32_t fourcc) {
+  return std::string{static_cast<char>(fourcc & 0xff),
+                     static_cast<char>((fourcc >> 8) & 0xff),
+                     static_cast<char>((fourcc >> 16) & 0xff),
+                     static_cast<char>((fourcc >> 24) & 0xff)};
+}
+
+}  // namespace
+
+std::unique_ptr<V4l2Device> OpenV4l2Device(const std::string &path) {
+  const int fd = open(path.c_str(), O_RDWR | O_NONBLOCK | O_CLOEXEC);
+  if (fd == -1) {
+    PLOG(ERROR) << "Unable to open " << path;
+    return nullptr;
+  }
+  return std::make_unique<FileV4l2Device>(fd);
+}
+
+V4l2Capture::V4l2Capture(std::unique_ptr<V4l2Device> device)
+    : device_(std::move(device)) {}
+
+std::unique_ptr<V4l2Capture> V4l2Capture::Start(
+    std::unique_ptr<V4l2Device> device, const Options &options) {
+  CHECK(device != nullptr);
+  std::unique_ptr<V4l2Capture> capture(new V4l2Capture(std::move(device)));
+  if (!capture->Setup(options)) {
+    return nullptr;
+  }
+  return capture;
+}
+
+bool V4l2Capture::Setup(const Options &options) {
+  CHECK_GT(options.buffers, 0u);
+  timeout_ = options.timeout;
+
+  const uint32_t fourcc =
+      options.mjpeg ? V4L2_PIX_FMT_MJPEG : FourCc(options.pixel_format);
+  v4l2_format format;
+  memset(&format, 0, sizeof(format));
+  format.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+  format.fmt.pix.width = options.width;
+  format.fmt.pix.height = options.height;
+  format.fmt.pix.pixelformat = fourcc;
+  format.fmt.pix.field = V4L2_FIELD_NONE;
+  if (device_->Ioctl(VIDIOC_S_FMT, &format) == -1) {
+    PLOG(ERROR) << "VIDIOC_S_FMT failed";
+    return false;
+  }
+  // Drivers pick the closest format they support instead of failing.
+  if (format.fmt.pix.pixelformat != fourcc) {
+    LOG(ERROR) << "Device can't capture " << FourCcName(fourcc) << ", only "
+               << FourCcName(format.fmt.pix.pixelformat);
+    return false;
+  }
+  mjpeg_ = options.mjpeg;
+  width_ = format.fmt.pix.width;
+  height_ = format.fmt.pix.height;
+  format_ = ImageFormat{.pixel_format = options.pixel_format,
+                        .stride = format.fmt.pix.bytesperline};
+  if (width_ != options.width || height_ != options.height) {
+    LOG(WARNING) << "Asked for " << options.width << "x" << options.height
+                 << ", capturing " << width_ << "x" << height_;
+  }
+
+  v4l2_streamparm parm;
+  memset(&parm, 0, sizeof(parm));
+  parm.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+  parm.parm.capture.timeperframe.numerator = 1;
+  parm.parm.capture.timeperframe.denominator = options.fps;
+  if (device_->Ioctl(VIDIOC_S_PARM, &parm) == -1) {
+    PLOG(WARNING) << "Unable to set the frame rate to " << options.fps;
+  }
+
+  v4l2_requestbuffers request;
+  memset(&request, 0, sizeof(request));
+  request.count = options.buffers;
+  request.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+  request.memory = V4L2_MEMORY_MMAP;
+  if (device_->Ioctl(VIDIOC_REQBUFS, &request) == -1) {
+    PLOG(ERROR) << "Device can't stream from mmap'd buffers";
+    return false;
+  }
+  if (request.count < 2) {
+    LOG(ERROR) << "Device only gave us " << request.count << " buffers";
+    return false;
+  }
+
+  for (uint32_t i = 0; i < request.count; ++i) {
+    v4l2_buffer buffer;
+    memset(&buffer, 0, sizeof(buffer));
+    buffer.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    buffer.memory = V4L2_MEMORY_MMAP;
+    buffer.index = i;
+    if (device_->Ioctl(VIDIOC_QUERYBUF, &buffer) == -1) {
+      PLOG(ERROR) << "VIDIOC_QUERYBUF failed for buffer " << i;
+      return false;
+    }
+    void *start = device_->Mmap(buffer.length, buffer.m.offset);
+    if (start == MAP_FAILED) {
+      PLOG(ERROR) << "Unable to map buffer " << i;
+      return false;
+    }
+    buffers_.push_back(Buffer{.start = start, .length = buffer.length});
+  }
+  for (size_t i = 0; i < buffers_.size(); ++i) {
+    if (!Queue(i)) {
+      return false;
+    }
+  }
+
+  v4l2_buf_type type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+  if (device_->Ioctl(VIDIOC_STREAMON, &type) == -1) {
+    PLOG(ERROR) << "VIDIOC_STREAMON failed";
+    return false;
+  }
+  streaming_ = true;
+  return true;
+}
+
+V4l2Capture::~V4l2Capture() {
+  if (streaming_) {
+    v4l2_buf_type type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    if (device_->Ioctl(VIDIOC_STREAMOFF, &type) == -1) {
+      PLOG(WARNING) << "VIDIOC_STREAMOFF failed";
+    }
+  }
+  for (const Buffer &buffer : buffers_) {
+    device_->Munmap(buffer.start, buffer.length);
+  }
+  if (!buffers_.empty()) {
+    v4l2_requestbuffers request;
+    memset(&request, 0, sizeof(request));
+    request.count = 0;
+    request.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    request.memory = V4L2_MEMORY_MMAP;
+    device_->Ioctl(VIDIOC_REQBUFS, &request);
+  }
+}
+
+bool V4l2Capture::SetControl(uint32_t id, int32_t value) {
+  v4l2_control control = {.id = id, .value = value};
+  if (device_->Ioctl(VIDIOC_S_CTRL, &control) == -1) {
+    PLOG(WARNING) << "Unable to set control " << id << " to " << value;
+    return false;
+  }
+  return true;
+}
+
+bool V4l2Capture::Queue(int index) {
+  v4l2_buffer buffer;
+  memset(&buffer, 0, sizeof(buffer));
+  buffer.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+  buffer.memory = V4L2_MEMORY_MMAP;
+  buffer.index = index;
+  if (device_->Ioctl(VIDIOC_QBUF, &buffer) == -1) {
+    PLOG(ERROR) << "VIDIOC_QBUF failed for buffer " << index;
+    return false;
+  }
+  return true;
+}
+
+bool V4l2Capture::Dequeue(std::chrono::milliseconds timeout,
+                          CapturedFrame *frame) {
+  const auto deadline = std::chrono::steady_clock::now() + timeout;
+  while (true) {
+    const auto remaining =
+        std::chrono::duration_cast<std::chrono::milliseconds>(
+            deadline - std::chrono::steady_clock::now());
+    if (!device_->WaitReadable(std::max(remaining, timeout.zero()))) {
+      return false;
+    }
+
+    v4l2_buffer buffer;
+    memset(&buffer, 0, sizeof(buffer));
+    buffer.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    buffer.memory = V4L2_MEMORY_MMAP;
+    if (device_->Ioctl(VIDIOC_DQBUF, &buffer) == -1) {
+      if (errno == EAGAIN) {
+        continue;
+      }
+      PLOG(ERROR) << "VIDIOC_DQBUF failed";
+      return false;
+    }
+
+    if (have_sequence_) {
+      dropped_ += buffer.sequence - last_sequence_ - 1;
+    }
+    have_sequence_ = true;
+    last_sequence_ = buffer.sequence;
+
+    // A frame the driver knows is torn isn't worth detecting on.
+    if (buffer.flags & V4L2_BUF_FLAG_ERROR) {
+      ++dropped_;
+      Queue(buffer.index);
+      continue;
+    }
+
+    frame->data = static_cast<const uint8_t *>(buffers_[buffer.index].start);
+    frame->bytes = buffer.bytesused;
+    frame->width = width_;
+    frame->height = height_;
+    frame->format = format_;
+    if ((buffer.flags & V4L2_BUF_FLAG_TIMESTAMP_MASK) ==
+        V4L2_BUF_FLAG_TIMESTAMP_MONOTONIC) {
+      // CLOCK_MONOTONIC, which is what steady_clock reads on Linux.
+      frame->timestamp = std::chrono::steady_clock::time_point(
+          std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+              std::chrono::seconds(buffer.timestamp.tv_sec) +
+              std::chrono::microseconds(buffer.timestamp.tv_usec)));
+    } else {
+      frame->timestamp = std::chrono::steady_clock::now();
+    }
+    frame->sequence = buffer.sequence;
+    frame->buffer = buffer.index;
+    return true;
+  }
+}
+
+void V4l2Capture::Requeue(const CapturedFrame &frame) {
+  CHECK_GE(frame.buffer, 0);
+  CHECK_LT(static_cast<size_t>(frame.buffer), buffers_.size());
+  Queue(frame.buffer);
+}
+
+}  // namespace frc971::apriltag
@@ -0,0 +1,126 @@
+#ifndef FRC971_ORIN_V4L2_CAPTURE_H_
+#define FRC971_ORIN_V4L2_CAPTURE_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#include <chrono>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "frame_source.h"
+#include "pixel_format.h"
+
+namespace frc971::apriltag {
+
+// The calls V4l2Capture makes on a video device.  Split out so tests can stand
+// in for the driver.
+class V4l2Device {
+ public:
+  virtual ~V4l2Device() = default;
+
+  // ioctl(2).  Returns -1 and sets errno on failure.
+  virtual int Ioctl(unsigned long request, void *arg) = 0;
+  // Maps a driver buffer.  Returns MAP_FAILED on failure.
+  virtual void *Mmap(size_t length, off_t offset) = 0;
+  virtual void Munmap(void *address, size_t length) = 0;
+  // Waits up to timeout for a buffer to be ready to dequeue.  Returns false on
+  // timeout.
+  virtual bool WaitReadable(std::chrono::milliseconds timeout) = 0;
+};
+
+// Opens a device node like /dev/video0.  Returns nullptr if it can't be
+// opened.
+std::unique_ptr<V4l2Device> OpenV4l2Device(const std::string &path);
+
+// Captures from a V4L2 device through mmap'd driver buffers.  Frames are
+// handed out in place, so the detector reads the pixels the camera wrote
+// without a copy or color conversion, and each frame carries the kernel's
+// monotonic capture timestamp instead of the time it was read.
+class V4l2Capture : public FrameSource {
+ public:
+  struct Options {
+    size_t width = 1280;
+    size_t height = 800;
+    // The device has to capture in this format itself.  Nothing is converted.
+    PixelFormat pixel_format = PixelFormat::kYuyv;
+    // Capture MJPEG instead of pixel_format.  Each frame is then a JPEG of
+    // frame.bytes bytes, for a JpegDecoder, and its format doesn't apply.
+    bool mjpeg = false;
+    int fps = 30;
+    // Driver buffers to cycle through.  Frames the caller is holding on to
+    // can't be captured into, so this wants to be a couple more than that.
+    size_t buffers = 4;
+    // How long Next waits for a frame.
+    std::chrono::milliseconds timeout = std::chrono::seconds(1);
+  };
+
+  // Negotiates the format, maps the buffers and starts streaming.  Returns
+  // nullptr if the device can't capture in the requested pixel format.  The
+  // driver may pick a different size, see width() and height().
+  static std::unique_ptr<V4l2Capture> Start(std::unique_ptr<V4l2Device> device,
+                                            const Options &options);
+
+  ~V4l2Capture() override;
+
+  V4l2Capture(const V4l2Capture &) = delete;
+  V4l2Capture &operator=(const V4l2Capture &) = delete;
+
+  // Waits up to timeout for the next frame.  The frame is the caller's until
+  // it is passed to Requeue.  Returns false on timeout or error.
+  bool Dequeue(std::chrono::milliseconds timeout, CapturedFrame *frame);
+
+  // Hands the frame's buffer back to the driver to capture into.
+  void Requeue(const CapturedFrame &frame);
+
+  bool Next(CapturedFrame *frame) override {
+    return Dequeue(timeout_, frame);
+  }
+  void Release(const CapturedFrame &frame) override { Requeue(frame); }
+
+  // Sets a V4L2_CID_* control, like the exposure.  Returns false if the
+  // device refused.
+  bool SetControl(uint32_t id, int32_t value);
+
+  size_t width() const override { return width_; }
+  size_t height() const override { return height_; }
+  ImageFormat format() const override { return format_; }
+  size_t buffers() const { return buffers_.size(); }
+  bool mjpeg() const { return mjpeg_; }
+
+  // Frames the driver dropped or flagged as corrupt.
+  size_t dropped() const override { return dropped_; }
+
+ private:
+  struct Buffer {
+    void *start;
+    size_t length;
+  };
+
+  explicit V4l2Capture(std::unique_ptr<V4l2Device> device);
+
+  bool Setup(const Options &options);
+
+  // Hands buffer index back to the driver.
+  bool Queue(int index);
+
+  std::unique_ptr<V4l2Device> device_;
+  std::vector<Buffer> buffers_;
+  bool streaming_ = false;
+  std::chrono::milliseconds timeout_;
+
+  size_t width_ = 0;
+  size_t height_ = 0;
+  ImageFormat format_;
+  bool mjpeg_ = false;
+
+  bool have_sequence_ = false;
+  uint32_t last_sequence_ = 0;
+  size_t dropped_ = 0;
+};
+
+}  // namespace frc971::apriltag
+
+#endif  // FRC971_ORIN_V4L2_CAPTURE_H_
@@ -0,0 +1,373 @@
+// v4l2_capture_test.cpp
+#include "v4l2_capture.h"
+
+#include <errno.h>
+#include <glog/logging.h>
+#include <gtest/gtest.h>
+#include <linux/videodev2.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <deque>
+#include <map>
+#include <set>
+#include <string>
+#include <vector>
+
+namespace frc971::apriltag {
+namespace {
+
+// Stands in for a capture driver.  Frames are "captured" as they are
+// dequeued, each row of luma filled with (frame + row) & 0xff.
+class FakeDriver {
+ public:
+  static constexpr size_t kMaxBuffers = 8;
+  static constexpr size_t kPadding = 32;
+  static constexpr off_t kOffsetStep = 1 << 20;
+
+  explicit FakeDriver(std::set<uint32_t> fourccs) : fourccs_(fourccs) {}
+
+  int Ioctl(unsigned long request, void *arg) {
+    switch (request) {
+      case VIDIOC_S_FMT: {
+        v4l2_pix_format *pix = &static_cast<v4l2_format *>(arg)->fmt.pix;
+        if (!fourccs_.contains(pix->pixelformat)) {
+          pix->pixelformat = *fourccs_.begin();
+        }
+        pix->width = std::min<uint32_t>(pix->width & ~1u, 640);
+        pix->height = std::min<uint32_t>(pix->height, 480);
+        bytes_per_pixel_ = pix->pixelformat == V4L2_PIX_FMT_GREY ? 1 : 2;
+        pix->bytesperline = pix->width * bytes_per_pixel_ + kPadding;
+        pix->sizeimage = pix->bytesperline * pix->height;
+        format_ = *pix;
+        return 0;
+      }
+      case VIDIOC_S_PARM:
+        return 0;
+      case VIDIOC_REQBUFS: {
+        v4l2_requestbuffers *request = static_cast<v4l2_requestbuffers *>(arg);
+        if (streaming_ || mapped_ != 0) {
+          errno = EBUSY;
+          return -1;
+        }
+        request->count = std::min(request->count, uint32_t{kMaxBuffers});
+        buffers_.assign(request->count,
+                        std::vector<uint8_t>(format_.sizeimage, 0));
+        return 0;
+      }
+      case VIDIOC_QUERYBUF: {
+        v4l2_buffer *buffer = static_cast<v4l2_buffer *>(arg);
+        if (buffer->index >= buffers_.size()) {
+          errno = EINVAL;
+          return -1;
+        }
+        buffer->length = buffers_[buffer->index].size();
+        buffer->m.offset = buffer->index * kOffsetStep;
+        return 0;
+      }
+      case VIDIOC_QBUF: {
+        const uint32_t index = static_cast<v4l2_buffer *>(arg)->index;
+        if (index >= buffers_.size() ||
+            std::find(queued_.begin(), queued_.end(), index) !=
+                queued_.end()) {
+          errno = EINVAL;
+          return -1;
+        }
+        queued_.push_back(index);
+        return 0;
+      }
+      case VIDIOC_DQBUF:
+        return Capture(static_cast<v4l2_buffer *>(arg));
+      case VIDIOC_STREAMON:
+        streaming_ = true;
+        return 0;
+      case VIDIOC_STREAMOFF:
+        streaming_ = false;
+        queued_.clear();
+        return 0;
+      case VIDIOC_S_CTRL: {
+        const v4l2_control *control = static_cast<v4l2_control *>(arg);
+        controls_[control->id] = control->value;
+        return 0;
+      }
+    }
+    errno = ENOTTY;
+    return -1;
+  }
+
+  void *Mmap(size_t length, off_t offset) {
+    const size_t index = offset / kOffsetStep;
+    if (index >= buffers_.size() || length != buffers_[index].size()) {
+      return MAP_FAILED;
+    }
+    ++mapped_;
+    return buffers_[index].data();
+  }
+
+  void Munmap() { --mapped_; }
+
+  bool Readable() const { return streaming_ && !queued_.empty(); }
+
+  // Makes the driver skip sequence numbers before the next frame, like a
+  // camera running ahead of us.
+  void Skip(uint32_t frames) { sequence_ += frames; }
+
+  // Flags the next frame as corrupt.
+  void Corrupt() { corrupt_ = true; }
+
+  const uint8_t *buffer(int index) const { return buffers_[index].data(); }
+  int mapped() const { return mapped_; }
+  bool streaming() const { return streaming_; }
+  size_t allocated() const { return buffers_.size(); }
+  int32_t control(uint32_t id) const { return controls_.at(id); }
+
+  // Capture time of the frame with this sequence number.
+  static timeval Timestamp(uint32_t sequence) {
+    return timeval{.tv_sec = 1000 + sequence / 30,
+                   .tv_usec = (sequence % 30) * 33333};
+  }
+
+ private:
+  int Capture(v4l2_buffer *buffer) {
+    if (!streaming_ || queued_.empty()) {
+      errno = EAGAIN;
+      return -1;
+    }
+    const uint32_t index = queued_.front();
+    queued_.pop_front();
+
+    uint8_t *data = buffers_[index].data();
+    for (size_t row = 0; row < format_.height; ++row) {
+      for (size_t col = 0; col < format_.width; ++col) {
+        data[row * format_.bytesperline + col * bytes_per_pixel_] =
+            (frames_ + row) & 0xff;
+      }
+    }
+    ++frames_;
+
+    buffer->index = index;
+    buffer->bytesused = format_.sizeimage;
+    buffer->sequence = sequence_++;
+    buffer->timestamp = Timestamp(buffer->sequence);
+    buffer->flags = V4L2_BUF_FLAG_TIMESTAMP_MONOTONIC;
+    if (corrupt_) {
+      buffer->flags |= V4L2_BUF_FLAG_ERROR;
+      corrupt_ = false;
+    }
+    return 0;
+  }
+
+  const std::set<uint32_t> fourccs_;
+  v4l2_pix_format format_ = {};
+  size_t bytes_per_pixel_ = 2;
+  std::vector<std::vector<uint8_t>> buffers_;
+  std::deque<uint32_t> queued_;
+  bool streaming_ = false;
+  int mapped_ = 0;
+  uint32_t frames_ = 0;
+  uint32_t sequence_ = 0;
+  bool corrupt_ = false;
+  std::map<uint32_t, int32_t> controls_;
+};
+
+class FakeV4l2Device : public V4l2Device {
+ public:
+  explicit FakeV4l2Device(FakeDriver *driver) : driver_(driver) {}
+
+  int Ioctl(unsigned long request, void *arg) override {
+    return driver_->Ioctl(request, arg);
+  }
+  void *Mmap(size_t length, off_t offset) override {
+    return driver_->Mmap(length, offset);
+  }
+  void Munmap(void *, size_t) override { driver_->Munmap(); }
+  bool WaitReadable(std::chrono::milliseconds) override {
+    return driver_->Readable();
+  }
+
+ private:
+  FakeDriver *driver_;
+};
+
+std::unique_ptr<V4l2Capture> StartFake(FakeDriver *driver,
+                                       V4l2Capture::Options options) {
+  return V4l2Capture::Start(std::make_unique<FakeV4l2Device>(driver), options);
+}
+
+constexpr std::chrono::milliseconds kTimeout(100);
+
+// Tests that frames come straight out of the driver's buffers with its
+// timestamps, and that buffers only cycle back once they are requeued.
+TEST(V4l2CaptureTest, HandsOutDriverBuffers) {
+  FakeDriver driver({V4L2_PIX_FMT_YUYV, V4L2_PIX_FMT_GREY});
+  std::unique_ptr<V4l2Capture> capture = StartFake(
+      &driver, {.width = 64, .height = 48, .pixel_format = PixelFormat::kYuyv,
+                .buffers = 3});
+  ASSERT_NE(capture, nullptr);
+  EXPECT_TRUE(driver.streaming());
+  EXPECT_EQ(capture->buffers(), 3u);
+  EXPECT_EQ(capture->width(), 64u);
+  EXPECT_EQ(capture->height(), 48u);
+  EXPECT_EQ(capture->format().pixel_format, PixelFormat::kYuyv);
+  EXPECT_EQ(capture->format().stride, 64 * 2 + FakeDriver::kPadding);
+
+  const std::chrono::steady_clock::time_point start(std::chrono::seconds(1000));
+  for (uint32_t i = 0; i < 10; ++i) {
+    CapturedFrame frame;
+    ASSERT_TRUE(capture->Dequeue(kTimeout, &frame));
+    EXPECT_EQ(frame.data, driver.buffer(frame.buffer));
+    EXPECT_EQ(frame.sequence, i);
+    EXPECT_EQ(frame.timestamp - start,
+              std::chrono::microseconds((i % 30) * 33333));
+    EXPECT_EQ(frame.bytes, capture->format().stride * 48);
+    for (size_t row = 0; row < 48; ++row) {
+      ASSERT_EQ(ReadLuma(frame.data + row * frame.format.stride, 7,
+                         frame.format.pixel_format),
+                (i + row) & 0xff);
+    }
+    capture->Requeue(frame);
+  }
+
+  // Holding every buffer stalls the driver.
+  std::vector<CapturedFrame> held(3);
+  for (CapturedFrame &frame : held) {
+    ASSERT_TRUE(capture->Dequeue(kTimeout, &frame));
+  }
+  CapturedFrame frame;
+  EXPECT_FALSE(capture->Dequeue(kTimeout, &frame));
+  capture->Requeue(held[1]);
+  ASSERT_TRUE(capture->Dequeue(kTimeout, &frame));
+  EXPECT_EQ(frame.buffer, held[1].buffer);
+  EXPECT_EQ(capture->dropped(), 0u);
+
+  capture.reset();
+  EXPECT_FALSE(driver.streaming());
+  EXPECT_EQ(driver.mapped(), 0);
+  EXPECT_EQ(driver.allocated(), 0u);
+}
+
+// Tests that gray frames are read at the driver's stride.
+TEST(V4l2CaptureTest, CapturesGray) {
+  FakeDriver driver({V4L2_PIX_FMT_YUYV, V4L2_PIX_FMT_GREY});
+  std::unique_ptr<V4l2Capture> capture = StartFake(
+      &driver, {.width = 1280, .height = 800,
+                .pixel_format = PixelFormat::kGray8});
+  ASSERT_NE(capture, nullptr);
+  // The fake driver tops out at 640x480.
+  EXPECT_EQ(capture->width(), 640u);
+  EXPECT_EQ(capture->height(), 480u);
+  EXPECT_EQ(capture->format().stride, 640 + FakeDriver::kPadding);
+
+  CapturedFrame frame;
+  ASSERT_TRUE(capture->Dequeue(kTimeout, &frame));
+  EXPECT_EQ(frame.format.pixel_format, PixelFormat::kGray8);
+  EXPECT_EQ(frame.data[300 * frame.format.stride + 639], 300 & 0xff);
+  capture->Requeue(frame);
+}
+
+// Tests that frames the driver skipped or flagged are counted as dropped, and
+// that flagged ones are never handed out.
+TEST(V4l2CaptureTest, CountsDroppedFrames) {
+  FakeDriver driver({V4L2_PIX_FMT_YUYV});
+  std::unique_ptr<V4l2Capture> capture = StartFake(&driver, {});
+  ASSERT_NE(capture, nullptr);
+
+  CapturedFrame frame;
+  ASSERT_TRUE(capture->Dequeue(kTimeout, &frame));
+  capture->Requeue(frame);
+  driver.Skip(3);
+  ASSERT_TRUE(capture->Dequeue(kTimeout, &frame));
+  EXPECT_EQ(frame.sequence, 4u);
+  EXPECT_EQ(capture->dropped(), 3u);
+  capture->Requeue(frame);
+
+  driver.Corrupt();
+  ASSERT_TRUE(capture->Dequeue(kTimeout, &frame));
+  EXPECT_EQ(frame.sequence, 6u);
+  EXPECT_EQ(capture->dropped(), 4u);
+  capture->Requeue(frame);
+}
+
+// Tests that a device which would pick a different pixel format is rejected
+// instead of handing the detector the wrong layout.
+TEST(V4l2CaptureTest, RejectsUnsupportedFormat) {
+  FakeDriver driver({V4L2_PIX_FMT_YUYV});
+  EXPECT_EQ(StartFake(&driver, {.pixel_format = PixelFormat::kGray8}),
+            nullptr);
+  EXPECT_EQ(driver.mapped(), 0);
+  EXPECT_FALSE(driver.streaming());
+}
+
+// Tests that MJPEG frames are handed out as the driver filled them, for the
+// JPEG decoder, and that controls reach the driver.
+TEST(V4l2CaptureTest, CapturesMjpeg) {
+  FakeDriver driver({V4L2_PIX_FMT_YUYV, V4L2_PIX_FMT_MJPEG});
+  std::unique_ptr<V4l2Capture> capture =
+      StartFake(&driver, {.width = 64, .height = 48, .mjpeg = true});
+  ASSERT_NE(capture, nullptr);
+  EXPECT_TRUE(capture->mjpeg());
+
+  CapturedFrame frame;
+  ASSERT_TRUE(capture->Dequeue(kTimeout, &frame));
+  EXPECT_EQ(frame.data, driver.buffer(frame.buffer));
+  EXPECT_GT(frame.bytes, 0u);
+  capture->Requeue(frame);
+
+  EXPECT_TRUE(capture->SetControl(V4L2_CID_EXPOSURE_ABSOLUTE, 50));
+  EXPECT_EQ(driver.control(V4L2_CID_EXPOSURE_ABSOLUTE), 50);
+
+  FakeDriver yuyv_driver({V4L2_PIX_FMT_YUYV});
+  EXPECT_EQ(StartFake(&yuyv_driver, {.mjpeg = true}), nullptr);
+}
+
+// Tests against the vivid virtual driver, when it is loaded
+// (modprobe vivid).
+TEST(V4l2CaptureTest, Vivid) {
+  std::unique_ptr<V4l2Device> device;
+  for (int i = 0; i < 64 && device == nullptr; ++i) {
+    const std::string path = "/dev/video" + std::to_string(i);
+    if (access(path.c_str(), F_OK) != 0) {
+      continue;
+    }
+    device = OpenV4l2Device(path);
+    v4l2_capability capability = {};
+    if (device != nullptr &&
+        (device->Ioctl(VIDIOC_QUERYCAP, &capability) == -1 ||
+         strcmp(reinterpret_cast<const char *>(capability.driver), "vivid") !=
+             0 ||
+         !(capability.device_caps & V4L2_CAP_VIDEO_CAPTURE))) {
+      device.reset();
+    }
+  }
+  if (device == nullptr) {
+    GTEST_SKIP() << "No vivid capture device";
+  }
+
+  std::unique_ptr<V4l2Capture> capture = V4l2Capture::Start(
+      std::move(device), {.width = 640, .height = 480});
+  ASSERT_NE(capture, nullptr);
+  uint32_t last_sequence = 0;
+  for (int i = 0; i < 5; ++i) {
+    CapturedFrame frame;
+    ASSERT_TRUE(capture->Dequeue(std::chrono::seconds(2), &frame));
+    EXPECT_GE(frame.bytes, LumaBytes(frame.format, capture->width(),
+                                     capture->height()));
+    EXPECT_LE(frame.timestamp, std::chrono::steady_clock::now());
+    if (i > 0) {
+      EXPECT_GT(frame.sequence, last_sequence);
+    }
+    last_sequence = frame.sequence;
+    capture->Requeue(frame);
+  }
+}
+
+}  // namespace
+}  // namespace frc971::apriltag
+
+int main(int argc, char **argv) {
+  ::testing::InitGoogleTest(&argc, argv);
+  google::InitGoogleLogging(argv[0]);
+  return RUN_ALL_TESTS();
+}
@@ -12,11 +12,20 @@ VideoProcessor::VideoProcessor(
       nthreads_(nthreads) {
   tf_ = nullptr;
   td_ = nullptr;
-  cap_ = nullptr;
   gpu_detector_ = nullptr;
   initialized_ = false;
 }
 
+VideoProcessor::VideoProcessor(
+    std::unique_ptr<frc971::apriltag::FrameSource> source,
+    const std::string& tag_family_name,
+    const frc971::apriltag::CameraMatrix& camera_matrix,
+    const frc971::apriltag::DistCoeffs& distortion_coefficients, int nthreads)
+    : VideoProcessor(-1, tag_family_name, camera_matrix,
+                     distortion_coefficients, nthreads) {
+  source_ = std::move(source);
+}
+
 VideoProcessor::~VideoProcessor() {
   /*if (cap_ != nullptr) {
     delete cap_;
@@ -51,19 +60,26 @@ bool VideoProcessor::initialize() {
   td_->refine_edges = true;
   td_->wp = workerpool_create(nthreads_);
 
-  // Setup the Video Capture device.
-  cap_ = std::make_unique<VideoCapture>(camera_index_, CAP_V4L);
-  if (!cap_->isOpened()) {
-    LOG(ERROR) << "Couldn't open video capture device " << camera_index_;
-    return false;
+  // Capture straight out of the driver's buffers, in YUYV which the gpu
+  // detector reads without a conversion.
+  if (source_ == nullptr) {
+    const std::string device = "/dev/video" + std::to_string(camera_index_);
+    std::unique_ptr<frc971::apriltag::V4l2Device> v4l2_device =
+        frc971::apriltag::OpenV4l2Device(device);
+    if (v4l2_device == nullptr) {
+      LOG(ERROR) << "Couldn't open video capture device " << device;
+      return false;
+    }
+    source_ = frc971::apriltag::V4l2Capture::Start(std::move(v4l2_device), {});
+    if (source_ == nullptr) {
+      LOG(ERROR) << "Couldn't capture YUYV from " << device;
+      return false;
+    }
   }
-  // Frames need to be in YUYV format to work properly with gpu detector.
-  cap_->set(CAP_PROP_CONVERT_RGB, false);
-  // cap_.set(CAP_PROP_MODE, CV_CAP_MODE_YUYV);
 
   // Initialize the GPU detector.
-  int width = cap_->get(CAP_PROP_FRAME_WIDTH);
-  int height = cap_->get(CAP_PROP_FRAME_HEIGHT);
+  int width = source_->width();
+  int height = source_->height();
 
   gpu_detector_ = std::make_unique<frc971::apriltag::GpuDetector>(
       width, height, td_, camera_matrix_, distortion_coefficients_);
@@ -80,17 +96,19 @@ bool VideoProcessor::process() {
     return false;
   }
 
-  Mat yuyv_img, bgr_img;
-  while (true) {
-    errno = 0;
-    *cap_ >> yuyv_img;
+  Mat bgr_img;
+  frc971::apriltag::CapturedFrame frame;
+  while (!source_->finished()) {
+    if (!source_->Next(&frame)) {
+      continue;
+    }
 
-    // TOOO: Add error checking of number of channels here.
-    cvtColor(yuyv_img, bgr_img, COLOR_YUV2BGR_YUYV);
-
-    gpu_detector_->Detect(yuyv_img.data);
+    captured_frame_to_bgr(frame, bgr_img);
+    gpu_detector_->Detect(frame.data, frame.format);
+    source_->Release(frame);
     const zarray_t* detections = gpu_detector_->Detections();
     draw_detection_outlines(bgr_img, const_cast<zarray_t*>(detections));
     img_ = bgr_img.clone();
   }
+  return true;
 }
\ No newline at end of file
@@ -5,7 +5,9 @@
 
 #include "apriltag_gpu.h"
 #include "apriltag_utils.h"
+#include "frame_source.h"
 #include "opencv2/opencv.hpp"
+#include "v4l2_capture.h"
 
 using namespace std;
 using namespace cv;
@@ -16,6 +18,12 @@ class VideoProcessor {
                  const frc971::apriltag::CameraMatrix& camera_matrix,
                  const frc971::apriltag::DistCoeffs& distortion_coefficients,
                  int nthreads = 4);
+  // Runs on frames from source, like a ReplaySource, instead of a camera.
+  VideoProcessor(std::unique_ptr<frc971::apriltag::FrameSource> source,
+                 const std::string& tag_family_name,
+                 const frc971::apriltag::CameraMatrix& camera_matrix,
+                 const frc971::apriltag::DistCoeffs& distortion_coefficients,
+                 int nthreads = 4);
 
   ~VideoProcessor();
 
@@ -30,7 +38,7 @@ class VideoProcessor {
   int nthreads_;
   apriltag_family_t* tf_;
   apriltag_detector_t* td_;
-  std::unique_ptr<VideoCapture> cap_;
+  std::unique_ptr<frc971::apriltag::FrameSource> source_;
   std::unique_ptr<frc971::apriltag::GpuDetector> gpu_detector_;
   bool initialized_;
   Mat img_;
@@ -0,0 +1,180 @@
+#include "work_stealing_pool.h"
+
+#include <limits>
+
+#include "glog/logging.h"
+
+namespace frc971::apriltag {
+namespace {
+
+uint64_t PackRange(uint32_t begin, uint32_t end) {
+  return static_cast<uint64_t>(end) << 32 | begin;
+}
+
+uint32_t RangeBegin(uint64_t bounds) { return static_cast<uint32_t>(bounds); }
+
+uint32_t RangeEnd(uint64_t bounds) {
+  return static_cast<uint32_t>(bounds >> 32);
+}
+
+}  // namespace
+
+WorkStealingPool::WorkStealingPool(size_t threads) : ranges_(threads) {
+  CHECK_GE(threads, 1u);
+  threads_.reserve(threads - 1);
+  for (size_t worker = 1; worker < threads; ++worker) {
+    threads_.emplace_back([this, worker]() { ThreadMain(worker); });
+  }
+}
+
+WorkStealingPool::~WorkStealingPool() {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    quit_ = true;
+  }
+  start_.notify_all();
+  for (std::thread &thread : threads_) {
+    thread.join();
+  }
+}
+
+void WorkStealingPool::Run(size_t n, Call call, const void *fn) {
+  if (n == 0) {
+    return;
+  }
+  CHECK_LE(n, std::numeric_limits<uint32_t>::max());
+
+  {
+    std::unique_lock<std::mutex> lock(turn_mutex_);
+    const uint64_t ticket = next_ticket_++;
+    turn_.wait(lock, [this, ticket]() { return serving_ == ticket; });
+  }
+
+  call_ = call;
+  fn_ = fn;
+  const size_t workers = threads();
+  for (size_t worker = 0; worker < workers; ++worker) {
+    ranges_[worker].bounds.store(
+        PackRange(n * worker / workers, n * (worker + 1) / workers),
+        std::memory_order_relaxed);
+  }
+
+  if (!threads_.empty()) {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      running_ = threads_.size();
+      ++generation_;
+    }
+    start_.notify_all();
+  }
+
+  Work(0);
+
+  if (!threads_.empty()) {
+    // Every range is empty now, but the other workers may still be finishing
+    // the last task they took.
+    std::unique_lock<std::mutex> lock(mutex_);
+    done_.wait(lock, [this]() { return running_ == 0; });
+  }
+
+  {
+    std::lock_guard<std::mutex> lock(turn_mutex_);
+    ++serving_;
+  }
+  turn_.notify_all();
+}
+
+void WorkStealingPool::ThreadMain(size_t worker) {
+  uint64_t generation = 0;
+  while (true) {
+    {
+      std::unique_lock<std::mutex> lock(mutex_);
+      start_.wait(lock,
+                  [&]() { return quit_ || generation_ != generation; });
+      if (quit_) {
+        return;
+      }
+      generation = generation_;
+    }
+
+    Work(worker);
+
+    bool last;
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      last = --running_ == 0;
+    }
+    if (last) {
+      done_.notify_one();
+    }
+  }
+}
+
+void WorkStealingPool::Work(size_t worker) {
+  size_t index;
+  while (Pop(worker, &index) || Steal(worker, &index)) {
+    call_(fn_, index, worker);
+  }
+}
+
+bool WorkStealingPool::Pop(size_t worker, size_t *index) {
+  std::atomic<uint64_t> &bounds = ranges_[worker].bounds;
+  uint64_t current = bounds.load(std::memory_order_acquire);
+  while (true) {
+    const uint32_t begin = RangeBegin(current);
+    const uint32_t end = RangeEnd(current);
+    if (begin >= end) {
+      return false;
+    }
+    if (bounds.compare_exchange_weak(current, PackRange(begin + 1, end),
+                                     std::memory_order_acq_rel)) {
+      *index = begin;
+      return true;
+    }
+  }
+}
+
+bool WorkStealingPool::Steal(size_t worker, size_t *index) {
+  const size_t workers = threads();
+  while (true) {
+    // Go after whoever has the most left.
+    size_t victim = workers;
+    uint64_t victim_bounds = 0;
+    uint32_t most_left = 0;
+    for (size_t i = 1; i < workers; ++i) {
+      const size_t other = (worker + i) % workers;
+      const uint64_t bounds =
+          ranges_[other].bounds.load(std::memory_order_acquire);
+      const uint32_t begin = RangeBegin(bounds);
+      const uint32_t end = RangeEnd(bounds);
+      if (end > begin && end - begin > most_left) {
+        victim = other;
+        victim_bounds = bounds;
+        most_left = end - begin;
+      }
+    }
+    if (victim == workers) {
+      return false;
+    }
+
+    const uint32_t begin = RangeBegin(victim_bounds);
+    const uint32_t end = RangeEnd(victim_bounds);
+    const uint32_t stolen = end - (most_left + 1) / 2;
+    if (!ranges_[victim].bounds.compare_exchange_strong(
+            victim_bounds, PackRange(begin, stolen),
+            std::memory_order_acq_rel)) {
+      // Somebody else got there first, look again.
+      continue;
+    }
+
+    // Nobody steals from an empty range, so our own range can be replaced
+    // outright.  Each index is only ever handed out once per batch, so a
+    // thief holding a stale copy of it can't succeed against the new one.
+    ranges_[worker].bounds.store(PackRange(stolen + 1, end),
+                                 std::memory_order_release);
+    *index = stolen;
+    return true;
+  }
+}
+
+}  // namespace frc971::apriltag
@@ -0,0 +1,99 @@
+#ifndef FRC971_ORIN_WORK_STEALING_POOL_H_
+#define FRC971_ORIN_WORK_STEALING_POOL_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <atomic>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace frc971::apriltag {
+
+// Persistent pool of threads which runs a batch of independent tasks of
+// uneven cost.  Each worker starts with an equal share of the task indices
+// and runs them in order.  When it runs out it steals the back half of
+// whichever worker has the most left, so one expensive task doesn't leave the
+// rest of the pool idle behind it.
+//
+// A pool can be shared by several detectors.  Batches from different callers
+// run one at a time, in the order they were started, so a detector which
+// submits batches back to back can't starve the others.
+class WorkStealingPool {
+ public:
+  // Creates a pool with threads workers in total.  The thread calling ForEach
+  // is one of them, so threads - 1 threads are started.
+  explicit WorkStealingPool(size_t threads);
+  ~WorkStealingPool();
+
+  WorkStealingPool(const WorkStealingPool &) = delete;
+  WorkStealingPool &operator=(const WorkStealingPool &) = delete;
+
+  size_t threads() const { return ranges_.size(); }
+
+  // Calls fn(index, worker) for every index in [0, n) and returns once they
+  // have all run.  worker is in [0, threads()), and a worker only runs one
+  // task at a time, so it can be used to index per worker state.
+  template <typename F>
+  void ForEach(size_t n, const F &fn) {
+    Run(
+        n,
+        [](const void *fn, size_t index, size_t worker) {
+          (*reinterpret_cast<const F *>(fn))(index, worker);
+        },
+        &fn);
+  }
+
+ private:
+  using Call = void (*)(const void *fn, size_t index, size_t worker);
+
+  // The indices a worker has left, begin in the low 32 bits and end in the
+  // high 32 bits, so the owner and thieves can both update it with one
+  // compare and swap.  Padded out so workers don't share cache lines.
+  struct alignas(64) Range {
+    std::atomic<uint64_t> bounds{0};
+  };
+
+  void Run(size_t n, Call call, const void *fn);
+
+  void ThreadMain(size_t worker);
+
+  // Runs tasks until there is nothing left to run or steal.
+  void Work(size_t worker);
+
+  // Takes the next index off the front of worker's own range.
+  bool Pop(size_t worker, size_t *index);
+
+  // Steals the back half of the largest other range.  The first stolen index
+  // is returned and the rest become worker's range.
+  bool Steal(size_t worker, size_t *index);
+
+  std::vector<Range> ranges_;
+  std::vector<std::thread> threads_;
+
+  // Hands out turns to run a batch.  Each Run takes the next ticket and waits
+  // for serving_ to reach it.
+  std::mutex turn_mutex_;
+  std::condition_variable turn_;
+  uint64_t next_ticket_ = 0;
+  uint64_t serving_ = 0;
+
+  // Protects the batch hand off to the threads.
+  std::mutex mutex_;
+  std::condition_variable start_;
+  std::condition_variable done_;
+  uint64_t generation_ = 0;
+  size_t running_ = 0;
+  bool quit_ = false;
+
+  // The batch being run.
+  Call call_ = nullptr;
+  const void *fn_ = nullptr;
+};
+
+}  // namespace frc971::apriltag
+
+#endif  // FRC971_ORIN_WORK_STEALING_POOL_H_
@@ -1,10 +1,12 @@
 #include <gflags/gflags.h>
 #include <glog/logging.h>
+#include <linux/videodev2.h>
 #include <seasocks/PrintfLogger.h>
 #include <seasocks/Server.h>
 #include <seasocks/StringUtil.h>
 #include <seasocks/WebSocket.h>
 
+#include <array>
 #include <atomic>
 #include <chrono>
 #include <condition_variable>
@@ -18,6 +20,7 @@
 #include <opencv2/opencv.hpp>
 #include <set>
 #include <span>
+#include <stdexcept>
 #include <string>
 #include <thread>
 #include <vector>
@@ -30,11 +33,21 @@
 #include "apriltag_gpu.h"
 #include "apriltag_utils.h"
 #include "cameraexception.h"
+#include "detection_pool.h"
+#include "field_localizer.h"
+#include "jpeg_decoder.h"
 #include "opencv2/opencv.hpp"
+#include "pose_estimator.h"
+#include "pose_message.h"
+#include "recorder.h"
+#include "replay_source.h"
+#include "spsc_queue.h"
+#include "triple_buffer.h"
+#include "v4l2_capture.h"
+#include "work_stealing_pool.h"
 
 extern "C" {
 #include "apriltag.h"
-#include "apriltag_pose.h"
 #include "common/zarray.h"
 }
 
@@ -46,48 +59,302 @@ DEFINE_bool(rotate_vertical, false,
             "Rotates image by 180 degrees prior to detecting apriltags");
 DEFINE_bool(rotate_horizontal, false,
             "Rotates image by 90 degrees prior to detecting apriltags");
+DEFINE_string(camera_config, "",
+              "path name to a JSON file listing the cameras to serve from "
+              "this one process.  Overrides --camera_idx, --cal_file and the "
+              "rotate flags");
 DEFINE_int32(port, 8080, "Server port to run webserver");
+DEFINE_int32(decimate, 2,
+             "Decimate the image by this factor (1-4) before finding quads");
+DEFINE_int32(undistort_map_step, 0,
+             "If nonzero, undistort edge refinement samples with a lookup "
+             "table with nodes this many pixels apart instead of the "
+             "iterative solver");
+DEFINE_int32(decode_cache_entries, 0,
+             "If nonzero, reuse last frame's decode for up to this many tags "
+             "whose quads haven't moved");
+DEFINE_double(decode_cache_tolerance, 1.0,
+              "Distance in pixels a quad corner can move and still hit the "
+              "decode cache");
+DEFINE_bool(decode_cache_failures, false,
+            "Also skip quads which didn't decode last frame while the pixels "
+            "inside them look the same.  Saves decoding quads which aren't "
+            "tags, but a tag which fails once, say to motion blur, can stay "
+            "missing until it changes");
+DEFINE_double(tag_size, 0.175,
+              "Size in meters of tags which aren't in --tag_size_file");
+DEFINE_string(tag_size_file, "",
+              "path name to a JSON file of per tag ID sizes in meters, like "
+              "{\"sizes\": {\"3\": 0.1651}}");
+DEFINE_bool(pose_tracking, false,
+            "Start each tag's pose solve from its pose in the last frame.  "
+            "Not supported with --field_layout");
+DEFINE_int32(pose_smoothing_ms, 50,
+             "Time constant in ms of the filter on the smoothed tag poses "
+             "when --pose_tracking is on");
+DEFINE_int32(capture_queue_depth, 2,
+             "Captured frames which can wait for the detector");
+DEFINE_bool(capture_queue_drop, true,
+            "Drop new frames while the capture queue is full instead of "
+            "holding up capture");
+DEFINE_bool(freshest_frame, true,
+            "Hand the detector only the newest captured frame, dropping the "
+            "ones it didn't get to, instead of queueing them up.  Overrides "
+            "--capture_queue_depth and --capture_queue_drop");
+DEFINE_int32(pose_queue_depth, 2,
+             "Detected frames which can wait for pose estimation");
+DEFINE_bool(pose_queue_drop, false,
+            "Drop newly detected frames while the pose queue is full instead "
+            "of holding up detection");
+DEFINE_int32(publish_queue_depth, 4,
+             "Frames with poses which can wait to be published");
+DEFINE_bool(publish_queue_drop, false,
+            "Drop frames with new poses while the publish queue is full "
+            "instead of holding up pose estimation");
+DEFINE_bool(overlap_decode, false,
+            "Decode each frame's tags while the next frame's quads are found "
+            "on the GPU.  Raises throughput at the cost of a frame of "
+            "latency");
+DEFINE_string(field_layout, "",
+              "path name to a WPILib field layout JSON.  If set, a single "
+              "camera pose on the field is solved from every tag in the frame "
+              "and published on field_pose, instead of each tag's pose on "
+              "raw_pose");
+DEFINE_string(replay, "",
+              "path name to a frame log to run on instead of the camera.  "
+              "Use --freshest_frame=false --capture_queue_drop=false to "
+              "detect on every frame");
+DEFINE_string(replay_mode, "realtime",
+              "How to play back frame logs: realtime, fast, or step, which "
+              "waits for a step message from the gui before each frame");
+DEFINE_bool(replay_loop, false,
+            "Start frame logs over from the beginning when they run out");
+DEFINE_string(pose_protocol, "binary",
+              "How poses go to web clients which don't ask for one: binary, "
+              "the fixed layout of pose_message.h, or json");
+DEFINE_bool(mjpeg_luma, false,
+            "Capture MJPEG straight from V4L2 and decode only its luma, "
+            "instead of decoding full color through OpenCV.  Images sent to "
+            "the gui are then gray");
+DEFINE_string(raw_capture, "",
+              "Capture yuyv, uyvy or gray8 frames straight from V4L2 and "
+              "hand them to the detector as is, instead of MJPEG decoded to "
+              "color through OpenCV.  Only the frames sent to the gui are "
+              "converted");
+DEFINE_bool(mjpeg_half_scale, false,
+            "With --mjpeg_luma and an even --decimate, decode at half "
+            "resolution with DCT scaling and leave the detector the rest of "
+            "the decimation.  Much cheaper to decode, but tags are decoded "
+            "and their edges refined at half resolution too");
+DEFINE_string(record, "",
+              "path name to record each frame's detections, poses and "
+              "timings to, along with images when sampled or triggered.  "
+              "With several cameras, each camera's id is appended");
+DEFINE_bool(record_full_frames, false,
+            "Record whole color images instead of just their luma");
+DEFINE_int32(record_sample_ms, 1000,
+             "Record an image at most this often in ms whether or not "
+             "anything triggered, or never if 0");
+DEFINE_bool(record_on_tag_loss, true,
+            "Record the image when a tag in the last frame is lost");
+DEFINE_bool(record_on_bit_errors, true,
+            "Record the image when a tag needed bit errors corrected");
+DEFINE_int32(record_latency_ms, 0,
+             "Record the image when capture to pose latency is over this "
+             "many ms, or never if 0");
 
 enum ExposureMode { AUTO = 0, MANUAL = 1 };
 
+// What gets published about a tag.
+struct TagResult {
+  int id;
+  int hamming;
+  // The pose, without its detection.
+  frc971::apriltag::TagPose pose;
+};
+
+// A frame on its way through the pipeline.
+struct Frame {
+  // Gray instead with --mjpeg_luma, and as captured with --raw_capture.
+  cv::Mat bgr_img;
+  frc971::apriltag::PixelFormat pixel_format =
+      frc971::apriltag::PixelFormat::kBgr24;
+  std::chrono::steady_clock::time_point capture_time;
+  // Counts up by one per frame captured, including dropped ones.
+  uint32_t sequence = 0;
+  // Filled in as the frame is detected, for the recorder.
+  frc971::apriltag::StageTimes times;
+  // Filled in by the detect stage.  Copies, since the detector recycles its
+  // own detections once it moves on to the next frame.
+  frc971::apriltag::DetectionCopies detections;
+  // Filled in by the pose stage.
+  std::vector<TagResult> tags;
+  frc971::apriltag::FieldPose field_pose;
+};
+
+// How to open one camera and what to call its results.
+struct CameraConfig {
+  // Tags the camera's results, and prefixes its networktables entries.  Empty
+  // when there is only the one camera from the command line.
+  std::string id;
+  int index = 0;
+  std::string cal_file;
+  int width = 1280;
+  int height = 800;
+  int fps = 30;
+  bool rotate_vertical = false;
+  bool rotate_horizontal = false;
+  // If set, frames come from this frame log instead of the camera.
+  std::string replay;
+};
+
+// Reads a list of cameras like
+//   {"cameras": [{"id": "front", "index": 0, "cal_file": "front.json"}, ...]}
+// where width, height, fps, rotate_vertical and rotate_horizontal can also be
+// set per camera.  A camera with "replay" set to a frame log plays it back
+// instead, and doesn't need an index.
+bool parsecamera_config(const std::string& camera_config_filepath,
+                        std::vector<CameraConfig>* cameras) {
+  std::ifstream f(camera_config_filepath);
+  json data = json::parse(f, nullptr, false);
+  if (data.is_discarded() || !data.contains("cameras")) {
+    LOG(ERROR) << "key \"cameras\" not found in camera config file.";
+    return false;
+  }
+
+  std::set<std::string> ids;
+  try {
+    for (const json& camera : data.at("cameras")) {
+      CameraConfig config;
+      config.id = camera.at("id").get<std::string>();
+      config.replay = camera.value("replay", config.replay);
+      config.index = config.replay.empty() ? camera.at("index").get<int>()
+                                           : camera.value("index", 0);
+      config.cal_file = camera.at("cal_file").get<std::string>();
+      config.width = camera.value("width", config.width);
+      config.height = camera.value("height", config.height);
+      config.fps = camera.value("fps", config.fps);
+      config.rotate_vertical =
+          camera.value("rotate_vertical", config.rotate_vertical);
+      config.rotate_horizontal =
+          camera.value("rotate_horizontal", config.rotate_horizontal);
+      if (config.id.empty() || !ids.insert(config.id).second) {
+        LOG(ERROR) << "camera ids must be unique and not empty, got \""
+                   << config.id << "\"";
+        return false;
+      }
+      if (!std::filesystem::exists(config.cal_file)) {
+        LOG(ERROR) << "calibration file does not exist: " << config.cal_file;
+        return false;
+      }
+      cameras->push_back(config);
+    }
+  } catch (const json::exception& e) {
+    LOG(ERROR) << "Bad camera in camera config file: " << e.what();
+    return false;
+  }
+  if (cameras->empty()) {
+    LOG(ERROR) << "No cameras in camera config file.";
+    return false;
+  }
+  return true;
+}
+
+// A camera being served, with the settings the gui can change.
+struct Camera {
+  CameraConfig config;
+  std::atomic<int> brightness{50};
+  std::atomic<int> exposure{50};
+  std::atomic<int> exposure_mode{0};
+  std::atomic<bool> settings_changed{false};
+  std::atomic<bool> flip_vertical{false};
+  std::atomic<bool> flip_horizontal{false};
+  // Where the camera's results go.  Every camera shares the process's
+  // networktables client.
+  std::unique_ptr<DoubleArraySender> tag_sender;
+  std::unique_ptr<DoubleArraySender> field_pose_sender;
+  // Capture to publish latency in ms and frames dropped so far, sent with
+  // every frame's poses.
+  std::unique_ptr<DoubleArraySender> latency_sender;
+  // Where frames come from when replaying a frame log.
+  std::unique_ptr<frc971::apriltag::ReplaySource> replay;
+  // Binary pose messages on their way from the publish thread to the web
+  // clients.  New ones are dropped if the server falls behind.
+  frc971::apriltag::SpscQueue<frc971::apriltag::PoseMessageBuilder>
+      pose_messages{4, frc971::apriltag::DropPolicy::kDropNewest};
+  // Runs the camera's capture loop.
+  std::thread thread;
+};
+
 class AprilTagHandler : public seasocks::WebSocket::Handler {
  public:
-  AprilTagHandler(std::shared_ptr<seasocks::Server> server) : server_(server) {}
+  AprilTagHandler(std::shared_ptr<seasocks::Server> server) : server_(server) {
+    if (FLAGS_pose_protocol != "binary" && FLAGS_pose_protocol != "json") {
+      throw std::runtime_error("Unknown pose protocol " +
+                               FLAGS_pose_protocol);
+    }
+  }
 
   void onConnect(seasocks::WebSocket* socket) override {
     std::lock_guard<std::mutex> lock(mutex_);
     clients_.insert(socket);
+    if (FLAGS_pose_protocol == "json") {
+      json_clients_.insert(socket);
+      json_client_count_ = json_clients_.size();
+    }
   }
 
   void onDisconnect(seasocks::WebSocket* socket) override {
     std::lock_guard<std::mutex> lock(mutex_);
     clients_.erase(socket);
+    json_clients_.erase(socket);
+    json_client_count_ = json_clients_.size();
   }
 
   void onData(seasocks::WebSocket* socket, const char* data) override {
     try {
       std::cerr << "Received data: " << data << std::endl;
       auto j = json::parse(data);
-      settings_changed_ = false;
-      if (j["type"] == "brightness") {
-        brightness_ = j["value"].get<int>();
-        settings_changed_ = true;
-      }
-      if (j["type"] == "exposure") {
-        exposure_ = j["value"].get<int>();
-        settings_changed_ = true;
-      }
-      if (j["type"] == "exposure-mode") {
-        exposure_mode_ = j["value"].get<int>();
-        settings_changed_ = true;
-      }
-      if (j["type"] == "flipVertical") {
-        flipVertical_ = j["value"].get<bool>();
-        settings_changed_ = true;
+      // Clients pick how they get poses, binary or json.
+      if (j["type"] == "pose_protocol") {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (j["value"] == "json") {
+          json_clients_.insert(socket);
+        } else {
+          json_clients_.erase(socket);
+        }
+        json_client_count_ = json_clients_.size();
+        return;
       }
-      if (j["type"] == "flipHorizontal") {
-        flipHorizontal_ = j["value"].get<bool>();
-        settings_changed_ = true;
+      // Settings go to the camera named, or to every camera.
+      for (const std::unique_ptr<Camera>& camera : cameras_) {
+        if (j.contains("camera") &&
+            j["camera"].get<std::string>() != camera->config.id) {
+          continue;
+        }
+        if (j["type"] == "brightness") {
+          camera->brightness = j["value"].get<int>();
+          camera->settings_changed = true;
+        }
+        if (j["type"] == "exposure") {
+          camera->exposure = j["value"].get<int>();
+          camera->settings_changed = true;
+        }
+        if (j["type"] == "exposure-mode") {
+          camera->exposure_mode = j["value"].get<int>();
+          camera->settings_changed = true;
+        }
+        if (j["type"] == "flipVertical") {
+          camera->flip_vertical = j["value"].get<bool>();
+          camera->settings_changed = true;
+        }
+        if (j["type"] == "flipHorizontal") {
+          camera->flip_horizontal = j["value"].get<bool>();
+          camera->settings_changed = true;
+        }
+        if (j["type"] == "step" && camera->replay) {
+          camera->replay->Step();
+        }
       }
 
     } catch (const json::parse_error& e) {
@@ -117,16 +384,37 @@ class AprilTagHandler : public seasocks::WebSocket::Handler {
 
     server_->execute([this, messageBytes] {
       std::lock_guard<std::mutex> lock(mutex_);
-      for (auto client : clients_) {
+      for (auto client : json_clients_) {
         client->send(messageBytes.data(), messageBytes.size());
       }
     });
   }
 
+  // Sends the camera's oldest binary pose message to the clients which didn't
+  // ask for json.  Called once for each message pushed.
+  void broadcastPoseMessage(Camera* camera) {
+    server_->execute([this, camera] {
+      const frc971::apriltag::PoseMessageBuilder* message =
+          camera->pose_messages.Front();
+      if (message == nullptr) {
+        return;
+      }
+      {
+        std::lock_guard<std::mutex> lock(mutex_);
+        for (auto client : clients_) {
+          if (!json_clients_.contains(client)) {
+            client->send(message->message().data(), message->message().size());
+          }
+        }
+      }
+      camera->pose_messages.Pop();
+    });
+  }
+
   bool parsecal_file(const std::string& cal_filepath,
                      frc971::apriltag::CameraMatrix* cam,
                      frc971::apriltag::DistCoeffs* dist) {
-    std::ifstream f(FLAGS_cal_file);
+    std::ifstream f(cal_filepath);
     json data = json::parse(f);
 
     // Ensure the keys that we are expecting to find are actually
@@ -172,6 +460,65 @@ class AprilTagHandler : public seasocks::WebSocket::Handler {
 
     return true;
   }
+  bool parsetag_size_file(const std::string& tag_size_filepath,
+                          frc971::apriltag::TagSizes* tag_sizes) {
+    std::ifstream f(tag_size_filepath);
+    json data = json::parse(f);
+
+    if (!data.contains("sizes")) {
+      LOG(ERROR) << "key \"sizes\" not found in tag size file.";
+      return false;
+    }
+
+    std::cout << "Loaded tag sizes:" << std::endl;
+    for (const auto& [id, size] : data["sizes"].items()) {
+      tag_sizes->Set(std::stoi(id), size.get<double>());
+      std::cout << "tag " << id << ": " << size << " m" << std::endl;
+    }
+    std::cout << "default: " << tag_sizes->default_size() << " m" << std::endl
+              << std::endl;
+
+    return true;
+  }
+
+  json fieldPoseRecord(const frc971::apriltag::FieldPose& field_pose) {
+    json record;
+    record["valid"] = field_pose.valid;
+    record["tags"] = field_pose.tags;
+    record["timestamp"] =
+        std::chrono::duration<double>(field_pose.timestamp.time_since_epoch())
+            .count();
+    if (field_pose.valid) {
+      const auto& R = field_pose.rotation;
+      record["rotation"] = {
+          {R[0], R[1], R[2]}, {R[3], R[4], R[5]}, {R[6], R[7], R[8]}};
+      record["translation"] = field_pose.translation;
+      record["covariance"] = field_pose.covariance;
+      record["rms_error"] = field_pose.rms_error;
+    }
+    return record;
+  }
+
+  // Packs a field pose for networktables as x, y, z, qw, qx, qy, qz, the 36
+  // entries of the covariance and the number of tags, or nothing if there is
+  // no pose.
+  std::vector<double> fieldPoseData(
+      const frc971::apriltag::FieldPose& field_pose) {
+    std::vector<double> data;
+    if (!field_pose.valid) {
+      return data;
+    }
+    const std::array<double, 4> q =
+        frc971::apriltag::RotationToQuaternion(field_pose.rotation);
+    data.insert(data.end(), field_pose.translation.begin(),
+                field_pose.translation.end());
+    data.insert(data.end(), q.begin(), q.end());
+    data.insert(data.end(), field_pose.covariance.begin(),
+                field_pose.covariance.end());
+    data.push_back(field_pose.tags);
+    return data;
+  }
+
   // Flipcode -1 = both directions
   void flipVertical(const cv::Mat& bgr_img, cv::Mat* output_img) {
     cv::flip(bgr_img, *output_img, 0);
@@ -182,16 +529,106 @@ class AprilTagHandler : public seasocks::WebSocket::Handler {
   void flipBoth(const cv::Mat& bgr_img, cv::Mat* output_img) {
     cv::flip(bgr_img, *output_img, -1);
   }
-  void startReadAndSendThread(const int camera_idx, const std::string& cal_file,
-                              const bool rotate_vertical,
-                              const bool rotate_horizontal) {
-    read_thread_ = std::thread(&AprilTagHandler::readAndSend, this, camera_idx,
-                               cal_file, rotate_vertical, rotate_horizontal);
+  // Returns the networktables entry name for a camera's results.
+  static std::string topicName(const CameraConfig& config,
+                               const std::string& name) {
+    return config.id.empty() ? name : config.id + "/" + name;
   }
 
-  void joinReadAndSendThread() {
-    if (read_thread_.joinable()) {
-      read_thread_.join();
+  // Starts serving the cameras.  They share one detector configuration, and
+  // with it the tag family tables, and one pool of threads for decoding and
+  // pose estimation which serves their batches in turn.  Each camera gets its
+  // own GpuDetector sized to its resolution.
+  void startCameras(const std::vector<CameraConfig>& configs) {
+    setup_tag_family(&tf_, kTagFamily);
+    td_ = apriltag_detector_create();
+    apriltag_detector_add_family(td_, tf_);
+
+    td_->quad_decimate = FLAGS_decimate;
+    if (FLAGS_mjpeg_half_scale) {
+      if (!FLAGS_mjpeg_luma || FLAGS_decimate % 2 != 0) {
+        throw std::runtime_error(
+            "--mjpeg_half_scale needs --mjpeg_luma and an even --decimate");
+      }
+      for (const CameraConfig& config : configs) {
+        if (!config.replay.empty()) {
+          throw std::runtime_error("--mjpeg_half_scale can't replay " +
+                                   config.replay);
+        }
+      }
+      // Half of the decimation is done by the JPEG decoder.
+      td_->quad_decimate = FLAGS_decimate / 2;
+    }
+    if (!FLAGS_raw_capture.empty()) {
+      if (!frc971::apriltag::ParsePixelFormat(FLAGS_raw_capture,
+                                              &raw_format_) ||
+          (raw_format_ != frc971::apriltag::PixelFormat::kYuyv &&
+           raw_format_ != frc971::apriltag::PixelFormat::kUyvy &&
+           raw_format_ != frc971::apriltag::PixelFormat::kGray8)) {
+        throw std::runtime_error("--raw_capture must be yuyv, uyvy or gray8");
+      }
+      if (FLAGS_mjpeg_luma) {
+        throw std::runtime_error(
+            "--raw_capture and --mjpeg_luma can't both be set");
+      }
+    }
+    // The field solve poses every tag at once, so there's nothing for the
+    // tracker to warm start or smooth.
+    if (FLAGS_pose_tracking && !FLAGS_field_layout.empty()) {
+      throw std::runtime_error(
+          "--pose_tracking and --field_layout can't both be set");
+    }
+    td_->quad_sigma = 0.0;
+    td_->nthreads = 1;
+    td_->debug = false;
+    td_->refine_edges = true;
+    td_->wp = workerpool_create(4);
+
+    pool_ = std::make_shared<frc971::apriltag::WorkStealingPool>(
+        workerpool_get_nthreads(td_->wp));
+
+    for (const CameraConfig& config : configs) {
+      auto camera = std::make_unique<Camera>();
+      camera->config = config;
+      camera->flip_vertical = config.rotate_vertical;
+      camera->flip_horizontal = config.rotate_horizontal;
+      camera->tag_sender =
+          std::make_unique<DoubleArraySender>(topicName(config, "raw_pose"));
+      camera->field_pose_sender =
+          std::make_unique<DoubleArraySender>(topicName(config, "field_pose"));
+      camera->latency_sender = std::make_unique<DoubleArraySender>(
+          topicName(config, "pose_latency"));
+      if (!config.replay.empty()) {
+        frc971::apriltag::ReplaySource::Options options;
+        options.loop = FLAGS_replay_loop;
+        if (!frc971::apriltag::ParseReplayMode(FLAGS_replay_mode,
+                                               &options.mode)) {
+          throw std::runtime_error("Unknown replay mode " + FLAGS_replay_mode);
+        }
+        camera->replay =
+            frc971::apriltag::ReplaySource::Open(config.replay, options);
+        if (camera->replay == nullptr) {
+          throw std::runtime_error("Unable to replay " + config.replay);
+        }
+      }
+      cameras_.push_back(std::move(camera));
+    }
+    for (const std::unique_ptr<Camera>& camera : cameras_) {
+      camera->thread =
+          std::thread(&AprilTagHandler::readAndSend, this, camera.get());
+    }
+  }
+
+  void joinCameras() {
+    for (const std::unique_ptr<Camera>& camera : cameras_) {
+      if (camera->thread.joinable()) {
+        camera->thread.join();
+      }
+    }
+    if (td_ != nullptr) {
+      apriltag_detector_destroy(td_);
+      teardown_tag_family(&tf_, kTagFamily);
+      td_ = nullptr;
     }
   }
 
@@ -212,17 +649,278 @@ class AprilTagHandler : public seasocks::WebSocket::Handler {
     std::cout << "Contrast: " << cap.get(cv::CAP_PROP_CONTRAST) << std::endl;
   }
 
-  void readAndSend(const int camera_idx, const std::string& cal_file,
-                   const bool rotate_vertical, const bool rotate_horizontal) {
-    std::cout << "Enabling video capture" << std::endl;
+  // Returns when the frame just read from cap was captured.  V4L2 stamps each
+  // buffer on the monotonic clock as the driver fills it, which leaves out
+  // however long the frame then waited to be read.
+  std::chrono::steady_clock::time_point captureTime(
+      const cv::VideoCapture& cap) {
+    const std::chrono::steady_clock::time_point now =
+        std::chrono::steady_clock::now();
+    const std::chrono::steady_clock::time_point stamp(
+        std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+            std::chrono::duration<double, std::milli>(
+                cap.get(cv::CAP_PROP_POS_MSEC))));
+    // Some drivers stamp on another clock, so fall back to when the read
+    // returned if the stamp doesn't look like it was this frame's.
+    if (stamp > now || now - stamp > std::chrono::seconds(1)) {
+      return now;
+    }
+    return stamp;
+  }
+
+  frc971::apriltag::DropPolicy dropPolicy(bool drop) {
+    return drop ? frc971::apriltag::DropPolicy::kDropNewest
+                : frc971::apriltag::DropPolicy::kBlock;
+  }
+
+  // The detector pulls the luma straight out of the frame in whatever format
+  // it was captured in, so there is no need to convert it first.
+  frc971::apriltag::ImageFormat imageFormat(const Frame& frame) {
+    return frc971::apriltag::ImageFormat{.pixel_format = frame.pixel_format,
+                                         .stride = frame.bgr_img.step};
+  }
+
+  // Returns a frame's image in a format cv::imencode takes, converting raw
+  // captures into converted.
+  const cv::Mat& encodableImage(const Frame& frame, cv::Mat* converted) {
+    switch (frame.pixel_format) {
+      case frc971::apriltag::PixelFormat::kYuyv:
+        cv::cvtColor(frame.bgr_img, *converted, cv::COLOR_YUV2BGR_YUYV);
+        return *converted;
+      case frc971::apriltag::PixelFormat::kUyvy:
+        cv::cvtColor(frame.bgr_img, *converted, cv::COLOR_YUV2BGR_UYVY);
+        return *converted;
+      default:
+        return frame.bgr_img;
+    }
+  }
+
+  // Finds the tags in a captured frame, and copies them into the frame for
+  // the pose stage.
+  void detectFrame(Frame* frame, frc971::apriltag::GpuDetector* detector) {
+    auto gpudetectstart = std::chrono::high_resolution_clock::now();
+    frame->times.detect_start = std::chrono::steady_clock::now();
+    detector->Detect(frame->bgr_img.data, imageFormat(*frame));
+    frame->times.detect_end = std::chrono::steady_clock::now();
+    frame->detections.CopyFrom(detector->Detections());
+    detector->ReinitializeDetections();
+    auto gpudetectend = std::chrono::high_resolution_clock::now();
+
+    auto gpudetectduration =
+        std::chrono::duration_cast<std::chrono::milliseconds>(gpudetectend -
+                                                              gpudetectstart);
+    VLOG(1) << "GPU Detect time: " << gpudetectduration.count() << " ms";
+  }
+
+  // Fills in the poses of the tags the detect stage found in a frame, records
+  // it if there is a recorder, and draws the tags' outlines on the image.
+  void finishFrame(Frame* frame,
+                   frc971::apriltag::PoseEstimator* pose_estimator,
+                   frc971::apriltag::FieldLocalizer* field_localizer,
+                   const frc971::apriltag::CameraMatrix& cam,
+                   std::vector<frc971::apriltag::TagPose>* field_tag_poses,
+                   frc971::apriltag::Recorder* recorder) {
+    const zarray_t* detections = frame->detections.detections();
+    frame->tags.clear();
+    frame->field_pose = frc971::apriltag::FieldPose{};
+
+    // With a field layout, one solve covers every tag on the field, and each
+    // tag's pose for the gui follows from it.  Frames without tags are still
+    // recorded.
+    std::span<const frc971::apriltag::TagPose> poses;
+    if (zarray_size(detections) > 0 && field_localizer) {
+      frame->field_pose =
+          field_localizer->Localize(detections, frame->capture_time);
+      field_tag_poses->clear();
+      for (int i = 0; i < zarray_size(detections); ++i) {
+        apriltag_detection_t* det;
+        zarray_get(const_cast<zarray_t*>(detections), i, &det);
+        const double tagsize = pose_estimator->tag_sizes().Get(det->id);
+        frc971::apriltag::TagPose pose{};
+        pose.detection = det;
+        if (field_localizer->TagInCamera(det->id, &pose.rotation,
+                                         &pose.translation)) {
+          // The same object space error as the tags solved on their own, so
+          // the errors of every tag mean the same thing.  The field solve's
+          // reprojection error is in the field pose.
+          pose.error = frc971::apriltag::PoseEstimator::PoseError(
+              det, tagsize, cam, pose.rotation, pose.translation);
+        } else {
+          pose = frc971::apriltag::PoseEstimator::EstimateTag(det, tagsize,
+                                                              cam);
+        }
+        pose.smoothed_rotation = pose.rotation;
+        pose.smoothed_translation = pose.translation;
+        pose.timestamp = frame->capture_time;
+        field_tag_poses->push_back(pose);
+      }
+      poses = *field_tag_poses;
+    } else if (zarray_size(detections) > 0) {
+      pose_estimator->Estimate(detections, frame->capture_time);
+      poses = pose_estimator->poses();
+    }
+    frame->times.pose_end = std::chrono::steady_clock::now();
+
+    // Before the outlines are drawn, so recorded images are as captured.
+    if (recorder != nullptr && !frame->bgr_img.empty()) {
+      recorder->Record(
+          frc971::apriltag::CapturedFrame{
+              .data = frame->bgr_img.data,
+              .bytes = frame->bgr_img.step * frame->bgr_img.rows,
+              .width = static_cast<size_t>(frame->bgr_img.cols),
+              .height = static_cast<size_t>(frame->bgr_img.rows),
+              .format = imageFormat(*frame),
+              .timestamp = frame->capture_time,
+              .sequence = frame->sequence},
+          detections, poses, frame->field_pose, frame->times);
+    }
+    draw_detection_outlines(frame->bgr_img, const_cast<zarray_t*>(detections));
+
+    // The frame's detections are overwritten once it comes back around to
+    // the detect stage, so only keep what gets published.
+    for (const frc971::apriltag::TagPose& pose : poses) {
+      frame->tags.push_back(TagResult{.id = pose.detection->id,
+                                      .hamming = pose.detection->hamming,
+                                      .pose = pose});
+      frame->tags.back().pose.detection = nullptr;
+    }
+  }
+
+  // Returns a frame's poses as json, for clients which asked for it instead
+  // of the binary messages.
+  std::string poseJson(const Camera& camera, const Frame& frame,
+                       bool field_mode, double latency_ms,
+                       size_t dropped_frames) {
+    json empty_detections_record;
+    std::string pose_json = "";
+    empty_detections_record["type"] = "pose_data";
+    empty_detections_record["EMPTY"] = "true";
+    empty_detections_record["camera"] = camera.config.id;
+    empty_detections_record["latency_ms"] = latency_ms;
+    empty_detections_record["dropped_frames"] = dropped_frames;
+    pose_json = empty_detections_record.dump();
+    if (!frame.tags.empty()) {
+      json detections_record;
+      detections_record["type"] = "pose_data";
+      detections_record["camera"] = camera.config.id;
+      detections_record["latency_ms"] = latency_ms;
+      detections_record["dropped_frames"] = dropped_frames;
+      detections_record["detections"] = json::array();
+      if (field_mode) {
+        detections_record["field_pose"] = fieldPoseRecord(frame.field_pose);
+      }
+
+      for (const TagResult& tag : frame.tags) {
+        json record;
+
+        const frc971::apriltag::TagPose& pose = tag.pose;
+        const auto& R = pose.rotation;
+        const auto& t = pose.translation;
+        record["id"] = tag.id;
+        record["hamming"] = tag.hamming;
+        record["pose_error"] = pose.error;
+
+        // Store pose in the json record
+        record["rotation"] = {
+            {R[0], R[1], R[2]}, {R[3], R[4], R[5]}, {R[6], R[7], R[8]}};
+        record["translation"] = {t[0], t[1], t[2]};
+        const auto& smoothed_R = pose.smoothed_rotation;
+        const auto& smoothed_t = pose.smoothed_translation;
+        record["smoothed_rotation"] = {
+            {smoothed_R[0], smoothed_R[1], smoothed_R[2]},
+            {smoothed_R[3], smoothed_R[4], smoothed_R[5]},
+            {smoothed_R[6], smoothed_R[7], smoothed_R[8]}};
+        record["smoothed_translation"] = {smoothed_t[0], smoothed_t[1],
+                                          smoothed_t[2]};
+        record["timestamp"] =
+            std::chrono::duration<double>(pose.timestamp.time_since_epoch())
+                .count();
+
+        detections_record["detections"].push_back(record);
+      }
+
+      pose_json = detections_record.dump();
+    }
+    return pose_json;
+  }
+
+  // Sends a detected frame's poses to the gui and networktables, along with
+  // the image if send_image is set.  dropped_frames is how many captured
+  // frames have been skipped so far to keep up.
+  void publishFrame(Camera& camera, const Frame& frame, bool send_image,
+                    bool field_mode, size_t dropped_frames) {
+    // Capture to publish latency.  The image goes out after the poses, so
+    // encoding it doesn't hold them up.
+    const double latency_ms = std::chrono::duration<double, std::milli>(
+                                  std::chrono::steady_clock::now() -
+                                  frame.capture_time)
+                                  .count();
+
+    // The binary message is built in place in the queue, so it isn't copied
+    // until seasocks sends it.
+    frc971::apriltag::PoseMessageBuilder* message =
+        camera.pose_messages.BeginPush();
+    if (message != nullptr) {
+      message->Start(camera.config.id, frame.capture_time, latency_ms,
+                     dropped_frames);
+      if (field_mode) {
+        message->SetFieldPose(frame.field_pose);
+      }
+      for (const TagResult& tag : frame.tags) {
+        message->AddTag(tag.id, tag.hamming, tag.pose);
+      }
+      camera.pose_messages.EndPush();
+      broadcastPoseMessage(&camera);
+    }
+    // Only built when some client asked for it.
+    if (json_client_count_ > 0) {
+      broadcastPoseData(
+          poseJson(camera, frame, field_mode, latency_ms, dropped_frames));
+    }
+
+    std::vector<double> networktables_pose_data = {};
+    for (const TagResult& tag : frame.tags) {
+      const frc971::apriltag::TagPose& pose = tag.pose;
+      const auto& R = pose.rotation;
+      const auto& t = pose.translation;
+      VLOG(1) << "Tag " << tag.id << " R: " << R[0] << " " << R[1] << " "
+              << R[2] << ", " << R[3] << " " << R[4] << " " << R[5] << ", "
+              << R[6] << " " << R[7] << " " << R[8] << " t: " << t[0] << " "
+              << t[1] << " " << t[2] << " Pose Error: " << pose.error;
+
+      networktables_pose_data.push_back(tag.id * 1.0);
+
+      networktables_pose_data.push_back(t[0]);
+      networktables_pose_data.push_back(t[1]);
+      networktables_pose_data.push_back(t[2]);
+    }
+    if (field_mode) {
+      camera.field_pose_sender->sendValue(fieldPoseData(frame.field_pose));
+    } else {
+      camera.tag_sender->sendValue(networktables_pose_data);
+    }
+    camera.latency_sender->sendValue(
+        {latency_ms, static_cast<double>(dropped_frames)});
+
+    // Broadcast the image to websocket clients.
+    if (send_image) {
+      // Encode the image to JPEG
+      std::vector<uchar> buffer;
+      cv::Mat converted;
+      cv::imencode(".jpg", encodableImage(frame, &converted), buffer);
+      broadcastImage(buffer);
+    }
+  }
+
+  // Opens a camera, retrying until it shows up, and sets its video mode.
+  void openCamera(const CameraConfig& config, cv::VideoCapture* cap) {
     bool camera_started = false;
-    cv::VideoCapture cap;
     while (!camera_started) {
       try {
-        cap.open(camera_idx, cv::CAP_V4L);
-        if (cap.isOpened()) {
+        cap->open(config.index, cv::CAP_V4L);
+        if (cap->isOpened()) {
           camera_started = true;
-          std::cout << "Camera started successfully on index " << camera_idx
+          std::cout << "Camera started successfully on index " << config.index
                     << std::endl;
         } else {
           throw CameraException();
@@ -237,43 +935,128 @@ class AprilTagHandler : public seasocks::WebSocket::Handler {
 
     // Set video mode, resolution and frame rate.
     int fourcc = cv::VideoWriter::fourcc('M', 'J', 'P', 'G');
-    cap.set(cv::CAP_PROP_FOURCC, fourcc);
-    cap.set(cv::CAP_PROP_FRAME_WIDTH, 1280);
-    cap.set(cv::CAP_PROP_FRAME_HEIGHT, 800);
-    cap.set(cv::CAP_PROP_FPS, 30);
-    cap.set(cv::CAP_PROP_CONVERT_RGB, true);
+    cap->set(cv::CAP_PROP_FOURCC, fourcc);
+    cap->set(cv::CAP_PROP_FRAME_WIDTH, config.width);
+    cap->set(cv::CAP_PROP_FRAME_HEIGHT, config.height);
+    cap->set(cv::CAP_PROP_FPS, config.fps);
+    cap->set(cv::CAP_PROP_CONVERT_RGB, true);
+  }
 
-    int frame_width = cap.get(cv::CAP_PROP_FRAME_WIDTH);
-    int frame_height = cap.get(cv::CAP_PROP_FRAME_HEIGHT);
-    printCameraSettings(cap);
-
-    // Setup the apriltag detector.
-    apriltag_family_t* tf = nullptr;
-    apriltag_detector_t* td = nullptr;
-    const char* tag_family = "tag36h11";
-    setup_tag_family(&tf, tag_family);
-    td = apriltag_detector_create();
-    apriltag_detector_add_family(td, tf);
-
-    td->quad_decimate = 2.0;
-    td->quad_sigma = 0.0;
-    td->nthreads = 1;
-    td->debug = false;
-    td->refine_edges = true;
-    td->wp = workerpool_create(4);
+  // Opens a camera for --mjpeg_luma or --raw_capture, retrying until it shows
+  // up or the server stops.  Returns nullptr if stopped first.
+  std::unique_ptr<frc971::apriltag::V4l2Capture> openV4l2Camera(
+      const CameraConfig& config, bool mjpeg) {
+    const std::string path = "/dev/video" + std::to_string(config.index);
+    while (running_) {
+      std::unique_ptr<frc971::apriltag::V4l2Device> device =
+          frc971::apriltag::OpenV4l2Device(path);
+      if (device != nullptr) {
+        std::unique_ptr<frc971::apriltag::V4l2Capture> capture =
+            frc971::apriltag::V4l2Capture::Start(
+                std::move(device),
+                {.width = static_cast<size_t>(config.width),
+                 .height = static_cast<size_t>(config.height),
+                 .pixel_format = raw_format_,
+                 .mjpeg = mjpeg,
+                 .fps = config.fps});
+        if (capture != nullptr) {
+          std::cout << "Camera started successfully on " << path << " at "
+                    << capture->width() << "x" << capture->height()
+                    << std::endl;
+          return capture;
+        }
+      }
+      std::cout << "Couldn't start " << (mjpeg ? "MJPEG" : FLAGS_raw_capture)
+                << " capture on " << path << std::endl;
+      std::cout << "Retrying in 1 second ...";
+      std::this_thread::sleep_for(std::chrono::seconds(1));
+    }
+    return nullptr;
+  }
+
+  // Returns the camera matrix of the image scaled down by scale.  Pixel
+  // centers move too, since each scaled pixel covers scale by scale pixels.
+  static frc971::apriltag::CameraMatrix scaleCameraMatrix(
+      const frc971::apriltag::CameraMatrix& cam, size_t scale) {
+    return frc971::apriltag::CameraMatrix{
+        .fx = cam.fx / scale,
+        .cx = (cam.cx - (scale - 1) / 2.0) / scale,
+        .fy = cam.fy / scale,
+        .cy = (cam.cy - (scale - 1) / 2.0) / scale};
+  }
+
+  // Captures, detects and publishes one camera's frames until stopped.
+  void readAndSend(Camera* camera) {
+    const CameraConfig& config = camera->config;
+    std::cout << "Enabling video capture " << config.id << std::endl;
+    cv::VideoCapture cap;
+    // With --mjpeg_luma or --raw_capture, frames come from here instead of
+    // cap.
+    std::unique_ptr<frc971::apriltag::V4l2Capture> v4l2_capture;
+    // What the frames handed to the detector hold.
+    frc971::apriltag::PixelFormat pixel_format =
+        frc971::apriltag::PixelFormat::kBgr24;
+    frc971::apriltag::JpegDecoder jpeg_decoder;
+    const size_t jpeg_scale = FLAGS_mjpeg_half_scale ? 2 : 1;
+    int frame_width;
+    int frame_height;
+    if (camera->replay) {
+      frame_width = camera->replay->width();
+      frame_height = camera->replay->height();
+    } else if (FLAGS_mjpeg_luma) {
+      v4l2_capture = openV4l2Camera(config, /*mjpeg=*/true);
+      if (v4l2_capture == nullptr) {
+        return;
+      }
+      pixel_format = frc971::apriltag::PixelFormat::kGray8;
+      frame_width = frc971::apriltag::JpegDecoder::ScaledSize(
+          v4l2_capture->width(), jpeg_scale);
+      frame_height = frc971::apriltag::JpegDecoder::ScaledSize(
+          v4l2_capture->height(), jpeg_scale);
+    } else if (!FLAGS_raw_capture.empty()) {
+      v4l2_capture = openV4l2Camera(config, /*mjpeg=*/false);
+      if (v4l2_capture == nullptr) {
+        return;
+      }
+      pixel_format = raw_format_;
+      frame_width = v4l2_capture->width();
+      frame_height = v4l2_capture->height();
+    } else {
+      openCamera(config, &cap);
+      frame_width = cap.get(cv::CAP_PROP_FRAME_WIDTH);
+      frame_height = cap.get(cv::CAP_PROP_FRAME_HEIGHT);
+      printCameraSettings(cap);
+    }
 
     // Read Camera Matrix and Distortion Coeffs from file.
     frc971::apriltag::CameraMatrix cam;
     frc971::apriltag::DistCoeffs dist;
-    if (!parsecal_file(cal_file, &cam, &dist)) {
-      std::cout << "Unable to read parameters from cal file " << cal_file
+    if (!parsecal_file(config.cal_file, &cam, &dist)) {
+      std::cout << "Unable to read parameters from cal file "
+                << config.cal_file << std::endl;
+      return;
+    }
+    if (FLAGS_mjpeg_luma && jpeg_scale > 1) {
+      cam = scaleCameraMatrix(cam, jpeg_scale);
+    }
+
+    frc971::apriltag::TagSizes tag_sizes(FLAGS_tag_size);
+    if (!FLAGS_tag_size_file.empty() &&
+        !parsetag_size_file(FLAGS_tag_size_file, &tag_sizes)) {
+      std::cout << "Unable to read tag sizes from " << FLAGS_tag_size_file
                 << std::endl;
       return;
     }
 
+    // Decoding and pose estimation take turns on the shared threads.
     auto gpucreatestart = std::chrono::high_resolution_clock::now();
-    frc971::apriltag::GpuDetector detector(frame_width, frame_height, td, cam,
+    frc971::apriltag::GpuDetector detector(frame_width, frame_height, td_, cam,
                                            dist);
+    detector.SetDecodePool(pool_);
+    detector.SetUndistortMapStep(FLAGS_undistort_map_step);
+    detector.SetDecodeCache(FLAGS_decode_cache_entries,
+                            FLAGS_decode_cache_tolerance,
+                            FLAGS_decode_cache_failures);
     auto gpucreateend = std::chrono::high_resolution_clock::now();
 
     auto gpucreateduration =
@@ -282,47 +1065,305 @@ class AprilTagHandler : public seasocks::WebSocket::Handler {
     std::cout << "GPU Detector Create Time: " << gpucreateduration.count()
               << " ms" << std::endl;
 
-    // Setup the detection info struct for use down below.
-    apriltag_detection_info_t info;
-    info.tagsize =
-        0.175;  // Measured in meters, with a ruler, for tag family 36h11
-    info.fx = cam.fx;
-    info.fy = cam.fy;
-    info.cx = cam.cx;
-    info.cy = cam.cy;
-
-    // Set the value of the gui rotate image variable to the value
-    // that is passed in on the command line.  The user can change it
-    // later on from the gui.
-    flipVertical_ = rotate_vertical;
-    flipHorizontal_ = rotate_horizontal;
-
-    int frame_counter = 0;
-    cv::Mat bgr_img, yuyv_img;
+    std::unique_ptr<frc971::apriltag::FieldLocalizer> field_localizer;
+    if (!FLAGS_field_layout.empty()) {
+      frc971::apriltag::FieldLayout layout;
+      if (!frc971::apriltag::LoadFieldLayout(FLAGS_field_layout, &layout)) {
+        std::cout << "Unable to read field layout from " << FLAGS_field_layout
+                  << std::endl;
+        return;
+      }
+      std::cout << "Loaded " << layout.size() << " tags from field layout"
+                << std::endl;
+      field_localizer = std::make_unique<frc971::apriltag::FieldLocalizer>(
+          cam, dist, tag_sizes, std::move(layout));
+    }
+
+    frc971::apriltag::PoseEstimator pose_estimator(cam, std::move(tag_sizes),
+                                                   pool_);
+    if (FLAGS_pose_tracking) {
+      frc971::apriltag::PoseTracker::Options tracking;
+      tracking.smoothing = std::chrono::milliseconds(FLAGS_pose_smoothing_ms);
+      pose_estimator.EnableTracking(tracking);
+    }
+
+    std::unique_ptr<frc971::apriltag::Recorder> recorder;
+    if (!FLAGS_record.empty()) {
+      frc971::apriltag::Recorder::Options options;
+      options.luma_only = !FLAGS_record_full_frames;
+      options.sample_period =
+          std::chrono::milliseconds(FLAGS_record_sample_ms);
+      options.trigger_on_tag_loss = FLAGS_record_on_tag_loss;
+      options.trigger_on_bit_errors = FLAGS_record_on_bit_errors;
+      options.latency_limit =
+          std::chrono::milliseconds(FLAGS_record_latency_ms);
+      const std::string path =
+          config.id.empty() ? FLAGS_record : FLAGS_record + "." + config.id;
+      // Captured images are tightly packed.
+      recorder = frc971::apriltag::Recorder::Create(
+          path, frame_width, frame_height,
+          {.pixel_format = pixel_format},
+          options);
+      if (recorder == nullptr) {
+        std::cout << "Unable to record to " << path << std::endl;
+        return;
+      }
+    }
+
+    // Capture, detection, pose estimation and publishing each run on their
+    // own thread, so the frame rate is set by the slowest of them rather than
+    // their sum.
+    frc971::apriltag::SpscQueue<Frame> detect_queue(
+        FLAGS_capture_queue_depth, dropPolicy(FLAGS_capture_queue_drop));
+    frc971::apriltag::SpscQueue<Frame> pose_queue(
+        FLAGS_pose_queue_depth, dropPolicy(FLAGS_pose_queue_drop));
+    frc971::apriltag::SpscQueue<Frame> publish_queue(
+        FLAGS_publish_queue_depth, dropPolicy(FLAGS_publish_queue_drop));
+    // With --freshest_frame, captured frames go through latest_frame instead
+    // of detect_queue, so detection always starts on the newest one.
+    frc971::apriltag::TripleBuffer<Frame> latest_frame;
+    auto take_frame = [&]() {
+      return FLAGS_freshest_frame ? latest_frame.Take() : detect_queue.Front();
+    };
+    auto release_frame = [&]() {
+      if (!FLAGS_freshest_frame) {
+        detect_queue.Pop();
+      }
+    };
+    auto capture_dropped = [&]() {
+      return FLAGS_freshest_frame ? latest_frame.dropped()
+                                  : detect_queue.dropped();
+    };
+
+    std::thread detect_thread([&]() {
+      // With --overlap_decode, frames wait here from Submit until Poll, while
+      // the detector decodes them on its own thread.
+      std::array<Frame, frc971::apriltag::DetectorBackend::kSlots> in_flight;
+      size_t submitted = 0;
+      size_t polled = 0;
+      auto finish_oldest = [&]() {
+        Frame* frame = &in_flight[polled++ % in_flight.size()];
+        const zarray_t* detections = detector.Poll(true);
+        frame->times.detect_end = std::chrono::steady_clock::now();
+        Frame* result = pose_queue.BeginPush();
+        if (result == nullptr) {
+          return;
+        }
+        frame->detections.CopyFrom(detections);
+        std::swap(*result, *frame);
+        pose_queue.EndPush();
+      };
+
+      while (Frame* frame = take_frame()) {
+        if (FLAGS_overlap_decode) {
+          Frame* submitted_frame = &in_flight[submitted++ % in_flight.size()];
+          std::swap(*submitted_frame, *frame);
+          release_frame();
+          submitted_frame->times.detect_start =
+              std::chrono::steady_clock::now();
+          detector.Submit(submitted_frame->bgr_img.data,
+                          imageFormat(*submitted_frame));
+          // The last frame was decoded while this one's quads were found.
+          if (detector.in_flight() > 1) {
+            finish_oldest();
+          }
+          continue;
+        }
+
+        Frame* result = pose_queue.BeginPush();
+        if (result == nullptr) {
+          // Pose estimation has fallen behind, so don't bother detecting.
+          release_frame();
+          continue;
+        }
+        try {
+          detectFrame(frame, &detector);
+        } catch (const std::exception& ex) {
+          LOG(WARNING) << "Encountered exception " << ex.what()
+                       << ", continuing";
+          frame->detections.Clear();
+        }
+        // Swap rather than copy, so the image buffers go around every ring.
+        std::swap(*result, *frame);
+        pose_queue.EndPush();
+        release_frame();
+      }
+      while (detector.in_flight() > 0) {
+        finish_oldest();
+      }
+      pose_queue.Close();
+    });
+
+    // Solving the poses of one frame overlaps detecting the next.
+    std::thread pose_thread([&]() {
+      std::vector<frc971::apriltag::TagPose> field_tag_poses;
+      while (Frame* frame = pose_queue.Front()) {
+        Frame* result = publish_queue.BeginPush();
+        if (result == nullptr) {
+          // Publishing has fallen behind, so don't bother with the poses.
+          pose_queue.Pop();
+          continue;
+        }
+        try {
+          finishFrame(frame, &pose_estimator, field_localizer.get(), cam,
+                      &field_tag_poses, recorder.get());
+        } catch (const std::exception& ex) {
+          LOG(WARNING) << "Encountered exception " << ex.what()
+                       << ", continuing";
+          frame->tags.clear();
+          frame->field_pose = frc971::apriltag::FieldPose{};
+        }
+        std::swap(*result, *frame);
+        publish_queue.EndPush();
+        pose_queue.Pop();
+      }
+      publish_queue.Close();
+    });
+
+    std::thread publish_thread([&]() {
+      int frame_counter = 0;
+      while (Frame* frame = publish_queue.Front()) {
+        try {
+          // Only the first camera's images go to the gui.
+          publishFrame(*camera, *frame,
+                       ++frame_counter % 50 == 0 &&
+                           camera == cameras_.front().get(),
+                       field_localizer != nullptr, capture_dropped());
+        } catch (const std::exception& ex) {
+          LOG(WARNING) << "Encountered exception " << ex.what()
+                       << ", continuing";
+        }
+        publish_queue.Pop();
+        VLOG(1) << "Dropped " << capture_dropped()
+                << " frames before detection, " << pose_queue.dropped()
+                << " before pose estimation and " << publish_queue.dropped()
+                << " before publishing";
+        if (recorder) {
+          VLOG(1) << "Recorded " << recorder->images() << " images, "
+                  << recorder->bytes_written() << " bytes, dropped "
+                  << recorder->dropped() << " frames from the recording";
+        }
+      }
+    });
+
+    // Frames which there was no room for are still read, so they don't back up
+    // in the driver.
+    cv::Mat dropped_img;
+    uint32_t sequence = 0;
+    size_t jpeg_failures = 0;
+    // Settings go to whichever of cap and v4l2_capture is capturing.  The
+    // auto exposure values are V4L2's either way.
+    auto set_control = [&](int property, uint32_t control, int value) {
+      if (v4l2_capture) {
+        v4l2_capture->SetControl(control, value);
+      } else {
+        cap.set(property, value);
+      }
+    };
     while (running_) {
       // Handle settings changes.
-      if (settings_changed_.exchange(false)) {
+      if (camera->settings_changed.exchange(false)) {
         std::cout << "Setting changed" << std::endl;
-        if (exposure_mode_ == 0) {
+        if (camera->exposure_mode == 0) {
           std::cout << "Auto Exposure set to Auto" << std::endl;
-          cap.set(cv::CAP_PROP_AUTO_EXPOSURE, 3);
-        } else if (exposure_mode_ == 1) {
+          set_control(cv::CAP_PROP_AUTO_EXPOSURE, V4L2_CID_EXPOSURE_AUTO,
+                      V4L2_EXPOSURE_APERTURE_PRIORITY);
+        } else if (camera->exposure_mode == 1) {
           std::cout << "Auto Exposure set to Manual" << std::endl;
-          cap.set(cv::CAP_PROP_AUTO_EXPOSURE, 1);
-          cap.set(cv::CAP_PROP_BRIGHTNESS, brightness_);
-          cap.set(cv::CAP_PROP_EXPOSURE, exposure_);
+          set_control(cv::CAP_PROP_AUTO_EXPOSURE, V4L2_CID_EXPOSURE_AUTO,
+                      V4L2_EXPOSURE_MANUAL);
+          set_control(cv::CAP_PROP_BRIGHTNESS, V4L2_CID_BRIGHTNESS,
+                      camera->brightness);
+          set_control(cv::CAP_PROP_EXPOSURE, V4L2_CID_EXPOSURE_ABSOLUTE,
+                      camera->exposure);
         }
       }
 
       try {
-        cap >> bgr_img;
-        frame_counter++;
+        Frame* frame = FLAGS_freshest_frame ? latest_frame.BeginWrite()
+                                            : detect_queue.BeginPush();
+        cv::Mat& bgr_img = frame != nullptr ? frame->bgr_img : dropped_img;
+        if (camera->replay) {
+          frc971::apriltag::CapturedFrame captured;
+          if (!camera->replay->Next(&captured)) {
+            if (camera->replay->finished()) {
+              std::cout << "Replay " << config.id << " finished" << std::endl;
+              break;
+            }
+            continue;
+          }
+          if (frame != nullptr) {
+            captured_frame_to_bgr(captured, bgr_img);
+            frame->capture_time = captured.timestamp;
+            frame->sequence = captured.sequence;
+          }
+          camera->replay->Release(captured);
+          if (frame == nullptr) {
+            continue;
+          }
+        } else if (v4l2_capture && !v4l2_capture->mjpeg()) {
+          frc971::apriltag::CapturedFrame captured;
+          if (!v4l2_capture->Next(&captured)) {
+            continue;
+          }
+          // Only the one copy out of the driver buffer, so it can go back to
+          // the driver right away.  Nothing is converted.
+          if (frame != nullptr) {
+            cv::Mat(frame_height, frame_width,
+                    pixel_format == frc971::apriltag::PixelFormat::kGray8
+                        ? CV_8UC1
+                        : CV_8UC2,
+                    const_cast<uint8_t*>(captured.data),
+                    frc971::apriltag::RowStride(captured.format, frame_width))
+                .copyTo(bgr_img);
+            frame->capture_time = captured.timestamp;
+            frame->sequence = captured.sequence;
+          }
+          v4l2_capture->Release(captured);
+          if (frame == nullptr) {
+            continue;
+          }
+        } else if (v4l2_capture) {
+          frc971::apriltag::CapturedFrame jpeg;
+          if (!v4l2_capture->Next(&jpeg)) {
+            continue;
+          }
+          // Frames there is no room for aren't decoded at all.
+          bool decoded = false;
+          if (frame != nullptr) {
+            bgr_img.create(frame_height, frame_width, CV_8UC1);
+            decoded = jpeg_decoder.DecodeLuma(
+                {jpeg.data, jpeg.bytes}, v4l2_capture->width(),
+                v4l2_capture->height(), jpeg_scale, bgr_img.data,
+                bgr_img.step);
+            frame->capture_time = jpeg.timestamp;
+            frame->sequence = jpeg.sequence;
+          }
+          v4l2_capture->Release(jpeg);
+          if (frame == nullptr) {
+            continue;
+          }
+          if (!decoded) {
+            VLOG(1) << "Unable to decode frame " << jpeg.sequence << ", "
+                    << ++jpeg_failures << " so far";
+            continue;
+          }
+        } else {
+          cap >> bgr_img;
+          ++sequence;
+          if (frame == nullptr) {
+            continue;
+          }
+          frame->capture_time = captureTime(cap);
+          frame->sequence = sequence;
+        }
+
+        frame->pixel_format = pixel_format;
 
-        auto overallstart = std::chrono::high_resolution_clock::now();
         // Let's check the time this takes, can always combine to one call if
         // both are true later. Best case scenario is we don't place the camera
         // wrong so we do not need this method at all.
-        if (flipVertical_ && flipHorizontal_) {
+        if (camera->flip_vertical && camera->flip_horizontal) {
           flipBoth(bgr_img.clone(), &bgr_img);
         } else {
           // if (flipVertical_) {
@@ -332,119 +1373,51 @@ class AprilTagHandler : public seasocks::WebSocket::Handler {
           //   flipHorizontal(bgr_img.clone(), &bgr_img);
           // }
         }
-
-        cv::cvtColor(bgr_img, yuyv_img, cv::COLOR_BGR2YUV_YUYV);
-        auto gpudetectstart = std::chrono::high_resolution_clock::now();
-        detector.Detect(yuyv_img.data);
-        auto gpudetectend = std::chrono::high_resolution_clock::now();
-        const zarray_t* detections = detector.Detections();
-        draw_detection_outlines(bgr_img, const_cast<zarray_t*>(detections));
-
-        // Broadcast the image to websocket clients.
-        if (frame_counter % 50 == 0) {
-          // Encode the image to JPEG
-          std::vector<uchar> buffer;
-          cv::imencode(".jpg", bgr_img, buffer);
-          broadcastImage(buffer);
-          frame_counter = 0;
-        }
-        std::vector<double> networktables_pose_data = {};
-        json empty_detections_record;
-        std::string pose_json = "";
-        empty_detections_record["type"] = "pose_data";
-        empty_detections_record["EMPTY"] = "true";
-        pose_json = empty_detections_record.dump();
-        // Determine the pose of the tags.
-        if (zarray_size(detections) > 0) {
-          // std::vector<std::vector<double>> poses = {};
-          json detections_record;
-          detections_record["type"] = "pose_data";
-          detections_record["detections"] = json::array();
-
-          for (int i = 0; i < zarray_size(detections); i++) {
-            json record;
-
-            apriltag_detection_t* det;
-            zarray_get(const_cast<zarray_t*>(detections), i, &det);
-
-            // Setup the detection info struct for use down below.
-            info.det = det;
-
-            apriltag_pose_t pose;
-            double err = estimate_tag_pose(&info, &pose);
-            matd_print(pose.R, "%.3f ");
-            matd_print(pose.t, "%.3f ");
-            // std::vector <double> pose_data = {pose.R, pose.t};
-            std::cout << "Pose Error: " << err << std::endl;
-
-            record["id"] = det->id;
-            record["hamming"] = det->hamming;
-            record["pose_error"] = err;
-
-            // Store pose in the json record
-            record["rotation"] = {
-                {pose.R->data[0], pose.R->data[1], pose.R->data[2]},
-                {pose.R->data[3], pose.R->data[4], pose.R->data[5]},
-                {pose.R->data[6], pose.R->data[7], pose.R->data[8]}};
-            record["translation"] = {pose.t->data[0], pose.t->data[1],
-                                     pose.t->data[2]};
-
-            detections_record["detections"].push_back(record);
-            networktables_pose_data.push_back(det->id * 1.0);
-
-            networktables_pose_data.push_back(pose.t->data[0]);
-            networktables_pose_data.push_back(pose.t->data[1]);
-            networktables_pose_data.push_back(pose.t->data[2]);
-          }
-
-          // Send the pose data
-          pose_json = detections_record.dump();
-
-          auto overallend = std::chrono::high_resolution_clock::now();
-          auto overallduration =
-              std::chrono::duration_cast<std::chrono::milliseconds>(
-                  overallend - overallstart);
-          auto gpudetectduration =
-              std::chrono::duration_cast<std::chrono::milliseconds>(
-                  gpudetectend - gpudetectstart);
-          std::cout << "Total Elapsed time: " << overallduration.count()
-                    << " ms" << std::endl;
-          // std::cout << "GPU Elapsed time: " << gpuoverallduration.count() <<
-          // " ms" << std::endl; std::cout << "GPU Detector Create time: " <<
-          // gpucreateduration.count() << " ms" << std::endl;
-          std::cout << "GPU Detect time: " << gpudetectduration.count() << " ms"
-                    << std::endl;
-
-          detector.ReinitializeDetections();
+        if (FLAGS_freshest_frame) {
+          latest_frame.EndWrite();
+        } else {
+          detect_queue.EndPush();
         }
-        broadcastPoseData(pose_json);
-        tagSender_.sendValue(networktables_pose_data);
-
       } catch (const std::exception& ex) {
-        std::cout << "Encounted exception " << ex.what() << std::endl;
-        std::cout << "Continuing." << std::endl;
+        LOG(WARNING) << "Encountered exception " << ex.what()
+                     << ", continuing";
       }
     }
-    // Clean up
-    apriltag_detector_destroy(td);
-    teardown_tag_family(&tf, tag_family);
+    detect_queue.Close();
+    latest_frame.Close();
+    detect_thread.join();
+    pose_thread.join();
+    publish_thread.join();
   }
 
-  void stop() { running_ = false; }
+  void stop() {
+    running_ = false;
+    for (const std::unique_ptr<Camera>& camera : cameras_) {
+      if (camera->replay) {
+        camera->replay->Stop();
+      }
+    }
+  }
 
  private:
-  DoubleArraySender tagSender_{"raw_pose"};
+  static constexpr const char* kTagFamily = "tag36h11";
+
   std::set<seasocks::WebSocket*> clients_;
+  // The clients which asked for poses as json.
+  std::set<seasocks::WebSocket*> json_clients_;
+  std::atomic<size_t> json_client_count_{0};
   std::mutex mutex_;
   std::shared_ptr<seasocks::Server> server_;
   std::atomic<bool> running_{true};
-  std::atomic<int> brightness_{50};
-  std::atomic<int> exposure_{50};
-  std::atomic<int> exposure_mode_{0};
-  std::atomic<bool> settings_changed_{false};
-  std::atomic<bool> flipVertical_{false};
-  std::atomic<bool> flipHorizontal_{false};
-  std::thread read_thread_;
+
+  // Shared by every camera.
+  apriltag_family_t* tf_ = nullptr;
+  apriltag_detector_t* td_ = nullptr;
+  std::shared_ptr<frc971::apriltag::WorkStealingPool> pool_;
+  // The format to capture in with --raw_capture.
+  frc971::apriltag::PixelFormat raw_format_ =
+      frc971::apriltag::PixelFormat::kYuyv;
+  std::vector<std::unique_ptr<Camera>> cameras_;
 };
 
 int main(int argc, char* argv[]) {
@@ -453,17 +1426,29 @@ int main(int argc, char* argv[]) {
 
   gflags::ParseCommandLineFlags(&argc, &argv, true);
 
-  if(FLAGS_cal_file.empty()) {
-    LOG(ERROR)
-        << "Usage: ws_server -camera_idx <index> -cal_file <path to cal file -port <webserver port>";
-  }
-  
-
-  gflags::ParseCommandLineFlags(&argc, &argv, true);
-
-  if (!std::filesystem::exists(FLAGS_cal_file)) {
-    LOG(ERROR) << "calibration file does not exist: " << FLAGS_cal_file;
-    return 1;
+  std::vector<CameraConfig> cameras;
+  if (!FLAGS_camera_config.empty()) {
+    if (!parsecamera_config(FLAGS_camera_config, &cameras)) {
+      LOG(ERROR) << "Unable to read cameras from " << FLAGS_camera_config;
+      return 1;
+    }
+  } else {
+    if (FLAGS_cal_file.empty()) {
+      LOG(ERROR) << "Usage: ws_server -camera_idx <index> -cal_file <path to "
+                    "cal file> -port <webserver port>, or -camera_config "
+                    "<path to camera config file> for several cameras";
+    }
+    if (!std::filesystem::exists(FLAGS_cal_file)) {
+      LOG(ERROR) << "calibration file does not exist: " << FLAGS_cal_file;
+      return 1;
+    }
+    cameras.push_back(CameraConfig{
+        .index = FLAGS_camera_idx,
+        .cal_file = FLAGS_cal_file,
+        .rotate_vertical = FLAGS_rotate_vertical,
+        .rotate_horizontal = FLAGS_rotate_horizontal,
+        .replay = FLAGS_replay,
+    });
   }
 
   auto logger = std::make_shared<seasocks::PrintfLogger>();
@@ -473,14 +1458,12 @@ int main(int argc, char* argv[]) {
     auto handler = std::make_shared<AprilTagHandler>(server);
     server->addWebSocketHandler("/ws", handler);
 
-    handler->startReadAndSendThread(FLAGS_camera_idx, FLAGS_cal_file,
-                                    FLAGS_rotate_vertical,
-                                    FLAGS_rotate_horizontal);
+    handler->startCameras(cameras);
 
     server->serve("public", FLAGS_port);
     
     handler->stop();
-    handler->joinReadAndSendThread();
+    handler->joinCameras();
   } catch (const std::exception& e) {
     LOG(ERROR) << e.what();
     return 1;